@@ -8,29 +8,33 @@
 # 2 - homologous sequences in multi-FASTA format
 # 3 - directory path for alignment output files
 # 4 - directory path for final output files
-# 5 - sequence source: GISAID or Genbank
+# 5 - stem of the output file names
 ref=$1
 seqs=$2
 aligned=$3
 outdir=$4
-source=$5
-filestem=$6
+filestem=$5
 
 echo ${filestem}
 
-# Align sequences to the given reference using needle.
-# Check first if the alignment file already exists.
-if [ ! -f ${aligned} ]
-then
-  needle -asequence ${ref} -bsequence ${seqs} \
-    -gapopen 10.0 -gapextend 0.5 \
-    -outfile ${aligned} -aformat fasta
-fi
+# Run each step through the cache of RunPipeline, keyed by a hash of the
+# command and the contents of the reference, sequences, and tool binaries,
+# so that alignments and summaries of unchanged sequences are reused.
+RunCached="bin/RunPipeline-1.1 -c data/GISAID/cache -x"
+
+# Align sequences to the given reference with the scoring of needle,
+# writing the alignment in the layout of needle -aformat fasta.
+${RunCached} "bin/AlignToReference-1.0 -f ${ref} -i ${seqs} \
+  -g 10.0 -e 0.5 \
+  -o ${aligned}" -O ${aligned}
 
 # Parse the alignment file and calculate the distance
 # of each sequence from the reference.
-python bin/CalculateSequenceDistances-1.0.py ${ref} ${aligned} \
-  ${outdir}/${filestem}-distances.data ${source}
+# The collection date is read from the sequence names,
+# which have the same '|'-separated layout for GISAID and Genbank.
+${RunCached} "bin/AASiteFrequencies-1.0 distances -f ${ref} -a ${aligned} \
+  -o ${outdir}/${filestem}-distances.data" \
+  -O ${outdir}/${filestem}-distances.data
 
 # Analyze the distances and exclude sequences that are more or less than
 # five interquartile ranges from the median amino-acid distance
@@ -41,5 +45,7 @@ Rscript analysis/figures/GlobalFrequencies/FilterOutlierSequences.R \
   
 # Analyze the sequence alignment, excluding sequences that contain indels
 # or are on the list of sequence exclusions set previously.
-python bin/AnalyzeAASiteFrequencies-2.0.py ${ref} ${aligned} \
-  ${outdir}/${filestem}-distances-exclusions.data ${outdir}/${filestem}-frequencies.data ${source}
\ No newline at end of file
+${RunCached} "bin/AASiteFrequencies-1.0 frequencies -f ${ref} -a ${aligned} \
+  -x ${outdir}/${filestem}-distances-exclusions.data \
+  -o ${outdir}/${filestem}-frequencies.data" \
+  -O ${outdir}/${filestem}-frequencies.data
@@ -32,7 +32,6 @@ do
 	${seqsdir}/H3N2-${chr}-GISAID.fasta \
 	${aligneddir}/H3N2-${gene}-GISAID.aligned \
 	${outdir} \
-	GISAID \
 	H3N2-${gene}-GISAID
 done
 
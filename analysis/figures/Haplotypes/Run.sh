@@ -7,55 +7,24 @@ dir="analysis/figures/Haplotypes"
 # stdio directory.
 intdir="nobackup/SCCA/sge"
 
-# Location of waiting script.
-waitscript="analysis/figures/Wait.sh"
-
-# Script to extract and summarize haplotypes at sites of interest from a given BAM file.
-# Script is run as script <BAMfile> <gene> <sitefile> <outdir>
-SummarizeHaplotypes="analysis/figures/Haplotypes/SummarizeHaplotypes.sh"
-
-# For each patient of interest, run the script to summarize haplotypes at HA sites of interest.
-Patients=( "A" "C" )
-Genes=( "4-HA" )
-for patient in "${Patients[@]}"
-do
-  for gene in "${Genes[@]}"
-  do
-    for f in nobackup/SCCA/${patient}*.bam
-	do
-	  sample=${f##*/}
-      sample=${sample%%.*}
-	  qsub -cwd -N "haplotypes" \
-	    -o ${intdir}/${sample}.o -e ${intdir}/${sample} \
-	    ${SummarizeHaplotypes} \
-        ${f} ${gene} \
-        ${dir}/${patient}/${patient}-${gene}-sites.data \
-		${dir}/${patient}/
-	done
-  done
-done
-
-# Wait until the previous jobs are complete to continue.
-sleep 5
-${waitscript} haplotypes 30
-
-
-# Concatenate the haplotype summaries for each patient and gene.
-# Also use the R script CalculateFrequencies.R to calculate the haplotype frequencies.
+# Pipeline runner, and the stages of the analysis.
+# The haplotypes of each sample are summarized with SummarizeHaplotypes.sh,
+# run as SummarizeHaplotypes.sh <BAMfile> <gene> <sitefile> <outdir>.
+# The haplotype frequencies of each patient are calculated as soon as
+# all of that patient's samples are done, without polling for finished jobs.
+# Samples whose BAM files and sites have not changed are restored from the
+# cache of the SCCA pipeline instead of being run again.
+RunPipeline="bin/RunPipeline-1.1"
+cachedir="nobackup/SCCA/cache"
+stages="${dir}/Haplotypes.stages"
+samplesheet="pipelines/SCCA/SCCA-H3N2.samples"
+
+# For each patient of interest, summarize haplotypes at HA sites of interest,
+# then concatenate the haplotype summaries for each patient and gene
+# and use the R script CalculateFrequencies.R to calculate the haplotype frequencies.
 # CalculateFrequencies.R takes the patient and gene as arguments.
-for patient in "${Patients[@]}"
-do
-  for gene in "${Genes[@]}"
-  do
-    # Concatenate files.
-    cat ${dir}/${patient}/*-${gene}.hapsummary > \
-	  ${dir}/${patient}/${patient}-${gene}-summaries.data
-	# Calculate haplotype frequencies.
-	Rscript ${dir}/CalculateFrequencies.R ${patient} ${gene}
-	# Remove intermediate files.
-	rm -f ${dir}/${patient}/*-${gene}.hapsummary
-	rm -f ${dir}/${patient}/*-${gene}.haplotypes
-  done
-done
+mkdir -p ${intdir}
+${RunPipeline} -s <(grep -E "^(A|C)" ${samplesheet}) -g ${stages} \
+  -c ${cachedir} -l ${intdir} -o ${intdir}/haplotypes.status
 
 echo "Haplotypes done."
@@ -8,15 +8,33 @@ dir="analysis/figures/Permutations"
 # to identify sites that do not vary from 2000 to the present.
 Rscript ${dir}/GlobalVariableSites.R 2000 2
 
+# Permutation tests are run by PermutationTest, which replaces
+# ParallelWithinPermutationTest.R and ParallelScalesPermutationTest.R.
+# -n gives the number of permutations run for each gene.
+PermutationTest="bin/PermutationTest-1.0"
+variants="analysis/figures/LongitudinalFrequencies/LongitudinalVariants.data"
+genes="analysis/figures/SequencingDepth/GenomeGeneSummary.data"
+globalsites="analysis/figures/GlobalFrequencies/H3N2-GISAID-sites.data"
+parallelsites="analysis/figures/GlobalFrequencies/ParallelSites.data"
+
 # Perform a permutation test to determine how much parallelism is expected
 # given the number of variable sites observed for each patient
-# if each site is equally likely to be variable.
-# The parameter gives the number of permutations run for each gene.
-Rscript ${dir}/ParallelWithinPermutationTest.R 100000
+# if each site is equally likely to be variable,
+# first across a range of proportions of mutable sites
+# and then for the proportion of globally variable sites.
+${PermutationTest} within -i ${variants} -g ${genes} -n 100000 \
+  -o ${dir}/ParallelWithinPermutation.data
+${PermutationTest} within -i ${variants} -g ${genes} -n 100000 \
+  -x ${dir}/GlobalVariableSites.data \
+  -o ${dir}/ParallelWithinPermutation-GlobalValues.data
 
 # Perform a permutation test to determine how much parallelism is expected
 # given the number of variable sites observed for each patient
 # and the number of variable sites in the global population,
 # for HA, NA, and the other flu genes.
-# The parameter gives the number of permutations run for each gene.
-Rscript ${dir}/ParallelScalesPermutationTest.R 10000
\ No newline at end of file
+${PermutationTest} scales -i ${variants} -g ${genes} -n 10000 \
+  -w ${globalsites} -p ${parallelsites} \
+  -o ${dir}/ParallelScalesPermutation.data
+${PermutationTest} scales -i ${variants} -g ${genes} -n 10000 \
+  -w ${globalsites} -p ${parallelsites} -x ${dir}/GlobalVariableSites.data \
+  -o ${dir}/ParallelScalesPermutation-GlobalValues.data
\ No newline at end of file
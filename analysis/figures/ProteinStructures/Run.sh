@@ -7,12 +7,26 @@ dir="analysis/figures/ProteinStructures"
 # Summarize the set of variable sites.
 Rscript ${dir}/SummarizeVariableSites.R analysis/figures/LongitudinalFrequencies/LongitudinalVariants.data
 
+# Distances and permutation tests are run by ProteinDistances, which
+# replaces CalculateDistancesHA.py, CalculateDistancesNA.py,
+# and PermuteDistances.R.
+ProteinDistances="bin/ProteinDistances-1.0"
+
 # Calculate the distances of each residue in HA and NA
 # from the receptor-binding pocket.
-python ${dir}/CalculateDistancesHA.py
-python ${dir}/CalculateDistancesNA.py
+# HA residues are numbered through the head (A) and stalk (B) chains.
+${ProteinDistances} ligand -p reference/H3-4hmg.pdb -c A,B -l SIA \
+  -o ${dir}/4HMG-SialicAcidDistances.data
+${ProteinDistances} ligand -p reference/N2-2bat.pdb -c A -l SIA \
+  -o ${dir}/2BAT-SialicAcidDistances.data
 
 # Permute distances of each residue from the active site.
 # Determine the likelihood that the observed distribution of distances
 # is due to chance.
-Rscript ${dir}/PermuteDistances.R 10000
\ No newline at end of file
+# HA codons in LongitudinalVariants.data already follow H3 numbering,
+# and the NA residues in 2bat are numbered beginning at 82.
+${ProteinDistances} permute \
+  -i analysis/figures/LongitudinalFrequencies/LongitudinalVariants.data \
+  -d 4-HA:${dir}/4HMG-SialicAcidDistances.data \
+  -d 6-NA:${dir}/2BAT-SialicAcidDistances.data:81 \
+  -n 10000 -o ${dir}/PermuteDistances.data
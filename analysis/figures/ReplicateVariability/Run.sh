@@ -3,10 +3,16 @@
 
 dir=analysis/figures/ReplicateVariability
 
-# Run R script that calls variants in all sequenced samples
-# based on frequency and coverage.
+# Call variants in all sequenced samples based on frequency and coverage.
 # Exports variants that meet the criteria in both library replicates.
-Rscript ${dir}/CallVariants.R
+# CallVariants replaces CallVariants.R, which is kept for reference.
+CallVariants="bin/CallVariants-1.0"
+${CallVariants} \
+  -i nobackup/SCCA/A-annotated.summary.gz \
+  -i nobackup/SCCA/C-annotated.summary.gz \
+  -i nobackup/SCCA/D-annotated.summary.gz \
+  -i nobackup/SCCA/E-annotated.summary.gz \
+  -f 0.01 -c 200 -o ${dir}/Variants.data
 
 # Run R script that analyzes the variability between replicates
 # for each timepoint.
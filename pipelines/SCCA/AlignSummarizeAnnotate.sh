@@ -5,7 +5,6 @@
 # Load modules.
 module load modules modules-init modules-gs
 module load python/2.7.3
-module load cutadapt/1.8.3
 module load bowtie2/2.2.3
 module load samtools/1.3
 module load picard/1.43
@@ -16,6 +15,7 @@ dir="nobackup"
 projectdir="SCCA"
 
 # Other software paths.
+TrimReads="bin/TrimReads-1.0"
 SummarizeBAM="bin/SummarizeBAM-1.21"
 CallVariants="pipelines/SCCA/CallVariants.r"
 AnnotateVariants="bin/AnnotateVariants-1.1"
@@ -24,9 +24,13 @@ AnnotateVariants="bin/AnnotateVariants-1.1"
 outdir="data"
 
 # Raw sequence reads and reference sequence.
+# The optional fourth argument runs a single step of the pipeline
+# (align, summarize, or annotate), so that RunPipeline can schedule
+# the steps as separate stages; by default all steps are run.
 fastq1="$1"
 fastq2="$2"
 reference="$3"
+step="${4:-all}"
 
 # Parse the sample name.
 sample=${fastq1##*/}
@@ -58,25 +62,26 @@ fi
 
 
 # Trim adapter sequences and bases below a quality threshold of 25.
-# Also remove all reads that are shorter than 20 bases after trimming.
-cutadapt -a TCGTCGGCAGCGTCAGATGTGTATAAGAGACAG -A GTCTCGTGGGCTCGGAGATGTGTATAAGAGACAG \
-    -q 25 -m 20 \
-    -o ${dir}/${projectdir}/${sample}_trimmed-R1.fastq.gz -p ${dir}/${projectdir}/${sample}_trimmed-R2.fastq.gz \
-    ${fastq1} ${fastq2} \
-    > ${dir}/${projectdir}/${sample}.cutadapt.log
-
-
+# Also remove all read pairs with a read shorter than 20 bases after trimming.
+# Trimmed pairs are streamed to Bowtie2 as tab-delimited pairs,
+# without writing trimmed FASTQ files.
 # Align trimmed reads to the appropriate references using Bowtie2.
 # Map reads as paired-end reads.
 # Use very sensitive settings for end-to-end alignment.
-echo "Align reads."
+if [[ ${step} == "all" ]] || [[ ${step} == "align" ]]
+then
+echo "Trim and align reads."
+${TrimReads} -a TCGTCGGCAGCGTCAGATGTGTATAAGAGACAG -A GTCTCGTGGGCTCGGAGATGTGTATAAGAGACAG \
+    -q 25 -m 20 \
+    -1 ${fastq1} -2 ${fastq2} \
+    -o - -t 2 \
+    2> ${dir}/${projectdir}/${sample}.trim.log |
 bowtie2 --very-sensitive-local --un-conc-gz ${dir}/${projectdir}/${sample}-unmapped \
 	-p 4 \
     -X 2300 \
     -x ${reference%%.*} \
 	-k 2 \
-    -1 ${dir}/${projectdir}/${sample}_trimmed-R1.fastq.gz \
-    -2 ${dir}/${projectdir}/${sample}_trimmed-R2.fastq.gz \
+    --12 - \
     -S ${dir}/${projectdir}/${sample}.sam \
     2> ${dir}/${projectdir}/${sample}.bt2.log
   
@@ -85,11 +90,20 @@ bowtie2 --very-sensitive-local --un-conc-gz ${dir}/${projectdir}/${sample}-unmap
 echo "Convert SAM files to BAM files."
 samtools view -b ${dir}/${projectdir}/${sample}.sam -o ${dir}/${projectdir}/${sample}.bam
 
+# Remove the intermediate SAM file once it is converted.
+rm ${dir}/${projectdir}/${sample}.sam
+fi
+
+if [[ ${step} == "all" ]] || [[ ${step} == "summarize" ]]
+then
 # Summarize base frequencies in the sorted BAM file.
 echo "Summarize base frequencies."
 ${SummarizeBAM} -i <(samtools view ${dir}/${projectdir}/${sample}.bam) \
   -f ${reference} -o ${dir}/${projectdir}/${sample}.summary
+fi
 
+if [[ ${step} == "all" ]] || [[ ${step} == "annotate" ]]
+then
 # Annotate variants as synonymous, nonsynonymous, etc.
 echo "Annotate variants."
 ${AnnotateVariants} -i ${dir}/${projectdir}/${sample}.summary -f ${reference} \
@@ -98,7 +112,4 @@ ${AnnotateVariants} -i ${dir}/${projectdir}/${sample}.summary -f ${reference} \
  # Annotate the annotation files with the sample name.
 sed -i "s/$/\t${sample}\t${patient}\t${timepoint}\t${site}\t${aliquot}\t${replicate}/" \
 	${dir}/${projectdir}/${sample}-annotated.summary
-
-# Remove intermediate files after the pipeline finishes.
-echo "Remove intermediate files."
-rm ${dir}/${projectdir}/${sample}.sam
+fi
@@ -6,12 +6,11 @@
 
 # Load modules.
 module load modules modules-init modules-gs
-module load bowtie2/2.2.3
 # Folder in which to save intermediate files.
 dir="nobackup"
 projectdir="SCCA"
 
-# Raw sequence reads and reference sequence.
+# Raw sequence reads and influenza reference sequences.
 fastq1="$1"
 fastq2="$2"
 reference="$3"
@@ -44,20 +43,16 @@ then
   aliquot="A"
 fi
 
-# Filter out all reads that align to the human genome.
-# Retain unmapped reads for further analysis.
-# Use a bowtie2 index built for human_g1k_hs37d5, a version of the hg19 reference genome.
-:<<END
-bowtie2 --very-fast-local --un-conc-gz ${dir}/${projectdir}/${sample}-filtered \
-  -p 4 \
-  -X 1000 \
-  -x ${reference} \
+# Filter out reads that do not come from influenza.
+# Retain read pairs that share at least two 21-mers with the influenza
+# reference segments, in place of aligning all reads to the human genome
+# (human_g1k_hs37d5) with bowtie2 and keeping the unaligned pairs.
+# The filtered reads are written to -filtered.1.fastq.gz and
+# -filtered.2.fastq.gz, as bowtie2 --un-conc-gz wrote them.
+bin/ScreenReads-1.0 screen -f ${reference} \
   -1 ${fastq1} \
   -2 ${fastq2} \
-  -S ${dir}/${projectdir}/${sample}-filtering.sam \
-  2> ${dir}/${projectdir}/${sample}-filtering.bt2.log
-END
-  
-# Rename output untrimmed read files to have a .fastq.gz extension.
-mv ${dir}/${projectdir}/${sample}-filtered.1 ${dir}/${projectdir}/${sample}-filtered.1.fastq.gz
-mv ${dir}/${projectdir}/${sample}-filtered.2 ${dir}/${projectdir}/${sample}-filtered.2.fastq.gz
\ No newline at end of file
+  -o ${dir}/${projectdir}/${sample}-filtered \
+  -k 21 -m 2 \
+  -t 4 \
+  > ${dir}/${projectdir}/${sample}-filtering.log
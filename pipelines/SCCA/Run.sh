@@ -1,17 +1,25 @@
 # Driver script to run SCCA longitudinal analysis pipeline.
-# Pipeline trims raw reads, aligns to the influenza reference genome,
+# Pipeline filters and trims raw reads, aligns to the influenza reference genome,
 # converts to a BAM file, summarizes the base calls at each position,
-# and annotates the bases in terms of the amino-acid changes they create.
+# annotates the bases in terms of the amino-acid changes they create,
+# and concatenates the annotated summaries of each patient.
 # Script is designed to be run from the top-level directory of the Github repository.
 
-# Location of pipeline script.
-pipeline="pipelines/SCCA/AlignSummarizeAnnotate.sh"
+# Location of pipeline runner, stages, and sample sheet.
+# RunPipeline runs each stage for all samples on this node, starting each
+# step as soon as the step before it is done and threads and memory are free,
+# in place of submitting a qsub job per sample.
+# Outputs are cached in nobackup/SCCA/cache by a hash of each command and its
+# inputs, so samples whose reads, reference, and scripts have not changed
+# are restored from the cache instead of being run again.
+RunPipeline="bin/RunPipeline-1.1"
+cachedir="nobackup/SCCA/cache"
+stages="pipelines/SCCA/SCCA-H3N2.stages"
 samplesheet="pipelines/SCCA/SCCA-H3N2.samples"
 
-# Run script for all samples.
-while read sample reference
-do
-  qsub -cwd -pe serial 4 \
-  -N ${sample} -o nobackup/SCCA/sge/${sample}.o -e nobackup/SCCA/sge/${sample}.e \
-  ${pipeline} nobackup/SCCA/${sample}-filtered.1.fastq.gz nobackup/SCCA/${sample}-filtered.2.fastq.gz ${reference}
-done < ${samplesheet}
\ No newline at end of file
+# Run all stages after filtering for all samples;
+# RunFilterAll.sh runs the filtering stage.
+mkdir -p nobackup/SCCA/logs
+${RunPipeline} -s ${samplesheet} -g ${stages} \
+  -r align,summarize,annotate,concat -c ${cachedir} \
+  -l nobackup/SCCA/logs -o nobackup/SCCA/logs/pipeline.status
@@ -0,0 +1,856 @@
+//============================================================================
+// Name        : AASiteFrequencies.cpp
+// Version     : 1.0
+// Description : 1.0 Given a needle pairwise alignment in FASTA format of many
+//               homologous sequences to a single coding reference, calculate
+//               the amino-acid distance of each sequence to the reference
+//               and summarize the amino-acid counts at each codon in each
+//               year. Sequences are processed in parallel threads.
+//               Replaces bin/CalculateSequenceDistances-1.0.py and
+//               bin/AnalyzeAASiteFrequencies-2.0.py.
+//============================================================================
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstring>
+#include <thread>
+
+using namespace std;
+
+// RUN PARAMETERS
+string MODE="";
+string REFFASTA="";
+string ALIGNFILE="";
+string EXCLUSIONFILE="";
+string OUTFILE="";
+int NUMTHREADS=0;
+
+bool DEBUG=false;
+
+// Number of aligned sequence pairs read in before they are
+// split among the threads.
+const unsigned int PAIRSPERTHREAD=512;
+
+// Amino acids counted at each codon, in the order they are written.
+// X is an ambiguous amino acid and * is a stop codon.
+const string AMINOACIDS="*ACDEFGHIKLMNPQRSTVWXY";
+
+// Marks a codon that is not covered by an aligned sequence.
+const char MISSINGAA=' ';
+
+// Stores one record of a needle alignment: the reference sequence
+// with gaps, followed by the aligned sequence with gaps.
+struct AlignedPair_t{
+	string RefName="";
+	string RefSeq="";
+	string Name="";
+	string Seq="";
+};
+
+// Stores the summary of a single aligned sequence.
+struct SequenceSummary_t{
+	string Name="";
+	string Year="unkn";
+	double DecimalYear=0;
+	bool Dated=false;
+	bool HasIndel=false;
+	bool MatchesRef=true;
+	int NumAADifferences=0;
+};
+
+// Stores the translation machinery and reference protein
+// shared read-only by all threads.
+struct Translator_t{
+	string RefSequence="";
+	string RefProtein="";
+	char CodonLookup[64];
+	signed char BaseCode[256];
+	signed char AAIndex[256];
+};
+
+
+// FUNCTIONS
+int ArgsParse(int argc, char *argv[]);
+void PrintUsage();
+void PrintParameters();
+void SetDebug();
+int ReadMultiFasta(string filename,
+		vector<string> *sequencenames,
+		vector<string> *sequences);
+vector<string> StringSplit(string s, char c);
+int InitializeCodonTable(map<char, map<char, map<char,char> > > *codontable);
+int InitializeTranslator(string refsequence, Translator_t *translator);
+char TranslateCodon(const char *codonseq, Translator_t *translator);
+int ReadExclusions(string filename, set<string> *exclusions);
+int ReadFastaRecord(ifstream *file, string *nextline, string *name, string *seq);
+bool ParseDate(string name, SequenceSummary_t *summary);
+void AnalyzePair(AlignedPair_t *pair, Translator_t *translator,
+		SequenceSummary_t *summary, string *protein);
+void AnalyzePairs(vector<AlignedPair_t> *pairs, unsigned int first,
+		unsigned int last, Translator_t *translator, set<string> *exclusions,
+		vector<SequenceSummary_t> *summaries,
+		map<string, vector<long long> > *counts);
+
+int main(int argc, char *argv[]) {
+
+	//==================================================
+	// Parse command-line arguments.
+	//==================================================
+
+	if(ArgsParse(argc, argv) != 0){
+		PrintUsage();
+		return 1;
+	}
+
+	if(NUMTHREADS<=0){
+		NUMTHREADS=thread::hardware_concurrency();
+		if(NUMTHREADS<=0){
+			NUMTHREADS=1;
+		}
+	}
+
+	PrintParameters();
+
+	//==================================================
+	// Read in the reference sequence and translate it.
+	//==================================================
+
+	printf("Reading reference.\n");
+	vector<string> RefNames;
+	vector<string> RefSequences;
+	if(ReadMultiFasta(REFFASTA,&RefNames, &RefSequences) != 0){
+		printf("Error: reference sequence does not exist.\n");
+		return 1;
+	}
+	if(RefSequences.size() != 1){
+		printf("Error: reference must contain a single sequence.\n");
+		return 1;
+	}
+
+	Translator_t Translator;
+	if(InitializeTranslator(RefSequences[0], &Translator) != 0){
+		printf("Error in codon table initialization.\n");
+		return 1;
+	}
+	unsigned int NumCodons=Translator.RefProtein.size();
+	printf("Reference %s: %u codons.\n", RefNames[0].c_str(), NumCodons);
+
+	//==================================================
+	// Read in the list of excluded sequences.
+	//==================================================
+
+	set<string> Exclusions;
+	if(MODE=="frequencies" && EXCLUSIONFILE!=""){
+		printf("Reading exclusions.\n");
+		if(ReadExclusions(EXCLUSIONFILE, &Exclusions) != 0){
+			printf("Error: exclusion file does not exist.\n");
+			return 1;
+		}
+		printf("Number of excluded sequences: %d\n", (int)Exclusions.size());
+	}
+
+	//==================================================
+	// Stream the alignment in blocks of sequence pairs.
+	// Each block is split evenly among the threads,
+	// and the sequence summaries are written in input order.
+	// Each thread keeps its own amino-acid counts,
+	// which are combined once the alignment is read.
+	//==================================================
+
+	ifstream fin(ALIGNFILE.c_str(), ios::in);
+	if(!fin){
+		printf("Error: alignment file does not exist.\n");
+		return 1;
+	}
+
+	ofstream fout(OUTFILE.c_str(), ios::out);
+	if(!fout){
+		printf("Error: could not open output file.\n");
+		return 1;
+	}
+	fout << setprecision(15);
+
+	printf("Processing alignment.\n");
+
+	unsigned int BlockSize=PAIRSPERTHREAD*NUMTHREADS;
+	vector<AlignedPair_t> Pairs(BlockSize);
+	vector<SequenceSummary_t> Summaries(BlockSize);
+	vector<map<string, vector<long long> > > ThreadCounts(NUMTHREADS);
+
+	long long NumSequences=0;
+	long long NumUndated=0;
+	long long NumIndels=0;
+	long long NumExcluded=0;
+	long long NumMismatched=0;
+	string NextLine="";
+	bool Done=false;
+
+	while(!Done){
+
+		// Read in the next block of aligned pairs.
+		unsigned int numpairs=0;
+		while(numpairs < BlockSize){
+			AlignedPair_t *pair=&Pairs[numpairs];
+			if(ReadFastaRecord(&fin, &NextLine,
+					&(*pair).RefName, &(*pair).RefSeq) != 0){
+				Done=true;
+				break;
+			}
+			if(ReadFastaRecord(&fin, &NextLine,
+					&(*pair).Name, &(*pair).Seq) != 0){
+				printf("Error: alignment ends with an unpaired reference record.\n");
+				return 1;
+			}
+			numpairs++;
+		}
+		if(numpairs==0){
+			break;
+		}
+
+		// Analyze the block in parallel.
+		int numthreads=NUMTHREADS;
+		if((unsigned int)numthreads > numpairs){
+			numthreads=numpairs;
+		}
+		vector<thread> threads;
+		for(int t=0; t<numthreads; t++){
+			unsigned int first=(unsigned long long)numpairs*t/numthreads;
+			unsigned int last=(unsigned long long)numpairs*(t+1)/numthreads;
+			threads.push_back(thread(AnalyzePairs, &Pairs, first, last,
+					&Translator, &Exclusions, &Summaries, &ThreadCounts[t]));
+		}
+		for(int t=0; t<numthreads; t++){
+			threads[t].join();
+		}
+
+		// Export the distances in input order and tally the exclusions.
+		for(unsigned int i=0; i<numpairs; i++){
+			SequenceSummary_t *summary=&Summaries[i];
+			NumSequences++;
+			if(!(*summary).MatchesRef){
+				NumMismatched++;
+				continue;
+			}
+			if((*summary).HasIndel){
+				NumIndels++;
+			}
+			if(MODE=="distances"){
+				if(!(*summary).Dated){
+					NumUndated++;
+					continue;
+				}
+				fout << (*summary).Name << " " <<
+						(*summary).DecimalYear << " " <<
+						(*summary).NumAADifferences << "\n";
+			}
+			else if(Exclusions.count((*summary).Name) > 0){
+				NumExcluded++;
+			}
+		}
+	}
+	fin.close();
+
+	if(NumMismatched > 0){
+		printf("Error: %lld aligned reference records do not match %s.\n",
+				NumMismatched, REFFASTA.c_str());
+		fout.close();
+		return 1;
+	}
+
+	//==================================================
+	// Combine the amino-acid counts of all threads
+	// and export them by year, codon, and amino acid.
+	// Codons are numbered from zero.
+	//==================================================
+
+	if(MODE=="frequencies"){
+		map<string, vector<long long> > Counts;
+		for(int t=0; t<NUMTHREADS; t++){
+			map<string, vector<long long> >::iterator it;
+			for(it=ThreadCounts[t].begin(); it!=ThreadCounts[t].end(); ++it){
+				vector<long long> *total=&Counts[(*it).first];
+				if((*total).size()==0){
+					(*total).assign((*it).second.size(), 0);
+				}
+				for(unsigned int k=0; k<(*it).second.size(); k++){
+					(*total)[k] += (*it).second[k];
+				}
+			}
+		}
+
+		fout << "Year\tPosition\tBase\tCount" << "\n";
+		map<string, vector<long long> >::iterator it;
+		for(it=Counts.begin(); it!=Counts.end(); ++it){
+			for(unsigned int pos=0; pos<NumCodons; pos++){
+				for(unsigned int aa=0; aa<AMINOACIDS.size(); aa++){
+					long long count=(*it).second[pos*AMINOACIDS.size()+aa];
+					if(count > 0){
+						fout << (*it).first << "\t" << pos << "\t" <<
+								AMINOACIDS[aa] << "\t" << count << "\n";
+					}
+				}
+			}
+		}
+	}
+
+	fout.close();
+
+	printf("Number of aligned sequences: %lld\n", NumSequences);
+	printf("Number of sequences with indels: %lld\n", NumIndels);
+	if(MODE=="distances"){
+		printf("Number of undated sequences skipped: %lld\n", NumUndated);
+	}
+	else{
+		printf("Number of excluded sequences found: %lld\n", NumExcluded);
+	}
+
+	return 0;
+}
+
+// ArgsParse
+// Parses command-line arguments.
+// The first argument names the mode, and the rest are flag pairs.
+// Returns 1 if any argument conditions are violated.
+int ArgsParse(int argc, char *argv[]){
+
+	// If the only argument is debug,
+	// set all parameters to the debug state.
+	if(argc==2 && strcmp(argv[1],"debug")==0){
+		SetDebug();
+		return 0;
+	}
+
+	if(argc<2){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	MODE=argv[1];
+	if(MODE!="distances" && MODE!="frequencies"){
+		printf("Invalid mode. Specify distances or frequencies.\n");
+		return 1;
+	}
+
+	// Ensure that there are an even number of arguments,
+	// leaving aside the program name and mode.
+	if((argc - 2) % 2 != 0){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	// Check the structure of arguments.
+	for(int i=2; i<argc; i++){
+		// Verify that every other argument is a flag.
+		if(i%2 == 0){
+			if(argv[i][0] != '-' || strlen(argv[i])!=2){
+				printf("Invalid use of argument flags.\n");
+				return 1;
+			}
+		}
+	}
+
+	// Parse each pair of arguments.
+	for(int i=1; i<(argc-2)/2+1; i++){
+
+		string flag=argv[2*i];
+		string arg=argv[2*i+1];
+
+		// Parse the flag string.
+		switch(flag[1]){
+		// -f reference FASTA file
+		case 'f':
+			REFFASTA = arg;
+			break;
+		// -a needle alignment in FASTA format
+		case 'a':
+			ALIGNFILE = arg;
+			break;
+		// -x list of excluded sequence names
+		case 'x':
+			EXCLUSIONFILE = arg;
+			break;
+		// -o output file
+		case 'o':
+			OUTFILE = arg;
+			break;
+		// -t number of threads
+		case 't':
+			NUMTHREADS = atoi(arg.c_str());
+			break;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(REFFASTA==""){
+		printf("Invalid arguments. Specify reference FASTA file.\n");
+		return 1;
+	}
+	if(ALIGNFILE==""){
+		printf("Invalid arguments. Specify alignment file.\n");
+		return 1;
+	}
+	if(OUTFILE==""){
+		printf("Invalid arguments. Specify output file.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// PrintParameters
+// When called, prints the parameters for the run.
+void PrintParameters(){
+	cout << "RUN PARAMETERS" << endl;
+	cout << "mode: " << MODE << endl;
+	cout << "reference: " << REFFASTA << endl;
+	cout << "alignment: " << ALIGNFILE << endl;
+	if(EXCLUSIONFILE != ""){
+		cout << "exclusions: " << EXCLUSIONFILE << endl;
+	}
+	cout << "output file: " << OUTFILE << endl;
+	cout << "threads: " << NUMTHREADS << endl;
+	cout << endl;
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: AASiteFrequencies distances -f ref.fasta -a aligned.fasta\n"
+			"         -o distances.data\n");
+	printf("       AASiteFrequencies frequencies -f ref.fasta -a aligned.fasta\n"
+			"         -x distances-exclusions.data -o frequencies.data\n");
+	printf("\n");
+	printf("Modes:\n");
+	printf("  distances\tamino-acid distance of each dated sequence to the reference\n");
+	printf("  frequencies\tamino-acid counts at each codon in each year, excluding\n"
+			"\t\tsequences with indels or named in the exclusion list\n");
+	printf("\n");
+	printf("Options (defaults in parentheses):\n");
+	printf("  -x FILE\tsequence names to exclude, one per line\n");
+	printf("  -t INT\tnumber of threads [all cores]\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	MODE="frequencies";
+	REFFASTA="ref.test";
+	ALIGNFILE="aligned.test";
+	OUTFILE="out.test";
+	NUMTHREADS=1;
+	DEBUG=true;
+}
+
+// ReadMultiFasta
+// Given a multi-FASTA file, reads in the names and sequences.
+// Returns 1 if the file does not exist.
+int ReadMultiFasta(string filename,
+		vector<string> *sequencenames,
+		vector<string> *sequences){
+
+	// Open the file.
+	ifstream f_in(filename.c_str(), ios::in);
+
+	string line;
+	string header;
+	string sequence;
+	int numsequences=0;
+
+	if(f_in){
+		// Read in the file line by line,
+		// storing lines that begin with '>' as the sequence name
+		while(getline(f_in, line)){
+
+			if(line[0] == '>') {
+				if(numsequences != 0){
+					(*sequences).push_back(sequence);
+				}
+				numsequences += 1;
+				sequence = "";
+				// Store the first word of the sequence name,
+				// with the > character removed.
+				(*sequencenames).push_back(
+						StringSplit(StringSplit(line,' ')[0],'>')[0]);
+				continue;
+			}
+			sequence += line;
+		}
+		if(numsequences != 0){
+			(*sequences).push_back(sequence);
+		}
+	}
+	else{
+		return 1;
+	}
+
+	// Close the file.
+	f_in.close();
+
+	return 0;
+
+}
+
+//
+// StringSplit
+// Takes in a string and a character delimiter
+// and returns a vector of strings split at that character.
+vector<string> StringSplit(string s, char c){
+	vector<string> splits;
+	string s0;
+	unsigned int i=0;
+
+	while(i < s.length()){
+		// Skip through delimiter characters at the beginnings of lines.
+		while(s[i] == c && i < s.length() - 1){
+			i++;
+		}
+		// Iterate through actual characters until you encounter c.
+		while(i < s.length() && s[i] != c){
+			s0 += s[i];
+			i++;
+		}
+		// Once c is encountered, stop and save the string, then reset it.
+		if(s0.size() > 0){
+			splits.push_back(s0);
+			s0 = "";
+		}
+		i++;
+	}
+
+	return splits;
+}
+
+// InitializeCodonTable
+// Initializes the codon table with the standard genetic code.
+int InitializeCodonTable(map<char, map<char, map<char,char> > > *codontable){
+
+	const char BASES[4]={'T','C','A','G'};
+	string CodonsToAAs="FFLLSSSSYY**CC*WLLLLPPPPHHQQRRRR"
+			"IIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG";
+
+	int iCodon=0;
+	for(int i=0; i<4; i++){
+		for(int j=0; j<4; j++){
+			for(int k=0; k<4; k++){
+				(*codontable)[BASES[i]][BASES[j]][BASES[k]]=CodonsToAAs[iCodon];
+				iCodon++;
+			}
+		}
+	}
+	return 0;
+}
+
+// InitializeTranslator
+// Flattens the codon table into a lookup by 2-bit base codes,
+// so that threads can translate codons without touching the map,
+// and translates the reference in frame from its first base.
+int InitializeTranslator(string refsequence, Translator_t *translator){
+
+	map<char, map<char, map<char,char> > > CodonTable;
+	if(InitializeCodonTable(&CodonTable) != 0){
+		return 1;
+	}
+
+	const char BASES[4]={'T','C','A','G'};
+	for(int c=0; c<256; c++){
+		(*translator).BaseCode[c]=-1;
+		(*translator).AAIndex[c]=-1;
+	}
+	for(int i=0; i<4; i++){
+		(*translator).BaseCode[(unsigned char)BASES[i]]=i;
+		(*translator).BaseCode[(unsigned char)tolower(BASES[i])]=i;
+	}
+	// Treat U as T for RNA sequences.
+	(*translator).BaseCode[(unsigned char)'U']=0;
+	(*translator).BaseCode[(unsigned char)'u']=0;
+	for(int i=0; i<4; i++){
+		for(int j=0; j<4; j++){
+			for(int k=0; k<4; k++){
+				(*translator).CodonLookup[16*i+4*j+k]=
+						CodonTable[BASES[i]][BASES[j]][BASES[k]];
+			}
+		}
+	}
+	for(unsigned int aa=0; aa<AMINOACIDS.size(); aa++){
+		(*translator).AAIndex[(unsigned char)AMINOACIDS[aa]]=aa;
+	}
+
+	(*translator).RefSequence=refsequence;
+	transform((*translator).RefSequence.begin(), (*translator).RefSequence.end(),
+			(*translator).RefSequence.begin(), ::toupper);
+	(*translator).RefProtein="";
+	for(unsigned int i=0; i+3<=refsequence.size(); i+=3){
+		(*translator).RefProtein += TranslateCodon(&refsequence[i], translator);
+	}
+	return 0;
+}
+
+// TranslateCodon
+// Given a pointer to three bases and the translator,
+// return the one-letter amino-acid code for the codon.
+// Return X if any base is ambiguous, and MISSINGAA
+// if any base is not covered by the aligned sequence.
+char TranslateCodon(const char *codonseq, Translator_t *translator){
+	if(codonseq[0]==MISSINGAA || codonseq[1]==MISSINGAA ||
+			codonseq[2]==MISSINGAA){
+		return MISSINGAA;
+	}
+	int b0=(*translator).BaseCode[(unsigned char)codonseq[0]];
+	int b1=(*translator).BaseCode[(unsigned char)codonseq[1]];
+	int b2=(*translator).BaseCode[(unsigned char)codonseq[2]];
+	if(b0 < 0 || b1 < 0 || b2 < 0){
+		return 'X';
+	}
+	return (*translator).CodonLookup[16*b0+4*b1+b2];
+}
+
+// ReadExclusions
+// Reads in a list of sequence names, one per line,
+// as written by FilterOutlierSequences.R.
+// Returns 1 if the file does not exist.
+int ReadExclusions(string filename, set<string> *exclusions){
+	ifstream fin(filename.c_str(), ios::in);
+	if(!fin){
+		return 1;
+	}
+	string line;
+	while(getline(fin, line)){
+		vector<string> fields=StringSplit(line, ' ');
+		if(fields.size() > 0 && fields[0] != "\r"){
+			string name=fields[0];
+			if(name[name.size()-1]=='\r'){
+				name.erase(name.size()-1);
+			}
+			(*exclusions).insert(name);
+		}
+	}
+	fin.close();
+	return 0;
+}
+
+// ReadFastaRecord
+// Reads the next record of a multi-FASTA file,
+// keeping the header line of the following record in nextline.
+// Stores the first word of the sequence name.
+// Returns 1 if there are no more records.
+int ReadFastaRecord(ifstream *file, string *nextline, string *name, string *seq){
+	string line;
+	// Find the header line of this record.
+	if((*nextline).size() > 0 && (*nextline)[0]=='>'){
+		line=*nextline;
+	}
+	else{
+		while(getline(*file, line)){
+			if(line.size() > 0 && line[0]=='>'){
+				break;
+			}
+		}
+		if(line.size()==0 || line[0]!='>'){
+			return 1;
+		}
+	}
+	(*name)=StringSplit(StringSplit(line,' ')[0],'>')[0];
+	(*seq)="";
+	(*nextline)="";
+	// Read sequence lines until the next header.
+	while(getline(*file, line)){
+		if(line.size() > 0 && line[0]=='>'){
+			(*nextline)=line;
+			break;
+		}
+		for(unsigned int i=0; i<line.size(); i++){
+			if(line[i]!='\r' && line[i]!=' '){
+				(*seq) += line[i];
+			}
+		}
+	}
+	return 0;
+}
+
+// ParseDate
+// Finds the collection date among the '|'-separated fields of a
+// GISAID or Genbank sequence name, as YYYY, YYYY-MM, or YYYY-MM-DD
+// with '-' or '/' separators. Unknown months and days may be written
+// as XX or left off. Stores the year as written, and the date as a
+// decimal year for sequences with a nonzero year.
+// Returns false if no field holds a date.
+bool ParseDate(string name, SequenceSummary_t *summary){
+	const int DAYSBEFOREMONTH[12]={0,31,59,90,120,151,181,212,243,273,304,334};
+	vector<string> fields=StringSplit(name, '|');
+	// Search from the last field, where the date is usually stored.
+	for(int f=fields.size()-1; f>=0; f--){
+		string field=fields[f];
+		if(field.size() < 4 || !isdigit(field[0]) || !isdigit(field[1]) ||
+				!isdigit(field[2]) || !isdigit(field[3])){
+			continue;
+		}
+		if(field.size() > 4 && field[4]!='-' && field[4]!='/' &&
+				field[4]!=' ' && field[4]!='('){
+			continue;
+		}
+		int year=atoi(field.substr(0,4).c_str());
+		int month=0;
+		int day=0;
+		if(field.size() > 6 && (field[4]=='-' || field[4]=='/') &&
+				isdigit(field[5])){
+			month=atoi(field.substr(5,2).c_str());
+			size_t sep=field.find_first_of("-/", 6);
+			if(sep!=string::npos && sep+1 < field.size() && isdigit(field[sep+1])){
+				day=atoi(field.substr(sep+1,2).c_str());
+			}
+		}
+		if(month < 1 || month > 12){
+			month=0;
+			day=0;
+		}
+		if(day < 1 || day > 31){
+			day=0;
+		}
+
+		(*summary).Year=field.substr(0,4);
+		(*summary).Dated=(year > 0);
+		(*summary).DecimalYear=year;
+		if(month > 0){
+			bool leap=(year%4==0 && year%100!=0) || year%400==0;
+			int dayofyear=DAYSBEFOREMONTH[month-1];
+			if(leap && month > 2){
+				dayofyear++;
+			}
+			if(day > 0){
+				dayofyear += day-1;
+			}
+			(*summary).DecimalYear += (double)dayofyear/(leap ? 366 : 365);
+		}
+		return true;
+	}
+	return false;
+}
+
+// AnalyzePair
+// Projects an aligned sequence onto reference coordinates and translates it.
+// Reference positions before the first or after the last aligned base of the
+// sequence are not covered. Gaps inside the covered region of either
+// sequence are indels. Counts the amino-acid differences from the
+// reference, leaving aside ambiguous and uncovered codons.
+void AnalyzePair(AlignedPair_t *pair, Translator_t *translator,
+		SequenceSummary_t *summary, string *protein){
+
+	string *refaln=&(*pair).RefSeq;
+	string *seqaln=&(*pair).Seq;
+
+	(*summary)=SequenceSummary_t();
+	(*summary).Name=(*pair).Name;
+	ParseDate((*pair).Name, summary);
+	(*protein)="";
+
+	if((*refaln).size()!=(*seqaln).size()){
+		(*summary).MatchesRef=false;
+		return;
+	}
+
+	// Find the aligned region of each sequence.
+	long long length=(*refaln).size();
+	long long refstart=length, refend=-1;
+	long long seqstart=length, seqend=-1;
+	for(long long i=0; i<length; i++){
+		if((*refaln)[i]!='-'){
+			if(refstart==length){
+				refstart=i;
+			}
+			refend=i;
+		}
+		if((*seqaln)[i]!='-'){
+			if(seqstart==length){
+				seqstart=i;
+			}
+			seqend=i;
+		}
+	}
+
+	// Build the sequence in reference coordinates.
+	string projected;
+	projected.reserve((*translator).RefSequence.size());
+	unsigned int refpos=0;
+	for(long long i=0; i<length; i++){
+		char refbase=(*refaln)[i];
+		char seqbase=(*seqaln)[i];
+		bool covered=(i >= seqstart && i <= seqend);
+		if(refbase=='-'){
+			if(seqbase!='-' && i > refstart && i < refend){
+				(*summary).HasIndel=true;
+			}
+			continue;
+		}
+		if(refpos >= (*translator).RefSequence.size() ||
+				toupper(refbase)!=(*translator).RefSequence[refpos]){
+			(*summary).MatchesRef=false;
+			return;
+		}
+		refpos++;
+		if(!covered){
+			projected += MISSINGAA;
+		}
+		else if(seqbase=='-'){
+			(*summary).HasIndel=true;
+			projected += MISSINGAA;
+		}
+		else{
+			projected += toupper(seqbase);
+		}
+	}
+	if(refpos!=(*translator).RefSequence.size()){
+		(*summary).MatchesRef=false;
+		return;
+	}
+
+	// Translate in frame and compare to the reference protein.
+	for(unsigned int i=0; i<(*translator).RefProtein.size(); i++){
+		char aa=TranslateCodon(&projected[3*i], translator);
+		(*protein) += aa;
+		if(aa!=MISSINGAA && aa!='X' && (*translator).RefProtein[i]!='X' &&
+				aa!=(*translator).RefProtein[i]){
+			(*summary).NumAADifferences++;
+		}
+	}
+}
+
+// AnalyzePairs
+// Analyzes the aligned pairs from first to last, not including last,
+// and adds the amino acids of sequences without indels that are not
+// excluded to the counts for their year.
+// Run in parallel threads on separate ranges of the same block.
+void AnalyzePairs(vector<AlignedPair_t> *pairs, unsigned int first,
+		unsigned int last, Translator_t *translator, set<string> *exclusions,
+		vector<SequenceSummary_t> *summaries,
+		map<string, vector<long long> > *counts){
+
+	unsigned int numcodons=(*translator).RefProtein.size();
+	unsigned int numaas=AMINOACIDS.size();
+	string protein;
+	for(unsigned int i=first; i<last; i++){
+		SequenceSummary_t *summary=&(*summaries)[i];
+		AnalyzePair(&(*pairs)[i], translator, summary, &protein);
+		if(MODE!="frequencies" || !(*summary).MatchesRef ||
+				(*summary).HasIndel || (*exclusions).count((*summary).Name) > 0){
+			continue;
+		}
+		vector<long long> *yearcounts=&(*counts)[(*summary).Year];
+		if((*yearcounts).size()==0){
+			(*yearcounts).assign(numcodons*numaas, 0);
+		}
+		for(unsigned int pos=0; pos<numcodons; pos++){
+			int aa=(*translator).AAIndex[(unsigned char)protein[pos]];
+			if(aa >= 0){
+				(*yearcounts)[pos*numaas+aa]++;
+			}
+		}
+	}
+}
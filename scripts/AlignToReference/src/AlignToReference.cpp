@@ -0,0 +1,1104 @@
+//============================================================================
+// Name        : AlignToReference.cpp
+// Version     : 1.0
+// Description : 1.0 Globally align each sequence of a multi-FASTA file to a
+//               single reference with the scoring of EMBOSS needle
+//               (EDNAFULL, affine gaps, end gaps not penalized), using a
+//               banded dynamic program over diagonals placed by shared
+//               k-mers with the reference. Sequences are aligned
+//               in parallel threads, and the alignments are written in
+//               input order in the FASTA layout of needle -aformat fasta.
+//               Rows of the band are filled by AVX2 kernels where the
+//               CPU supports them, and by scalar kernels otherwise.
+//============================================================================
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <thread>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ALIGN_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// RUN PARAMETERS
+string REFFASTA="";
+string SEQFILE="";
+string OUTFILE="";
+double GAPOPEN=10.0;
+double GAPEXTEND=0.5;
+int BANDWIDTH=32;
+int NUMTHREADS=0;
+
+bool DEBUG=false;
+
+// Number of sequences read in before they are split among the threads.
+const unsigned int SEQUENCESPERTHREAD=256;
+
+// Length of the k-mers used to place the band. Only k-mers that occur
+// once in the reference are used.
+const int KMERLENGTH=10;
+
+// Number of bases per line of aligned FASTA output, as written by needle.
+const unsigned int LINEWIDTH=60;
+
+// Scores are kept as integers in units of 1/SCORESCALE,
+// so gap penalties are exact to two decimal places.
+const int SCORESCALE=100;
+
+// Score of cells outside the band or the matrix. Low enough never to be
+// chosen, and high enough that subtracting penalties cannot overflow.
+const int NEGINF=-(1<<28);
+
+// Nucleotide codes of the EDNAFULL matrix, in matrix order.
+// Any other character is scored as N.
+const string EDNACODES="ATGCSWRYKMBVHDN";
+const int EDNAFULL[15][15]={
+	{ 5,-4,-4,-4,-4, 1, 1,-4,-4, 1,-4,-1,-1,-1,-2},
+	{-4, 5,-4,-4,-4, 1,-4, 1, 1,-4,-1,-4,-1,-1,-2},
+	{-4,-4, 5,-4, 1,-4, 1,-4, 1,-4,-1,-1,-4,-1,-2},
+	{-4,-4,-4, 5, 1,-4,-4, 1,-4, 1,-1,-1,-1,-4,-2},
+	{-4,-4, 1, 1,-1,-4,-2,-2,-2,-2,-1,-1,-3,-3,-1},
+	{ 1, 1,-4,-4,-4,-1,-2,-2,-2,-2,-3,-3,-1,-1,-1},
+	{ 1,-4, 1,-4,-2,-2,-1,-4,-2,-2,-3,-1,-3,-1,-1},
+	{-4, 1,-4, 1,-2,-2,-4,-1,-2,-2,-1,-3,-1,-3,-1},
+	{-4, 1, 1,-4,-2,-2,-2,-2,-1,-4,-1,-3,-3,-1,-1},
+	{ 1,-4,-4, 1,-2,-2,-2,-2,-4,-1,-3,-1,-1,-3,-1},
+	{-4,-1,-1,-1,-1,-3,-3,-1,-1,-3,-1,-2,-2,-2,-1},
+	{-1,-4,-1,-1,-1,-3,-1,-3,-3,-1,-2,-1,-2,-2,-1},
+	{-1,-1,-4,-1,-3,-1,-3,-1,-3,-1,-2,-2,-1,-2,-1},
+	{-1,-1,-1,-4,-3,-1,-1,-3,-1,-3,-2,-2,-2,-1,-1},
+	{-2,-2,-2,-2,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1}
+};
+
+// Bits of the traceback byte stored for each cell of the band.
+// The low two bits give the matrix that the best score comes from.
+const unsigned char TB_DIAG=0;
+const unsigned char TB_E=1;
+const unsigned char TB_F=2;
+const unsigned char TB_EEXTEND=4;
+const unsigned char TB_FEXTEND=8;
+
+// Stores the reference sequence, its EDNAFULL codes,
+// and the scoring parameters shared read-only by all threads.
+struct Reference_t{
+	string Name="";
+	string Seq="";
+	vector<unsigned char> Codes;
+	int Matrix[15][15];
+	unsigned char CodeOf[256];
+	int GapOpen=0;
+	int GapExtend=0;
+	signed char KmerCode[256];
+	vector<int> KmerPosition;
+};
+
+// Stores one input sequence and its alignment to the reference.
+struct Alignment_t{
+	string Name="";
+	string Seq="";
+	string AlignedRef="";
+	string AlignedSeq="";
+	bool Seeded=false;
+	int NumPasses=0;
+	long long Score=0;
+};
+
+// Working memory reused by a thread from one alignment to the next.
+// Rows of the band are indexed by diagonal, so that cell k of row i
+// is query position j=i+DiagLow+k.
+struct AlignBuffer_t{
+	vector<int> Profile;
+	vector<int> HPrev;
+	vector<int> HCur;
+	vector<int> FPrev;
+	vector<int> FCur;
+	vector<int> Diag;
+	vector<int> EMax;
+	vector<unsigned char> Traceback;
+};
+
+// Signatures shared by the scalar and vectorized row kernels.
+// The vertical kernel fills the diagonal and vertical gap scores of a row
+// from the row above; the horizontal kernel adds the horizontal gaps
+// from the running maxima in emax over cells kmin+1 to kmax.
+typedef void (*VerticalKernel_t)(const int *hprev, const int *fprev,
+		const int *profile, int width, int gapopen, int gapextend,
+		int *fcur, int *diag, unsigned char *tb);
+typedef void (*HorizontalKernel_t)(const int *diag, const int *emax,
+		int kmin, int kstart, int kmax, int gapopen, int gapextend,
+		int *hcur, unsigned char *tb);
+
+
+// FUNCTIONS
+int ArgsParse(int argc, char *argv[]);
+void PrintUsage();
+void PrintParameters();
+void SetDebug();
+int ReadMultiFasta(string filename,
+		vector<string> *sequencenames,
+		vector<string> *sequences);
+vector<string> StringSplit(string s, char c);
+int ReadFastaRecord(ifstream *file, string *nextline, string *name, string *seq);
+void InitializeReference(string name, string seq, Reference_t *reference);
+bool FindDiagonals(Reference_t *reference, Alignment_t *alignment,
+		int *diaglow, int *diaghigh);
+void VerticalKernelScalar(const int *hprev, const int *fprev,
+		const int *profile, int width, int gapopen, int gapextend,
+		int *fcur, int *diag, unsigned char *tb);
+void HorizontalKernelScalar(const int *diag, const int *emax,
+		int kmin, int kstart, int kmax, int gapopen, int gapextend,
+		int *hcur, unsigned char *tb);
+#ifdef ALIGN_X86_DISPATCH
+void VerticalKernelAVX2(const int *hprev, const int *fprev,
+		const int *profile, int width, int gapopen, int gapextend,
+		int *fcur, int *diag, unsigned char *tb);
+void HorizontalKernelAVX2(const int *diag, const int *emax,
+		int kmin, int kstart, int kmax, int gapopen, int gapextend,
+		int *hcur, unsigned char *tb);
+#endif
+void SelectRowKernels(string *kernelname);
+bool AlignBanded(Reference_t *reference, Alignment_t *alignment,
+		int diaglow, int diaghigh, AlignBuffer_t *buffer);
+void AlignSequence(Reference_t *reference, Alignment_t *alignment,
+		AlignBuffer_t *buffer);
+void AlignSequences(vector<Alignment_t> *alignments, unsigned int first,
+		unsigned int last, Reference_t *reference);
+void WriteAlignedFasta(ofstream *out, string name, string seq);
+
+// Row kernels selected at startup based on the CPU.
+VerticalKernel_t VerticalKernel=VerticalKernelScalar;
+HorizontalKernel_t HorizontalKernel=HorizontalKernelScalar;
+string ROWKERNELNAME="scalar";
+
+int main(int argc, char *argv[]) {
+
+	//==================================================
+	// Parse command-line arguments.
+	//==================================================
+
+	if(ArgsParse(argc, argv) != 0){
+		PrintUsage();
+		return 1;
+	}
+
+	if(NUMTHREADS<=0){
+		NUMTHREADS=thread::hardware_concurrency();
+		if(NUMTHREADS<=0){
+			NUMTHREADS=1;
+		}
+	}
+
+	// Choose the row kernels for this CPU.
+	SelectRowKernels(&ROWKERNELNAME);
+
+	PrintParameters();
+
+	//==================================================
+	// Read in the reference sequence.
+	//==================================================
+
+	printf("Reading reference.\n");
+	vector<string> RefNames;
+	vector<string> RefSequences;
+	if(ReadMultiFasta(REFFASTA,&RefNames, &RefSequences) != 0){
+		printf("Error: reference sequence does not exist.\n");
+		return 1;
+	}
+	if(RefSequences.size() != 1 || RefSequences[0].size()==0){
+		printf("Error: reference must contain a single sequence.\n");
+		return 1;
+	}
+
+	Reference_t Reference;
+	InitializeReference(RefNames[0], RefSequences[0], &Reference);
+
+	//==================================================
+	// Stream the sequences in blocks.
+	// Each block is split evenly among the threads,
+	// and the alignments are written in input order.
+	//==================================================
+
+	ifstream fin(SEQFILE.c_str(), ios::in);
+	if(!fin){
+		printf("Error: sequence file does not exist.\n");
+		return 1;
+	}
+
+	ofstream fout(OUTFILE.c_str(), ios::out);
+	if(!fout){
+		printf("Error: could not open output file.\n");
+		return 1;
+	}
+
+	printf("Aligning sequences.\n");
+
+	unsigned int BlockSize=SEQUENCESPERTHREAD*NUMTHREADS;
+	vector<Alignment_t> Alignments(BlockSize);
+
+	long long NumSequences=0;
+	long long NumWidened=0;
+	long long NumUnseeded=0;
+	string NextLine="";
+	bool Done=false;
+
+	while(!Done){
+
+		// Read in the next block of sequences.
+		unsigned int numseqs=0;
+		while(numseqs < BlockSize){
+			Alignment_t *alignment=&Alignments[numseqs];
+			if(ReadFastaRecord(&fin, &NextLine,
+					&(*alignment).Name, &(*alignment).Seq) != 0){
+				Done=true;
+				break;
+			}
+			numseqs++;
+		}
+		if(numseqs==0){
+			break;
+		}
+
+		// Align the block in parallel.
+		int numthreads=NUMTHREADS;
+		if((unsigned int)numthreads > numseqs){
+			numthreads=numseqs;
+		}
+		vector<thread> threads;
+		for(int t=0; t<numthreads; t++){
+			unsigned int first=(unsigned long long)numseqs*t/numthreads;
+			unsigned int last=(unsigned long long)numseqs*(t+1)/numthreads;
+			threads.push_back(thread(AlignSequences, &Alignments, first, last,
+					&Reference));
+		}
+		for(int t=0; t<numthreads; t++){
+			threads[t].join();
+		}
+
+		// Export the alignments in input order.
+		for(unsigned int i=0; i<numseqs; i++){
+			WriteAlignedFasta(&fout, Reference.Name, Alignments[i].AlignedRef);
+			WriteAlignedFasta(&fout, Alignments[i].Name, Alignments[i].AlignedSeq);
+			if(!Alignments[i].Seeded){
+				NumUnseeded++;
+			}
+			else if(Alignments[i].NumPasses > 1){
+				NumWidened++;
+			}
+			if(DEBUG){
+				printf("%s\tscore %.2f\tpasses %d\n", Alignments[i].Name.c_str(),
+						(double)Alignments[i].Score/SCORESCALE,
+						Alignments[i].NumPasses);
+			}
+		}
+		NumSequences += numseqs;
+	}
+	fin.close();
+	fout.close();
+
+	printf("Number of aligned sequences: %lld\n", NumSequences);
+	printf("Number of alignments that needed a wider band: %lld\n", NumWidened);
+	printf("Number of sequences without shared %d-mers, aligned in full: %lld\n",
+			KMERLENGTH, NumUnseeded);
+
+	return 0;
+}
+
+// ArgsParse
+// Parses command-line arguments.
+// Returns 1 if any argument conditions are violated.
+int ArgsParse(int argc, char *argv[]){
+
+	// If the only argument is debug,
+	// set all parameters to the debug state.
+	if(argc==2 && strcmp(argv[1],"debug")==0){
+		SetDebug();
+		return 0;
+	}
+
+	// Ensure that there are an even number of arguments.
+	if((argc - 1) % 2 != 0){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	// Check the structure of arguments.
+	for(int i=1; i<argc; i++){
+		// Verify that every other argument is a flag.
+		if(i%2 == 1){
+			if(argv[i][0] != '-' || strlen(argv[i])!=2){
+				printf("Invalid use of argument flags.\n");
+				return 1;
+			}
+		}
+	}
+
+	// Parse each pair of arguments.
+	for(int i=1; i<(argc-1)/2+1; i++){
+
+		string flag=argv[2*i-1];
+		string arg=argv[2*i];
+
+		// Parse the flag string.
+		switch(flag[1]){
+		// -f reference FASTA file
+		case 'f':
+			REFFASTA = arg;
+			break;
+		// -i sequences to align, in multi-FASTA format
+		case 'i':
+			SEQFILE = arg;
+			break;
+		// -o output file
+		case 'o':
+			OUTFILE = arg;
+			break;
+		// -g gap opening penalty
+		case 'g':
+			GAPOPEN = atof(arg.c_str());
+			if(GAPOPEN < 0){
+				printf("Invalid -g gap opening penalty.\n");
+				return 1;
+			}
+			break;
+		// -e gap extension penalty
+		case 'e':
+			GAPEXTEND = atof(arg.c_str());
+			if(GAPEXTEND < 0 || GAPEXTEND > GAPOPEN){
+				printf("Invalid -e gap extension penalty.\n");
+				return 1;
+			}
+			break;
+		// -b band width around the k-mer diagonals
+		case 'b':
+			BANDWIDTH = atoi(arg.c_str());
+			if(BANDWIDTH <= 0){
+				printf("Invalid -b band width.\n");
+				return 1;
+			}
+			break;
+		// -t number of threads
+		case 't':
+			NUMTHREADS = atoi(arg.c_str());
+			break;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(REFFASTA==""){
+		printf("Invalid arguments. Specify reference FASTA file.\n");
+		return 1;
+	}
+	if(SEQFILE==""){
+		printf("Invalid arguments. Specify sequence file.\n");
+		return 1;
+	}
+	if(OUTFILE==""){
+		printf("Invalid arguments. Specify output file.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// PrintParameters
+// When called, prints the parameters for the run.
+void PrintParameters(){
+	cout << "RUN PARAMETERS" << endl;
+	cout << "reference: " << REFFASTA << endl;
+	cout << "sequences: " << SEQFILE << endl;
+	cout << "output file: " << OUTFILE << endl;
+	cout << "gap opening penalty: " << GAPOPEN << endl;
+	cout << "gap extension penalty: " << GAPEXTEND << endl;
+	cout << "band width: " << BANDWIDTH << endl;
+	cout << "threads: " << NUMTHREADS << endl;
+	cout << "row kernel: " << ROWKERNELNAME << endl;
+	cout << endl;
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: AlignToReference -f ref.fasta -i seqs.fasta -o aligned.fasta\n");
+	printf("\n");
+	printf("Options (defaults in parentheses):\n");
+	printf("  -g FLOAT\tgap opening penalty [10.0]\n");
+	printf("  -e FLOAT\tgap extension penalty [0.5]\n");
+	printf("  -b INT\tband width on each side of the diagonals of k-mers\n"
+			"\t\tshared with the reference [32]\n");
+	printf("  -t INT\tnumber of threads [all cores]\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	REFFASTA="ref.test";
+	SEQFILE="seqs.test";
+	OUTFILE="out.test";
+	NUMTHREADS=1;
+	DEBUG=true;
+}
+
+// ReadMultiFasta
+// Given a multi-FASTA file, reads in the names and sequences.
+// Returns 1 if the file does not exist.
+int ReadMultiFasta(string filename,
+		vector<string> *sequencenames,
+		vector<string> *sequences){
+
+	// Open the file.
+	ifstream f_in(filename.c_str(), ios::in);
+
+	string line;
+	string header;
+	string sequence;
+	int numsequences=0;
+
+	if(f_in){
+		// Read in the file line by line,
+		// storing lines that begin with '>' as the sequence name
+		while(getline(f_in, line)){
+
+			if(line[0] == '>') {
+				if(numsequences != 0){
+					(*sequences).push_back(sequence);
+				}
+				numsequences += 1;
+				sequence = "";
+				// Store the first word of the sequence name,
+				// with the > character removed.
+				(*sequencenames).push_back(
+						StringSplit(StringSplit(line,' ')[0],'>')[0]);
+				continue;
+			}
+			sequence += line;
+		}
+		if(numsequences != 0){
+			(*sequences).push_back(sequence);
+		}
+	}
+	else{
+		return 1;
+	}
+
+	// Close the file.
+	f_in.close();
+
+	return 0;
+
+}
+
+//
+// StringSplit
+// Takes in a string and a character delimiter
+// and returns a vector of strings split at that character.
+vector<string> StringSplit(string s, char c){
+	vector<string> splits;
+	string s0;
+	unsigned int i=0;
+
+	while(i < s.length()){
+		// Skip through delimiter characters at the beginnings of lines.
+		while(s[i] == c && i < s.length() - 1){
+			i++;
+		}
+		// Iterate through actual characters until you encounter c.
+		while(i < s.length() && s[i] != c){
+			s0 += s[i];
+			i++;
+		}
+		// Once c is encountered, stop and save the string, then reset it.
+		if(s0.size() > 0){
+			splits.push_back(s0);
+			s0 = "";
+		}
+		i++;
+	}
+
+	return splits;
+}
+
+// ReadFastaRecord
+// Reads the next record of a multi-FASTA file,
+// keeping the header line of the following record in nextline.
+// Stores the first word of the sequence name.
+// Returns 1 if there are no more records.
+int ReadFastaRecord(ifstream *file, string *nextline, string *name, string *seq){
+	string line;
+	// Find the header line of this record.
+	if((*nextline).size() > 0 && (*nextline)[0]=='>'){
+		line=*nextline;
+	}
+	else{
+		while(getline(*file, line)){
+			if(line.size() > 0 && line[0]=='>'){
+				break;
+			}
+		}
+		if(line.size()==0 || line[0]!='>'){
+			return 1;
+		}
+	}
+	(*name)=StringSplit(StringSplit(line,' ')[0],'>')[0];
+	(*seq)="";
+	(*nextline)="";
+	// Read sequence lines until the next header.
+	while(getline(*file, line)){
+		if(line.size() > 0 && line[0]=='>'){
+			(*nextline)=line;
+			break;
+		}
+		for(unsigned int i=0; i<line.size(); i++){
+			if(line[i]!='\r' && line[i]!=' ' && line[i]!='-'){
+				(*seq) += line[i];
+			}
+		}
+	}
+	return 0;
+}
+
+// InitializeReference
+// Stores the reference and the scaled scoring parameters.
+// U is scored as T, and unknown characters as N.
+void InitializeReference(string name, string seq, Reference_t *reference){
+	(*reference).Name=name;
+	(*reference).Seq=seq;
+	for(int c=0; c<256; c++){
+		(*reference).CodeOf[c]=EDNACODES.size()-1;
+	}
+	for(unsigned int i=0; i<EDNACODES.size(); i++){
+		(*reference).CodeOf[(unsigned char)EDNACODES[i]]=i;
+		(*reference).CodeOf[(unsigned char)tolower(EDNACODES[i])]=i;
+	}
+	(*reference).CodeOf[(unsigned char)'U']=(*reference).CodeOf[(unsigned char)'T'];
+	(*reference).CodeOf[(unsigned char)'u']=(*reference).CodeOf[(unsigned char)'T'];
+	for(unsigned int a=0; a<EDNACODES.size(); a++){
+		for(unsigned int b=0; b<EDNACODES.size(); b++){
+			(*reference).Matrix[a][b]=EDNAFULL[a][b]*SCORESCALE;
+		}
+	}
+	(*reference).GapOpen=(int)floor(GAPOPEN*SCORESCALE+0.5);
+	(*reference).GapExtend=(int)floor(GAPEXTEND*SCORESCALE+0.5);
+	(*reference).Codes.resize(seq.size());
+	for(unsigned int i=0; i<seq.size(); i++){
+		(*reference).Codes[i]=(*reference).CodeOf[(unsigned char)seq[i]];
+	}
+
+	// Index the start of each reference k-mer of unambiguous bases,
+	// marking k-mers that occur more than once with -2.
+	for(int c=0; c<256; c++){
+		(*reference).KmerCode[c]=-1;
+	}
+	const char BASES[4]={'A','C','G','T'};
+	for(int b=0; b<4; b++){
+		(*reference).KmerCode[(unsigned char)BASES[b]]=b;
+		(*reference).KmerCode[(unsigned char)tolower(BASES[b])]=b;
+	}
+	(*reference).KmerCode[(unsigned char)'U']=3;
+	(*reference).KmerCode[(unsigned char)'u']=3;
+	(*reference).KmerPosition.assign(1<<(2*KMERLENGTH), -1);
+	unsigned int kmer=0;
+	unsigned int mask=(1u<<(2*KMERLENGTH))-1;
+	int run=0;
+	for(int i=0; i<(int)seq.size(); i++){
+		int code=(*reference).KmerCode[(unsigned char)seq[i]];
+		if(code < 0){
+			run=0;
+			continue;
+		}
+		kmer=((kmer<<2) | code) & mask;
+		run++;
+		if(run >= KMERLENGTH){
+			int *position=&(*reference).KmerPosition[kmer];
+			(*position)=((*position)==-1 ? i-KMERLENGTH+1 : -2);
+		}
+	}
+}
+
+// FindDiagonals
+// Finds the lowest and highest diagonals j-i on which the sequence
+// shares k-mers with the reference, using k-mers that occur once in
+// the reference. A diagonal must hold at least two shared k-mers,
+// so that chance matches between diverged k-mers do not stretch the band.
+// Returns false if no diagonal holds two shared k-mers.
+bool FindDiagonals(Reference_t *reference, Alignment_t *alignment,
+		int *diaglow, int *diaghigh){
+	string *seq=&(*alignment).Seq;
+	unsigned int kmer=0;
+	unsigned int mask=(1u<<(2*KMERLENGTH))-1;
+	int run=0;
+	vector<int> diagonals;
+	for(int j=0; j<(int)(*seq).size(); j++){
+		int code=(*reference).KmerCode[(unsigned char)(*seq)[j]];
+		if(code < 0){
+			run=0;
+			continue;
+		}
+		kmer=((kmer<<2) | code) & mask;
+		run++;
+		if(run < KMERLENGTH){
+			continue;
+		}
+		int i=(*reference).KmerPosition[kmer];
+		if(i < 0){
+			continue;
+		}
+		diagonals.push_back((j-KMERLENGTH+1)-i);
+	}
+
+	sort(diagonals.begin(), diagonals.end());
+	bool found=false;
+	for(unsigned int d=1; d<diagonals.size(); d++){
+		if(diagonals[d]!=diagonals[d-1]){
+			continue;
+		}
+		if(!found || diagonals[d] < (*diaglow)){
+			(*diaglow)=diagonals[d];
+		}
+		if(!found || diagonals[d] > (*diaghigh)){
+			(*diaghigh)=diagonals[d];
+		}
+		found=true;
+	}
+	return found;
+}
+
+// VerticalKernelScalar
+// Fills the vertical gap scores (fcur) and the best of the diagonal move
+// and the vertical gap (diag) for each cell of a row, from the row above,
+// and sets the F and F-extension bits of the traceback.
+// This is the reference implementation for the vectorized kernels.
+// The traceback bits are set in a separate loop, which keeps the number
+// of arrays per loop low enough for the compiler to vectorize both
+// with the baseline instruction set.
+void VerticalKernelScalar(const int *hprev, const int *fprev,
+		const int *profile, int width, int gapopen, int gapextend,
+		int *fcur, int *diag, unsigned char *tb){
+	for(int k=0; k<width; k++){
+		int f=max(hprev[k+1]-gapopen, fprev[k+1]-gapextend);
+		fcur[k]=f;
+		diag[k]=max(hprev[k]+profile[k], f);
+	}
+	for(int k=0; k<width; k++){
+		bool vertical=(diag[k] > hprev[k]+profile[k]);
+		bool extend=(fprev[k+1]-gapextend > hprev[k+1]-gapopen);
+		tb[k]=(unsigned char)((vertical ? TB_F : TB_DIAG) |
+				(extend ? TB_FEXTEND : 0));
+	}
+}
+
+// HorizontalKernelScalar
+// Given the running maxima of diag[l]+(l-kmin)*gapextend left of each
+// cell, fills the final scores of cells kstart to kmax of a row, and sets
+// the E and E-extension bits of the traceback. A horizontal gap never
+// follows another one directly, so it opens from the diagonal and
+// vertical scores alone.
+// This is the reference implementation for the vectorized kernels.
+void HorizontalKernelScalar(const int *diag, const int *emax,
+		int kmin, int kstart, int kmax, int gapopen, int gapextend,
+		int *hcur, unsigned char *tb){
+	for(int k=kstart; k<=kmax; k++){
+		int e=emax[k]-gapopen-(k-kmin-1)*gapextend;
+		int eleft=emax[k-1]-gapopen-(k-kmin-2)*gapextend;
+		int hleft=max(diag[k-1], eleft);
+		bool extend=(eleft-gapextend > hleft-gapopen);
+		hcur[k]=max(diag[k], e);
+		tb[k]=(unsigned char)((e > diag[k] ? (tb[k] & ~3) | TB_E : tb[k]) |
+				(extend ? TB_EEXTEND : 0));
+	}
+}
+
+#ifdef ALIGN_X86_DISPATCH
+
+// PackBytesAVX2
+// Narrows eight 32-bit lanes holding small values to eight bytes
+// and stores them.
+__attribute__((target("avx2")))
+static inline void PackBytesAVX2(__m256i x, unsigned char *out){
+	__m256i b=_mm256_packs_epi16(_mm256_packs_epi32(x, x), x);
+	__m128i lanes=_mm_unpacklo_epi32(_mm256_castsi256_si128(b),
+			_mm256_extracti128_si256(b, 1));
+	_mm_storel_epi64((__m128i *) out, lanes);
+}
+
+// VerticalKernelAVX2
+// Vectorized version of VerticalKernelScalar that fills 8 cells at a time.
+__attribute__((target("avx2")))
+void VerticalKernelAVX2(const int *hprev, const int *fprev,
+		const int *profile, int width, int gapopen, int gapextend,
+		int *fcur, int *diag, unsigned char *tb){
+	const __m256i Open=_mm256_set1_epi32(gapopen);
+	const __m256i Extend=_mm256_set1_epi32(gapextend);
+	const __m256i F=_mm256_set1_epi32(TB_F);
+	const __m256i FExtend=_mm256_set1_epi32(TB_FEXTEND);
+
+	int k=0;
+	for(; k+8<=width; k+=8){
+		__m256i up=_mm256_loadu_si256((const __m256i *) (hprev+k+1));
+		__m256i fup=_mm256_loadu_si256((const __m256i *) (fprev+k+1));
+		__m256i d=_mm256_add_epi32(
+				_mm256_loadu_si256((const __m256i *) (hprev+k)),
+				_mm256_loadu_si256((const __m256i *) (profile+k)));
+		__m256i open=_mm256_sub_epi32(up, Open);
+		__m256i extend=_mm256_sub_epi32(fup, Extend);
+		__m256i f=_mm256_max_epi32(open, extend);
+		_mm256_storeu_si256((__m256i *) (fcur+k), f);
+		_mm256_storeu_si256((__m256i *) (diag+k), _mm256_max_epi32(d, f));
+		__m256i bits=_mm256_or_si256(
+				_mm256_and_si256(_mm256_cmpgt_epi32(f, d), F),
+				_mm256_and_si256(_mm256_cmpgt_epi32(extend, open), FExtend));
+		PackBytesAVX2(bits, tb+k);
+	}
+	VerticalKernelScalar(hprev+k, fprev+k, profile+k, width-k,
+			gapopen, gapextend, fcur+k, diag+k, tb+k);
+}
+
+// HorizontalKernelAVX2
+// Vectorized version of HorizontalKernelScalar that fills 8 cells at a time.
+__attribute__((target("avx2")))
+void HorizontalKernelAVX2(const int *diag, const int *emax,
+		int kmin, int kstart, int kmax, int gapopen, int gapextend,
+		int *hcur, unsigned char *tb){
+	const __m256i Open=_mm256_set1_epi32(gapopen);
+	const __m256i Extend=_mm256_set1_epi32(gapextend);
+	const __m256i Lanes=_mm256_setr_epi32(0,1,2,3,4,5,6,7);
+	const __m256i Source=_mm256_set1_epi32(3);
+	const __m256i E=_mm256_set1_epi32(TB_E);
+	const __m256i EExtend=_mm256_set1_epi32(TB_EEXTEND);
+
+	int k=kstart;
+	for(; k+8<=kmax+1; k+=8){
+		// Gap extensions from the left edge of the row to each cell.
+		__m256i steps=_mm256_mullo_epi32(Extend,
+				_mm256_add_epi32(Lanes, _mm256_set1_epi32(k-kmin-1)));
+		__m256i d=_mm256_loadu_si256((const __m256i *) (diag+k));
+		__m256i e=_mm256_sub_epi32(_mm256_sub_epi32(
+				_mm256_loadu_si256((const __m256i *) (emax+k)), Open), steps);
+		__m256i eleft=_mm256_add_epi32(_mm256_sub_epi32(_mm256_sub_epi32(
+				_mm256_loadu_si256((const __m256i *) (emax+k-1)), Open), steps),
+				Extend);
+		__m256i hleft=_mm256_max_epi32(
+				_mm256_loadu_si256((const __m256i *) (diag+k-1)), eleft);
+		_mm256_storeu_si256((__m256i *) (hcur+k), _mm256_max_epi32(d, e));
+
+		// Widen the traceback bytes, replace the source bits where the
+		// horizontal gap wins, and add the extension bit.
+		__m256i old=_mm256_cvtepu8_epi32(
+				_mm_loadl_epi64((const __m128i *) (tb+k)));
+		__m256i bits=_mm256_blendv_epi8(old,
+				_mm256_or_si256(_mm256_andnot_si256(Source, old), E),
+				_mm256_cmpgt_epi32(e, d));
+		bits=_mm256_or_si256(bits, _mm256_and_si256(EExtend,
+				_mm256_cmpgt_epi32(_mm256_sub_epi32(eleft, Extend),
+						_mm256_sub_epi32(hleft, Open))));
+		PackBytesAVX2(bits, tb+k);
+	}
+	HorizontalKernelScalar(diag, emax, kmin, k, kmax, gapopen, gapextend,
+			hcur, tb);
+}
+
+#endif
+
+// SelectRowKernels
+// Chooses the fastest row kernels supported by the CPU
+// and stores their name in the given string.
+void SelectRowKernels(string *kernelname){
+#ifdef ALIGN_X86_DISPATCH
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		VerticalKernel=VerticalKernelAVX2;
+		HorizontalKernel=HorizontalKernelAVX2;
+		*kernelname="avx2";
+		return;
+	}
+#endif
+	VerticalKernel=VerticalKernelScalar;
+	HorizontalKernel=HorizontalKernelScalar;
+	*kernelname="scalar";
+}
+
+// AlignBanded
+// Aligns a sequence to the reference within a band of diagonals,
+// following Gotoh's affine gap recurrences with EMBOSS gap costs:
+// a gap of length L costs GapOpen+(L-1)*GapExtend. End gaps are free.
+// The reference runs down the rows (i) and the query across (j),
+// and the band spans diagonals j-i from diaglow to diaghigh.
+// The inner loops over a row read and write contiguous arrays without
+// branches, and run in the row kernels chosen for the CPU; only a running
+// maximum for the horizontal gaps is carried along the row.
+// Returns false if the best path touches an edge of the band that is
+// not an edge of the matrix, in which case a wider band may score higher.
+bool AlignBanded(Reference_t *reference, Alignment_t *alignment,
+		int diaglow, int diaghigh, AlignBuffer_t *buffer){
+
+	const int n=(*reference).Seq.size();
+	const int m=(*alignment).Seq.size();
+	const int gapopen=(*reference).GapOpen;
+	const int gapextend=(*reference).GapExtend;
+	const int numcodes=EDNACODES.size();
+
+	// Clip the band to the matrix.
+	if(diaglow < -n){
+		diaglow=-n;
+	}
+	if(diaghigh > m){
+		diaghigh=m;
+	}
+	const int width=diaghigh-diaglow+1;
+
+	// Build the query profile: the score of each reference code against
+	// each query position, padded on both sides by the band width so that
+	// out-of-matrix cells read NEGINF.
+	const int pad=width+1;
+	const int profilelength=m+2*pad;
+	(*buffer).Profile.assign((size_t)numcodes*profilelength, NEGINF);
+	for(int c=0; c<numcodes; c++){
+		int *row=&(*buffer).Profile[(size_t)c*profilelength+pad];
+		for(int j=0; j<m; j++){
+			row[j]=(*reference).Matrix[c][(*reference).CodeOf[
+					(unsigned char)(*alignment).Seq[j]]];
+		}
+	}
+
+	(*buffer).HPrev.assign(width+1, NEGINF);
+	(*buffer).HCur.assign(width+1, NEGINF);
+	(*buffer).FPrev.assign(width+1, NEGINF);
+	(*buffer).FCur.assign(width+1, NEGINF);
+	(*buffer).Diag.assign(width+1, NEGINF);
+	(*buffer).EMax.assign(width+1, NEGINF);
+	(*buffer).Traceback.assign((size_t)n*width, TB_DIAG);
+
+	// Row 0: leading gaps in the reference are free.
+	for(int k=0; k<width; k++){
+		int j=diaglow+k;
+		if(j >= 0 && j <= m){
+			(*buffer).HPrev[k]=0;
+		}
+	}
+
+	long long best=NEGINF;
+	int besti=0, bestj=0;
+	// Row 0 ends in the last column only for an empty query.
+	if(m==0){
+		best=0;
+	}
+
+	for(int i=1; i<=n; i++){
+		int *hprev=&(*buffer).HPrev[0];
+		int *hcur=&(*buffer).HCur[0];
+		int *fprev=&(*buffer).FPrev[0];
+		int *fcur=&(*buffer).FCur[0];
+		int *diag=&(*buffer).Diag[0];
+		int *emax=&(*buffer).EMax[0];
+		unsigned char *tb=&(*buffer).Traceback[(size_t)(i-1)*width];
+		// Profile entry for query position j=i+diaglow+k is at
+		// offset j-1 from the start of the unpadded row.
+		const int *profile=&(*buffer).Profile[
+				(size_t)(*reference).Codes[i-1]*profilelength+pad+i+diaglow-1];
+
+		// Diagonal moves and vertical gaps depend only on the previous row.
+		VerticalKernel(hprev, fprev, profile, width, gapopen, gapextend,
+				fcur, diag, tb);
+
+		// Cells of the row that lie in the matrix. The first column
+		// starts at 0, since leading gaps in the query are free.
+		// The band may miss the matrix in rows far from the diagonals.
+		int kmin=max(0, -i-diaglow);
+		int kmax=min(width-1, m-i-diaglow);
+		if(kmin > kmax){
+			kmin=width;
+			kmax=width-1;
+		}
+		else if(kmin==-i-diaglow){
+			diag[kmin]=0;
+			fcur[kmin]=NEGINF;
+		}
+
+		// Horizontal gaps depend on the cells to the left. A horizontal
+		// gap never follows another one directly, so it can open from the
+		// diagonal and vertical scores alone:
+		//   E[k] = max over l<k of (diag[l]-gapopen-(k-1-l)*gapextend).
+		// The only step carried along the row is the running maximum of
+		// diag[l]+l*gapextend; the rest is vectorized.
+		int run=NEGINF;
+		for(int k=kmin; k<=kmax; k++){
+			emax[k]=run;
+			run=max(run, diag[k]+(k-kmin)*gapextend);
+		}
+		if(kmin <= kmax){
+			hcur[kmin]=diag[kmin];
+		}
+		HorizontalKernel(diag, emax, kmin, kmin+1, kmax, gapopen, gapextend,
+				hcur, tb);
+
+		// Clear cells outside the matrix.
+		for(int k=0; k<kmin; k++){
+			hcur[k]=NEGINF;
+			fcur[k]=NEGINF;
+		}
+		for(int k=kmax+1; k<width; k++){
+			hcur[k]=NEGINF;
+			fcur[k]=NEGINF;
+		}
+
+		// Trailing gaps in the reference are free, so the last column
+		// may end the alignment at any row.
+		int klast=m-i-diaglow;
+		if(klast >= 0 && klast < width && hcur[klast] > best){
+			best=hcur[klast];
+			besti=i;
+			bestj=m;
+		}
+
+		swap((*buffer).HPrev, (*buffer).HCur);
+		swap((*buffer).FPrev, (*buffer).FCur);
+	}
+
+	// Trailing gaps in the query are free, so the last row
+	// may end the alignment at any column.
+	for(int k=0; k<width; k++){
+		int j=n+diaglow+k;
+		if(j >= 0 && j <= m && (*buffer).HPrev[k] > best){
+			best=(*buffer).HPrev[k];
+			besti=n;
+			bestj=j;
+		}
+	}
+
+	//==================================================
+	// Trace back from the best end cell.
+	// The alignment is built in reverse and flipped.
+	//==================================================
+
+	string *ref=&(*reference).Seq;
+	string *seq=&(*alignment).Seq;
+	string alignedref;
+	string alignedseq;
+	bool touchesedge=false;
+
+	// Trailing overhang of either sequence.
+	for(int j=m; j>bestj; j--){
+		alignedref += '-';
+		alignedseq += (*seq)[j-1];
+	}
+	for(int i=n; i>besti; i--){
+		alignedref += (*ref)[i-1];
+		alignedseq += '-';
+	}
+
+	int i=besti, j=bestj;
+	int state=TB_DIAG;
+	while(i > 0 && j > 0){
+		int k=j-i-diaglow;
+		if((k==0 && diaglow > -n) || (k==width-1 && diaghigh < m)){
+			touchesedge=true;
+		}
+		unsigned char bits=(*buffer).Traceback[(size_t)(i-1)*width+k];
+		if(state==TB_DIAG){
+			state=bits & 3;
+		}
+		if(state==TB_DIAG){
+			alignedref += (*ref)[i-1];
+			alignedseq += (*seq)[j-1];
+			i--;
+			j--;
+		}
+		else if(state==TB_E){
+			alignedref += '-';
+			alignedseq += (*seq)[j-1];
+			if(!(bits & TB_EEXTEND)){
+				state=TB_DIAG;
+			}
+			j--;
+		}
+		else{
+			alignedref += (*ref)[i-1];
+			alignedseq += '-';
+			if(!(bits & TB_FEXTEND)){
+				state=TB_DIAG;
+			}
+			i--;
+		}
+	}
+
+	// Leading overhang of either sequence.
+	for(; j>0; j--){
+		alignedref += '-';
+		alignedseq += (*seq)[j-1];
+	}
+	for(; i>0; i--){
+		alignedref += (*ref)[i-1];
+		alignedseq += '-';
+	}
+
+	reverse(alignedref.begin(), alignedref.end());
+	reverse(alignedseq.begin(), alignedseq.end());
+	(*alignment).AlignedRef=alignedref;
+	(*alignment).AlignedSeq=alignedseq;
+	(*alignment).NumPasses++;
+	(*alignment).Score=best;
+
+	return !touchesedge;
+}
+
+// AlignSequence
+// Aligns a sequence within BANDWIDTH diagonals on either side of the
+// diagonals of its shared k-mers, doubling the band until the best path
+// stays clear of its edges or the band covers the whole matrix.
+// The band also spans the diagonals that join the starts (0) and the
+// ends (m-n) of the two sequences, since indels near the ends of an
+// alignment need not be bracketed by shared k-mers.
+// Sequences that share no k-mers with the reference are aligned in full.
+void AlignSequence(Reference_t *reference, Alignment_t *alignment,
+		AlignBuffer_t *buffer){
+	const int n=(*reference).Seq.size();
+	const int m=(*alignment).Seq.size();
+	int seedlow=0, seedhigh=0;
+	(*alignment).Seeded=FindDiagonals(reference, alignment, &seedlow, &seedhigh);
+	(*alignment).NumPasses=0;
+	if(!(*alignment).Seeded){
+		AlignBanded(reference, alignment, -n, m, buffer);
+		return;
+	}
+	seedlow=min(seedlow, min(0, m-n));
+	seedhigh=max(seedhigh, max(0, m-n));
+	int bandwidth=BANDWIDTH;
+	while(!AlignBanded(reference, alignment, seedlow-bandwidth,
+			seedhigh+bandwidth, buffer) &&
+			(seedlow-bandwidth > -n || seedhigh+bandwidth < m)){
+		bandwidth *= 2;
+	}
+}
+
+// AlignSequences
+// Aligns the sequences from first to last, not including last.
+// Run in parallel threads on separate ranges of the same block.
+void AlignSequences(vector<Alignment_t> *alignments, unsigned int first,
+		unsigned int last, Reference_t *reference){
+	AlignBuffer_t buffer;
+	for(unsigned int i=first; i<last; i++){
+		AlignSequence(reference, &(*alignments)[i], &buffer);
+	}
+}
+
+// WriteAlignedFasta
+// Writes one aligned sequence in FASTA format,
+// with LINEWIDTH bases per line as written by needle.
+void WriteAlignedFasta(ofstream *out, string name, string seq){
+	(*out) << ">" << name << "\n";
+	for(unsigned int i=0; i<seq.size(); i+=LINEWIDTH){
+		(*out) << seq.substr(i, LINEWIDTH) << "\n";
+	}
+}
@@ -1,7 +1,9 @@
 //============================================================================
 // Name        : AnnotateVariants.cpp
-// Version     : 1.1
-// Description : 1.1 Allow multiple annotations for a single variant.
+// Version     : 1.2
+// Description : 1.2 Accept sparse summaries from SummarizeBAM, copying their
+//               header and depth rows to the output unannotated.
+//           1.1 Allow multiple annotations for a single variant.
 //               For instance, one might be in M1 and M2.
 //           1.0 Given a BED format file, a reference, and list of sites,
 //               annotate those sites as synonymous or nonsynonymous.
@@ -126,6 +128,12 @@ int main(int argc, char *argv[]) {
 
 		while(getline(fin, line)){
 
+			// Copy the header lines of a sparse summary.
+			if(line[0]=='#'){
+				fout << line << endl;
+				continue;
+			}
+
 			// Split the tab-delimited line.
 			vector<string> fields=StringSplit(line,'\t');
 
@@ -135,6 +143,13 @@ int main(int argc, char *argv[]) {
 				return 1;
 			}
 
+			// Copy the depth rows of a sparse summary,
+			// which give the coverage rather than a base.
+			if(fields[2]=="*"){
+				fout << line << endl;
+				continue;
+			}
+
 			// Store the information in the appropriate formats.
 			// Fields in the variant file are hard-coded to follow a one-indexed
 			// Chr Pos Base RefBase format.
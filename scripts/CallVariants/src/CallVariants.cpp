@@ -0,0 +1,684 @@
+//============================================================================
+// Name        : CallVariants.cpp
+// Version     : 1.1
+// Description : 1.1 Read sparse annotated summaries, which give the sample
+//               metadata in a header and the coverage in a depth row.
+//           1.0 Given annotated summary files concatenated across the
+//               sequenced samples of a patient, call variants relative to
+//               the consensus at the first timepoint and export the sites
+//               called as variant in both library replicates.
+//               Replaces ReplicateVariability/CallVariants.R.
+//============================================================================
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <zlib.h>
+
+using namespace std;
+
+// RUN PARAMETERS
+vector<string> INFILES;
+string OUTFILE="";
+double MINFREQ=0.01;
+long long MINCOVERAGE=200;
+
+bool DEBUG=false;
+
+// Number of sample metadata fields appended to the end of each line
+// of an annotated summary: Sample Patient Timepoint Site Aliquot Replicate.
+const unsigned int NUMSAMPLEFIELDS=6;
+const unsigned int NUMBASES=4;
+
+// Stores the base counts at one position of one sequenced sample.
+// Annotated summaries repeat a position once for each gene annotation
+// on its chromosome, so each base is kept only once.
+struct SiteGroup_t{
+	string Sample="";
+	string Patient="";
+	string Timepoint="";
+	double TimepointValue=0;
+	string Site="";
+	string Aliquot="";
+	int Replicate=0;
+	string Chr="";
+	int Pos=0;
+	long long GenomePos=0;
+	int NumBases=0;
+	char Base[NUMBASES];
+	long long Count[NUMBASES];
+	long long Coverage=0;
+};
+
+// Stores the highest-frequency base at a genome position
+// among the first-replicate samples of a single timepoint.
+struct ConsensusBase_t{
+	char Base=0;
+	double Freq=-1;
+};
+
+// Sample metadata read from the header of a sparse summary,
+// which applies to the lines that follow it.
+struct SampleHeader_t{
+	bool Sparse=false;
+	string Sample="";
+	string Patient="";
+	string Timepoint="";
+	string Site="";
+	string Aliquot="";
+	string Replicate="";
+};
+
+// Stores a single base called as variant in a single replicate.
+struct Variant_t{
+	string Patient="";
+	string Timepoint="";
+	double TimepointValue=0;
+	string Site="";
+	string Aliquot="";
+	string Chr="";
+	int Pos=0;
+	char Base='N';
+	long long GenomePos=0;
+	char InitBase='N';
+	int Replicate=0;
+	long long Count=0;
+	long long Coverage=0;
+	double Freq=0;
+};
+
+
+// FUNCTIONS
+int ArgsParse(int argc, char *argv[]);
+void PrintUsage();
+void PrintParameters();
+void SetDebug();
+vector<string> StringSplit(string s, char c);
+vector<string> WhitespaceSplit(const string &s);
+int ReadGzLine(gzFile file, string *line);
+void ReadHeaderLine(const string &line, SampleHeader_t *header);
+int ReadSiteGroup(gzFile file, string *nextline, SampleHeader_t *header,
+		SiteGroup_t *group);
+void AddConsensusGroup(SiteGroup_t *group,
+		map<double, vector<ConsensusBase_t> > *consensus);
+bool VariantLess(const Variant_t &a, const Variant_t &b);
+int CompareVariantKeys(const Variant_t &a, const Variant_t &b);
+int CallPatientVariants(string filename, ofstream *out, long long *numvariants);
+
+int main(int argc, char *argv[]) {
+
+	//==================================================
+	// Parse command-line arguments.
+	//==================================================
+
+	if(ArgsParse(argc, argv) != 0){
+		PrintUsage();
+		return 1;
+	}
+
+	PrintParameters();
+
+	//==================================================
+	// Call variants separately for each patient and
+	// write them to a single space-delimited table.
+	// The columns follow the table written by CallVariants.R.
+	//==================================================
+
+	ofstream fout(OUTFILE.c_str(), ios::out);
+	if(!fout){
+		printf("Error: could not open output file.\n");
+		return 1;
+	}
+	fout << "Patient Timepoint Site Aliquot Chr Pos Base GenomePos InitBase " <<
+			"Replicate.x Count.x Coverage.x Freq.x Variant.x " <<
+			"Replicate.y Count.y Coverage.y Freq.y Variant.y" << "\n";
+	fout << setprecision(15);
+
+	for(unsigned int i=0; i<INFILES.size(); i++){
+		printf("Calling variants in %s.\n", INFILES[i].c_str());
+		long long NumVariants=0;
+		if(CallPatientVariants(INFILES[i], &fout, &NumVariants) != 0){
+			return 1;
+		}
+		printf("Number of variants called in both replicates: %lld\n",
+				NumVariants);
+	}
+
+	fout.close();
+
+	return 0;
+}
+
+// ArgsParse
+// Parses command-line arguments.
+// Returns 1 if any argument conditions are violated.
+int ArgsParse(int argc, char *argv[]){
+
+	// If the only argument is debug,
+	// set all parameters to the debug state.
+	if(argc==2 && strcmp(argv[1],"debug")==0){
+		SetDebug();
+		return 0;
+	}
+
+	// Ensure that there are an even number of arguments,
+	// leaving aside the program name.
+	// The only exception is if the only argument is debug,
+	// which sets all parameters to the debug state.
+	if((argc - 1) % 2 != 0){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	// Check the structure of arguments.
+	for(int i=1; i<argc; i++){
+		// Verify that every other argument is a flag.
+		if(i%2 != 0){
+			if(argv[i][0] != '-' || strlen(argv[i])!=2){
+				printf("Invalid use of argument flags.\n");
+				return 1;
+			}
+		}
+	}
+
+	// Parse each pair of arguments.
+	for(int i=0; i<(argc-1)/2; i++){
+
+		string flag=argv[2*i+1];
+		string arg=argv[2*i+2];
+
+		// Parse the flag string.
+		switch(flag[1]){
+		// -i input annotated summary, once for each patient
+		case 'i':
+			INFILES.push_back(arg);
+			break;
+		// -o output variant table
+		case 'o':
+			OUTFILE = arg;
+			break;
+		// -f minimum variant frequency
+		case 'f':
+			MINFREQ = atof(arg.c_str());
+			break;
+		// -c minimum coverage
+		case 'c':
+			MINCOVERAGE = atoll(arg.c_str());
+			break;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(INFILES.size()==0){
+		printf("Invalid arguments. Specify at least one annotated summary.\n");
+		return 1;
+	}
+	if(OUTFILE==""){
+		printf("Invalid arguments. Specify output file.\n");
+		return 1;
+	}
+	if(MINFREQ<0 || MINFREQ>=1){
+		printf("Invalid arguments. Minimum frequency must be in [0,1).\n");
+		return 1;
+	}
+	if(MINCOVERAGE<0){
+		printf("Invalid arguments. Minimum coverage must be non-negative.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// PrintParameters
+// When called, prints the parameters for the run.
+void PrintParameters(){
+	cout << "RUN PARAMETERS" << endl;
+	for(unsigned int i=0; i<INFILES.size(); i++){
+		cout << "input file: " << INFILES[i] << endl;
+	}
+	cout << "output file: " << OUTFILE << endl;
+	cout << "minimum frequency: " << MINFREQ << endl;
+	cout << "minimum coverage: " << MINCOVERAGE << endl;
+	cout << endl;
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: CallVariants -i A-annotated.summary.gz [-i ...] -o out.data\n");
+	printf("\n");
+	printf("Required inputs:\n");
+	printf("  -i FILE\tannotated summary concatenated across the samples of one\n"
+			"\t\tpatient, plain or gzipped, with the sample name, patient,\n"
+			"\t\ttimepoint, site, aliquot and replicate in the last six fields,\n"
+			"\t\tor concatenated sparse summaries (SummarizeBAM -t sparse)\n"
+			"\t\twith the same fields given by -a in each header;\n"
+			"\t\trepeat for each patient\n");
+	printf("  -o FILE\toutput; space-delimited table of variants called\n"
+			"\t\tin both replicates\n");
+	printf("Input options (defaults in parentheses):\n");
+	printf("  -f FLOAT\tcall variants above this frequency [0.01]\n");
+	printf("  -c INT\tcall variants above this coverage [200]\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	INFILES.push_back("summary.test");
+	OUTFILE="out.test";
+	DEBUG=true;
+}
+
+//
+// StringSplit
+// Takes in a string and a character delimiter
+// and returns a vector of strings split at that character.
+vector<string> StringSplit(string s, char c){
+	vector<string> splits;
+	string s0;
+	unsigned int i=0;
+
+	while(i < s.length()){
+		// Skip through delimiter characters at the beginnings of lines.
+		while(s[i] == c && i < s.length() - 1){
+			i++;
+		}
+		// Iterate through actual characters until you encounter c.
+		while(i < s.length() && s[i] != c){
+			s0 += s[i];
+			i++;
+		}
+		// Once c is encountered, stop and save the string, then reset it.
+		if(s0.size() > 0){
+			splits.push_back(s0);
+			s0 = "";
+		}
+		i++;
+	}
+
+	return splits;
+}
+
+// WhitespaceSplit
+// Splits a line at runs of spaces and tabs, as read.table does.
+// Summaries end each line with a tab, so the annotations that follow
+// would otherwise leave an empty field behind.
+vector<string> WhitespaceSplit(const string &s){
+	vector<string> splits;
+	unsigned int i=0;
+	while(i < s.length()){
+		while(i < s.length() && (s[i]==' ' || s[i]=='\t' || s[i]=='\r')){
+			i++;
+		}
+		unsigned int start=i;
+		while(i < s.length() && s[i]!=' ' && s[i]!='\t' && s[i]!='\r'){
+			i++;
+		}
+		if(i > start){
+			splits.push_back(s.substr(start, i-start));
+		}
+	}
+	return splits;
+}
+
+// ReadGzLine
+// Reads a single line from a gzipped or plain text file,
+// removing the trailing newline.
+// Returns 0 at the end of the file and 1 otherwise.
+int ReadGzLine(gzFile file, string *line){
+	char buffer[4096];
+	(*line).clear();
+	while(gzgets(file, buffer, sizeof(buffer)) != NULL){
+		size_t len=strlen(buffer);
+		if(len > 0 && buffer[len-1]=='\n'){
+			(*line).append(buffer, len-1);
+			return 1;
+		}
+		(*line).append(buffer, len);
+	}
+	return (*line).size() > 0 ? 1 : 0;
+}
+
+// ReadHeaderLine
+// Reads one NAME=VALUE line from the header of a sparse summary.
+// The format line starts the header of a new sample.
+void ReadHeaderLine(const string &line, SampleHeader_t *header){
+	if(line=="#Format=sparse"){
+		*header=SampleHeader_t();
+		header->Sparse=true;
+		return;
+	}
+	size_t equals=line.find('=');
+	if(equals==string::npos){
+		return;
+	}
+	string name=line.substr(1, equals-1);
+	string value=line.substr(equals+1);
+	if(name=="Sample") header->Sample=value;
+	else if(name=="Patient") header->Patient=value;
+	else if(name=="Timepoint") header->Timepoint=value;
+	else if(name=="Site") header->Site=value;
+	else if(name=="Aliquot") header->Aliquot=value;
+	else if(name=="Replicate") header->Replicate=value;
+}
+
+// ReadSiteGroup
+// Reads the consecutive lines that describe one position
+// of one sample and stores their base counts.
+// nextline carries the first line of the following group between calls
+// and must be empty before the first call, and header carries the
+// metadata of the current sparse summary, which starts empty.
+// In a sparse summary, the coverage is read from the depth row.
+// Returns 1 if a group was read, 0 at the end of the file,
+// and -1 if a line is malformed.
+int ReadSiteGroup(gzFile file, string *nextline, SampleHeader_t *header,
+		SiteGroup_t *group){
+
+	group->NumBases=0;
+	group->Coverage=0;
+
+	string line=*nextline;
+	if(line.size()==0 && ReadGzLine(file, &line)==0){
+		return 0;
+	}
+
+	bool started=false;
+	bool depth=false;
+	do{
+		if(line.size()==0){
+			continue;
+		}
+
+		// A header starts a new sample, so it also ends the group.
+		if(line[0]=='#'){
+			if(started){
+				*nextline=line;
+				return 1;
+			}
+			ReadHeaderLine(line, header);
+			continue;
+		}
+		vector<string> fields=WhitespaceSplit(line);
+		bool sparse=header->Sparse;
+		if(fields.size() < (sparse ? 6 : 6+NUMSAMPLEFIELDS)){
+			printf("Error: annotated summary line contains too few fields.\n");
+			printf("%s\n", line.c_str());
+			return -1;
+		}
+
+		// Annotated summary lines are hard-coded to begin with
+		// Chr Pos Base RefBase GenomePos Count
+		// and, unless the summary is sparse, to end with the sample metadata.
+		unsigned int s=fields.size()-NUMSAMPLEFIELDS;
+		const string &sample=sparse ? header->Sample : fields[s];
+		int pos=atoi(fields[1].c_str());
+		if(started && (sample!=group->Sample || fields[0]!=group->Chr ||
+				pos!=group->Pos)){
+			*nextline=line;
+			return 1;
+		}
+		if(!started){
+			group->Chr=fields[0];
+			group->Pos=pos;
+			group->GenomePos=atoll(fields[4].c_str());
+			group->Sample=sample;
+			group->Patient=sparse ? header->Patient : fields[s+1];
+			group->Timepoint=sparse ? header->Timepoint : fields[s+2];
+			group->TimepointValue=atof(group->Timepoint.c_str());
+			group->Site=sparse ? header->Site : fields[s+3];
+			group->Aliquot=sparse ? header->Aliquot : fields[s+4];
+			group->Replicate=atoi(sparse ? header->Replicate.c_str() :
+					fields[s+5].c_str());
+			started=true;
+		}
+
+		// The depth row of a sparse summary gives the coverage,
+		// including bases below the floors for base rows.
+		char base=fields[2][0];
+		if(base=='*'){
+			group->Coverage=atoll(fields[5].c_str());
+			depth=true;
+			continue;
+		}
+
+		// Store each base only once, since the same line is repeated
+		// for every gene annotated on its chromosome.
+		bool seen=false;
+		for(int i=0; i<group->NumBases; i++){
+			if(group->Base[i]==base){
+				seen=true;
+			}
+		}
+		if(!seen){
+			if(group->NumBases==(int) NUMBASES){
+				printf("Error: more than %u bases at %s %d in sample %s.\n",
+						NUMBASES, group->Chr.c_str(), group->Pos,
+						group->Sample.c_str());
+				return -1;
+			}
+			group->Base[group->NumBases]=base;
+			group->Count[group->NumBases]=atoll(fields[5].c_str());
+			if(!depth){
+				group->Coverage+=group->Count[group->NumBases];
+			}
+			group->NumBases++;
+		}
+	} while(ReadGzLine(file, &line)==1);
+
+	(*nextline).clear();
+	return started ? 1 : 0;
+}
+
+// AddConsensusGroup
+// Records the highest-frequency base at a position of a first-replicate
+// sample, keeping the earliest base among ties in file order.
+// Positions with no coverage do not contribute a consensus.
+void AddConsensusGroup(SiteGroup_t *group,
+		map<double, vector<ConsensusBase_t> > *consensus){
+	if(group->Replicate!=1 || group->Coverage==0 || group->GenomePos<=0){
+		return;
+	}
+	vector<ConsensusBase_t> *bases=&(*consensus)[group->TimepointValue];
+	if((*bases).size() < (unsigned long) group->GenomePos+1){
+		(*bases).resize(group->GenomePos+1);
+	}
+	ConsensusBase_t *best=&(*bases)[group->GenomePos];
+	for(int i=0; i<group->NumBases; i++){
+		double freq=(double) group->Count[i]/group->Coverage;
+		if(freq > best->Freq){
+			best->Freq=freq;
+			best->Base=group->Base[i];
+		}
+	}
+}
+
+// CompareVariantKeys
+// Compares the sample and site of two variants,
+// ordering timepoints and positions numerically.
+// Returns a negative number, 0, or a positive number
+// as the first variant sorts before, with, or after the second.
+int CompareVariantKeys(const Variant_t &a, const Variant_t &b){
+	int c=a.Patient.compare(b.Patient);
+	if(c!=0) return c;
+	if(a.TimepointValue!=b.TimepointValue){
+		return a.TimepointValue < b.TimepointValue ? -1 : 1;
+	}
+	c=a.Site.compare(b.Site);
+	if(c!=0) return c;
+	c=a.Aliquot.compare(b.Aliquot);
+	if(c!=0) return c;
+	c=a.Chr.compare(b.Chr);
+	if(c!=0) return c;
+	if(a.Pos!=b.Pos){
+		return a.Pos < b.Pos ? -1 : 1;
+	}
+	return (int) a.Base - (int) b.Base;
+}
+
+// VariantLess
+// Sort order for variants, used to join the two replicates.
+bool VariantLess(const Variant_t &a, const Variant_t &b){
+	return CompareVariantKeys(a, b) < 0;
+}
+
+// CallPatientVariants
+// Reads the annotated summary of a single patient twice.
+// The first pass determines the consensus base at each genome position
+// in the first replicate of the earliest timepoint.
+// The second pass calls variants against that consensus in each replicate,
+// and the variants called in both replicates are written to out.
+// Returns 1 if the file cannot be read.
+int CallPatientVariants(string filename, ofstream *out, long long *numvariants){
+
+	gzFile fin=gzopen(filename.c_str(), "rb");
+	if(fin==NULL){
+		printf("Error: annotated summary %s does not exist.\n", filename.c_str());
+		return 1;
+	}
+
+	//==================================================
+	// Determine the initial consensus.
+	//==================================================
+
+	// Candidate consensus bases are stored for every timepoint,
+	// so that the earliest timepoint need not be known in advance.
+	map<double, vector<ConsensusBase_t> > Consensus;
+	bool SeenTimepoint=false;
+	double MinTimepoint=0;
+
+	string NextLine="";
+	SampleHeader_t Header;
+	SiteGroup_t Group;
+	int status;
+	while((status=ReadSiteGroup(fin, &NextLine, &Header, &Group))==1){
+		if(!SeenTimepoint || Group.TimepointValue < MinTimepoint){
+			MinTimepoint=Group.TimepointValue;
+			SeenTimepoint=true;
+		}
+		AddConsensusGroup(&Group, &Consensus);
+	}
+	if(status < 0){
+		gzclose(fin);
+		return 1;
+	}
+
+	// If the earliest timepoint lacks a first replicate,
+	// there is no initial consensus and no variants are called.
+	vector<ConsensusBase_t> InitialConsensus;
+	if(Consensus.count(MinTimepoint) > 0){
+		InitialConsensus.swap(Consensus[MinTimepoint]);
+	}
+	Consensus.clear();
+
+	//==================================================
+	// Call variants in each replicate.
+	//==================================================
+
+	gzrewind(fin);
+	NextLine="";
+	Header=SampleHeader_t();
+	vector<Variant_t> Variants[2];
+	while((status=ReadSiteGroup(fin, &NextLine, &Header, &Group))==1){
+		if(Group.Replicate!=1 && Group.Replicate!=2){
+			continue;
+		}
+		if(Group.GenomePos<=0 ||
+				(unsigned long) Group.GenomePos >= InitialConsensus.size()){
+			continue;
+		}
+		char InitBase=InitialConsensus[Group.GenomePos].Base;
+		if(InitBase==0 || Group.Coverage <= MINCOVERAGE){
+			continue;
+		}
+		for(int i=0; i<Group.NumBases; i++){
+			double freq=(double) Group.Count[i]/Group.Coverage;
+			if(Group.Base[i]==InitBase || freq <= MINFREQ){
+				continue;
+			}
+			Variant_t variant;
+			variant.Patient=Group.Patient;
+			variant.Timepoint=Group.Timepoint;
+			variant.TimepointValue=Group.TimepointValue;
+			variant.Site=Group.Site;
+			variant.Aliquot=Group.Aliquot;
+			variant.Chr=Group.Chr;
+			variant.Pos=Group.Pos;
+			variant.Base=Group.Base[i];
+			variant.GenomePos=Group.GenomePos;
+			variant.InitBase=InitBase;
+			variant.Replicate=Group.Replicate;
+			variant.Count=Group.Count[i];
+			variant.Coverage=Group.Coverage;
+			variant.Freq=freq;
+			Variants[Group.Replicate-1].push_back(variant);
+		}
+	}
+	gzclose(fin);
+	if(status < 0){
+		return 1;
+	}
+
+	if(DEBUG){
+		printf("Variants in replicate 1: %lu\n", Variants[0].size());
+		printf("Variants in replicate 2: %lu\n", Variants[1].size());
+	}
+
+	//==================================================
+	// Join the replicates and write the shared variants.
+	//==================================================
+
+	sort(Variants[0].begin(), Variants[0].end(), VariantLess);
+	sort(Variants[1].begin(), Variants[1].end(), VariantLess);
+
+	unsigned long i=0, j=0;
+	while(i < Variants[0].size() && j < Variants[1].size()){
+		int c=CompareVariantKeys(Variants[0][i], Variants[1][j]);
+		if(c < 0){
+			i++;
+			continue;
+		}
+		if(c > 0){
+			j++;
+			continue;
+		}
+
+		// Every combination of matching rows is written,
+		// as merge does when a key occurs more than once.
+		unsigned long iend=i, jend=j;
+		while(iend < Variants[0].size() &&
+				CompareVariantKeys(Variants[0][iend], Variants[0][i])==0){
+			iend++;
+		}
+		while(jend < Variants[1].size() &&
+				CompareVariantKeys(Variants[1][jend], Variants[1][j])==0){
+			jend++;
+		}
+		for(unsigned long x=i; x<iend; x++){
+			for(unsigned long y=j; y<jend; y++){
+				Variant_t *v=&Variants[0][x];
+				Variant_t *w=&Variants[1][y];
+				(*out) << v->Patient << " " << v->Timepoint << " " <<
+						v->Site << " " << v->Aliquot << " " <<
+						v->Chr << " " << v->Pos << " " << v->Base << " " <<
+						v->GenomePos << " " << v->InitBase << " " <<
+						v->Replicate << " " << v->Count << " " <<
+						v->Coverage << " " << v->Freq << " " << 1 << " " <<
+						w->Replicate << " " << w->Count << " " <<
+						w->Coverage << " " << w->Freq << " " << 1 << "\n";
+				(*numvariants)++;
+			}
+		}
+		i=iend;
+		j=jend;
+	}
+
+	return 0;
+}
@@ -1,7 +1,26 @@
 //============================================================================
 // Name        : CountHaplotypes.cpp
-// Version     : 2.0
-// Description : 2.0 Implement haplotype inference from paired-end
+// Version     : 2.4
+// Description : 2.4 Optionally discover the sites of interest instead of
+//               reading them: set the filtered read pairs aside in a file
+//               next to the output while tallying a pileup as in
+//               SummarizeBAM, choose the sites whose minor allele passes
+//               a frequency threshold, then phase the held pairs, so that
+//               the input is read only once and may be a pipe.
+//               Phasing and discovery call bases with the same
+//               helpers, over the same aligned run of each read,
+//               trimmed by -l and -r.
+//           2.3 Optionally downsample read pairs: a fixed fraction,
+//               a coverage cap, or a fixed number per window,
+//               decided by a hash of the read name as in SummarizeBAM.
+//           2.2 Optionally output the frequencies of fully called
+//               haplotypes with 95% confidence intervals, and linkage
+//               statistics (D, D', r^2) between all pairs of sites,
+//               computed from the haplotypes counted in memory.
+//           2.1 Filter reads with FLAG bitmasks, mapping quality,
+//               and chromosome before parsing the rest of the read.
+//               Ignore secondary and supplementary alignments.
+//           2.0 Implement haplotype inference from paired-end
 //               reads listed sequentially in a SAM format file.
 //           1.0 Given a BAM file, reference sequence,
 //               and ordered list of 1-indexed sites of interest,
@@ -22,21 +41,122 @@
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <cstring>
+#include <stdint.h>
+#include <math.h>
+#include <ctype.h>
 
 using namespace std;
 
 // RUN PARAMETERS
-string VERSION="2.0";
+string VERSION="2.4";
 string SAM="";
 string QUERY="";
 string OUTFILE="";
+string FREQFILE="";
+string LINKAGEFILE="";
 string CHR="";
 int BASEQTHRESHOLD=20;
 int MAPQTHRESHOLD=20;
 int LEFTTRIM=0;
 int RIGHTTRIM=0;
+int REQUIREFLAGS=0;
+int EXCLUDEFLAGS=0xF04;
 bool HEADER=false;
+string DOWNSAMPLEMODE="none";
+double DOWNSAMPLEVALUE=0;
+int DOWNSAMPLEWINDOW=200;
+long long DOWNSAMPLESEED=0;
+bool DISCOVER=false;
+double MINORFREQ=0;
+long long MINCOVERAGE=100;
+string SITESFILE="";
+
+// Number of read pairs whose calls are packed into the site bitsets
+// at a time, so that the bitsets of hundreds of sites stay in cache
+// while all pairs of sites are compared.
+const unsigned int TILEPAIRS=8192;
+
+// Normal quantile of the 95% confidence intervals on haplotype frequencies.
+const double CONFIDENCEZ=1.959964;
+
+// Number of mandatory fields in a SAM-format line.
+// Optional fields, if present, are kept together as one extra field.
+const int NUMSAMFIELDS=11;
+
+// Locations of the tab-delimited fields in a SAM-format line,
+// so that integer fields can be checked before SEQ and QUAL are touched.
+struct SAMFields_t{
+	const char *Start[NUMSAMFIELDS+1];
+	int Length[NUMSAMFIELDS+1];
+};
+
+// Read filter expressed as FLAG bitmasks, as in samtools view -f/-F,
+// together with a minimum mapping quality and an optional chromosome.
+struct ReadFilter_t{
+	int RequireFlags=0;
+	int ExcludeFlags=0;
+	int MinMapQ=0;
+	string Chr="";
+};
+
+// Results of FilterRead, naming the filter that rejected a read.
+enum FilterResult_t {FILTER_PASS, FILTER_FLAGS, FILTER_UNMAPPED,
+	FILTER_MAPQ, FILTER_REFERENCE};
+
+// Number of reads removed by each filter, in the order they are applied.
+struct FilterCounts_t{
+	long long Total=0;
+	long long FailRequireFlags=0;
+	long long FailExcludeFlags=0;
+	long long Unmapped=0;
+	long long FailMapQ=0;
+	long long FailReference=0;
+	long long Indel=0;
+	long long Passed=0;
+};
+
+// Read pair downsampling modes, applied to every alignment line
+// before the read filters.
+enum DownsampleMode_t {DOWNSAMPLE_NONE, DOWNSAMPLE_FRACTION,
+	DOWNSAMPLE_CAP, DOWNSAMPLE_WINDOW};
+
+// Identifies the window of a read pair in window downsampling:
+// the chromosome and window index of the leftmost mate,
+// computed the same way from either mate.
+typedef pair<string, int> WindowKey_t;
+
+// A decision on a read pair in coverage cap mode, made at the first
+// primary line of the pair and applied to the rest of the pair.
+struct PairDecision_t{
+	bool Keep=true;
+	int NumPrimary=0;
+};
+
+// Downsampling parameters and state.
+// Pairs are ranked by a hash of the read name, so every line of a pair
+// gets the same decision, and any program reading the same SAM file
+// with the same parameters keeps the same pairs.
+//   Fraction: keep pairs whose hash falls below Fraction of the hash range.
+//   Cap: keep a pair unless the read coverage of the pairs already kept
+//     reaches Cap at every position of its fragment.
+//   Window: keep the PairsPerWindow pairs with the lowest hashes among
+//     the pairs whose leftmost mate starts in each window of WindowSize
+//     positions, found in a first pass over the file.
+struct Downsampler_t{
+	DownsampleMode_t Mode=DOWNSAMPLE_NONE;
+	uint64_t Seed=0;
+	uint64_t FractionThreshold=0;
+	long long Cap=0;
+	long long PairsPerWindow=0;
+	int WindowSize=1;
+	map<string, vector<long long> > Depth;
+	unordered_map<string, PairDecision_t> Decisions;
+	map<WindowKey_t, uint64_t> WindowThresholds;
+	long long NumLines=0;
+	long long NumRemoved=0;
+};
 
 struct SAMRead_t {
 	string QName;
@@ -48,7 +168,23 @@ struct SAMRead_t {
 	int TLen;
 	string Seq;
 	string Quality;
-	string ExpandedCigar;
+};
+
+// Major and minor alleles at a site of interest:
+// the two most common bases among the counted haplotypes.
+struct SiteAlleles_t{
+	char Major='N';
+	char Minor='N';
+};
+
+// Counts of read pairs called as the major or minor allele at both sites
+// of a pair of sites, and of those, the read pairs with the minor allele
+// at the first site, at the second site, and at both sites.
+struct LinkageCounts_t{
+	long long Both=0;
+	long long Minor1=0;
+	long long Minor2=0;
+	long long MinorBoth=0;
 };
 
 // FUNCTIONS
@@ -60,8 +196,41 @@ int ReadMultiFasta(string filename,
 		vector<string> *sequencenames,
 		vector<string> *sequences);
 vector<string> StringSplit(string s, char c);
-string ExpandCIGAR(string cigar);
-SAMRead_t ReadSAM(string line);
+int SplitSAMLine(const string &line, SAMFields_t *fields);
+int FilterRead(SAMFields_t *fields, ReadFilter_t *filter,
+		map<string, int> *refindex, int *chrindex, FilterCounts_t *counts);
+void PrintFilterCounts(FilterCounts_t *counts);
+SAMRead_t ReadSAM(SAMFields_t *fields);
+int ReadPairHaplotype(vector<SAMRead_t> *readpair, vector<int> *querysites,
+		string *haplotype);
+int OutputReadPair(vector<SAMRead_t> *readpair, vector<int> *querysites,
+		ofstream *out, map<string, long long> *haplotypecounts);
+void WriteSiteHeader(ofstream *out, vector<int> *querysites);
+int ReadRun(SAMRead_t *read, int *refstart, int *runstart, int *runend);
+char CallBase(SAMRead_t *read, int k);
+void TallyReadPair(vector<SAMRead_t> *readpair, vector<long long> *basecounts);
+void SiteAlleleCounts(vector<long long> *basecounts, int site,
+		long long *coverage, int *major, int *minor);
+void DiscoverSites(vector<long long> *basecounts, vector<int> *querysites);
+int WriteDiscoveredSites(string filename, vector<long long> *basecounts,
+		vector<int> *querysites);
+void WilsonInterval(long long count, long long total,
+		double *lower, double *upper);
+int WriteFrequencies(string filename, map<string, long long> *haplotypecounts);
+void CountSiteAlleles(map<string, long long> *haplotypecounts, int numsites,
+		vector<SiteAlleles_t> *alleles);
+void TallyLinkageTile(vector<uint64_t> *called, vector<uint64_t> *minor,
+		int numsites, vector<LinkageCounts_t> *linkagecounts);
+int WriteLinkage(string filename, map<string, long long> *haplotypecounts,
+		vector<int> *querysites);
+int CheckDownsampleParameters();
+void SetDownsampler(Downsampler_t *downsampler);
+void PrintDownsampleParameters();
+uint64_t HashReadName(const char *name, int length, uint64_t seed);
+int CIGARReferenceLength(const char *cigar, int length);
+WindowKey_t PairWindow(SAMFields_t *fields, int windowsize);
+int InitializeDownsampler(ifstream *in, Downsampler_t *downsampler);
+bool KeepRead(SAMFields_t *fields, Downsampler_t *downsampler);
 
 int main(int argc, char *argv[]) {
 
@@ -80,27 +249,31 @@ int main(int argc, char *argv[]) {
 	// Read in query sites.
 	//==================================================
 
-	printf("Reading queries.\n");
+	// In discovery mode, the sites are found from the reads instead.
 	vector<int> QuerySites;
-	// Open the file.
-	ifstream fq(QUERY.c_str(), ios::in);
+	if(!DISCOVER){
+		printf("Reading queries.\n");
 
-	// Check that file exists.
-	if(!fq){
-		printf("Error: query file does not exist.\n");
-		return 1;
-	}
+		// Open the file.
+		ifstream fq(QUERY.c_str(), ios::in);
 
-	// Read in the file line by line.
-	// Record sites of interest as zero-indexed positions along the chromosome.
-	string line;
-	while(getline(fq, line)){
-		QuerySites.push_back(atoi(line.c_str())-1);
-	}
-	int NumQueries=QuerySites.size();
+		// Check that file exists.
+		if(!fq){
+			printf("Error: query file does not exist.\n");
+			return 1;
+		}
 
-	// Close the file.
-	fq.close();
+		// Read in the file line by line.
+		// Record sites of interest as zero-indexed positions
+		// along the chromosome.
+		string line;
+		while(getline(fq, line)){
+			QuerySites.push_back(atoi(line.c_str())-1);
+		}
+
+		// Close the file.
+		fq.close();
+	}
 
 
 	//==================================================
@@ -117,175 +290,211 @@ int main(int argc, char *argv[]) {
 
 		// If the header option is turned on,
 		// then print a header with the tab-delimited sites of interest.
-		// These sites are one-indexed, as in the input query file.
-		if(HEADER){
-			for(unsigned int i=0; i<QuerySites.size(); i++){
-				if(i<QuerySites.size()-1){
-					fout << QuerySites[i]+1 << "\t";
-				}
-				else{
-					fout << QuerySites[i]+1 << endl;
-				}
-			}
+		// In discovery mode, it is printed once the sites are known.
+		if(HEADER && !DISCOVER){
+			WriteSiteHeader(&fout, &QuerySites);
 		}
 
 		// Read in the file line by line.
 		string line;
 
+		// Set up the read filter and its counters.
+		ReadFilter_t Filter;
+		Filter.RequireFlags=REQUIREFLAGS;
+		Filter.ExcludeFlags=EXCLUDEFLAGS;
+		Filter.MinMapQ=MAPQTHRESHOLD;
+		Filter.Chr=CHR;
+		FilterCounts_t FilterCounts;
+
 		// To take in pairs of reads at a time,
 		// store the current read ID and a vector format to store reads.
+		// Record whether any read in the pair has failed the filters.
 		string CurrentReadID="";
 		vector<SAMRead_t> ReadPair;
-		int NumReads=0;
+		bool ParsePair=true;
+		bool EndOfFile=false;
+
+		// Count each distinct haplotype if frequencies
+		// or linkage statistics are requested.
+		bool CountHaplotypes=(FREQFILE!="" || LINKAGEFILE!="");
+		map<string, long long> HaplotypeCounts;
+		map<string, long long> *Counts=CountHaplotypes ? &HaplotypeCounts : NULL;
+
+		// In discovery mode, tally the bases of the read pairs that pass
+		// the filters, indexed by position*4 + the index of the base in ACGT,
+		// and write their lines to a file to be phased once the sites are
+		// known, so that memory does not grow with the depth of the sample.
+		// Pairs are separated by empty lines.
+		vector<long long> BaseCounts;
+		string HeldFile=OUTFILE+".held";
+		ofstream HeldOut;
+		string PairLines="";
+		if(DISCOVER){
+			HeldOut.open(HeldFile.c_str(), ios::out);
+			if(!HeldOut){
+				printf("Error: could not write %s.\n", HeldFile.c_str());
+				return 1;
+			}
+		}
 
-		while(getline(fin, line)){
+		// Downsample read pairs before any other work on them.
+		// In window mode, find the pairs to keep in each window
+		// in a first pass over the input.
+		Downsampler_t Downsampler;
+		SetDownsampler(&Downsampler);
+		if(InitializeDownsampler(&fin, &Downsampler)!=0){
+			printf("Error: window downsampling requires a SAM file rather than a pipe.\n");
+			return 1;
+		}
 
-			// Read the line as a SAM format line and store in the appropriate object.
-			SAMRead_t NewRead=ReadSAM(line);
+		while(!EndOfFile){
 
-			// If the new read matches the current read ID,
-			// then save it and continue.
-			if(strcmp(NewRead.QName.c_str(),CurrentReadID.c_str())==0){
-				ReadPair.push_back(NewRead);
-				NumReads++;
-				continue;
+			// Locate the fields of the next read without copying them.
+			// Skip header lines and lines without the mandatory fields.
+			SAMFields_t Fields;
+			string ReadID="";
+			if(getline(fin, line)){
+				if(line[0]=='@' || SplitSAMLine(line, &Fields) < NUMSAMFIELDS){
+					continue;
+				}
+
+				// Drop reads from pairs that are not in the subsample,
+				// as if they were not in the input.
+				if(!KeepRead(&Fields, &Downsampler)){
+					continue;
+				}
+				ReadID.assign(Fields.Start[0], Fields.Length[0]);
 			}
-			// If the new read does not match the previous read,
-			// then save the read in the read vector,
-			// and reset the read ID and read vector.
 			else{
+				EndOfFile=true;
+			}
 
-				// Determine whether the read pair is worth parsing.
-				bool ParsePair=true;
-
-				// Run through the criteria for parsing the read.
-				for(unsigned int i=0; i<ReadPair.size(); i++){
-
-					// Exclude reads that did not map.
-					if(ReadPair[i].Cigar=="*"){
-						ParsePair=false;
-						continue;
-					}
+			// Once all reads in the pair have been seen,
+			// determine the haplotype of the pair if it is worth parsing.
+			if(ReadID!=CurrentReadID || EndOfFile){
 
-					// Exclude reads with more than one alignment.
-					if(ReadPair[i].Flag>256){
-						ParsePair=false;
-						continue;
+				if(ParsePair && ReadPair.size()>0){
+					if(DISCOVER){
+						TallyReadPair(&ReadPair, &BaseCounts);
+						HeldOut << PairLines << "\n";
 					}
-
-					// Consider only reads that map to the specified chromosome
-					// and exceed the specified minimum mapping quality.
-					if(ReadPair[i].Chr!=CHR || ReadPair[i].MapQ<MAPQTHRESHOLD){
-						ParsePair=false;
-						continue;
+					else if(OutputReadPair(&ReadPair, &QuerySites, &fout,
+							Counts)!=0){
+						printf("CIGAR parsing error.\n");
+						return 1;
 					}
+				}
 
-					// Exclude reads that contain indels.
-					// Determine from the CIGAR string whether indels are present.
-					bool indel=false;
-					string ForbiddenOperations="IDP";
-					for(unsigned int j=0; j<ReadPair[i].Cigar.size();j++){
-						if(strchr(ForbiddenOperations.c_str(), ReadPair[i].Cigar[j])!=NULL){
-							ParsePair=false;
-							continue;
-						}
-					}
+				// Save the new read ID and reset the read array.
+				CurrentReadID=ReadID;
+				ReadPair.clear();
+				PairLines="";
+				ParsePair=true;
+			}
+			if(EndOfFile){
+				break;
+			}
 
-					// Consider only reads that, based on mapping position
-					// and length of mapping region, cover at least some of the
-					// region of interest.
-					if(!(ReadPair[i].Pos+ReadPair[i].TLen>QuerySites[0] &&
-							ReadPair[i].Pos<QuerySites[NumQueries-1])){
-						continue;
-					}
+			// Apply the FLAG filters before anything else.
+			// Reads excluded by their FLAG, such as secondary alignments,
+			// are ignored without affecting the rest of the pair.
+			int Result=FilterRead(&Fields, &Filter, NULL, NULL, &FilterCounts);
+			if(Result==FILTER_FLAGS){
+				continue;
+			}
 
-				}
+			// Exclude pairs with reads that did not map,
+			// that do not exceed the specified minimum mapping quality,
+			// or that do not map to the specified chromosome.
+			if(Result!=FILTER_PASS){
+				ParsePair=false;
+				continue;
+			}
 
-				// If the read pair fails any of the criteria above,
-				// then move on to the next line of the file.
-				if(!ParsePair){
-					// Save the new read ID,
-					// reset the number of saved reads and the read array,
-					// and save the new read.
-					CurrentReadID=NewRead.QName;
-					ReadPair.clear();
-					ReadPair.push_back(NewRead);
-					NumReads=1;
-					continue;
+			// Exclude pairs with reads that contain indels.
+			// Determine from the CIGAR string whether indels are present.
+			string ForbiddenOperations="IDP";
+			for(int i=0; i<Fields.Length[5]; i++){
+				if(strchr(ForbiddenOperations.c_str(), Fields.Start[5][i])!=NULL){
+					FilterCounts.Indel++;
+					ParsePair=false;
+					break;
 				}
+			}
+			if(!ParsePair){
+				continue;
+			}
 
-				// If the read is worth parsing,
-				// then create an array to store the haplotype.
-				// Initialize it with 'N'.
-				bool HaplotypeNonEmpty=false;
-				char Haplotype[NumQueries];
-				for(unsigned int i=0; i<NumQueries; i++){
-					Haplotype[i]='N';
-				}
+			// Store the read in the appropriate object.
+			FilterCounts.Passed++;
+			ReadPair.push_back(ReadSAM(&Fields));
+			if(DISCOVER){
+				PairLines+=line;
+				PairLines+="\n";
+			}
+		}
 
-				// Expand the CIGAR string for each read in the pair.
-				for(unsigned int i=0; i<ReadPair.size(); i++){
-					ReadPair[i].ExpandedCigar=ExpandCIGAR(ReadPair[i].Cigar);
-					// Verify that the expanded CIGAR string matches the read length.
-					if(ReadPair[i].ExpandedCigar.size()!=ReadPair[i].Seq.size()){
-						printf("CIGAR parsing error.\n");
-						return 1;
-					}
+		if(Downsampler.Mode!=DOWNSAMPLE_NONE){
+			printf("Number of reads removed by downsampling: %lld of %lld\n",
+					Downsampler.NumRemoved, Downsampler.NumLines);
+		}
+		PrintFilterCounts(&FilterCounts);
+
+		//==================================================
+		// Discover sites and phase the held read pairs.
+		//==================================================
+
+		if(DISCOVER){
+			printf("Discovering sites.\n");
+			DiscoverSites(&BaseCounts, &QuerySites);
+			printf("Number of sites discovered: %d\n", (int) QuerySites.size());
+			if(SITESFILE!="" &&
+					WriteDiscoveredSites(SITESFILE, &BaseCounts, &QuerySites)!=0){
+				printf("Error: could not write discovered sites.\n");
+				return 1;
+			}
+			if(HEADER){
+				WriteSiteHeader(&fout, &QuerySites);
+			}
+			HeldOut.close();
+			if(!HeldOut){
+				printf("Error: could not write %s.\n", HeldFile.c_str());
+				return 1;
+			}
+			ifstream HeldIn(HeldFile.c_str(), ios::in);
+			while(getline(HeldIn, line)){
+				if(line.size()>0){
+					SAMFields_t Fields;
+					SplitSAMLine(line, &Fields);
+					ReadPair.push_back(ReadSAM(&Fields));
+					continue;
 				}
-
-				// Iterate through the sites of interest and output the genotypes
-				// at those sites in this read.
-				// Include only sites in the read that exceed the specified quality score.
-				for(unsigned int i=0; i<NumQueries; i++){
-					char genotype='N';
-					for(unsigned int j=0; j<ReadPair.size(); j++){
-						if(QuerySites[i]>ReadPair[j].Pos &&
-								QuerySites[i]<ReadPair[j].Pos+ReadPair[j].Seq.size()){
-							// Iterate along the read until you reach the site of interest.
-							// Do not count sites that have been soft-clipped.
-							int RefPos=ReadPair[j].Pos;
-							for(unsigned int k=0; k<ReadPair[j].Seq.size(); k++){
-								if(ReadPair[j].ExpandedCigar[k]=='M'){
-									if(RefPos==QuerySites[i] &&
-											ReadPair[j].Quality[k]>=BASEQTHRESHOLD){
-
-										// Record the genotype once you reach the site.
-										genotype=ReadPair[j].Seq[k];
-
-										// Check that the genotypes of the reads
-										// in the pair are concordant.
-										// Otherwise, output 'N' at that site.
-										if(Haplotype[i]=='N'){
-											Haplotype[i]=genotype;
-											HaplotypeNonEmpty=true;
-										}
-										else if(Haplotype[i]!=genotype){
-											Haplotype[i]='N';
-										}
-									}
-									RefPos++;
-								}
-							}
-						}
-					}
+				if(OutputReadPair(&ReadPair, &QuerySites, &fout, Counts)!=0){
+					printf("CIGAR parsing error.\n");
+					return 1;
 				}
+				ReadPair.clear();
+			}
+			HeldIn.close();
+			remove(HeldFile.c_str());
+		}
 
-				// If the haplotype is non-empty,
-				// output it in tab-delimited form.
-				if(HaplotypeNonEmpty){
-					for(unsigned int i=0; i<NumQueries; i++){
-						fout << Haplotype[i] << "\t";
-					}
-					fout << "\n";
-				}
+		//==================================================
+		// Summarize haplotype frequencies and linkage.
+		//==================================================
 
-				// Save the new read ID,
-				// reset the number of saved reads and the read array,
-				// and save the new read.
-				CurrentReadID=NewRead.QName;
-				ReadPair.clear();
-				ReadPair.push_back(NewRead);
-				NumReads=1;
+		if(FREQFILE!=""){
+			printf("Writing haplotype frequencies.\n");
+			if(WriteFrequencies(FREQFILE, &HaplotypeCounts) != 0){
+				printf("Error: could not write haplotype frequencies.\n");
+				return 1;
+			}
+		}
+		if(LINKAGEFILE!=""){
+			printf("Writing linkage statistics.\n");
+			if(WriteLinkage(LINKAGEFILE, &HaplotypeCounts, &QuerySites) != 0){
+				printf("Error: could not write linkage statistics.\n");
+				return 1;
 			}
 		}
 	}
@@ -357,6 +566,14 @@ int ArgsParse(int argc, char *argv[]){
 		case 'o':
 			OUTFILE = arg;
 			break;
+		// -f output haplotype frequencies
+		case 'f':
+			FREQFILE = arg;
+			break;
+		// -d output linkage statistics between pairs of sites
+		case 'd':
+			LINKAGEFILE = arg;
+			break;
 		// -Q base quality threshold
 		case 'Q':
 			BASEQTHRESHOLD = atoi(arg.c_str());
@@ -377,9 +594,51 @@ int ArgsParse(int argc, char *argv[]){
 		case 'r':
 			RIGHTTRIM = atoi(arg.c_str());
 			break;
+		// -R FLAG bits that must all be set
+		case 'R':
+			REQUIREFLAGS = strtol(arg.c_str(), NULL, 0);
+			break;
+		// -F FLAG bits that must all be unset
+		case 'F':
+			EXCLUDEFLAGS = strtol(arg.c_str(), NULL, 0);
+			break;
 		// -h header
 		case 'h':
 			HEADER=true;
+			break;
+		// -D downsampling mode
+		case 'D':
+			DOWNSAMPLEMODE = arg;
+			break;
+		// -N fraction, coverage, or pairs per window for downsampling
+		case 'N':
+			DOWNSAMPLEVALUE = atof(arg.c_str());
+			break;
+		// -W downsampling window
+		case 'W':
+			DOWNSAMPLEWINDOW = atoi(arg.c_str());
+			break;
+		// -S downsampling seed
+		case 'S':
+			DOWNSAMPLESEED = atoll(arg.c_str());
+			break;
+		// -a minor allele frequency for discovering sites
+		case 'a':
+			DISCOVER=true;
+			MINORFREQ = atof(arg.c_str());
+			if(MINORFREQ <= 0 || MINORFREQ > 0.5){
+				printf("Invalid -a minor allele frequency; must be in (0,0.5].\n");
+				return 1;
+			}
+			break;
+		// -x minimum coverage of a discovered site
+		case 'x':
+			MINCOVERAGE = atoll(arg.c_str());
+			break;
+		// -p output discovered sites
+		case 'p':
+			SITESFILE = arg;
+			break;
 		}
 	}
 
@@ -388,8 +647,16 @@ int ArgsParse(int argc, char *argv[]){
 		printf("Invalid arguments. Specify SAM file.\n");
 		return 1;
 	}
-	if(QUERY==""){
-		printf("Invalid arguments. Specify query sites.\n");
+	if(QUERY=="" && !DISCOVER){
+		printf("Invalid arguments. Specify query sites or -a to discover them.\n");
+		return 1;
+	}
+	if(QUERY!="" && DISCOVER){
+		printf("Invalid arguments. Specify either query sites or -a, not both.\n");
+		return 1;
+	}
+	if(SITESFILE!="" && !DISCOVER){
+		printf("Invalid arguments. -p requires -a.\n");
 		return 1;
 	}
 	if(CHR==""){
@@ -400,7 +667,7 @@ int ArgsParse(int argc, char *argv[]){
 		printf("Invalid arguments. Specify output file.\n");
 		return 1;
 	}
-	return 0;
+	return CheckDownsampleParameters();
 }
 
 // PrintParameters
@@ -409,14 +676,32 @@ void PrintParameters(){
 	cout << "CountHaplotypes version " << VERSION << endl;
 	cout << "RUN PARAMETERS" << endl;
 	cout << "SAM file: " << SAM << endl;
-	cout << "query: " << QUERY << endl;
+	if(DISCOVER){
+		cout << "discover sites with minor allele frequency: " << MINORFREQ << endl;
+		cout << "minimum coverage of discovered sites: " << MINCOVERAGE << endl;
+		if(SITESFILE!=""){
+			cout << "discovered sites file: " << SITESFILE << endl;
+		}
+	}
+	else{
+		cout << "query: " << QUERY << endl;
+	}
 	cout << "chromosome: " << CHR << endl;
 	cout << "output file: " << OUTFILE << endl;
+	if(FREQFILE!=""){
+		cout << "haplotype frequency file: " << FREQFILE << endl;
+	}
+	if(LINKAGEFILE!=""){
+		cout << "linkage file: " << LINKAGEFILE << endl;
+	}
 	cout << "header: " << HEADER << endl;
 	cout << "base quality threshold: " << BASEQTHRESHOLD << endl;
 	cout << "mapping quality threshold: " << MAPQTHRESHOLD << endl;
 	cout << "left read trimming: " << LEFTTRIM << endl;
 	cout << "right read trimming: " << RIGHTTRIM << endl;
+	cout << "required FLAG bits: 0x" << hex << REQUIREFLAGS << dec << endl;
+	cout << "excluded FLAG bits: 0x" << hex << EXCLUDEFLAGS << dec << endl;
+	PrintDownsampleParameters();
 	cout << endl;
 }
 
@@ -431,6 +716,10 @@ void PrintUsage(){
 			"iterate through the reads and establish haplotypes.\n");
 	printf("\n");
 	printf("  -i FILE\tordered list of 1-indexed sites of interest, one per line\n");
+	printf("  -a FLOAT\tinstead of -i, discover the sites at which the minor\n"
+			"\t\tallele has at least this frequency in a pileup of the reads,\n"
+			"\t\tthen phase them; filtered read pairs are held meanwhile\n"
+			"\t\tin the file -o with the extension .held\n");
 	printf("  -s FILE\tSAM-format file of reads, sorted so read pairs are adjacent to each other\n");
 	printf("  -c STRING\tname of chromosome of interest\n");
 	printf("  -o FILE\toutput list of haplotypes, one per line\n");
@@ -439,7 +728,27 @@ void PrintUsage(){
 	printf("  -q INT\tminimum mapping quality for a read to be tallied [20]\n");
 	printf("  -l INT\tnum bases to trim from 5' (left) end of each read, after soft clipping [0]\n");
 	printf("  -r INT\tnum bases to trim from 3' (right) end of each read, after soft clipping [0]\n");
+	printf("  -R INT\tonly use reads with all of these FLAG bits set [0]\n");
+	printf("  -F INT\tignore reads with any of these FLAG bits set\n"
+			"\t\t(unmapped, secondary, QC fail, duplicate,\n"
+			"\t\tsupplementary) [0xF04]\n");
+	printf("  -f FILE\toutput frequencies of fully called haplotypes,\n"
+			"\t\twith 95%% confidence intervals\n");
+	printf("  -d FILE\toutput linkage statistics (D, D', r^2) between all pairs of sites\n");
 	printf("  -h print header line with query sites\n");
+	printf("  -D STRING\tdownsample read pairs, deciding by a hash of the read name\n"
+			"\t\tso that mates stay together [none]\n");
+	printf("\t\tfraction: keep a fraction -N of read pairs\n");
+	printf("\t\tcap: keep pairs until the read coverage reaches -N\n"
+			"\t\t   at every position of their fragment\n");
+	printf("\t\twindow: keep the -N pairs with the lowest hashes among those\n"
+			"\t\t   starting in each -W window; the input must be a file\n");
+	printf("  -N FLOAT\tfraction, coverage, or pairs per window for -D\n");
+	printf("  -W INT\twidth of windows for -D window [200]\n");
+	printf("  -S INT\tseed for the read name hash [0]\n");
+	printf("  -x INT\tminimum coverage of a site discovered with -a [100]\n");
+	printf("  -p FILE\toutput the sites discovered with -a, with their coverage,\n"
+			"\t\tmajor and minor alleles, and minor allele frequency\n");
 	printf("\n\n");
 }
 
@@ -485,51 +794,117 @@ vector<string> StringSplit(string s, char c){
 }
 
 //
-// ExpandCIGAR
-// Takes in a CIGAR string as specified by the SAM/BAM file standard
-// and expands it into a string the length of the read describing its features.
-// For instance, 1S5M4S becomes SMMMMMSSSS
-string ExpandCIGAR(string cigar){
-	string expanded="";
-	string NumBases="";
-	// All allowed operations characters.
-	string CigarOperations="MIDNSHP=X";
-	// Operations characters that sum to the length of the sequence.
-	string CigarOperationsSubset="MIS=X";
-
-	// Iterate through the CIGAR string and check for operation characters.
-	for(unsigned int i=0; i<cigar.length(); i++){
-		// Store non-operation characters that indicate the number of bases.
-		if(strchr(CigarOperations.c_str(), cigar[i])==NULL){
-			NumBases+=cigar[i];
-		}
-		// After reaching one of the useful operation characters,
-		// add the appropriate number of characters to the expanded string.
-		else if(strchr(CigarOperationsSubset.c_str(), cigar[i])!=NULL){
-			unsigned int Num=atoi(NumBases.c_str());
-			for(unsigned int j=0; j<Num; j++){
-				expanded+=cigar[i];
-			}
-			NumBases="";
-		}
-		// If the operation character should not be added to the string,
-		// reset the number of bases.
-		else{
-			NumBases="";
+// SplitSAMLine
+// Given a line of a SAM-format file, records where each of the
+// mandatory tab-delimited fields starts and how long it is.
+// Any optional fields are kept together as one extra field.
+// Returns the number of mandatory fields found.
+int SplitSAMLine(const string &line, SAMFields_t *fields){
+	const char *start=line.c_str();
+	const char *end=start+line.size();
+	int numfields=0;
+	while(numfields<NUMSAMFIELDS){
+		const char *tab=(const char *) memchr(start, '\t', end-start);
+		const char *fieldend=(tab==NULL) ? end : tab;
+		(*fields).Start[numfields]=start;
+		(*fields).Length[numfields]=fieldend-start;
+		numfields++;
+		if(tab==NULL){
+			break;
+		}
+		start=tab+1;
+	}
+	// Store the optional fields, which are empty if absent.
+	if(numfields==NUMSAMFIELDS && (*fields).Start[NUMSAMFIELDS-1]+
+			(*fields).Length[NUMSAMFIELDS-1] < end){
+		(*fields).Start[NUMSAMFIELDS]=start;
+		(*fields).Length[NUMSAMFIELDS]=end-start;
+	}
+	else{
+		(*fields).Start[NUMSAMFIELDS]=end;
+		(*fields).Length[NUMSAMFIELDS]=0;
+	}
+	return numfields;
+}
+
+//
+// FilterRead
+// Given the fields of a SAM-format line and a read filter,
+// decides whether the read should be tallied, using only the
+// FLAG, RNAME, MAPQ, and CIGAR fields.
+// If a map of reference names is given, reads must map to one of them,
+// and the index of the read's reference sequence is stored in chrindex.
+// Counts the filter that rejected the read, if any, and returns it.
+int FilterRead(SAMFields_t *fields, ReadFilter_t *filter,
+		map<string, int> *refindex, int *chrindex, FilterCounts_t *counts){
+
+	(*counts).Total++;
+
+	// Check the FLAG bitmasks.
+	int flag=atoi((*fields).Start[1]);
+	if((flag & (*filter).RequireFlags) != (*filter).RequireFlags){
+		(*counts).FailRequireFlags++;
+		return FILTER_FLAGS;
+	}
+	if((flag & (*filter).ExcludeFlags) != 0){
+		(*counts).FailExcludeFlags++;
+		return FILTER_FLAGS;
+	}
+
+	// Exclude reads that did not map based on the CIGAR string.
+	if((*fields).Start[5][0]=='*'){
+		(*counts).Unmapped++;
+		return FILTER_UNMAPPED;
+	}
+
+	// Check the mapping quality.
+	if(atoi((*fields).Start[4]) < (*filter).MinMapQ){
+		(*counts).FailMapQ++;
+		return FILTER_MAPQ;
+	}
+
+	// Check that the read maps to the chromosome of interest,
+	// if one is given, and to a reference sequence.
+	string chr((*fields).Start[2], (*fields).Length[2]);
+	if((*filter).Chr != "" && chr != (*filter).Chr){
+		(*counts).FailReference++;
+		return FILTER_REFERENCE;
+	}
+	if(refindex != NULL){
+		map<string, int>::iterator it=(*refindex).find(chr);
+		if(it==(*refindex).end()){
+			(*counts).FailReference++;
+			return FILTER_REFERENCE;
 		}
+		*chrindex=it->second;
 	}
-	return expanded;
+
+	return FILTER_PASS;
 }
 
+//
+// PrintFilterCounts
+// Prints the number of reads removed by each filter.
+void PrintFilterCounts(FilterCounts_t *counts){
+	printf("Number of reads: %lld\n", (*counts).Total);
+	printf("Number of reads missing required FLAG bits: %lld\n",
+			(*counts).FailRequireFlags);
+	printf("Number of reads with excluded FLAG bits: %lld\n",
+			(*counts).FailExcludeFlags);
+	printf("Number of unmapped reads: %lld\n", (*counts).Unmapped);
+	printf("Number of reads below mapping quality threshold: %lld\n",
+			(*counts).FailMapQ);
+	printf("Number of reads not mapping to the reference: %lld\n",
+			(*counts).FailReference);
+	printf("Number of reads containing indels: %lld\n", (*counts).Indel);
+	printf("Number of reads in parsed pairs: %lld\n", (*counts).Passed);
+}
 
 //
 // ReadSAM
-// Given a line of a SAM-format file,
-// parse that line and return a SAMRead_t type object.
-SAMRead_t ReadSAM(string line){
-
-	// Split the tab-delimited line and load it into BAM format.
-	vector<string> fields=StringSplit(line,'\t');
+// Given the fields of a line of a SAM-format file,
+// return a SAMRead_t type object.
+SAMRead_t ReadSAM(SAMFields_t *fields){
 
 	// Create a new SAMRead_t object.
 	SAMRead_t Read;
@@ -537,15 +912,783 @@ SAMRead_t ReadSAM(string line){
 	// Store the information in the appropriate formats.
 	// Fields are hard-coded based on BAM file format.
 	// Convert sequence positions from one-indexed to zero-indexed.
-	Read.QName=fields[0];
-	Read.Flag=atoi(fields[1].c_str());
-	Read.Chr=fields[2];
-	Read.Pos=atoi(fields[3].c_str())-1;
-	Read.MapQ=atoi(fields[4].c_str())-1;
-	Read.Cigar=fields[5];
-	Read.TLen=atoi(fields[8].c_str());
-	Read.Seq=fields[9];
-	Read.Quality=fields[10];
+	Read.QName.assign((*fields).Start[0], (*fields).Length[0]);
+	Read.Flag=atoi((*fields).Start[1]);
+	Read.Chr.assign((*fields).Start[2], (*fields).Length[2]);
+	Read.Pos=atoi((*fields).Start[3])-1;
+	Read.MapQ=atoi((*fields).Start[4]);
+	Read.Cigar.assign((*fields).Start[5], (*fields).Length[5]);
+	Read.TLen=atoi((*fields).Start[8]);
+	Read.Seq.assign((*fields).Start[9], (*fields).Length[9]);
+	Read.Quality.assign((*fields).Start[10], (*fields).Length[10]);
 
 	return Read;
 }
+
+//
+// ReadPairHaplotype
+// Given the reads in a read pair and an ordered list of sites of interest,
+// records the genotype of the pair at each site in the haplotype string.
+// Sites not covered by the pair, and sites at which the reads in the pair
+// disagree, are recorded as 'N'.
+// Bases are called with CallBase over the run from ReadRun, as in
+// discovery, so phasing and discovery see the same bases.
+// Returns 1 if any site has a genotype, 0 if the haplotype is empty,
+// and -1 if a CIGAR string does not match its read.
+int ReadPairHaplotype(vector<SAMRead_t> *readpair, vector<int> *querysites,
+		string *haplotype){
+
+	// Initialize the haplotype with 'N'.
+	bool HaplotypeNonEmpty=false;
+	int NumQueries=(*querysites).size();
+	(*haplotype).assign(NumQueries, 'N');
+
+	// Record the genotype of each read at the sites of interest
+	// within its aligned run.
+	for(unsigned int j=0; j<(*readpair).size(); j++){
+		SAMRead_t *Read=&(*readpair)[j];
+		int RefStart, RunStart, RunEnd;
+		if(ReadRun(Read, &RefStart, &RunStart, &RunEnd)!=0){
+			return -1;
+		}
+		for(int i=0; i<NumQueries; i++){
+			int k=RunStart+(*querysites)[i]-RefStart;
+			if(k<RunStart || k>=RunEnd){
+				continue;
+			}
+			char genotype=CallBase(Read, k);
+			if(genotype==0){
+				continue;
+			}
+
+			// Check that the genotypes of the reads
+			// in the pair are concordant.
+			// Otherwise, output 'N' at that site.
+			if((*haplotype)[i]=='N'){
+				(*haplotype)[i]=genotype;
+				HaplotypeNonEmpty=true;
+			}
+			else if((*haplotype)[i]!=genotype){
+				(*haplotype)[i]='N';
+			}
+		}
+	}
+
+	return HaplotypeNonEmpty ? 1 : 0;
+}
+
+//
+// OutputReadPair
+// Finds the haplotype of a read pair at the sites of interest and,
+// if it is non-empty, outputs it in tab-delimited form and adds it to the
+// haplotype counts, if given.
+// Returns -1 if a CIGAR string does not match its read.
+int OutputReadPair(vector<SAMRead_t> *readpair, vector<int> *querysites,
+		ofstream *out, map<string, long long> *haplotypecounts){
+	string Haplotype;
+	int Result=ReadPairHaplotype(readpair, querysites, &Haplotype);
+	if(Result<0){
+		return -1;
+	}
+	if(Result>0){
+		for(unsigned int i=0; i<Haplotype.size(); i++){
+			(*out) << Haplotype[i] << "\t";
+		}
+		(*out) << "\n";
+		if(haplotypecounts!=NULL){
+			(*haplotypecounts)[Haplotype]++;
+		}
+	}
+	return 0;
+}
+
+//
+// WriteSiteHeader
+// Outputs a header with the tab-delimited sites of interest.
+// These sites are one-indexed, as in the input query file.
+void WriteSiteHeader(ofstream *out, vector<int> *querysites){
+	for(unsigned int i=0; i<(*querysites).size(); i++){
+		if(i<(*querysites).size()-1){
+			(*out) << (*querysites)[i]+1 << "\t";
+		}
+		else{
+			(*out) << (*querysites)[i]+1 << endl;
+		}
+	}
+}
+
+//
+// ReadRun
+// Given a read without indels, finds its aligned run: the read positions
+// from runstart up to runend between the soft clips, less LEFTTRIM and
+// RIGHTTRIM bases as in SummarizeBAM, and the reference position refstart
+// of the first of them. The run may be empty, as it is for reads whose
+// CIGAR strings skip reference bases (N).
+// Returns -1 if the CIGAR string does not match the read length.
+int ReadRun(SAMRead_t *read, int *refstart, int *runstart, int *runend){
+	string *Cigar=&(*read).Cigar;
+	int LeftClip=0;
+	int RightClip=0;
+	int ReadLength=0;
+	bool Aligned=false;
+	bool Skipped=false;
+	int Length=0;
+	for(unsigned int c=0; c<(*Cigar).size(); c++){
+		char op=(*Cigar)[c];
+		if(isdigit(op)){
+			Length=Length*10+(op-'0');
+			continue;
+		}
+		if(op=='S'){
+			if(Aligned){
+				RightClip+=Length;
+			}
+			else{
+				LeftClip+=Length;
+			}
+			ReadLength+=Length;
+		}
+		else if(op=='M' || op=='=' || op=='X' || op=='I'){
+			Aligned=true;
+			ReadLength+=Length;
+		}
+		else if(op=='N'){
+			Skipped=true;
+		}
+		Length=0;
+	}
+	if(ReadLength!=(int) (*read).Seq.size() ||
+			(*read).Quality.size()!=(*read).Seq.size()){
+		return -1;
+	}
+
+	*runstart=LeftClip+LEFTTRIM;
+	*runend=ReadLength-RightClip-RIGHTTRIM;
+	if(Skipped || *runend < *runstart){
+		*runend=*runstart;
+	}
+	*refstart=(*read).Pos+LEFTTRIM;
+	return 0;
+}
+
+//
+// CallBase
+// Returns the base at read position k if it is A, C, G, or T
+// and its quality exceeds the base quality threshold, as in SummarizeBAM,
+// and 0 otherwise. Qualities are Phred+33.
+char CallBase(SAMRead_t *read, int k){
+	char base=(*read).Seq[k];
+	if((base!='A' && base!='C' && base!='G' && base!='T') ||
+			((int) (*read).Quality[k])-33 <= BASEQTHRESHOLD){
+		return 0;
+	}
+	return base;
+}
+
+//
+// TallyReadPair
+// Adds the bases of each read in a pair to the discovery pileup,
+// counting the bases that CallBase accepts over the run from ReadRun,
+// as ReadPairHaplotype does. The pileup grows to cover the reads.
+// Reads whose CIGAR strings do not match them are skipped here
+// and reported when the pair is phased.
+void TallyReadPair(vector<SAMRead_t> *readpair, vector<long long> *basecounts){
+	string Bases="ACGT";
+	for(unsigned int i=0; i<(*readpair).size(); i++){
+		SAMRead_t *Read=&(*readpair)[i];
+		int RefStart, RunStart, RunEnd;
+		if(ReadRun(Read, &RefStart, &RunStart, &RunEnd)!=0){
+			continue;
+		}
+		int RefEnd=RefStart+RunEnd-RunStart;
+		if((*basecounts).size()<(unsigned int) RefEnd*4){
+			(*basecounts).resize(RefEnd*4, 0);
+		}
+		for(int k=RunStart; k<RunEnd; k++){
+			char base=CallBase(Read, k);
+			if(base!=0){
+				(*basecounts)[(RefStart+k-RunStart)*4+Bases.find(base)]++;
+			}
+		}
+	}
+}
+
+//
+// SiteAlleleCounts
+// Given the discovery pileup, finds the coverage of a site and its
+// major and minor alleles, as indices into ACGT, or -1 if absent.
+void SiteAlleleCounts(vector<long long> *basecounts, int site,
+		long long *coverage, int *major, int *minor){
+	*coverage=0;
+	*major=-1;
+	*minor=-1;
+	for(int b=0; b<4; b++){
+		long long count=(*basecounts)[site*4+b];
+		*coverage += count;
+		if(count==0){
+			continue;
+		}
+		if(*major<0 || count>(*basecounts)[site*4+*major]){
+			*minor=*major;
+			*major=b;
+		}
+		else if(*minor<0 || count>(*basecounts)[site*4+*minor]){
+			*minor=b;
+		}
+	}
+}
+
+//
+// DiscoverSites
+// Records as sites of interest, in order, the sites with at least
+// the minimum coverage at which the minor allele has at least
+// the minor allele frequency.
+void DiscoverSites(vector<long long> *basecounts, vector<int> *querysites){
+	(*querysites).clear();
+	int NumSites=(*basecounts).size()/4;
+	for(int site=0; site<NumSites; site++){
+		long long coverage;
+		int major, minor;
+		SiteAlleleCounts(basecounts, site, &coverage, &major, &minor);
+		if(coverage<MINCOVERAGE || coverage==0 || minor<0){
+			continue;
+		}
+		if((double) (*basecounts)[site*4+minor]/coverage >= MINORFREQ){
+			(*querysites).push_back(site);
+		}
+	}
+}
+
+//
+// WriteDiscoveredSites
+// Writes each discovered site, one-indexed as in a query file,
+// with its coverage, major and minor alleles, and minor allele frequency.
+// Returns 1 if the file cannot be written.
+int WriteDiscoveredSites(string filename, vector<long long> *basecounts,
+		vector<int> *querysites){
+	ofstream fout(filename.c_str(), ios::out);
+	if(!fout){
+		return 1;
+	}
+	string Bases="ACGT";
+	fout << "Site\tCoverage\tMajor\tMinor\tMinorFrequency\n";
+	for(unsigned int i=0; i<(*querysites).size(); i++){
+		int site=(*querysites)[i];
+		long long coverage;
+		int major, minor;
+		SiteAlleleCounts(basecounts, site, &coverage, &major, &minor);
+		fout << site+1 << "\t" << coverage << "\t" << Bases[major] << "\t"
+				<< Bases[minor] << "\t"
+				<< (double) (*basecounts)[site*4+minor]/coverage << "\n";
+	}
+	fout.close();
+	return 0;
+}
+
+//
+// WilsonInterval
+// Given the count of a haplotype and the total count of haplotypes,
+// computes the Wilson score confidence interval on its frequency.
+void WilsonInterval(long long count, long long total,
+		double *lower, double *upper){
+	if(total==0){
+		*lower=0;
+		*upper=1;
+		return;
+	}
+	double n=total;
+	double p=count/n;
+	double z2=CONFIDENCEZ*CONFIDENCEZ;
+	double center=(p+z2/(2*n))/(1+z2/n);
+	double halfwidth=CONFIDENCEZ*sqrt(p*(1-p)/n+z2/(4*n*n))/(1+z2/n);
+	*lower=max(0.0, center-halfwidth);
+	*upper=min(1.0, center+halfwidth);
+}
+
+//
+// WriteFrequencies
+// Writes the count and frequency of each fully called haplotype,
+// i.e. without N's, with the 95% confidence interval on its frequency,
+// from the most to the least common haplotype.
+// Returns 1 if the file cannot be written.
+int WriteFrequencies(string filename, map<string, long long> *haplotypecounts){
+	ofstream fout(filename.c_str(), ios::out);
+	if(!fout){
+		return 1;
+	}
+
+	// Collect the fully called haplotypes and their total count.
+	vector<pair<long long, string> > Called;
+	long long Total=0;
+	for(map<string, long long>::iterator it=(*haplotypecounts).begin();
+			it!=(*haplotypecounts).end(); ++it){
+		if(it->first.find('N')!=string::npos){
+			continue;
+		}
+		Called.push_back(make_pair(-it->second, it->first));
+		Total += it->second;
+	}
+	sort(Called.begin(), Called.end());
+
+	fout << "Haplotype\tCount\tFrequency\tLower\tUpper\n";
+	for(unsigned int i=0; i<Called.size(); i++){
+		long long count=-Called[i].first;
+		double lower, upper;
+		WilsonInterval(count, Total, &lower, &upper);
+		fout << Called[i].second << "\t" << count << "\t"
+				<< (double)count/Total << "\t"
+				<< lower << "\t" << upper << "\n";
+	}
+	fout.close();
+	return 0;
+}
+
+//
+// CountSiteAlleles
+// Given the counts of each haplotype, finds the major and minor alleles
+// at each site, i.e. the two most common bases other than N.
+void CountSiteAlleles(map<string, long long> *haplotypecounts, int numsites,
+		vector<SiteAlleles_t> *alleles){
+	string Bases="ACGT";
+	vector<long long> BaseCounts(numsites*4, 0);
+	for(map<string, long long>::iterator it=(*haplotypecounts).begin();
+			it!=(*haplotypecounts).end(); ++it){
+		for(int s=0; s<numsites; s++){
+			size_t b=Bases.find(it->first[s]);
+			if(b!=string::npos){
+				BaseCounts[s*4+b] += it->second;
+			}
+		}
+	}
+
+	(*alleles).assign(numsites, SiteAlleles_t());
+	for(int s=0; s<numsites; s++){
+		int major=-1;
+		int minor=-1;
+		for(int b=0; b<4; b++){
+			long long count=BaseCounts[s*4+b];
+			if(count==0){
+				continue;
+			}
+			if(major<0 || count>BaseCounts[s*4+major]){
+				minor=major;
+				major=b;
+			}
+			else if(minor<0 || count>BaseCounts[s*4+minor]){
+				minor=b;
+			}
+		}
+		if(major>=0){
+			(*alleles)[s].Major=Bases[major];
+		}
+		if(minor>=0){
+			(*alleles)[s].Minor=Bases[minor];
+		}
+	}
+}
+
+//
+// TallyLinkageTile
+// Given the bitsets of one tile of read pairs, in which bit j of a site
+// is set if read pair j is called as the major or minor allele (called)
+// or as the minor allele (minor) at that site, adds the counts of read
+// pairs called at both sites of each pair of sites to the linkage counts.
+// Each bitset holds TILEPAIRS bits, and the loop over its words is
+// branch-free so that the compiler can vectorize it.
+void TallyLinkageTile(vector<uint64_t> *called, vector<uint64_t> *minor,
+		int numsites, vector<LinkageCounts_t> *linkagecounts){
+	const int NumWords=TILEPAIRS/64;
+	for(int a=0; a<numsites; a++){
+		const uint64_t *CalledA=&(*called)[a*NumWords];
+		const uint64_t *MinorA=&(*minor)[a*NumWords];
+		for(int b=a+1; b<numsites; b++){
+			const uint64_t *CalledB=&(*called)[b*NumWords];
+			const uint64_t *MinorB=&(*minor)[b*NumWords];
+			long long Both=0;
+			long long Minor1=0;
+			long long Minor2=0;
+			long long MinorBoth=0;
+			for(int w=0; w<NumWords; w++){
+				Both += __builtin_popcountll(CalledA[w] & CalledB[w]);
+				Minor1 += __builtin_popcountll(MinorA[w] & CalledB[w]);
+				Minor2 += __builtin_popcountll(CalledA[w] & MinorB[w]);
+				MinorBoth += __builtin_popcountll(MinorA[w] & MinorB[w]);
+			}
+			LinkageCounts_t *counts=&(*linkagecounts)[a*numsites+b];
+			(*counts).Both += Both;
+			(*counts).Minor1 += Minor1;
+			(*counts).Minor2 += Minor2;
+			(*counts).MinorBoth += MinorBoth;
+		}
+	}
+}
+
+//
+// WriteLinkage
+// Computes the linkage disequilibrium between the minor alleles of each
+// pair of sites of interest, using the read pairs called as the major or
+// minor allele at both sites. Writes D, Lewontin's D' (signed),
+// and r^2 for each pair of sites, or NA where a site is not polymorphic
+// among those read pairs.
+// Returns 1 if the file cannot be written.
+int WriteLinkage(string filename, map<string, long long> *haplotypecounts,
+		vector<int> *querysites){
+	ofstream fout(filename.c_str(), ios::out);
+	if(!fout){
+		return 1;
+	}
+
+	int NumSites=(*querysites).size();
+	vector<SiteAlleles_t> Alleles;
+	CountSiteAlleles(haplotypecounts, NumSites, &Alleles);
+
+	// Pack the calls of each read pair into the site bitsets
+	// one tile of read pairs at a time.
+	const int NumWords=TILEPAIRS/64;
+	vector<uint64_t> Called(NumSites*NumWords, 0);
+	vector<uint64_t> Minor(NumSites*NumWords, 0);
+	vector<LinkageCounts_t> LinkageCounts(NumSites*NumSites);
+	vector<int> States(NumSites);
+	unsigned int TilePairs=0;
+	for(map<string, long long>::iterator it=(*haplotypecounts).begin();
+			it!=(*haplotypecounts).end(); ++it){
+
+		// Record the state of the haplotype at each site:
+		// 1 for the major allele, 2 for the minor allele, 0 otherwise.
+		for(int s=0; s<NumSites; s++){
+			char base=it->first[s];
+			States[s]=(base==Alleles[s].Major) ? 1 :
+					(base==Alleles[s].Minor) ? 2 : 0;
+		}
+
+		// Set the bits of each read pair with this haplotype.
+		for(long long c=0; c<it->second; c++){
+			uint64_t bit=1ULL << (TilePairs % 64);
+			int word=TilePairs/64;
+			for(int s=0; s<NumSites; s++){
+				if(States[s]>0){
+					Called[s*NumWords+word] |= bit;
+				}
+				if(States[s]==2){
+					Minor[s*NumWords+word] |= bit;
+				}
+			}
+			TilePairs++;
+			if(TilePairs==TILEPAIRS){
+				TallyLinkageTile(&Called, &Minor, NumSites, &LinkageCounts);
+				fill(Called.begin(), Called.end(), 0);
+				fill(Minor.begin(), Minor.end(), 0);
+				TilePairs=0;
+			}
+		}
+	}
+	if(TilePairs>0){
+		TallyLinkageTile(&Called, &Minor, NumSites, &LinkageCounts);
+	}
+
+	// Output the linkage statistics for each pair of sites.
+	// Sites are one-indexed, as in the input query file.
+	fout << "Site1\tSite2\tMajor1\tMinor1\tMajor2\tMinor2\tCount\tD\tDPrime\tR2\n";
+	for(int a=0; a<NumSites; a++){
+		for(int b=a+1; b<NumSites; b++){
+			LinkageCounts_t *counts=&LinkageCounts[a*NumSites+b];
+			fout << (*querysites)[a]+1 << "\t" << (*querysites)[b]+1 << "\t"
+					<< Alleles[a].Major << "\t" << Alleles[a].Minor << "\t"
+					<< Alleles[b].Major << "\t" << Alleles[b].Minor << "\t"
+					<< (*counts).Both << "\t";
+
+			// Frequencies of the minor alleles and of the haplotype
+			// carrying both minor alleles.
+			double n=(*counts).Both;
+			double p1=(n>0) ? (*counts).Minor1/n : 0;
+			double p2=(n>0) ? (*counts).Minor2/n : 0;
+			double p12=(n>0) ? (*counts).MinorBoth/n : 0;
+			if(p1<=0 || p1>=1 || p2<=0 || p2>=1){
+				fout << "NA\tNA\tNA\n";
+				continue;
+			}
+			double D=p12-p1*p2;
+			double DMax=(D>0) ? min(p1*(1-p2), (1-p1)*p2) :
+					min(p1*p2, (1-p1)*(1-p2));
+			double R2=D*D/(p1*(1-p1)*p2*(1-p2));
+			fout << D << "\t" << D/DMax << "\t" << R2 << "\n";
+		}
+	}
+	fout.close();
+	return 0;
+}
+
+//
+// CheckDownsampleParameters
+// Checks the downsampling mode and the number that goes with it.
+// Returns 1 if any argument conditions are violated.
+int CheckDownsampleParameters(){
+	if(DOWNSAMPLEMODE=="none"){
+		return 0;
+	}
+	if(DOWNSAMPLEMODE=="fraction"){
+		if(DOWNSAMPLEVALUE<=0 || DOWNSAMPLEVALUE>1){
+			printf("Invalid -N fraction of read pairs; must be in (0,1].\n");
+			return 1;
+		}
+	}
+	else if(DOWNSAMPLEMODE=="cap" || DOWNSAMPLEMODE=="window"){
+		if(DOWNSAMPLEVALUE<1){
+			printf("Invalid -N number for %s downsampling.\n",
+					DOWNSAMPLEMODE.c_str());
+			return 1;
+		}
+	}
+	else{
+		printf("Invalid -D downsampling mode.\n");
+		return 1;
+	}
+	if(DOWNSAMPLEWINDOW<=0){
+		printf("Invalid -W downsampling window.\n");
+		return 1;
+	}
+	return 0;
+}
+
+//
+// SetDownsampler
+// Sets the downsampler from the run parameters.
+void SetDownsampler(Downsampler_t *downsampler){
+	(*downsampler).Seed=DOWNSAMPLESEED;
+	(*downsampler).WindowSize=DOWNSAMPLEWINDOW;
+	if(DOWNSAMPLEMODE=="fraction"){
+		(*downsampler).Mode=DOWNSAMPLE_FRACTION;
+		(*downsampler).FractionThreshold=(DOWNSAMPLEVALUE>=1) ? UINT64_MAX :
+				(uint64_t) ((long double) DOWNSAMPLEVALUE*18446744073709551616.0L);
+	}
+	else if(DOWNSAMPLEMODE=="cap"){
+		(*downsampler).Mode=DOWNSAMPLE_CAP;
+		(*downsampler).Cap=(long long) DOWNSAMPLEVALUE;
+	}
+	else if(DOWNSAMPLEMODE=="window"){
+		(*downsampler).Mode=DOWNSAMPLE_WINDOW;
+		(*downsampler).PairsPerWindow=(long long) DOWNSAMPLEVALUE;
+	}
+}
+
+//
+// PrintDownsampleParameters
+// Prints the downsampling parameters, if reads are downsampled.
+void PrintDownsampleParameters(){
+	if(DOWNSAMPLEMODE=="none"){
+		return;
+	}
+	cout << "downsampling: " << DOWNSAMPLEMODE << " " << DOWNSAMPLEVALUE << endl;
+	if(DOWNSAMPLEMODE=="window"){
+		cout << "downsampling window: " << DOWNSAMPLEWINDOW << endl;
+	}
+	cout << "downsampling seed: " << DOWNSAMPLESEED << endl;
+}
+
+//
+// HashReadName
+// Hashes a read name with the given seed (64-bit FNV-1a,
+// followed by the SplitMix64 finalizer to mix the high bits).
+uint64_t HashReadName(const char *name, int length, uint64_t seed){
+	uint64_t hash=14695981039346656037ULL ^ seed;
+	for(int i=0; i<length; i++){
+		hash^=(unsigned char) name[i];
+		hash*=1099511628211ULL;
+	}
+	hash^=hash >> 30;
+	hash*=0xbf58476d1ce4e5b9ULL;
+	hash^=hash >> 27;
+	hash*=0x94d049bb133111ebULL;
+	hash^=hash >> 31;
+	return hash;
+}
+
+//
+// CIGARReferenceLength
+// Returns the number of reference positions covered by a CIGAR string.
+int CIGARReferenceLength(const char *cigar, int length){
+	int reflength=0;
+	int numbases=0;
+	for(int i=0; i<length; i++){
+		if(isdigit(cigar[i])){
+			numbases=numbases*10+(cigar[i]-'0');
+			continue;
+		}
+		if(strchr("MDN=X", cigar[i])!=NULL){
+			reflength+=numbases;
+		}
+		numbases=0;
+	}
+	return reflength;
+}
+
+//
+// PairWindow
+// Returns the window of the leftmost mate of a read pair,
+// which is the same for both mates. For mates on different chromosomes,
+// the window is that of the first mate.
+WindowKey_t PairWindow(SAMFields_t *fields, int windowsize){
+	string rname((*fields).Start[2], (*fields).Length[2]);
+	string rnext((*fields).Start[6], (*fields).Length[6]);
+	int flag=atoi((*fields).Start[1]);
+	int pos=atoi((*fields).Start[3]);
+	int pnext=atoi((*fields).Start[7]);
+	if(!(flag & 0x1)){
+		return WindowKey_t(rname, pos/windowsize);
+	}
+	if(rnext=="=" || rnext==rname){
+		int start=(pnext>0 && pnext<pos) ? pnext : pos;
+		return WindowKey_t(rname, start/windowsize);
+	}
+	if(flag & 0x80){
+		return WindowKey_t(rnext, pnext/windowsize);
+	}
+	return WindowKey_t(rname, pos/windowsize);
+}
+
+//
+// InitializeDownsampler
+// Prepares the downsampler for a run. In window mode, reads the whole
+// input once to find the hash of the last pair kept in each window,
+// counting each pair at its first mate, then returns to the start.
+// Returns 1 if the input cannot be read twice.
+int InitializeDownsampler(ifstream *in, Downsampler_t *downsampler){
+	if((*downsampler).Mode!=DOWNSAMPLE_WINDOW){
+		return 0;
+	}
+	streampos start=(*in).tellg();
+	if(start==(streampos) -1){
+		return 1;
+	}
+
+	// Keep the lowest hashes of each window in a max-heap.
+	map<WindowKey_t, vector<uint64_t> > lowest;
+	string line;
+	while(getline(*in, line)){
+		SAMFields_t fields;
+		if(line[0]=='@' || SplitSAMLine(line, &fields) < NUMSAMFIELDS){
+			continue;
+		}
+		int flag=atoi(fields.Start[1]);
+		if((flag & 0x900) || ((flag & 0x1) && !(flag & 0x40))){
+			continue;
+		}
+		vector<uint64_t> *heap=&lowest[PairWindow(&fields,
+				(*downsampler).WindowSize)];
+		uint64_t hash=HashReadName(fields.Start[0], fields.Length[0],
+				(*downsampler).Seed);
+		if((long long) (*heap).size() < (*downsampler).PairsPerWindow){
+			(*heap).push_back(hash);
+			push_heap((*heap).begin(), (*heap).end());
+		}
+		else if(hash < (*heap).front()){
+			pop_heap((*heap).begin(), (*heap).end());
+			(*heap).back()=hash;
+			push_heap((*heap).begin(), (*heap).end());
+		}
+	}
+
+	// Windows with no more pairs than the limit keep all of their pairs.
+	(*downsampler).WindowThresholds.clear();
+	for(map<WindowKey_t, vector<uint64_t> >::iterator it=lowest.begin();
+			it!=lowest.end(); ++it){
+		(*downsampler).WindowThresholds[it->first]=
+				((long long) it->second.size() < (*downsampler).PairsPerWindow) ?
+				UINT64_MAX : it->second.front();
+	}
+
+	(*in).clear();
+	(*in).seekg(start);
+	return 0;
+}
+
+//
+// KeepRead
+// Decides whether to keep an alignment line, using only its SAM fields
+// and, in coverage cap mode, the pairs kept so far.
+// Every line of a pair gets the same decision.
+// In coverage cap mode, the first primary line of a pair decides for the
+// pair, based on the coverage over its fragment: from the leftmost mate
+// to the end of the rightmost mate, taking the mate to be as long as the
+// read. The primary lines of kept pairs then add to the coverage.
+bool KeepRead(SAMFields_t *fields, Downsampler_t *downsampler){
+	if((*downsampler).Mode==DOWNSAMPLE_NONE){
+		return true;
+	}
+	(*downsampler).NumLines++;
+
+	bool keep=true;
+	uint64_t hash=HashReadName((*fields).Start[0], (*fields).Length[0],
+			(*downsampler).Seed);
+	if((*downsampler).Mode==DOWNSAMPLE_FRACTION){
+		keep=(hash < (*downsampler).FractionThreshold);
+	}
+	else if((*downsampler).Mode==DOWNSAMPLE_WINDOW){
+		map<WindowKey_t, uint64_t>::iterator it=
+				(*downsampler).WindowThresholds.find(
+						PairWindow(fields, (*downsampler).WindowSize));
+		keep=(it==(*downsampler).WindowThresholds.end() || hash <= it->second);
+	}
+	else{
+		int flag=atoi((*fields).Start[1]);
+		string qname((*fields).Start[0], (*fields).Length[0]);
+		string rname((*fields).Start[2], (*fields).Length[2]);
+		int pos=atoi((*fields).Start[3])-1;
+		int reflength=(flag & 0x4) ? (*fields).Length[9] :
+				CIGARReferenceLength((*fields).Start[5], (*fields).Length[5]);
+		bool primary=!(flag & 0x900);
+
+		// Look up the decision for the pair, if one has been made.
+		unordered_map<string, PairDecision_t>::iterator it=
+				(*downsampler).Decisions.find(qname);
+		if(it!=(*downsampler).Decisions.end()){
+			keep=it->second.Keep;
+			if(primary && ++it->second.NumPrimary==2){
+				(*downsampler).Decisions.erase(it);
+			}
+		}
+		else if(primary){
+
+			// Find the fragment of the pair on this chromosome.
+			int fragstart=pos;
+			int fragend=pos+reflength;
+			string rnext((*fields).Start[6], (*fields).Length[6]);
+			int pnext=atoi((*fields).Start[7])-1;
+			if((flag & 0x1) && pnext>=0 && (rnext=="=" || rnext==rname)){
+				fragstart=min(pos, pnext);
+				fragend=max(pos, pnext)+reflength;
+			}
+
+			// Keep the pair unless every position is already at the cap.
+			vector<long long> *depth=&(*downsampler).Depth[rname];
+			keep=(fragend<=fragstart || fragstart<0);
+			for(int i=max(fragstart, 0); i<fragend && !keep; i++){
+				keep=(i>=(int) (*depth).size() || (*depth)[i] < (*downsampler).Cap);
+			}
+
+			// Hold the decision for the mate.
+			if((flag & 0x1)){
+				PairDecision_t decision;
+				decision.Keep=keep;
+				decision.NumPrimary=1;
+				(*downsampler).Decisions[qname]=decision;
+			}
+		}
+
+		// Add the primary mapped lines of kept pairs to the coverage.
+		if(keep && primary && !(flag & 0x4) && pos>=0 && reflength>0){
+			vector<long long> *depth=&(*downsampler).Depth[rname];
+			if((int) (*depth).size() < pos+reflength){
+				(*depth).resize(pos+reflength, 0);
+			}
+			for(int i=pos; i<pos+reflength; i++){
+				(*depth)[i]++;
+			}
+		}
+	}
+
+	if(!keep){
+		(*downsampler).NumRemoved++;
+	}
+	return keep;
+}
@@ -0,0 +1,1048 @@
+//============================================================================
+// Name        : FrequencyMatrix.cpp
+// Version     : 1.2
+// Description : 1.2 Read binary pileups that also carry histograms.
+//           1.1 Read sparse summaries from SummarizeBAM, taking the
+//               coverage of each position from its depth row.
+//           1.0 Build a dense sample x genome position x base matrix
+//               of base frequencies from the pileups of many samples,
+//               stored in a file that can be memory-mapped, and query it
+//               for longitudinal and parallel variable sites with scans
+//               over contiguous arrays instead of table joins.
+//============================================================================
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// RUN PARAMETERS
+string MODE="";
+string REFFASTA="";
+string OUTFILE="";
+vector<string> INFILES;
+string MATRIXFILE="";
+string SAMPLEFILTER="";
+float MINFREQ=0.05;
+long long MINCOVERAGE=200;
+int MINSAMPLES=1;
+int MINPATIENTS=1;
+
+bool DEBUG=false;
+
+// Bases are stored in the matrix by their 2-bit code,
+// so that BASES[code] gives the base.
+const char BASES[4]={'A','C','G','T'};
+const int NUMBASES=4;
+
+// Identifiers at the start of binary pileups written by SummarizeBAM
+// and of frequency matrices.
+const char PILEUPMAGIC[8]={'S','B','P','I','L','E','U','P'};
+const long long PILEUPFORMAT=1;
+const long long PILEUPHISTOGRAMFORMAT=2;
+const char MATRIXMAGIC[8]={'S','B','F','R','E','Q','M','X'};
+const long long MATRIXFORMAT=1;
+
+// Rows of the frequency matrix are padded to a multiple of this many
+// floats, so that every row starts on a 64-byte boundary.
+const long long ROWALIGN=16;
+
+// Layout of a frequency matrix file. All sections start at the offsets
+// given in the header, which are multiples of 64 bytes:
+//   MatrixHeader_t
+//   MatrixSample_t[NumSamples]
+//   MatrixReference_t[NumReferences]
+//   float Frequency[NumSamples][RowStride], where the frequency of base b
+//     at genome position p (0-indexed) is at p*NUMBASES+b
+//   long long Coverage[NumSamples][NumPositions]
+// Samples are sorted by patient, timepoint, site, aliquot, and replicate.
+struct MatrixHeader_t{
+	char Magic[8];
+	long long Format;
+	long long NumSamples;
+	long long NumReferences;
+	long long NumPositions;
+	long long NumBases;
+	long long RowStride;
+	long long SampleOffset;
+	long long ReferenceOffset;
+	long long FrequencyOffset;
+	long long CoverageOffset;
+	long long Reserved[5];
+};
+
+// Sample information parsed from the sample name,
+// following AlignSummarizeAnnotate.sh.
+struct MatrixSample_t{
+	char Name[32];
+	char Patient[8];
+	char Site[8];
+	char Aliquot[4];
+	int Timepoint;
+	int Replicate;
+	int Reserved;
+};
+
+// A reference sequence and its first 0-indexed genome position.
+struct MatrixReference_t{
+	char Name[48];
+	long long GenomeStart;
+	long long Length;
+};
+
+// Input file for one sample, with the information parsed from its name.
+struct InputSample_t{
+	string FileName;
+	MatrixSample_t Sample;
+};
+
+// A frequency matrix opened for queries.
+// The arrays point into the memory-mapped file.
+struct FrequencyMatrix_t{
+	const MatrixHeader_t *Header=NULL;
+	const MatrixSample_t *Samples=NULL;
+	const MatrixReference_t *References=NULL;
+	const float *Frequency=NULL;
+	const long long *Coverage=NULL;
+	void *Data=NULL;
+	size_t Size=0;
+	vector<char> Buffer;
+};
+
+// Replicate samples of one timepoint, site, and aliquot of a patient.
+struct ReplicatePair_t{
+	int First=-1;
+	int Second=-1;
+};
+
+
+// FUNCTIONS
+int ArgsParse(int argc, char *argv[]);
+int BuildArgsParse(int argc, char *argv[]);
+int QueryArgsParse(int argc, char *argv[]);
+void PrintUsage();
+void PrintParameters();
+void SetDebug();
+int ReadMultiFasta(string filename,
+		vector<string> *sequencenames,
+		vector<string> *sequences);
+vector<string> StringSplit(string s, char c);
+void CopyField(char *field, size_t size, string value);
+int ParseSampleName(string filename, MatrixSample_t *sample);
+bool SampleLess(const InputSample_t &a, const InputSample_t &b);
+long long ReadInt64(ifstream *in);
+string ReadString(ifstream *in);
+int ReadSampleCounts(string filename, vector<string> *refnames,
+		vector<long long> *refstarts, long long numpositions,
+		vector<long long> *counts, vector<long long> *coverage);
+int BuildMatrix();
+int OpenMatrix(string filename, FrequencyMatrix_t *matrix);
+void CloseMatrix(FrequencyMatrix_t *matrix);
+int QueryMatrix();
+
+int main(int argc, char *argv[]) {
+
+	//==================================================
+	// Parse command-line arguments.
+	//==================================================
+
+	if(ArgsParse(argc, argv) != 0){
+		PrintUsage();
+		return 1;
+	}
+
+	PrintParameters();
+
+	if(MODE=="build"){
+		return BuildMatrix();
+	}
+	return QueryMatrix();
+}
+
+// ArgsParse
+// Parses command-line arguments.
+// The first argument names the mode, build or query.
+// Returns 1 if any argument conditions are violated.
+int ArgsParse(int argc, char *argv[]){
+
+	// If the only argument is debug,
+	// set all parameters to the debug state.
+	if(argc==2 && strcmp(argv[1],"debug")==0){
+		SetDebug();
+		return 0;
+	}
+
+	if(argc>=2 && strcmp(argv[1],"build")==0){
+		MODE="build";
+		return BuildArgsParse(argc, argv);
+	}
+	if(argc>=2 && strcmp(argv[1],"query")==0){
+		MODE="query";
+		return QueryArgsParse(argc, argv);
+	}
+
+	printf("Invalid arguments. Specify build or query.\n");
+	return 1;
+}
+
+// BuildArgsParse
+// Parses command-line arguments for build mode,
+// in which every argument that does not follow a flag is an input file.
+// Returns 1 if any argument conditions are violated.
+int BuildArgsParse(int argc, char *argv[]){
+
+	for(int i=2; i<argc; i++){
+
+		// Store arguments that are not flags as input files.
+		if(argv[i][0] != '-'){
+			INFILES.push_back(argv[i]);
+			continue;
+		}
+
+		// Verify that each flag is followed by a value.
+		if(strlen(argv[i])!=2 || i+1>=argc){
+			printf("Invalid use of argument flags.\n");
+			return 1;
+		}
+		string arg=argv[i+1];
+		i++;
+
+		// Parse the flag string.
+		switch(argv[i-1][1]){
+		// -f reference FASTA
+		case 'f':
+			REFFASTA = arg;
+			break;
+		// -o output frequency matrix
+		case 'o':
+			OUTFILE = arg;
+			break;
+		default:
+			printf("Invalid flag for build mode.\n");
+			return 1;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(INFILES.size()==0){
+		printf("Invalid arguments. Specify sample pileups.\n");
+		return 1;
+	}
+	if(REFFASTA==""){
+		printf("Invalid arguments. Specify reference sequence.\n");
+		return 1;
+	}
+	if(OUTFILE==""){
+		printf("Invalid arguments. Specify output file.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// QueryArgsParse
+// Parses command-line arguments for query mode.
+// Returns 1 if any argument conditions are violated.
+int QueryArgsParse(int argc, char *argv[]){
+
+	// Ensure that there are an even number of arguments,
+	// leaving aside the program name and mode.
+	if((argc - 2) % 2 != 0){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+
+	// Parse each pair of arguments.
+	for(int i=2; i<argc; i+=2){
+
+		if(argv[i][0] != '-' || strlen(argv[i])!=2){
+			printf("Invalid use of argument flags.\n");
+			return 1;
+		}
+		string arg=argv[i+1];
+
+		// Parse the flag string.
+		switch(argv[i][1]){
+		// -i input frequency matrix
+		case 'i':
+			MATRIXFILE = arg;
+			break;
+		// -o output variable sites
+		case 'o':
+			OUTFILE = arg;
+			break;
+		// -x list of high-quality patients and timepoints
+		case 'x':
+			SAMPLEFILTER = arg;
+			break;
+		// -f minimum frequency
+		case 'f':
+			MINFREQ = atof(arg.c_str());
+			break;
+		// -c minimum coverage
+		case 'c':
+			MINCOVERAGE = atoll(arg.c_str());
+			break;
+		// -n minimum number of samples per patient
+		case 'n':
+			MINSAMPLES = atoi(arg.c_str());
+			if(MINSAMPLES < 1){
+				printf("Invalid -n minimum number of samples.\n");
+				return 1;
+			}
+			break;
+		// -p minimum number of patients
+		case 'p':
+			MINPATIENTS = atoi(arg.c_str());
+			if(MINPATIENTS < 1){
+				printf("Invalid -p minimum number of patients.\n");
+				return 1;
+			}
+			break;
+		default:
+			printf("Invalid flag for query mode.\n");
+			return 1;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(MATRIXFILE==""){
+		printf("Invalid arguments. Specify frequency matrix.\n");
+		return 1;
+	}
+	if(OUTFILE==""){
+		printf("Invalid arguments. Specify output file.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// PrintParameters
+// When called, prints the parameters for the run.
+void PrintParameters(){
+	cout << "RUN PARAMETERS" << endl;
+	cout << "mode: " << MODE << endl;
+	if(MODE=="build"){
+		cout << "reference: " << REFFASTA << endl;
+		cout << "number of samples: " << INFILES.size() << endl;
+		cout << "output file: " << OUTFILE << endl;
+		cout << endl;
+		return;
+	}
+	cout << "frequency matrix: " << MATRIXFILE << endl;
+	if(SAMPLEFILTER != ""){
+		cout << "high-quality samples: " << SAMPLEFILTER << endl;
+	}
+	cout << "output file: " << OUTFILE << endl;
+	cout << "minimum frequency: " << MINFREQ << endl;
+	cout << "minimum coverage: " << MINCOVERAGE << endl;
+	cout << "minimum samples per patient: " << MINSAMPLES << endl;
+	cout << "minimum patients: " << MINPATIENTS << endl;
+	cout << endl;
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: FrequencyMatrix build -f ref.fasta -o out.fmx in1 in2 ...\n");
+	printf("Builds a frequency matrix from one pileup per sample, either a\n"
+			"binary pileup (SummarizeBAM -b) or a dense or sparse text summary.\n"
+			"Samples are named by their file names, e.g. A00A-NW-1.summary,\n"
+			"which are parsed for the patient, timepoint, aliquot, site,\n"
+			"and replicate as in AlignSummarizeAnnotate.sh.\n");
+	printf("\n");
+	printf("Usage: FrequencyMatrix query -i in.fmx -o out.txt\n");
+	printf("Lists sites at which a base other than the consensus of the\n"
+			"first timepoint is called as a variant in both replicates of a sample.\n");
+	printf("  -x FILE\tuse only the Patient Timepoint pairs listed in FILE\n");
+	printf("  -f FLOAT\tcall variants above this frequency [0.05]\n");
+	printf("  -c INT\tcall variants above this coverage [200]\n");
+	printf("  -n INT\tminimum number of samples in which a patient's\n"
+			"\t\tvariant is called [1]\n");
+	printf("  -p INT\tminimum number of patients in which a variant is called [1]\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	MODE="query";
+	MATRIXFILE="matrix.test";
+	OUTFILE="out.test";
+	DEBUG=true;
+}
+
+// ReadMultiFasta
+// Given a file name for a FASTA file containing multiple sequences,
+// as well as a location to store multiple sequences,
+// reads in the sequences as multiple strings to the given location
+// and returns the FASTA header names as a vector of strings.
+// Returns 1 if the file does not exist.
+int ReadMultiFasta(string filename,
+		vector<string> *sequencenames,
+		vector<string> *sequences){
+
+	// Open the file.
+	ifstream f_in(filename.c_str(), ios::in);
+
+	string line;
+	string header;
+	string sequence;
+	int numsequences=0;
+
+	if(f_in){
+		// Read in the file line by line,
+		// storing lines that begin with '>' as the sequence name
+		while(getline(f_in, line)){
+
+			if(line[0] == '>') {
+				if(numsequences != 0){
+					(*sequences).push_back(sequence);
+				}
+				numsequences += 1;
+				sequence = "";
+				// Store the first word of the sequence name,
+				// with the > character removed.
+				(*sequencenames).push_back(
+						StringSplit(StringSplit(line,' ')[0],'>')[0]);
+				continue;
+			}
+			sequence += line;
+		}
+		(*sequences).push_back(sequence);
+	}
+	else{
+		return 1;
+	}
+
+	// Close the file.
+	f_in.close();
+
+	return 0;
+
+}
+
+//
+// StringSplit
+// Takes in a string and a character delimiter
+// and returns a vector of strings split at that character.
+vector<string> StringSplit(string s, char c){
+	vector<string> splits;
+	string s0;
+	unsigned int i=0;
+
+	while(i < s.length()){
+		// Skip through delimiter characters at the beginnings of lines.
+		while(s[i] == c && i < s.length() - 1){
+			i++;
+		}
+		// Iterate through actual characters until you encounter c.
+		while(i < s.length() && s[i] != c){
+			s0 += s[i];
+			i++;
+		}
+		// Once c is encountered, stop and save the string, then reset it.
+		if(s0.size() > 0){
+			splits.push_back(s0);
+			s0 = "";
+		}
+		i++;
+	}
+
+	return splits;
+}
+
+// CopyField
+// Copies a string into a fixed-size, null-terminated field.
+void CopyField(char *field, size_t size, string value){
+	memset(field, 0, size);
+	memcpy(field, value.c_str(), min(value.size(), size-1));
+}
+
+// ParseSampleName
+// Parses the sample name from a file name, dropping the directory,
+// every extension, and an -annotated suffix,
+// and then parses the sample name as AlignSummarizeAnnotate.sh does:
+// e.g. A00A-NW-1 is patient A, timepoint 0, aliquot A, site NW, replicate 1.
+// Returns 1 if the name is too short to parse.
+int ParseSampleName(string filename, MatrixSample_t *sample){
+
+	string name=filename.substr(filename.find_last_of("/\\")+1);
+	name=name.substr(0, name.find('.'));
+	if(name.size()>10 && name.substr(name.size()-10)=="-annotated"){
+		name=name.substr(0, name.size()-10);
+	}
+	if(name.size() < 8){
+		return 1;
+	}
+
+	memset(sample, 0, sizeof(MatrixSample_t));
+	CopyField((*sample).Name, sizeof((*sample).Name), name);
+	CopyField((*sample).Patient, sizeof((*sample).Patient), name.substr(0,1));
+	(*sample).Timepoint=atoi(name.substr(1,2).c_str());
+	CopyField((*sample).Aliquot, sizeof((*sample).Aliquot), name.substr(3,1));
+	CopyField((*sample).Site, sizeof((*sample).Site), name.substr(5,2));
+	(*sample).Replicate=atoi(name.substr(name.size()-1).c_str());
+
+	// Set separate names for the control samples.
+	if(name.find("PLASMID")!=string::npos || name.find("WSN")!=string::npos){
+		CopyField((*sample).Patient, sizeof((*sample).Patient),
+				name.find("PLASMID")!=string::npos ? "PLASMID" : "WSN");
+		(*sample).Timepoint=0;
+		CopyField((*sample).Site, sizeof((*sample).Site), "CL");
+		CopyField((*sample).Aliquot, sizeof((*sample).Aliquot), "A");
+	}
+	return 0;
+}
+
+// SampleLess
+// Orders samples by patient, timepoint, site, aliquot, and replicate.
+bool SampleLess(const InputSample_t &a, const InputSample_t &b){
+	int c=strcmp(a.Sample.Patient, b.Sample.Patient);
+	if(c!=0) return c<0;
+	if(a.Sample.Timepoint!=b.Sample.Timepoint){
+		return a.Sample.Timepoint<b.Sample.Timepoint;
+	}
+	c=strcmp(a.Sample.Site, b.Sample.Site);
+	if(c!=0) return c<0;
+	c=strcmp(a.Sample.Aliquot, b.Sample.Aliquot);
+	if(c!=0) return c<0;
+	return a.Sample.Replicate<b.Sample.Replicate;
+}
+
+//
+// ReadInt64
+// Reads a 64-bit integer from a binary file.
+long long ReadInt64(ifstream *in){
+	long long value=0;
+	(*in).read((char *) &value, sizeof(value));
+	return value;
+}
+
+//
+// ReadString
+// Reads a length-prefixed string from a binary file.
+string ReadString(ifstream *in){
+	long long length=ReadInt64(in);
+	if(!(*in) || length<0 || length>(1<<30)){
+		(*in).setstate(ios::failbit);
+		return "";
+	}
+	string value(length, ' ');
+	if(length>0){
+		(*in).read(&value[0], length);
+	}
+	return value;
+}
+
+// ReadSampleCounts
+// Reads the base counts of one sample into counts,
+// indexed by genome position*NUMBASES + base code,
+// and the coverage of each genome position into coverage.
+// The file may be a binary pileup written by SummarizeBAM -b,
+// whose reference sequences must match the given ones
+// and whose histograms, if any, are not read,
+// or a text summary, in which lines repeated by annotation are read once.
+// The coverage of a sparse summary is read from its depth rows, so that it
+// includes bases below the floors for base rows; otherwise it is the sum
+// of the base counts.
+// Returns 1 if the file cannot be read.
+int ReadSampleCounts(string filename, vector<string> *refnames,
+		vector<long long> *refstarts, long long numpositions,
+		vector<long long> *counts, vector<long long> *coverage){
+
+	(*counts).assign(numpositions*NUMBASES, 0);
+	(*coverage).assign(numpositions, 0);
+
+	ifstream in(filename.c_str(), ios::in | ios::binary);
+	if(!in){
+		return 1;
+	}
+
+	// Identify the type of file from its first bytes.
+	char magic[sizeof(PILEUPMAGIC)];
+	in.read(magic, sizeof(magic));
+	if(in && memcmp(magic, PILEUPMAGIC, sizeof(magic))==0){
+		long long format=ReadInt64(&in);
+		if((format!=PILEUPFORMAT && format!=PILEUPHISTOGRAMFORMAT) ||
+				ReadInt64(&in)!=(long long) (*refnames).size()){
+			return 1;
+		}
+		vector<long long> lengths((*refnames).size());
+		for(unsigned int i=0; i<(*refnames).size(); i++){
+			string name=ReadString(&in);
+			lengths[i]=ReadInt64(&in);
+			long long end=(i+1<(*refnames).size()) ?
+					(*refstarts)[i+1] : numpositions;
+			if(!in || name!=(*refnames)[i] || lengths[i]!=end-(*refstarts)[i]){
+				return 1;
+			}
+		}
+
+		// Each position stores a count, total quality, and total read
+		// position for each base, followed by the coverage of each position.
+		for(unsigned int i=0; i<(*refnames).size(); i++){
+			vector<long long> summary(lengths[i]*NUMBASES*3);
+			in.read((char *) &summary[0], summary.size()*sizeof(long long));
+			in.seekg(lengths[i]*sizeof(long long), ios::cur);
+			if(!in){
+				return 1;
+			}
+			for(long long j=0; j<lengths[i]*NUMBASES; j++){
+				(*counts)[(*refstarts)[i]*NUMBASES+j]=summary[3*j];
+				(*coverage)[(*refstarts)[i]+j/NUMBASES]+=summary[3*j];
+			}
+		}
+		return 0;
+	}
+
+	// Otherwise, read a text summary line by line.
+	in.close();
+	ifstream fin(filename.c_str(), ios::in);
+	map<string, int> refindex;
+	for(unsigned int i=0; i<(*refnames).size(); i++){
+		refindex[(*refnames)[i]]=i;
+	}
+	string line;
+	bool sparse=false;
+	while(getline(fin, line)){
+
+		// Skip the header of a sparse summary.
+		if(line[0]=='#'){
+			sparse=sparse || line=="#Format=sparse";
+			continue;
+		}
+		vector<string> fields=StringSplit(line,'\t');
+		if(fields.size()<6){
+			return 1;
+		}
+		map<string, int>::iterator it=refindex.find(fields[0]);
+		bool depth=(fields[2]=="*");
+		const char *base=(const char *) memchr(BASES, fields[2][0], NUMBASES);
+		if(it==refindex.end() || ((base==NULL || fields[2].size()!=1) && !depth)){
+			return 1;
+		}
+		long long pos=(*refstarts)[it->second]+atoi(fields[1].c_str())-1;
+		long long end=(it->second+1<(int) (*refnames).size()) ?
+				(*refstarts)[it->second+1] : numpositions;
+		if(pos<(*refstarts)[it->second] || pos>=end){
+			return 1;
+		}
+		if(depth){
+			(*coverage)[pos]=atoll(fields[5].c_str());
+			continue;
+		}
+		(*counts)[pos*NUMBASES+(base-BASES)]=atoll(fields[5].c_str());
+	}
+	if(!sparse){
+		for(long long p=0; p<numpositions; p++){
+			for(int b=0; b<NUMBASES; b++){
+				(*coverage)[p]+=(*counts)[p*NUMBASES+b];
+			}
+		}
+	}
+	return 0;
+}
+
+// BuildMatrix
+// Reads the pileup of each sample and writes the frequency matrix.
+// Samples are written one at a time, so only the counts and coverage
+// of one sample are held in memory.
+// Returns 1 if an input cannot be read.
+int BuildMatrix(){
+
+	//==================================================
+	// Read in reference sequence.
+	//==================================================
+
+	printf("Reading reference.\n");
+	vector<string> RefNames;
+	vector<string> RefSequences;
+	if(ReadMultiFasta(REFFASTA,&RefNames, &RefSequences) != 0){
+		printf("Error: reference sequence does not exist.\n");
+		return 1;
+	}
+	vector<long long> RefStarts;
+	long long NumPositions=0;
+	for(unsigned int i=0; i<RefSequences.size(); i++){
+		RefStarts.push_back(NumPositions);
+		NumPositions+=RefSequences[i].size();
+	}
+
+	//==================================================
+	// Parse and sort the samples.
+	//==================================================
+
+	vector<InputSample_t> Inputs;
+	for(unsigned int i=0; i<INFILES.size(); i++){
+		InputSample_t input;
+		input.FileName=INFILES[i];
+		if(ParseSampleName(INFILES[i], &input.Sample) != 0){
+			printf("Error: cannot parse sample name from %s.\n", INFILES[i].c_str());
+			return 1;
+		}
+		Inputs.push_back(input);
+	}
+	stable_sort(Inputs.begin(), Inputs.end(), SampleLess);
+
+	//==================================================
+	// Write the header, samples, and references.
+	//==================================================
+
+	MatrixHeader_t Header;
+	memset(&Header, 0, sizeof(Header));
+	memcpy(Header.Magic, MATRIXMAGIC, sizeof(MATRIXMAGIC));
+	Header.Format=MATRIXFORMAT;
+	Header.NumSamples=Inputs.size();
+	Header.NumReferences=RefNames.size();
+	Header.NumPositions=NumPositions;
+	Header.NumBases=NUMBASES;
+	Header.RowStride=(NumPositions*NUMBASES+ROWALIGN-1)/ROWALIGN*ROWALIGN;
+	Header.SampleOffset=sizeof(MatrixHeader_t);
+	Header.ReferenceOffset=Header.SampleOffset+
+			Header.NumSamples*sizeof(MatrixSample_t);
+	Header.FrequencyOffset=(Header.ReferenceOffset+
+			Header.NumReferences*sizeof(MatrixReference_t)+63)/64*64;
+	Header.CoverageOffset=Header.FrequencyOffset+
+			Header.NumSamples*Header.RowStride*sizeof(float);
+
+	ofstream fout(OUTFILE.c_str(), ios::out | ios::binary);
+	if(!fout){
+		printf("Error: could not open output file.\n");
+		return 1;
+	}
+	fout.write((const char *) &Header, sizeof(Header));
+	for(unsigned int i=0; i<Inputs.size(); i++){
+		fout.write((const char *) &Inputs[i].Sample, sizeof(MatrixSample_t));
+	}
+	for(unsigned int i=0; i<RefNames.size(); i++){
+		MatrixReference_t reference;
+		memset(&reference, 0, sizeof(reference));
+		CopyField(reference.Name, sizeof(reference.Name), RefNames[i]);
+		reference.GenomeStart=RefStarts[i];
+		reference.Length=RefSequences[i].size();
+		fout.write((const char *) &reference, sizeof(reference));
+	}
+	vector<char> Padding(Header.FrequencyOffset-(long long) fout.tellp(), 0);
+	fout.write(&Padding[0], Padding.size());
+
+	//==================================================
+	// Write the frequencies of each sample, and then its coverage.
+	//==================================================
+
+	// The coverage section follows all of the frequencies, so each
+	// sample's coverage is written at its place in that section and
+	// the file position is then returned to the next frequency row.
+	vector<long long> Coverage;
+	vector<long long> Counts;
+	vector<float> Row(Header.RowStride, 0);
+	for(unsigned int s=0; s<Inputs.size(); s++){
+		printf("Reading %s as sample %s.\n", Inputs[s].FileName.c_str(),
+				Inputs[s].Sample.Name);
+		if(ReadSampleCounts(Inputs[s].FileName, &RefNames, &RefStarts,
+				NumPositions, &Counts, &Coverage) != 0){
+			printf("Error: cannot read pileup %s.\n", Inputs[s].FileName.c_str());
+			return 1;
+		}
+		for(long long p=0; p<NumPositions; p++){
+			long long coverage=Coverage[p];
+			for(int b=0; b<NUMBASES; b++){
+				Row[p*NUMBASES+b]=(coverage>0) ?
+						(float) Counts[p*NUMBASES+b]/coverage : 0;
+			}
+		}
+		fout.write((const char *) &Row[0], Row.size()*sizeof(float));
+		fout.seekp(Header.CoverageOffset+s*NumPositions*sizeof(long long));
+		fout.write((const char *) &Coverage[0], NumPositions*sizeof(long long));
+		fout.seekp(Header.FrequencyOffset+(s+1)*Header.RowStride*sizeof(float));
+	}
+
+	if(!fout){
+		printf("Error writing frequency matrix.\n");
+		return 1;
+	}
+	fout.close();
+
+	printf("Wrote %lld samples x %lld positions.\n",
+			Header.NumSamples, Header.NumPositions);
+	return 0;
+}
+
+// OpenMatrix
+// Maps a frequency matrix file into memory, or reads it in where
+// memory mapping is unavailable, and checks its header.
+// Returns 1 if the file is missing or invalid.
+int OpenMatrix(string filename, FrequencyMatrix_t *matrix){
+
+	const char *data=NULL;
+#ifndef _WIN32
+	int fd=open(filename.c_str(), O_RDONLY);
+	if(fd<0){
+		return 1;
+	}
+	struct stat st;
+	if(fstat(fd, &st)!=0 || st.st_size < (off_t) sizeof(MatrixHeader_t)){
+		close(fd);
+		return 1;
+	}
+	(*matrix).Size=st.st_size;
+	(*matrix).Data=mmap(NULL, (*matrix).Size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if((*matrix).Data==MAP_FAILED){
+		(*matrix).Data=NULL;
+		return 1;
+	}
+	data=(const char *) (*matrix).Data;
+#else
+	ifstream in(filename.c_str(), ios::in | ios::binary);
+	if(!in){
+		return 1;
+	}
+	in.seekg(0, ios::end);
+	(*matrix).Size=in.tellg();
+	in.seekg(0);
+	if((*matrix).Size < sizeof(MatrixHeader_t)){
+		return 1;
+	}
+	(*matrix).Buffer.resize((*matrix).Size);
+	in.read(&(*matrix).Buffer[0], (*matrix).Size);
+	data=&(*matrix).Buffer[0];
+#endif
+
+	const MatrixHeader_t *header=(const MatrixHeader_t *) data;
+	if(memcmp((*header).Magic, MATRIXMAGIC, sizeof(MATRIXMAGIC))!=0 ||
+			(*header).Format!=MATRIXFORMAT || (*header).NumBases!=NUMBASES ||
+			(*header).CoverageOffset+(*header).NumSamples*(*header).NumPositions*
+			(long long) sizeof(long long) > (long long) (*matrix).Size){
+		return 1;
+	}
+	(*matrix).Header=header;
+	(*matrix).Samples=(const MatrixSample_t *) (data+(*header).SampleOffset);
+	(*matrix).References=(const MatrixReference_t *) (data+(*header).ReferenceOffset);
+	(*matrix).Frequency=(const float *) (data+(*header).FrequencyOffset);
+	(*matrix).Coverage=(const long long *) (data+(*header).CoverageOffset);
+	return 0;
+}
+
+// CloseMatrix
+// Releases a frequency matrix opened with OpenMatrix.
+void CloseMatrix(FrequencyMatrix_t *matrix){
+#ifndef _WIN32
+	if((*matrix).Data!=NULL){
+		munmap((*matrix).Data, (*matrix).Size);
+	}
+#endif
+	(*matrix).Data=NULL;
+	(*matrix).Buffer.clear();
+}
+
+// QueryMatrix
+// For each patient, determines the consensus base at each position in the
+// first replicate of the first timepoint, and counts the samples in which
+// each other base is above MINFREQ in both replicates, with both replicates
+// above MINCOVERAGE, as CallLongitudinalVariants.R does.
+// Sites called in at least MINSAMPLES samples of a patient are written
+// if they are called in at least MINPATIENTS patients.
+// Each step is a branch-free pass over contiguous arrays,
+// which the compiler vectorizes.
+// Returns 1 if an input cannot be read.
+int QueryMatrix(){
+
+	FrequencyMatrix_t Matrix;
+	if(OpenMatrix(MATRIXFILE, &Matrix) != 0){
+		printf("Error: cannot open frequency matrix %s.\n", MATRIXFILE.c_str());
+		return 1;
+	}
+	long long NumSamples=(*Matrix.Header).NumSamples;
+	long long NumPositions=(*Matrix.Header).NumPositions;
+	long long RowStride=(*Matrix.Header).RowStride;
+	long long NumCells=NumPositions*NUMBASES;
+
+	// Read in the patient timepoints to keep, if given.
+	set<pair<string, int> > KeepTimepoints;
+	if(SAMPLEFILTER != ""){
+		ifstream fin(SAMPLEFILTER.c_str(), ios::in);
+		if(!fin){
+			printf("Error: cannot read %s.\n", SAMPLEFILTER.c_str());
+			return 1;
+		}
+		string line;
+		getline(fin, line);
+		while(getline(fin, line)){
+			vector<string> fields=StringSplit(line,' ');
+			if(fields.size()>=2){
+				KeepTimepoints.insert(make_pair(fields[0], atoi(fields[1].c_str())));
+			}
+		}
+	}
+
+	// Group the samples by patient, in the sorted order of the matrix.
+	vector<string> Patients;
+	vector<vector<int> > PatientSamples;
+	for(long long s=0; s<NumSamples; s++){
+		const MatrixSample_t *sample=&Matrix.Samples[s];
+		if(SAMPLEFILTER != "" && KeepTimepoints.count(
+				make_pair(string((*sample).Patient), (*sample).Timepoint))==0){
+			continue;
+		}
+		if(Patients.size()==0 || Patients.back()!=(*sample).Patient){
+			Patients.push_back((*sample).Patient);
+			PatientSamples.push_back(vector<int>());
+		}
+		PatientSamples.back().push_back(s);
+	}
+
+	// Working arrays, indexed by genome position*NUMBASES + base code.
+	vector<unsigned char> InitCode(NumPositions);
+	vector<unsigned char> NotInit(NumCells);
+	vector<float> Threshold(NumCells);
+	vector<unsigned short> SampleCount(NumCells);
+	vector<vector<unsigned short> > PatientSampleCount(Patients.size());
+	vector<unsigned short> PatientCount(NumCells, 0);
+	vector<vector<unsigned char> > PatientInit(Patients.size());
+
+	for(unsigned int pt=0; pt<Patients.size(); pt++){
+
+		vector<int> *samples=&PatientSamples[pt];
+
+		// Determine the initial consensus from the first replicates
+		// of the first timepoint, keeping the earliest sample among ties.
+		// Positions without coverage have no consensus (code NUMBASES).
+		int firsttimepoint=Matrix.Samples[(*samples)[0]].Timepoint;
+		vector<float> maxfreq(NumPositions, 0);
+		InitCode.assign(NumPositions, NUMBASES);
+		for(unsigned int i=0; i<(*samples).size(); i++){
+			const MatrixSample_t *sample=&Matrix.Samples[(*samples)[i]];
+			if((*sample).Timepoint!=firsttimepoint || (*sample).Replicate!=1){
+				continue;
+			}
+			const float *freq=Matrix.Frequency+(*samples)[i]*RowStride;
+			for(long long p=0; p<NumPositions; p++){
+				for(int b=0; b<NUMBASES; b++){
+					if(freq[p*NUMBASES+b] > maxfreq[p]){
+						maxfreq[p]=freq[p*NUMBASES+b];
+						InitCode[p]=b;
+					}
+				}
+			}
+		}
+		for(long long c=0; c<NumCells; c++){
+			NotInit[c]=(InitCode[c/NUMBASES]!=NUMBASES &&
+					InitCode[c/NUMBASES]!=c%NUMBASES) ? 1 : 0;
+		}
+		PatientInit[pt]=InitCode;
+
+		// Pair the replicates of each timepoint, site, and aliquot.
+		vector<ReplicatePair_t> pairs;
+		for(unsigned int i=0; i<(*samples).size(); i++){
+			const MatrixSample_t *a=&Matrix.Samples[(*samples)[i]];
+			if((*a).Replicate!=1){
+				continue;
+			}
+			for(unsigned int j=0; j<(*samples).size(); j++){
+				const MatrixSample_t *b=&Matrix.Samples[(*samples)[j]];
+				if((*b).Replicate==2 && (*b).Timepoint==(*a).Timepoint &&
+						strcmp((*b).Site, (*a).Site)==0 &&
+						strcmp((*b).Aliquot, (*a).Aliquot)==0){
+					ReplicatePair_t pair;
+					pair.First=(*samples)[i];
+					pair.Second=(*samples)[j];
+					pairs.push_back(pair);
+				}
+			}
+		}
+
+		// Count the paired samples in which each base is called.
+		// A position failing the coverage criterion gets a frequency
+		// threshold above 1, so that the count needs no branch.
+		SampleCount.assign(NumCells, 0);
+		for(unsigned int k=0; k<pairs.size(); k++){
+			const float *freq1=Matrix.Frequency+pairs[k].First*RowStride;
+			const float *freq2=Matrix.Frequency+pairs[k].Second*RowStride;
+			const long long *cov1=Matrix.Coverage+pairs[k].First*NumPositions;
+			const long long *cov2=Matrix.Coverage+pairs[k].Second*NumPositions;
+			for(long long p=0; p<NumPositions; p++){
+				float threshold=(cov1[p]>MINCOVERAGE && cov2[p]>MINCOVERAGE) ?
+						MINFREQ : 2.0f;
+				for(int b=0; b<NUMBASES; b++){
+					Threshold[p*NUMBASES+b]=threshold;
+				}
+			}
+			const float *thresholds=&Threshold[0];
+			const unsigned char *notinit=&NotInit[0];
+			unsigned short *counts=&SampleCount[0];
+			for(long long c=0; c<NumCells; c++){
+				counts[c]+=(freq1[c]>thresholds[c]) & (freq2[c]>thresholds[c]) &
+						notinit[c];
+			}
+		}
+
+		// Count the patients in which each base is called
+		// in enough samples.
+		unsigned short *counts=&SampleCount[0];
+		unsigned short *patientcounts=&PatientCount[0];
+		for(long long c=0; c<NumCells; c++){
+			patientcounts[c]+=(counts[c]>=MINSAMPLES);
+		}
+		PatientSampleCount[pt]=SampleCount;
+
+		if(DEBUG){
+			printf("Patient %s: %lu samples, %lu replicate pairs\n",
+					Patients[pt].c_str(), (*samples).size(), pairs.size());
+		}
+	}
+
+	//==================================================
+	// Write the sites that meet both criteria.
+	//==================================================
+
+	ofstream fout(OUTFILE.c_str(), ios::out);
+	fout << "Patient Chr Pos GenomePos InitBase Base NumSamples NumPatients" << "\n";
+
+	// Genome positions in the output are 1-indexed, as in the summaries.
+	long long NumSites=0;
+	int ref=0;
+	for(long long c=0; c<NumCells; c++){
+		if(PatientCount[c] < MINPATIENTS){
+			continue;
+		}
+		long long p=c/NUMBASES;
+		while(ref+1 < (*Matrix.Header).NumReferences &&
+				Matrix.References[ref+1].GenomeStart <= p){
+			ref++;
+		}
+		for(unsigned int pt=0; pt<Patients.size(); pt++){
+			if(PatientSampleCount[pt][c] < MINSAMPLES){
+				continue;
+			}
+			fout << Patients[pt] << " " << Matrix.References[ref].Name << " " <<
+					p-Matrix.References[ref].GenomeStart+1 << " " << p+1 << " " <<
+					BASES[PatientInit[pt][p]] << " " << BASES[c%NUMBASES] << " " <<
+					PatientSampleCount[pt][c] << " " << PatientCount[c] << "\n";
+			NumSites++;
+		}
+	}
+	fout.close();
+	CloseMatrix(&Matrix);
+
+	printf("Number of patient variable sites written: %lld\n", NumSites);
+	return 0;
+}
@@ -0,0 +1,1079 @@
+//============================================================================
+// Name        : PermutationTest.cpp
+// Version     : 1.0
+// Description : 1.0 Permutation tests for parallel evolution, replacing
+//               ParallelWithinPermutationTest.R,
+//               ParallelScalesPermutationTest.R, and
+//               AntigenicSitesPermutationTest.R.
+//               Simulations run in parallel threads, and each simulation
+//               draws from its own counter-based random number stream,
+//               so results do not depend on the number of threads.
+//============================================================================
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstring>
+#include <cmath>
+#include <thread>
+
+using namespace std;
+
+// RUN PARAMETERS
+string MODE="";
+string VARFILE="";
+string GENESUMMARY="";
+string REFBED="";
+string GLOBALPROPORTIONS="";
+string GLOBALSITES="";
+string PARALLELSITES="";
+string ANTIGENICSITES="";
+string OUTFILE="";
+long long NUMSIMULATIONS=10000;
+int NUMTHREADS=0;
+unsigned long long SEED=0;
+
+bool DEBUG=false;
+
+// Statistics computed from the sites drawn in each simulation.
+// STAT_UNIQUE counts the unique sites drawn across patients.
+// STAT_BELOW counts the sites drawn at or below a threshold,
+// i.e. the overlap with a fixed set of sites numbered 1 to threshold.
+// STAT_INSET counts the sites drawn that are in a given set.
+enum Statistic_t {STAT_UNIQUE, STAT_BELOW, STAT_INSET};
+
+// A single permutation test, in which each simulation draws
+// Draws[p] sites without replacement from sites 1 to NumSites
+// for each patient p, and the statistic is tallied over simulations.
+struct PermutationTest_t{
+	string Gene="";
+	int GeneLength=0;
+	double SiteProportion=1;
+	int NumSites=0;
+	vector<int> Draws;
+	int Statistic=STAT_UNIQUE;
+	int Threshold=0;
+	vector<char> InSet;
+	long long Observed=0;
+	vector<long long> Frequency;
+};
+
+// Length of a gene in codons.
+struct GeneLength_t{
+	string Gene="";
+	int NumCodons=0;
+};
+
+// Gene annotation read from a BED file.
+struct Annotation_t{
+	string Chr="";
+	int ChrStart=0;
+	int ChrEnd=0;
+	string Name="";
+	int NumExons=0;
+	vector <int> ExonSizes;
+	vector <int> ExonStarts;
+};
+
+// Random number stream for one simulation, generated with Philox4x32-10
+// (Salmon et al. 2011). Each block of four numbers is a function only of
+// the key and counter, so a simulation's draws depend on the seed,
+// the test, and the simulation number, and not on the thread that runs it.
+struct RandomStream_t{
+	uint32_t Key[2];
+	uint32_t Counter[4];
+	uint32_t Block[4];
+	int Used=4;
+};
+
+// Working memory reused by a thread from one simulation to the next.
+// Stamps mark the sites drawn for the current patient and simulation,
+// so they need not be cleared between draws.
+struct SimulationBuffer_t{
+	vector<uint32_t> PatientStamp;
+	vector<uint32_t> SimulationStamp;
+	uint32_t NumPatientDraws=0;
+	uint32_t NumSimulations=0;
+};
+
+
+// FUNCTIONS
+int ArgsParse(int argc, char *argv[]);
+void PrintUsage();
+void PrintParameters();
+void SetDebug();
+vector<string> StringSplit(string s, char c);
+int ReadTable(string filename, map<string, int> *columns,
+		vector<vector<string> > *rows);
+int ReadBED(string filename, vector<Annotation_t> *annotations);
+int ReadGeneLengths(vector<GeneLength_t> *genelengths);
+int ReadWithinSites(string aachange, map<string, map<string, set<int> > > *sites);
+double RoundHalfEven(double x);
+void InitializeStream(RandomStream_t *stream, unsigned long long seed,
+		unsigned int test, unsigned long long simulation);
+uint32_t NextRandom(RandomStream_t *stream);
+uint32_t RandomBelow(RandomStream_t *stream, uint32_t n);
+long long Simulate(PermutationTest_t *test, RandomStream_t *stream,
+		SimulationBuffer_t *buffer);
+void RunSimulations(PermutationTest_t *test, unsigned int testindex,
+		long long first, long long last, vector<long long> *frequency);
+void RunPermutationTest(PermutationTest_t *test, unsigned int testindex);
+double GreaterPValue(PermutationTest_t *test);
+double AtLeastPValue(PermutationTest_t *test);
+int RunWithinTests(ofstream *out);
+int RunScalesTests(ofstream *out);
+int RunAntigenicTests(ofstream *out);
+
+int main(int argc, char *argv[]) {
+
+	//==================================================
+	// Parse command-line arguments.
+	//==================================================
+
+	if(ArgsParse(argc, argv) != 0){
+		PrintUsage();
+		return 1;
+	}
+
+	if(NUMTHREADS<=0){
+		NUMTHREADS=thread::hardware_concurrency();
+		if(NUMTHREADS<=0){
+			NUMTHREADS=1;
+		}
+	}
+
+	PrintParameters();
+
+	//==================================================
+	// Run the permutation tests for the chosen mode.
+	//==================================================
+
+	ofstream fout(OUTFILE.c_str(), ios::out);
+	if(!fout){
+		printf("Error: could not open output file.\n");
+		return 1;
+	}
+	fout << setprecision(15);
+
+	int status=1;
+	if(MODE=="within"){
+		status=RunWithinTests(&fout);
+	}
+	else if(MODE=="scales"){
+		status=RunScalesTests(&fout);
+	}
+	else if(MODE=="antigenic"){
+		status=RunAntigenicTests(&fout);
+	}
+
+	fout.close();
+
+	return status;
+}
+
+// ArgsParse
+// Parses command-line arguments.
+// The first argument names the test, and the rest are flag pairs.
+// Returns 1 if any argument conditions are violated.
+int ArgsParse(int argc, char *argv[]){
+
+	// If the only argument is debug,
+	// set all parameters to the debug state.
+	if(argc==2 && strcmp(argv[1],"debug")==0){
+		SetDebug();
+		return 0;
+	}
+
+	if(argc<2){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	MODE=argv[1];
+	if(MODE!="within" && MODE!="scales" && MODE!="antigenic"){
+		printf("Invalid test. Specify within, scales, or antigenic.\n");
+		return 1;
+	}
+
+	// Ensure that there are an even number of arguments,
+	// leaving aside the program name and test.
+	if((argc - 2) % 2 != 0){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	// Check the structure of arguments.
+	for(int i=2; i<argc; i++){
+		// Verify that every other argument is a flag.
+		if(i%2 == 0){
+			if(argv[i][0] != '-' || strlen(argv[i])!=2){
+				printf("Invalid use of argument flags.\n");
+				return 1;
+			}
+		}
+	}
+
+	// Parse each pair of arguments.
+	for(int i=1; i<(argc-2)/2+1; i++){
+
+		string flag=argv[2*i];
+		string arg=argv[2*i+1];
+
+		// Parse the flag string.
+		switch(flag[1]){
+		// -i longitudinal variant file
+		case 'i':
+			VARFILE = arg;
+			break;
+		// -g gene length summary
+		case 'g':
+			GENESUMMARY = arg;
+			break;
+		// -b reference BED file, in place of the gene length summary
+		case 'b':
+			REFBED = arg;
+			break;
+		// -x proportion of globally variable sites in each gene
+		case 'x':
+			GLOBALPROPORTIONS = arg;
+			break;
+		// -w globally variable sites
+		case 'w':
+			GLOBALSITES = arg;
+			break;
+		// -p sites variable both within and between hosts
+		case 'p':
+			PARALLELSITES = arg;
+			break;
+		// -a antigenic site annotation
+		case 'a':
+			ANTIGENICSITES = arg;
+			break;
+		// -o output file
+		case 'o':
+			OUTFILE = arg;
+			break;
+		// -n number of simulations per test
+		case 'n':
+			NUMSIMULATIONS = atoll(arg.c_str());
+			if(NUMSIMULATIONS <= 0){
+				printf("Invalid -n number of simulations.\n");
+				return 1;
+			}
+			break;
+		// -t number of threads
+		case 't':
+			NUMTHREADS = atoi(arg.c_str());
+			break;
+		// -s random seed
+		case 's':
+			SEED = strtoull(arg.c_str(), NULL, 0);
+			break;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(VARFILE==""){
+		printf("Invalid arguments. Specify longitudinal variant file.\n");
+		return 1;
+	}
+	if(GENESUMMARY=="" && REFBED==""){
+		printf("Invalid arguments. Specify gene length summary or BED file.\n");
+		return 1;
+	}
+	if(MODE=="scales" && (GLOBALSITES=="" || PARALLELSITES=="")){
+		printf("Invalid arguments. Specify global and parallel sites.\n");
+		return 1;
+	}
+	if(MODE=="antigenic" && ANTIGENICSITES==""){
+		printf("Invalid arguments. Specify antigenic sites.\n");
+		return 1;
+	}
+	if(OUTFILE==""){
+		printf("Invalid arguments. Specify output file.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// PrintParameters
+// When called, prints the parameters for the run.
+void PrintParameters(){
+	cout << "RUN PARAMETERS" << endl;
+	cout << "test: " << MODE << endl;
+	cout << "longitudinal variants: " << VARFILE << endl;
+	if(REFBED != ""){
+		cout << "reference annotation: " << REFBED << endl;
+	}
+	else{
+		cout << "gene length summary: " << GENESUMMARY << endl;
+	}
+	if(GLOBALPROPORTIONS != ""){
+		cout << "global variable proportions: " << GLOBALPROPORTIONS << endl;
+	}
+	if(GLOBALSITES != ""){
+		cout << "global variable sites: " << GLOBALSITES << endl;
+	}
+	if(PARALLELSITES != ""){
+		cout << "parallel sites: " << PARALLELSITES << endl;
+	}
+	if(ANTIGENICSITES != ""){
+		cout << "antigenic sites: " << ANTIGENICSITES << endl;
+	}
+	cout << "output file: " << OUTFILE << endl;
+	cout << "simulations per test: " << NUMSIMULATIONS << endl;
+	cout << "threads: " << NUMTHREADS << endl;
+	cout << "random seed: " << SEED << endl;
+	cout << endl;
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: PermutationTest within -i LongitudinalVariants.data\n"
+			"         -g GenomeGeneSummary.data -o out.data\n");
+	printf("       PermutationTest scales -i LongitudinalVariants.data\n"
+			"         -g GenomeGeneSummary.data -w H3N2-GISAID-sites.data\n"
+			"         -p ParallelSites.data -o out.data\n");
+	printf("       PermutationTest antigenic -i LongitudinalVariants.data\n"
+			"         -g GenomeGeneSummary.data -a ChenLeeAntigenicSites.txt\n"
+			"         -o out.data\n");
+	printf("\n");
+	printf("Tests:\n");
+	printf("  within\tunique sites among nonsynonymous variants across patients\n");
+	printf("  scales\toverlap of within-host and global variable sites,\n"
+			"\t\tfor HA, NA, and other genes\n");
+	printf("  antigenic\tHA variants in antigenic sites\n");
+	printf("\n");
+	printf("Input options (defaults in parentheses):\n");
+	printf("  -b FILE\tBED format annotation, used for gene lengths in place of -g\n");
+	printf("  -x FILE\tGlobalVariableSites.data; test the proportion of globally\n"
+			"\t\tvariable sites in each gene instead of proportions 0.05-1\n");
+	printf("  -n INT\tnumber of simulations per test [10000]\n");
+	printf("  -t INT\tnumber of threads [all cores]\n");
+	printf("  -s INT\trandom seed [0]\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	MODE="within";
+	VARFILE="var.test";
+	GENESUMMARY="genes.test";
+	OUTFILE="out.test";
+	NUMSIMULATIONS=1000;
+	DEBUG=true;
+}
+
+//
+// StringSplit
+// Takes in a string and a character delimiter
+// and returns a vector of strings split at that character.
+vector<string> StringSplit(string s, char c){
+	vector<string> splits;
+	string s0;
+	unsigned int i=0;
+
+	while(i < s.length()){
+		// Skip through delimiter characters at the beginnings of lines.
+		while(s[i] == c && i < s.length() - 1){
+			i++;
+		}
+		// Iterate through actual characters until you encounter c.
+		while(i < s.length() && s[i] != c){
+			s0 += s[i];
+			i++;
+		}
+		// Once c is encountered, stop and save the string, then reset it.
+		if(s0.size() > 0){
+			splits.push_back(s0);
+			s0 = "";
+		}
+		i++;
+	}
+
+	return splits;
+}
+
+// ReadTable
+// Reads a space-delimited table with a header row,
+// as written by write.table, and stores the column index of each name.
+// Returns 1 if the file does not exist or a row has too few fields.
+int ReadTable(string filename, map<string, int> *columns,
+		vector<vector<string> > *rows){
+
+	ifstream f_in(filename.c_str(), ios::in);
+	if(!f_in){
+		return 1;
+	}
+
+	string line;
+	if(!getline(f_in, line)){
+		return 1;
+	}
+	vector<string> header=StringSplit(line,' ');
+	for(unsigned int i=0; i<header.size(); i++){
+		(*columns)[header[i]]=i;
+	}
+
+	while(getline(f_in, line)){
+		vector<string> fields=StringSplit(line,' ');
+		if(fields.size()==0){
+			continue;
+		}
+		if(fields.size() < header.size()){
+			printf("Table %s has a row with too few fields.\n", filename.c_str());
+			return 1;
+		}
+		(*rows).push_back(fields);
+	}
+
+	f_in.close();
+
+	return 0;
+}
+
+// ReadBED
+// Given a file name for a BED format file containing sequence annotations,
+// as well as a location to store the annotations,
+// reads in the annotations and stores the information in appropriate form.
+// Returns 1 if the file does not exist.
+int ReadBED(string filename, vector<Annotation_t> *annotations){
+	// Open the file.
+	ifstream f_in(filename.c_str(), ios::in);
+
+	string line;
+
+	if(f_in){
+		while(getline(f_in, line)){
+
+			vector<string> fields=StringSplit(line,'\t');
+
+			// Check that annotation contains the necessary fields.
+			if(fields.size()>=12){
+
+				// Store relevant information in Annotation_t format.
+				Annotation_t annotation;
+
+				annotation.Chr=fields[0];
+				annotation.ChrStart=atoi(fields[1].c_str());
+				annotation.ChrEnd=atoi(fields[2].c_str());
+				annotation.Name=fields[3];
+				annotation.NumExons=atoi(fields[9].c_str());
+
+				vector<string> exonsizes=StringSplit(fields[10],',');
+				vector<string> exonstarts=StringSplit(fields[11],',');
+				for(int i=0; i<annotation.NumExons; i++){
+					annotation.ExonSizes.push_back(atoi(exonsizes[i].c_str()));
+					annotation.ExonStarts.push_back(atoi(exonstarts[i].c_str()));
+				}
+
+				(*annotations).push_back(annotation);
+			}
+			else{
+				printf("BED file is not in accepted format.\n");
+				return 1;
+			}
+		}
+	}
+	else{
+		return 1;
+	}
+
+	// Close the file.
+	f_in.close();
+
+	return 0;
+}
+
+// ReadGeneLengths
+// Reads the length of each gene in codons, in file order,
+// either from the exons of a BED annotation
+// or from the gene summary written by SummarizeGeneLengths.R.
+// Returns 1 if the file cannot be read.
+int ReadGeneLengths(vector<GeneLength_t> *genelengths){
+
+	if(REFBED != ""){
+		vector<Annotation_t> annotations;
+		if(ReadBED(REFBED, &annotations) != 0){
+			printf("Error: BED annotation does not exist.\n");
+			return 1;
+		}
+		for(unsigned int i=0; i<annotations.size(); i++){
+			GeneLength_t genelength;
+			genelength.Gene=annotations[i].Name;
+			int numbases=0;
+			for(int j=0; j<annotations[i].NumExons; j++){
+				numbases+=annotations[i].ExonSizes[j];
+			}
+			genelength.NumCodons=numbases/3;
+			(*genelengths).push_back(genelength);
+		}
+		return 0;
+	}
+
+	map<string, int> columns;
+	vector<vector<string> > rows;
+	if(ReadTable(GENESUMMARY, &columns, &rows) != 0 ||
+			columns.count("Gene")==0 || columns.count("NumCodons")==0){
+		printf("Error: cannot read gene summary %s.\n", GENESUMMARY.c_str());
+		return 1;
+	}
+	for(unsigned int i=0; i<rows.size(); i++){
+		GeneLength_t genelength;
+		genelength.Gene=rows[i][columns["Gene"]];
+		genelength.NumCodons=atoi(rows[i][columns["NumCodons"]].c_str());
+		(*genelengths).push_back(genelength);
+	}
+	return 0;
+}
+
+// ReadWithinSites
+// Reads the longitudinal variants and stores the codons at which
+// each patient has a variant, by gene and then by patient.
+// aachange selects nonsynonymous ("NS") or synonymous ("S") variants.
+// Returns 1 if the file cannot be read.
+int ReadWithinSites(string aachange, map<string, map<string, set<int> > > *sites){
+
+	map<string, int> columns;
+	vector<vector<string> > rows;
+	if(ReadTable(VARFILE, &columns, &rows) != 0){
+		printf("Error: cannot read variant file %s.\n", VARFILE.c_str());
+		return 1;
+	}
+	const char *required[5]={"Patient","Gene","Codon","InitAA","DerAA"};
+	for(int i=0; i<5; i++){
+		if(columns.count(required[i])==0){
+			printf("Error: variant file has no %s column.\n", required[i]);
+			return 1;
+		}
+	}
+
+	for(unsigned int i=0; i<rows.size(); i++){
+		vector<string> *row=&rows[i];
+		bool synonymous=((*row)[columns["InitAA"]]==(*row)[columns["DerAA"]]);
+		if(synonymous != (aachange=="S")){
+			continue;
+		}
+		(*sites)[(*row)[columns["Gene"]]][(*row)[columns["Patient"]]].insert(
+				atoi((*row)[columns["Codon"]].c_str()));
+	}
+	return 0;
+}
+
+// RoundHalfEven
+// Rounds to the nearest integer with ties to even, as R's round does.
+double RoundHalfEven(double x){
+	double r=floor(x+0.5);
+	if(r-x==0.5 && fmod(r, 2)!=0){
+		r-=1;
+	}
+	return r;
+}
+
+// InitializeStream
+// Sets up the random number stream for one simulation of one test.
+void InitializeStream(RandomStream_t *stream, unsigned long long seed,
+		unsigned int test, unsigned long long simulation){
+	(*stream).Key[0]=(uint32_t) seed;
+	(*stream).Key[1]=(uint32_t) (seed >> 32);
+	(*stream).Counter[0]=0;
+	(*stream).Counter[1]=(uint32_t) simulation;
+	(*stream).Counter[2]=(uint32_t) (simulation >> 32);
+	(*stream).Counter[3]=test;
+	(*stream).Used=4;
+}
+
+// NextRandom
+// Returns the next uniformly distributed 32-bit integer in a stream,
+// computing a new block of four with ten Philox rounds when needed.
+uint32_t NextRandom(RandomStream_t *stream){
+	if((*stream).Used==4){
+		uint32_t c[4];
+		memcpy(c, (*stream).Counter, sizeof(c));
+		uint32_t k0=(*stream).Key[0];
+		uint32_t k1=(*stream).Key[1];
+		for(int round=0; round<10; round++){
+			uint64_t p0=(uint64_t) 0xD2511F53u*c[0];
+			uint64_t p1=(uint64_t) 0xCD9E8D57u*c[2];
+			uint32_t n0=(uint32_t) (p1 >> 32) ^ c[1] ^ k0;
+			uint32_t n1=(uint32_t) p1;
+			uint32_t n2=(uint32_t) (p0 >> 32) ^ c[3] ^ k1;
+			uint32_t n3=(uint32_t) p0;
+			c[0]=n0;
+			c[1]=n1;
+			c[2]=n2;
+			c[3]=n3;
+			k0+=0x9E3779B9u;
+			k1+=0xBB67AE85u;
+		}
+		memcpy((*stream).Block, c, sizeof(c));
+		(*stream).Counter[0]++;
+		(*stream).Used=0;
+	}
+	return (*stream).Block[(*stream).Used++];
+}
+
+// RandomBelow
+// Returns a uniformly distributed integer in [0, n),
+// using Lemire's multiply-and-reject method to avoid modulo bias.
+uint32_t RandomBelow(RandomStream_t *stream, uint32_t n){
+	uint64_t m=(uint64_t) NextRandom(stream)*n;
+	uint32_t low=(uint32_t) m;
+	if(low < n){
+		uint32_t threshold=(uint32_t) (-n) % n;
+		while(low < threshold){
+			m=(uint64_t) NextRandom(stream)*n;
+			low=(uint32_t) m;
+		}
+	}
+	return (uint32_t) (m >> 32);
+}
+
+// Simulate
+// Runs a single simulation of a permutation test and returns its statistic.
+// Sites are drawn without replacement for each patient
+// with Floyd's algorithm, which takes one random number per site drawn.
+long long Simulate(PermutationTest_t *test, RandomStream_t *stream,
+		SimulationBuffer_t *buffer){
+
+	uint32_t simulationstamp=++(*buffer).NumSimulations;
+	long long statistic=0;
+	int n=(*test).NumSites;
+
+	for(unsigned int p=0; p<(*test).Draws.size(); p++){
+		uint32_t patientstamp=++(*buffer).NumPatientDraws;
+		int k=(*test).Draws[p];
+		for(int j=n-k; j<n; j++){
+			// Draw a site from 0 to j; if it was already drawn,
+			// take site j, which cannot have been drawn yet.
+			int site=RandomBelow(stream, j+1);
+			if((*buffer).PatientStamp[site]==patientstamp){
+				site=j;
+			}
+			(*buffer).PatientStamp[site]=patientstamp;
+
+			// Sites are numbered from 1 in the statistics.
+			switch((*test).Statistic){
+			case STAT_UNIQUE:
+				if((*buffer).SimulationStamp[site]!=simulationstamp){
+					(*buffer).SimulationStamp[site]=simulationstamp;
+					statistic++;
+				}
+				break;
+			case STAT_BELOW:
+				if(site+1 <= (*test).Threshold){
+					statistic++;
+				}
+				break;
+			case STAT_INSET:
+				if((*test).InSet[site+1]){
+					statistic++;
+				}
+				break;
+			}
+		}
+	}
+	return statistic;
+}
+
+// RunSimulations
+// Runs simulations first to last-1 of a test
+// and tallies the frequency of each value of the statistic.
+void RunSimulations(PermutationTest_t *test, unsigned int testindex,
+		long long first, long long last, vector<long long> *frequency){
+	SimulationBuffer_t buffer;
+	buffer.PatientStamp.assign((*test).NumSites, 0);
+	buffer.SimulationStamp.assign((*test).NumSites, 0);
+	RandomStream_t stream;
+	for(long long s=first; s<last; s++){
+		InitializeStream(&stream, SEED, testindex, s);
+		(*frequency)[Simulate(test, &stream, &buffer)]++;
+	}
+}
+
+// RunPermutationTest
+// Runs NUMSIMULATIONS simulations of a test, divided among NUMTHREADS
+// threads, and stores the frequency of each value of the statistic.
+void RunPermutationTest(PermutationTest_t *test, unsigned int testindex){
+
+	// The statistic can be no larger than the total number of draws.
+	int maxstatistic=0;
+	for(unsigned int p=0; p<(*test).Draws.size(); p++){
+		maxstatistic+=(*test).Draws[p];
+	}
+
+	int numthreads=NUMTHREADS;
+	if(numthreads > NUMSIMULATIONS){
+		numthreads=NUMSIMULATIONS;
+	}
+	vector<vector<long long> > frequencies(numthreads,
+			vector<long long>(maxstatistic+1, 0));
+	vector<thread> threads;
+	for(int t=0; t<numthreads; t++){
+		long long first=NUMSIMULATIONS*t/numthreads;
+		long long last=NUMSIMULATIONS*(t+1)/numthreads;
+		threads.push_back(thread(RunSimulations, test, testindex,
+				first, last, &frequencies[t]));
+	}
+	(*test).Frequency.assign(maxstatistic+1, 0);
+	for(int t=0; t<numthreads; t++){
+		threads[t].join();
+		for(int i=0; i<=maxstatistic; i++){
+			(*test).Frequency[i]+=frequencies[t][i];
+		}
+	}
+}
+
+// GreaterPValue
+// Returns the proportion of simulations in which the statistic
+// is at most the observed value, i.e. one minus the proportion
+// in which it is greater, as computed by the R scripts.
+double GreaterPValue(PermutationTest_t *test){
+	long long greater=0;
+	for(unsigned int i=0; i<(*test).Frequency.size(); i++){
+		if((long long) i > (*test).Observed){
+			greater+=(*test).Frequency[i];
+		}
+	}
+	return 1-((double) greater)/NUMSIMULATIONS;
+}
+
+// AtLeastPValue
+// Returns the proportion of simulations in which the statistic
+// is at least the observed value, i.e. one minus the proportion
+// in which it is smaller, as computed by the R scripts.
+double AtLeastPValue(PermutationTest_t *test){
+	long long smaller=0;
+	for(unsigned int i=0; i<(*test).Frequency.size(); i++){
+		if((long long) i < (*test).Observed){
+			smaller+=(*test).Frequency[i];
+		}
+	}
+	return 1-((double) smaller)/NUMSIMULATIONS;
+}
+
+// RunWithinTests
+// Tests the parallelism among patients in each gene:
+// each patient's nonsynonymous sites are redrawn from the mutable sites,
+// and the number of unique sites is compared with the data.
+// Genes without parallel sites, whose p-value is 1, are skipped.
+// Returns 1 if an input cannot be read.
+int RunWithinTests(ofstream *out){
+
+	vector<GeneLength_t> GeneLengths;
+	map<string, map<string, set<int> > > Sites;
+	if(ReadGeneLengths(&GeneLengths) != 0 || ReadWithinSites("NS", &Sites) != 0){
+		return 1;
+	}
+
+	// Read in the proportion of globally variable sites, if given.
+	map<string, double> GlobalProportions;
+	if(GLOBALPROPORTIONS != ""){
+		map<string, int> columns;
+		vector<vector<string> > rows;
+		if(ReadTable(GLOBALPROPORTIONS, &columns, &rows) != 0 ||
+				columns.count("Gene")==0 || columns.count("VariableProportion")==0){
+			printf("Error: cannot read %s.\n", GLOBALPROPORTIONS.c_str());
+			return 1;
+		}
+		for(unsigned int i=0; i<rows.size(); i++){
+			GlobalProportions[rows[i][columns["Gene"]]]=
+					atof(rows[i][columns["VariableProportion"]].c_str());
+		}
+	}
+
+	(*out) << "Gene NumSitesTotal NumUniqueData NumUniqueSimulated Frequency " <<
+			"GeneLength SiteProportion NumSimulations pvalue" << "\n";
+
+	unsigned int TestIndex=0;
+	for(unsigned int g=0; g<GeneLengths.size(); g++){
+
+		string Gene=GeneLengths[g].Gene;
+
+		// Count the sites in each patient and the unique sites overall.
+		PermutationTest_t Test;
+		Test.Gene=Gene;
+		Test.GeneLength=GeneLengths[g].NumCodons;
+		Test.Statistic=STAT_UNIQUE;
+		set<int> UniqueSites;
+		int NumSitesTotal=0;
+		map<string, set<int> > *PatientSites=&Sites[Gene];
+		for(map<string, set<int> >::iterator it=(*PatientSites).begin();
+				it!=(*PatientSites).end(); it++){
+			Test.Draws.push_back(it->second.size());
+			NumSitesTotal+=it->second.size();
+			UniqueSites.insert(it->second.begin(), it->second.end());
+		}
+		Test.Observed=UniqueSites.size();
+		if(NumSitesTotal==Test.Observed){
+			continue;
+		}
+
+		// Test the proportions 0.05 to 1 in steps of 0.05, computed as seq does,
+		// or only the proportion of globally variable sites.
+		vector<double> Proportions;
+		if(GLOBALPROPORTIONS != ""){
+			if(GlobalProportions.count(Gene)==0){
+				printf("No global variable proportion for %s.\n", Gene.c_str());
+				continue;
+			}
+			Proportions.push_back(GlobalProportions[Gene]);
+		}
+		else{
+			for(int i=0; i<20; i++){
+				Proportions.push_back(0.05+i*0.05);
+			}
+		}
+
+		for(unsigned int i=0; i<Proportions.size(); i++){
+			Test.SiteProportion=Proportions[i];
+			Test.NumSites=(int) RoundHalfEven(Test.GeneLength*Test.SiteProportion);
+			int MaxDraws=*max_element(Test.Draws.begin(), Test.Draws.end());
+			if(MaxDraws > Test.NumSites){
+				printf("Skipping %s at proportion %g: "
+						"fewer mutable sites than variants.\n",
+						Gene.c_str(), Test.SiteProportion);
+				continue;
+			}
+
+			RunPermutationTest(&Test, TestIndex++);
+			double pvalue=GreaterPValue(&Test);
+
+			for(unsigned int j=0; j<Test.Frequency.size(); j++){
+				if(Test.Frequency[j]==0){
+					continue;
+				}
+				(*out) << Gene << " " << NumSitesTotal << " " << Test.Observed <<
+						" " << j << " " << Test.Frequency[j] << " " <<
+						Test.GeneLength << " " << Test.SiteProportion << " " <<
+						NUMSIMULATIONS << " " << pvalue << "\n";
+			}
+			printf("%s\t%g\tp=%g\n", Gene.c_str(), Test.SiteProportion, pvalue);
+		}
+	}
+	return 0;
+}
+
+// RunScalesTests
+// Tests the overlap between within-host and global variable sites
+// for HA, NA, and the other genes combined:
+// the global sites are redrawn from the mutable sites, and the number
+// that fall among the within-host sites is compared with the data.
+// Returns 1 if an input cannot be read.
+int RunScalesTests(ofstream *out){
+
+	vector<GeneLength_t> GeneLengths;
+	map<string, map<string, set<int> > > Sites;
+	if(ReadGeneLengths(&GeneLengths) != 0 || ReadWithinSites("NS", &Sites) != 0){
+		return 1;
+	}
+
+	// Genes are binned as in the R script, and bins are tested in sorted order.
+	map<string, int> BinNumCodons;
+	map<string, long long> BinWithin;
+	map<string, long long> BinBetween;
+	map<string, long long> BinParallel;
+	map<string, long long> BinVariableSites;
+	map<string, string> GeneBin;
+	for(unsigned int g=0; g<GeneLengths.size(); g++){
+		string gene=GeneLengths[g].Gene;
+		GeneBin[gene]=(gene=="4-HA" || gene=="6-NA") ? gene : "other";
+		BinNumCodons[GeneBin[gene]]+=GeneLengths[g].NumCodons;
+	}
+	for(map<string, map<string, set<int> > >::iterator it=Sites.begin();
+			it!=Sites.end(); it++){
+		set<int> unique;
+		for(map<string, set<int> >::iterator jt=it->second.begin();
+				jt!=it->second.end(); jt++){
+			unique.insert(jt->second.begin(), jt->second.end());
+		}
+		string bin=(it->first=="4-HA" || it->first=="6-NA") ? it->first : "other";
+		BinWithin[bin]+=unique.size();
+	}
+
+	// Count the unique global variable sites in each gene.
+	map<string, int> columns;
+	vector<vector<string> > rows;
+	if(ReadTable(GLOBALSITES, &columns, &rows) != 0 ||
+			columns.count("Gene")==0 || columns.count("Position")==0){
+		printf("Error: cannot read %s.\n", GLOBALSITES.c_str());
+		return 1;
+	}
+	set<pair<string, int> > GlobalSites;
+	for(unsigned int i=0; i<rows.size(); i++){
+		GlobalSites.insert(make_pair(rows[i][columns["Gene"]],
+				atoi(rows[i][columns["Position"]].c_str())));
+	}
+	for(set<pair<string, int> >::iterator it=GlobalSites.begin();
+			it!=GlobalSites.end(); it++){
+		string bin=(it->first=="4-HA" || it->first=="6-NA") ? it->first : "other";
+		BinBetween[bin]++;
+	}
+
+	// Count the sites variable both within and between hosts.
+	columns.clear();
+	rows.clear();
+	if(ReadTable(PARALLELSITES, &columns, &rows) != 0 || columns.count("Gene")==0){
+		printf("Error: cannot read %s.\n", PARALLELSITES.c_str());
+		return 1;
+	}
+	for(unsigned int i=0; i<rows.size(); i++){
+		string gene=rows[i][columns["Gene"]];
+		BinParallel[(gene=="4-HA" || gene=="6-NA") ? gene : "other"]++;
+	}
+
+	// Read in the number of globally variable sites in each gene, if given.
+	if(GLOBALPROPORTIONS != ""){
+		columns.clear();
+		rows.clear();
+		if(ReadTable(GLOBALPROPORTIONS, &columns, &rows) != 0 ||
+				columns.count("Gene")==0 || columns.count("VariableSites")==0){
+			printf("Error: cannot read %s.\n", GLOBALPROPORTIONS.c_str());
+			return 1;
+		}
+		for(unsigned int i=0; i<rows.size(); i++){
+			string gene=rows[i][columns["Gene"]];
+			if(GeneBin.count(gene)>0){
+				BinVariableSites[GeneBin[gene]]+=
+						atoll(rows[i][columns["VariableSites"]].c_str());
+			}
+		}
+	}
+
+	(*out) << "OverlapSimulated Frequency Gene GeneLength SiteProportion " <<
+			"NumSimulations OverlapEmpirical pvalue" << "\n";
+
+	unsigned int TestIndex=0;
+	for(map<string, int>::iterator it=BinNumCodons.begin();
+			it!=BinNumCodons.end(); it++){
+
+		PermutationTest_t Test;
+		Test.Gene=it->first;
+		Test.GeneLength=it->second;
+		Test.Statistic=STAT_BELOW;
+		Test.Threshold=BinWithin[Test.Gene];
+		Test.Draws.push_back(BinBetween[Test.Gene]);
+		Test.Observed=BinParallel[Test.Gene];
+
+		vector<double> Proportions;
+		if(GLOBALPROPORTIONS != ""){
+			Proportions.push_back((double) BinVariableSites[Test.Gene]/Test.GeneLength);
+		}
+		else{
+			for(int i=0; i<20; i++){
+				Proportions.push_back(0.05+i*0.05);
+			}
+		}
+
+		for(unsigned int i=0; i<Proportions.size(); i++){
+			Test.SiteProportion=Proportions[i];
+
+			// Skip proportions with fewer mutable sites than global sites.
+			if(Test.GeneLength*Test.SiteProportion < Test.Draws[0]){
+				continue;
+			}
+			Test.NumSites=(int) RoundHalfEven(Test.GeneLength*Test.SiteProportion);
+
+			RunPermutationTest(&Test, TestIndex++);
+			double pvalue=AtLeastPValue(&Test);
+
+			for(unsigned int j=0; j<Test.Frequency.size(); j++){
+				if(Test.Frequency[j]==0){
+					continue;
+				}
+				(*out) << j << " " << Test.Frequency[j] << " " << Test.Gene << " " <<
+						Test.GeneLength << " " << Test.SiteProportion << " " <<
+						NUMSIMULATIONS << " " << Test.Observed << " " <<
+						pvalue << "\n";
+			}
+			printf("%s\t%g\tp=%g\n", Test.Gene.c_str(), Test.SiteProportion, pvalue);
+		}
+	}
+	return 0;
+}
+
+// RunAntigenicTests
+// Tests whether HA variants fall in antigenic sites more often than
+// expected, separately for nonsynonymous and synonymous variants:
+// each patient's sites are redrawn from all HA codons, and the number
+// in antigenic sites is compared with the data.
+// Returns 1 if an input cannot be read.
+int RunAntigenicTests(ofstream *out){
+
+	vector<GeneLength_t> GeneLengths;
+	if(ReadGeneLengths(&GeneLengths) != 0){
+		return 1;
+	}
+	int HALength=0;
+	for(unsigned int g=0; g<GeneLengths.size(); g++){
+		if(GeneLengths[g].Gene=="4-HA"){
+			HALength=GeneLengths[g].NumCodons;
+		}
+	}
+	if(HALength==0){
+		printf("Error: no length for 4-HA.\n");
+		return 1;
+	}
+
+	// Read in the antigenic sites, which are in HA numbering.
+	map<string, int> columns;
+	vector<vector<string> > rows;
+	if(ReadTable(ANTIGENICSITES, &columns, &rows) != 0 ||
+			columns.count("AA")==0 || columns.count("Antigenic_site")==0){
+		printf("Error: cannot read %s.\n", ANTIGENICSITES.c_str());
+		return 1;
+	}
+	vector<char> Antigenic(HALength+1, 0);
+	for(unsigned int i=0; i<rows.size(); i++){
+		int aa=atoi(rows[i][columns["AA"]].c_str());
+		if(rows[i][columns["Antigenic_site"]]!="NA" && aa>=1 && aa<=HALength){
+			Antigenic[aa]=1;
+		}
+	}
+
+	(*out) << "Gene AAChange NumSimulations pvalue" << "\n";
+
+	const char *AAChanges[2]={"NS","S"};
+	for(unsigned int c=0; c<2; c++){
+
+		map<string, map<string, set<int> > > Sites;
+		if(ReadWithinSites(AAChanges[c], &Sites) != 0){
+			return 1;
+		}
+
+		PermutationTest_t Test;
+		Test.Gene="4-HA";
+		Test.GeneLength=HALength;
+		Test.NumSites=HALength;
+		Test.Statistic=STAT_INSET;
+		Test.InSet=Antigenic;
+		map<string, set<int> > *PatientSites=&Sites["4-HA"];
+		for(map<string, set<int> >::iterator it=(*PatientSites).begin();
+				it!=(*PatientSites).end(); it++){
+			Test.Draws.push_back(it->second.size());
+			for(set<int>::iterator jt=it->second.begin();
+					jt!=it->second.end(); jt++){
+				if(*jt>=1 && *jt<=HALength && Antigenic[*jt]){
+					Test.Observed++;
+				}
+			}
+		}
+
+		RunPermutationTest(&Test, c);
+		double pvalue=AtLeastPValue(&Test);
+		(*out) << Test.Gene << " " << AAChanges[c] << " " << NUMSIMULATIONS <<
+				" " << pvalue << "\n";
+		printf("%s\t%s\tp=%g\n", Test.Gene.c_str(), AAChanges[c], pvalue);
+	}
+	return 0;
+}
@@ -0,0 +1,1114 @@
+//============================================================================
+// Name        : ProteinDistances.cpp
+// Version     : 1.0
+// Description : 1.0 Distances on protein structures, replacing
+//               CalculateDistancesHA.py, CalculateDistancesNA.py,
+//               and PermuteDistances.R.
+//               Parses the ATOM and HETATM records of a PDB file once
+//               into coordinate arrays, computes residue distances from
+//               a ligand such as sialic acid, finds residue-to-residue
+//               minimal distances with a cell list, and runs the distance
+//               permutation tests in parallel threads.
+//============================================================================
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstring>
+#include <cmath>
+#include <thread>
+
+using namespace std;
+
+// RUN PARAMETERS
+string MODE="";
+string PDBFILE="";
+string CHAINS="";
+string LIGAND="SIA";
+string LIGANDCHAIN="";
+string ATOMS="CA";
+double CUTOFF=8.0;
+string VARFILE="";
+vector<string> DISTANCEFILES;
+string OUTFILE="";
+long long NUMSIMULATIONS=10000;
+int NUMTHREADS=0;
+unsigned long long SEED=0;
+
+bool DEBUG=false;
+
+// One-letter codes of the standard amino acids, by residue name.
+const char *AMINOACIDS[20][2]={
+		{"ALA","A"}, {"ARG","R"}, {"ASN","N"}, {"ASP","D"}, {"CYS","C"},
+		{"GLU","E"}, {"GLN","Q"}, {"GLY","G"}, {"HIS","H"}, {"ILE","I"},
+		{"LEU","L"}, {"LYS","K"}, {"MET","M"}, {"PHE","F"}, {"PRO","P"},
+		{"SER","S"}, {"THR","T"}, {"TRP","W"}, {"TYR","Y"}, {"VAL","V"}};
+
+// One residue of a structure, whose atoms are stored contiguously
+// from FirstAtom in the coordinate arrays.
+struct Residue_t{
+	char Chain=' ';
+	string ResSeq="";
+	string Name="";
+	char Code=' ';
+	int FirstAtom=0;
+	int NumAtoms=0;
+	int CAAtom=-1;
+};
+
+// Atoms of a structure, with coordinates stored as separate arrays
+// so that distance loops run over contiguous memory.
+struct Structure_t{
+	vector<float> X;
+	vector<float> Y;
+	vector<float> Z;
+	vector<string> AtomName;
+	vector<char> Element;
+	vector<int> AtomResidue;
+	vector<Residue_t> Residues;
+};
+
+// Atoms sorted into cubic cells, so that the atoms within a cutoff
+// of an atom are found in its own and the 26 neighbouring cells.
+// The atoms of cell c are CellAtoms[CellStart[c]] to CellAtoms[CellStart[c+1]-1].
+struct CellList_t{
+	float Size=0;
+	float Min[3];
+	int Dim[3];
+	vector<int> CellStart;
+	vector<int> CellAtoms;
+};
+
+// Distances of the residues of one gene from a ligand,
+// by codon number of the gene.
+struct GeneDistances_t{
+	string Gene="";
+	int Offset=0;
+	map<int, double> Distances;
+	vector<double> AllDistances;
+};
+
+// A single permutation test, in which each simulation draws
+// Draws[p] residues without replacement from Pool for each patient p,
+// and the median distance of the drawn residues is compared with
+// the median distance of the observed variant sites.
+struct PermutationTest_t{
+	string Gene="";
+	string AAChange="";
+	vector<double> *Pool=NULL;
+	vector<int> Draws;
+	double Observed=0;
+	long long NumAtMost=0;
+};
+
+// Random number stream for one simulation, generated with Philox4x32-10
+// (Salmon et al. 2011), as in PermutationTest. A simulation's draws depend
+// on the seed, the test, and the simulation number, and not on the thread
+// that runs it.
+struct RandomStream_t{
+	uint32_t Key[2];
+	uint32_t Counter[4];
+	uint32_t Block[4];
+	int Used=4;
+};
+
+
+// FUNCTIONS
+int ArgsParse(int argc, char *argv[]);
+void PrintUsage();
+void PrintParameters();
+void SetDebug();
+vector<string> StringSplit(string s, char c);
+string Trim(string s);
+int ReadPDB(string filename, Structure_t *structure);
+int ChainResidues(Structure_t *structure, string chains,
+		vector<int> *residues);
+float AtomDistance(Structure_t *structure, int a, int b);
+void BuildCellList(Structure_t *structure, vector<int> *atoms, float size,
+		CellList_t *cells);
+int CellIndex(CellList_t *cells, float x, float y, float z, int dim);
+int WriteLigandDistances();
+int WriteResidueDistances();
+int ReadTable(string filename, char delimiter, map<string, int> *columns,
+		vector<vector<string> > *rows);
+int ReadGeneDistances(string spec, GeneDistances_t *gene);
+double Median(vector<double> *values);
+void InitializeStream(RandomStream_t *stream, unsigned long long seed,
+		unsigned int test, unsigned long long simulation);
+uint32_t NextRandom(RandomStream_t *stream);
+uint32_t RandomBelow(RandomStream_t *stream, uint32_t n);
+void RunSimulations(PermutationTest_t *test, unsigned int testindex,
+		long long first, long long last, long long *numatmost);
+void RunPermutationTest(PermutationTest_t *test, unsigned int testindex);
+int RunPermutations();
+
+int main(int argc, char *argv[]) {
+
+	//==================================================
+	// Parse command-line arguments.
+	//==================================================
+
+	if(ArgsParse(argc, argv) != 0){
+		PrintUsage();
+		return 1;
+	}
+
+	if(NUMTHREADS<=0){
+		NUMTHREADS=thread::hardware_concurrency();
+		if(NUMTHREADS<=0){
+			NUMTHREADS=1;
+		}
+	}
+
+	PrintParameters();
+
+	//==================================================
+	// Compute distances or run the permutation tests.
+	//==================================================
+
+	if(MODE=="ligand"){
+		return WriteLigandDistances();
+	}
+	if(MODE=="residues"){
+		return WriteResidueDistances();
+	}
+	return RunPermutations();
+}
+
+// ArgsParse
+// Parses command-line arguments.
+// The first argument names the mode, and the rest are flag pairs.
+// Returns 1 if any argument conditions are violated.
+int ArgsParse(int argc, char *argv[]){
+
+	// If the only argument is debug,
+	// set all parameters to the debug state.
+	if(argc==2 && strcmp(argv[1],"debug")==0){
+		SetDebug();
+		return 0;
+	}
+
+	if(argc<2){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	MODE=argv[1];
+	if(MODE!="ligand" && MODE!="residues" && MODE!="permute"){
+		printf("Invalid mode. Specify ligand, residues, or permute.\n");
+		return 1;
+	}
+
+	// Ensure that there are an even number of arguments,
+	// leaving aside the program name and mode.
+	if((argc - 2) % 2 != 0){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	// Check the structure of arguments.
+	for(int i=2; i<argc; i++){
+		// Verify that every other argument is a flag.
+		if(i%2 == 0){
+			if(argv[i][0] != '-' || strlen(argv[i])!=2){
+				printf("Invalid use of argument flags.\n");
+				return 1;
+			}
+		}
+	}
+
+	// Parse each pair of arguments.
+	for(int i=1; i<(argc-2)/2+1; i++){
+
+		string flag=argv[2*i];
+		string arg=argv[2*i+1];
+
+		// Parse the flag string.
+		switch(flag[1]){
+		// -p PDB file
+		case 'p':
+			PDBFILE = arg;
+			break;
+		// -c comma-separated chains, numbered in order
+		case 'c':
+			CHAINS = arg;
+			break;
+		// -l ligand residue name
+		case 'l':
+			LIGAND = arg;
+			break;
+		// -k ligand chain
+		case 'k':
+			LIGANDCHAIN = arg;
+			break;
+		// -a residue atoms: CA or all
+		case 'a':
+			ATOMS = arg;
+			if(ATOMS!="CA" && ATOMS!="all"){
+				printf("Invalid -a residue atoms. Specify CA or all.\n");
+				return 1;
+			}
+			break;
+		// -x residue distance cutoff in angstroms
+		case 'x':
+			CUTOFF = atof(arg.c_str());
+			if(CUTOFF <= 0){
+				printf("Invalid -x distance cutoff.\n");
+				return 1;
+			}
+			break;
+		// -i longitudinal variant file
+		case 'i':
+			VARFILE = arg;
+			break;
+		// -d gene residue distances, as GENE:FILE[:OFFSET]
+		case 'd':
+			DISTANCEFILES.push_back(arg);
+			break;
+		// -o output file
+		case 'o':
+			OUTFILE = arg;
+			break;
+		// -n number of simulations per test
+		case 'n':
+			NUMSIMULATIONS = atoll(arg.c_str());
+			if(NUMSIMULATIONS <= 0){
+				printf("Invalid -n number of simulations.\n");
+				return 1;
+			}
+			break;
+		// -t number of threads
+		case 't':
+			NUMTHREADS = atoi(arg.c_str());
+			break;
+		// -s random seed
+		case 's':
+			SEED = strtoull(arg.c_str(), NULL, 0);
+			break;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(OUTFILE==""){
+		printf("Invalid arguments. Specify output file.\n");
+		return 1;
+	}
+	if(MODE=="permute"){
+		if(VARFILE==""){
+			printf("Invalid arguments. Specify longitudinal variant file.\n");
+			return 1;
+		}
+		if(DISTANCEFILES.size()==0){
+			printf("Invalid arguments. Specify gene residue distances.\n");
+			return 1;
+		}
+		return 0;
+	}
+	if(PDBFILE==""){
+		printf("Invalid arguments. Specify PDB file.\n");
+		return 1;
+	}
+	if(CHAINS==""){
+		printf("Invalid arguments. Specify chains.\n");
+		return 1;
+	}
+	// The ligand is found in the first chain by default.
+	if(LIGANDCHAIN==""){
+		LIGANDCHAIN=CHAINS.substr(0,1);
+	}
+	return 0;
+}
+
+// PrintParameters
+// When called, prints the parameters for the run.
+void PrintParameters(){
+	cout << "RUN PARAMETERS" << endl;
+	cout << "mode: " << MODE << endl;
+	if(MODE=="permute"){
+		cout << "longitudinal variants: " << VARFILE << endl;
+		for(unsigned int i=0; i<DISTANCEFILES.size(); i++){
+			cout << "gene residue distances: " << DISTANCEFILES[i] << endl;
+		}
+		cout << "simulations per test: " << NUMSIMULATIONS << endl;
+		cout << "threads: " << NUMTHREADS << endl;
+		cout << "random seed: " << SEED << endl;
+	}
+	else{
+		cout << "PDB file: " << PDBFILE << endl;
+		cout << "chains: " << CHAINS << endl;
+		cout << "residue atoms: " << ATOMS << endl;
+		if(MODE=="ligand"){
+			cout << "ligand: " << LIGAND << " in chain " << LIGANDCHAIN << endl;
+		}
+		else{
+			cout << "distance cutoff: " << CUTOFF << endl;
+		}
+	}
+	cout << "output file: " << OUTFILE << endl;
+	cout << endl;
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: ProteinDistances ligand -p H3-4hmg.pdb -c A,B -l SIA\n"
+			"         -o 4HMG-SialicAcidDistances.data\n");
+	printf("       ProteinDistances residues -p H3-4hmg.pdb -c A,B -a all\n"
+			"         -o 4HMG-ResidueDistances.data\n");
+	printf("       ProteinDistances permute -i LongitudinalVariants.data\n"
+			"         -d 4-HA:4HMG-SialicAcidDistances.data\n"
+			"         -d 6-NA:2BAT-SialicAcidDistances.data:81\n"
+			"         -o PermuteDistances.data\n");
+	printf("\n");
+	printf("Modes:\n");
+	printf("  ligand\tminimal distance of each amino acid in the chains\n"
+			"\t\tfrom the ligand\n");
+	printf("  residues\tminimal distances between amino acids in the chains\n"
+			"\t\tup to the cutoff\n");
+	printf("  permute\tcompare the median ligand distance of variant sites\n"
+			"\t\twith random draws of residues\n");
+	printf("\n");
+	printf("Amino acids are numbered from 1 through the chains in the order given.\n");
+	printf("In permute mode, OFFSET is added to the residue numbers of a gene\n"
+			"to match the variant codons: 81 for 2bat NA, and 16 for 4hmg HA\n"
+			"if codons are numbered from the start of HA as by AnnotateVariants\n"
+			"rather than in H3 numbering [0].\n");
+	printf("\n");
+	printf("Options (defaults in parentheses):\n");
+	printf("  -l STRING\tligand residue name [SIA]\n");
+	printf("  -k CHAR\tchain of the ligand [first chain]\n");
+	printf("  -a STRING\tresidue atoms: CA or all [CA]\n");
+	printf("  -x FLOAT\tresidue distance cutoff in angstroms [8]\n");
+	printf("  -n INT\tnumber of simulations per test [10000]\n");
+	printf("  -t INT\tnumber of threads [all cores]\n");
+	printf("  -s INT\trandom seed [0]\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	MODE="ligand";
+	PDBFILE="pdb.test";
+	CHAINS="A";
+	LIGANDCHAIN="A";
+	OUTFILE="out.test";
+	NUMSIMULATIONS=1000;
+	DEBUG=true;
+}
+
+//
+// StringSplit
+// Takes in a string and a character delimiter
+// and returns a vector of strings split at that character.
+vector<string> StringSplit(string s, char c){
+	vector<string> splits;
+	string s0;
+	unsigned int i=0;
+
+	while(i < s.length()){
+		// Skip through delimiter characters at the beginnings of lines.
+		while(s[i] == c && i < s.length() - 1){
+			i++;
+		}
+		// Iterate through actual characters until you encounter c.
+		while(i < s.length() && s[i] != c){
+			s0 += s[i];
+			i++;
+		}
+		// Once c is encountered, stop and save the string, then reset it.
+		if(s0.size() > 0){
+			splits.push_back(s0);
+			s0 = "";
+		}
+		i++;
+	}
+
+	return splits;
+}
+
+// Trim
+// Returns a string without leading and trailing spaces.
+string Trim(string s){
+	size_t first=s.find_first_not_of(' ');
+	if(first==string::npos){
+		return "";
+	}
+	size_t last=s.find_last_not_of(' ');
+	return s.substr(first, last-first+1);
+}
+
+// ReadPDB
+// Reads the ATOM and HETATM records of the first model of a PDB file.
+// Only the first alternate location of each atom is kept.
+// Atoms of the same chain, residue number, and residue name are grouped
+// into one residue, in the order the residues first appear.
+// Returns 1 if the file does not exist or has no atoms.
+int ReadPDB(string filename, Structure_t *structure){
+	ifstream fin(filename.c_str(), ios::in);
+	if(!fin){
+		return 1;
+	}
+
+	string line;
+	string lastkey="";
+	while(getline(fin, line)){
+		if(line.compare(0, 6, "ENDMDL")==0){
+			break;
+		}
+		if(line.size() < 54 ||
+				(line.compare(0, 6, "ATOM  ")!=0 && line.compare(0, 6, "HETATM")!=0)){
+			continue;
+		}
+		char altloc=line[16];
+		if(altloc!=' ' && altloc!='A' && altloc!='1'){
+			continue;
+		}
+
+		// Start a new residue when the chain, number,
+		// insertion code, or name changes.
+		string key=line.substr(17, 10);
+		if(key!=lastkey){
+			Residue_t residue;
+			residue.Chain=line[21];
+			residue.ResSeq=Trim(line.substr(22, 5));
+			residue.Name=Trim(line.substr(17, 3));
+			for(int a=0; a<20; a++){
+				if(residue.Name==AMINOACIDS[a][0]){
+					residue.Code=AMINOACIDS[a][1][0];
+				}
+			}
+			residue.FirstAtom=(*structure).X.size();
+			(*structure).Residues.push_back(residue);
+			lastkey=key;
+		}
+		Residue_t *residue=&(*structure).Residues.back();
+
+		string name=Trim(line.substr(12, 4));
+		if(name=="CA"){
+			(*residue).CAAtom=(*structure).X.size();
+		}
+		char element=(line.size() >= 78) ? line[77] : name[0];
+		(*structure).X.push_back(atof(line.substr(30, 8).c_str()));
+		(*structure).Y.push_back(atof(line.substr(38, 8).c_str()));
+		(*structure).Z.push_back(atof(line.substr(46, 8).c_str()));
+		(*structure).AtomName.push_back(name);
+		(*structure).Element.push_back(element);
+		(*structure).AtomResidue.push_back((*structure).Residues.size()-1);
+		(*residue).NumAtoms++;
+	}
+	fin.close();
+
+	return (*structure).X.size()==0 ? 1 : 0;
+}
+
+// ChainResidues
+// Lists the amino acids of the given comma-separated chains,
+// chain by chain in the order given.
+// Returns 1 if an amino acid has no alpha carbon.
+int ChainResidues(Structure_t *structure, string chains,
+		vector<int> *residues){
+	vector<string> chainlist=StringSplit(chains, ',');
+	for(unsigned int c=0; c<chainlist.size(); c++){
+		for(unsigned int r=0; r<(*structure).Residues.size(); r++){
+			Residue_t *residue=&(*structure).Residues[r];
+			if((*residue).Chain!=chainlist[c][0] || (*residue).Code==' '){
+				continue;
+			}
+			if((*residue).CAAtom < 0){
+				printf("Error: residue %c %s has no alpha carbon.\n",
+						(*residue).Chain, (*residue).ResSeq.c_str());
+				return 1;
+			}
+			(*residues).push_back(r);
+		}
+	}
+	return 0;
+}
+
+// AtomDistance
+// Returns the distance between two atoms, computed in single precision
+// as BioPDB does, so that distances match the earlier Python output.
+float AtomDistance(Structure_t *structure, int a, int b){
+	float dx=(*structure).X[a]-(*structure).X[b];
+	float dy=(*structure).Y[a]-(*structure).Y[b];
+	float dz=(*structure).Z[a]-(*structure).Z[b];
+	return sqrtf(dx*dx+dy*dy+dz*dz);
+}
+
+// BuildCellList
+// Sorts the given atoms into cubic cells of the given size
+// with a counting sort.
+void BuildCellList(Structure_t *structure, vector<int> *atoms, float size,
+		CellList_t *cells){
+	(*cells).Size=size;
+	float Max[3];
+	for(int d=0; d<3; d++){
+		(*cells).Min[d]=1e30;
+		Max[d]=-1e30;
+	}
+	for(unsigned int i=0; i<(*atoms).size(); i++){
+		int a=(*atoms)[i];
+		float coords[3]={(*structure).X[a], (*structure).Y[a], (*structure).Z[a]};
+		for(int d=0; d<3; d++){
+			(*cells).Min[d]=min((*cells).Min[d], coords[d]);
+			Max[d]=max(Max[d], coords[d]);
+		}
+	}
+	for(int d=0; d<3; d++){
+		(*cells).Dim[d]=(int)((Max[d]-(*cells).Min[d])/size)+1;
+	}
+
+	int numcells=(*cells).Dim[0]*(*cells).Dim[1]*(*cells).Dim[2];
+	vector<int> cellofatom((*atoms).size());
+	(*cells).CellStart.assign(numcells+1, 0);
+	for(unsigned int i=0; i<(*atoms).size(); i++){
+		int a=(*atoms)[i];
+		cellofatom[i]=CellIndex(cells, (*structure).X[a], (*structure).Y[a],
+				(*structure).Z[a], -1);
+		(*cells).CellStart[cellofatom[i]+1]++;
+	}
+	for(int c=0; c<numcells; c++){
+		(*cells).CellStart[c+1] += (*cells).CellStart[c];
+	}
+	vector<int> fill((*cells).CellStart.begin(), (*cells).CellStart.end()-1);
+	(*cells).CellAtoms.resize((*atoms).size());
+	for(unsigned int i=0; i<(*atoms).size(); i++){
+		(*cells).CellAtoms[fill[cellofatom[i]]++]=(*atoms)[i];
+	}
+}
+
+// CellIndex
+// Returns the index of the cell containing a point.
+// If dim is 0, 1, or 2, returns the cell coordinate along that axis instead.
+int CellIndex(CellList_t *cells, float x, float y, float z, int dim){
+	float coords[3]={x, y, z};
+	int cell[3];
+	for(int d=0; d<3; d++){
+		cell[d]=(int)((coords[d]-(*cells).Min[d])/(*cells).Size);
+		cell[d]=max(0, min((*cells).Dim[d]-1, cell[d]));
+	}
+	if(dim>=0){
+		return cell[dim];
+	}
+	return (cell[2]*(*cells).Dim[1]+cell[1])*(*cells).Dim[0]+cell[0];
+}
+
+// WriteLigandDistances
+// Writes the minimal distance of each amino acid in the chains from any
+// atom of the ligand, measured from the alpha carbon or from the nearest
+// atom of the amino acid, in the format of CalculateDistancesHA.py.
+// Returns 1 if the structure cannot be read or has no such ligand.
+int WriteLigandDistances(){
+	Structure_t Structure;
+	if(ReadPDB(PDBFILE, &Structure) != 0){
+		printf("Error: could not read PDB file.\n");
+		return 1;
+	}
+	vector<int> Residues;
+	if(ChainResidues(&Structure, CHAINS, &Residues) != 0){
+		return 1;
+	}
+
+	// Take the last ligand of that name in its chain,
+	// as CalculateDistancesHA.py does.
+	int Ligand=-1;
+	for(unsigned int r=0; r<Structure.Residues.size(); r++){
+		if(Structure.Residues[r].Name==LIGAND &&
+				Structure.Residues[r].Chain==LIGANDCHAIN[0]){
+			Ligand=r;
+		}
+	}
+	if(Ligand<0){
+		printf("Error: ligand %s not found in chain %s.\n",
+				LIGAND.c_str(), LIGANDCHAIN.c_str());
+		return 1;
+	}
+	int LigandFirst=Structure.Residues[Ligand].FirstAtom;
+	int LigandLast=LigandFirst+Structure.Residues[Ligand].NumAtoms;
+	printf("Number of amino acids: %d\n", (int)Residues.size());
+	printf("Number of ligand atoms: %d\n", LigandLast-LigandFirst);
+
+	FILE *fout=fopen(OUTFILE.c_str(), "w");
+	if(fout==NULL){
+		printf("Error: could not open output file.\n");
+		return 1;
+	}
+	fprintf(fout, "AANumber\tChainAANumber\tResidue\tDistance\n");
+	char LastChain=' ';
+	int ChainNumber=0;
+	for(unsigned int i=0; i<Residues.size(); i++){
+		Residue_t *residue=&Structure.Residues[Residues[i]];
+		if((*residue).Chain!=LastChain){
+			LastChain=(*residue).Chain;
+			ChainNumber=0;
+		}
+		ChainNumber++;
+
+		int first=(*residue).CAAtom;
+		int last=first+1;
+		if(ATOMS=="all"){
+			first=(*residue).FirstAtom;
+			last=first+(*residue).NumAtoms;
+		}
+		float mindistance=1e10;
+		for(int a=first; a<last; a++){
+			for(int l=LigandFirst; l<LigandLast; l++){
+				mindistance=min(mindistance, AtomDistance(&Structure, l, a));
+			}
+		}
+		fprintf(fout, "%d\t%d\t%c\t%f\n", i+1, ChainNumber, (*residue).Code,
+				mindistance);
+	}
+	fclose(fout);
+	return 0;
+}
+
+// WriteResidueDistances
+// Writes the minimal distance between each pair of amino acids
+// in the chains that are within the cutoff, measured between alpha
+// carbons or between the nearest heavy atoms. Atoms are sorted into
+// cells as large as the cutoff, so each atom is compared only with the
+// atoms in its own and the neighbouring cells.
+// Returns 1 if the structure cannot be read.
+int WriteResidueDistances(){
+	Structure_t Structure;
+	if(ReadPDB(PDBFILE, &Structure) != 0){
+		printf("Error: could not read PDB file.\n");
+		return 1;
+	}
+	vector<int> Residues;
+	if(ChainResidues(&Structure, CHAINS, &Residues) != 0){
+		return 1;
+	}
+	int NumResidues=Residues.size();
+
+	// List the atoms to compare, and the amino acid number of each atom.
+	vector<int> Atoms;
+	vector<int> AtomNumber(Structure.X.size(), -1);
+	for(int i=0; i<NumResidues; i++){
+		Residue_t *residue=&Structure.Residues[Residues[i]];
+		if(ATOMS=="CA"){
+			Atoms.push_back((*residue).CAAtom);
+			AtomNumber[(*residue).CAAtom]=i;
+			continue;
+		}
+		for(int a=(*residue).FirstAtom; a<(*residue).FirstAtom+(*residue).NumAtoms; a++){
+			if(Structure.Element[a]!='H'){
+				Atoms.push_back(a);
+				AtomNumber[a]=i;
+			}
+		}
+	}
+	printf("Number of amino acids: %d\n", NumResidues);
+	printf("Number of atoms: %d\n", (int)Atoms.size());
+
+	CellList_t Cells;
+	BuildCellList(&Structure, &Atoms, CUTOFF, &Cells);
+
+	// Minimal distance between each pair of amino acids i<j,
+	// stored at i*NumResidues+j, or above the cutoff if none is closer.
+	vector<float> MinDistance((size_t)NumResidues*NumResidues, 1e10);
+	for(unsigned int i=0; i<Atoms.size(); i++){
+		int a=Atoms[i];
+		int cell[3];
+		for(int d=0; d<3; d++){
+			cell[d]=CellIndex(&Cells, Structure.X[a], Structure.Y[a],
+					Structure.Z[a], d);
+		}
+		for(int dz=-1; dz<=1; dz++){
+			int cz=cell[2]+dz;
+			if(cz<0 || cz>=Cells.Dim[2]) continue;
+			for(int dy=-1; dy<=1; dy++){
+				int cy=cell[1]+dy;
+				if(cy<0 || cy>=Cells.Dim[1]) continue;
+				for(int dx=-1; dx<=1; dx++){
+					int cx=cell[0]+dx;
+					if(cx<0 || cx>=Cells.Dim[0]) continue;
+					int c=(cz*Cells.Dim[1]+cy)*Cells.Dim[0]+cx;
+					for(int k=Cells.CellStart[c]; k<Cells.CellStart[c+1]; k++){
+						int b=Cells.CellAtoms[k];
+						if(AtomNumber[a] >= AtomNumber[b]){
+							continue;
+						}
+						float distance=AtomDistance(&Structure, a, b);
+						float *stored=&MinDistance[(size_t)AtomNumber[a]*NumResidues+
+								AtomNumber[b]];
+						if(distance < *stored){
+							*stored=distance;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	FILE *fout=fopen(OUTFILE.c_str(), "w");
+	if(fout==NULL){
+		printf("Error: could not open output file.\n");
+		return 1;
+	}
+	fprintf(fout, "AANumber1\tAANumber2\tResidue1\tResidue2\tDistance\n");
+	long long NumPairs=0;
+	for(int i=0; i<NumResidues; i++){
+		for(int j=i+1; j<NumResidues; j++){
+			float distance=MinDistance[(size_t)i*NumResidues+j];
+			if(distance > CUTOFF){
+				continue;
+			}
+			fprintf(fout, "%d\t%d\t%c\t%c\t%f\n", i+1, j+1,
+					Structure.Residues[Residues[i]].Code,
+					Structure.Residues[Residues[j]].Code, distance);
+			NumPairs++;
+		}
+	}
+	fclose(fout);
+	printf("Number of amino acid pairs within cutoff: %lld\n", NumPairs);
+	return 0;
+}
+
+// ReadTable
+// Reads a delimited table with a header row,
+// and stores the column index of each name.
+// Returns 1 if the file does not exist or a row has too few fields.
+int ReadTable(string filename, char delimiter, map<string, int> *columns,
+		vector<vector<string> > *rows){
+
+	ifstream f_in(filename.c_str(), ios::in);
+	if(!f_in){
+		return 1;
+	}
+
+	string line;
+	if(!getline(f_in, line)){
+		return 1;
+	}
+	vector<string> header=StringSplit(line, delimiter);
+	for(unsigned int i=0; i<header.size(); i++){
+		(*columns)[header[i]]=i;
+	}
+
+	while(getline(f_in, line)){
+		vector<string> fields=StringSplit(line, delimiter);
+		if(fields.size()==0){
+			continue;
+		}
+		if(fields.size() < header.size()){
+			printf("Table %s has a row with too few fields.\n", filename.c_str());
+			return 1;
+		}
+		(*rows).push_back(fields);
+	}
+
+	f_in.close();
+
+	return 0;
+}
+
+// ReadGeneDistances
+// Reads the ligand distances of a gene, given as GENE:FILE[:OFFSET],
+// from a file written in ligand mode. The offset is added to the
+// residue numbers to give the codon numbers of the variants.
+// Returns 1 if the file cannot be read.
+int ReadGeneDistances(string spec, GeneDistances_t *gene){
+	vector<string> parts=StringSplit(spec, ':');
+	if(parts.size() < 2 || parts.size() > 3){
+		printf("Error: specify gene residue distances as GENE:FILE[:OFFSET].\n");
+		return 1;
+	}
+	(*gene).Gene=parts[0];
+	(*gene).Offset=(parts.size()==3) ? atoi(parts[2].c_str()) : 0;
+
+	map<string, int> columns;
+	vector<vector<string> > rows;
+	if(ReadTable(parts[1], '\t', &columns, &rows) != 0 ||
+			columns.count("AANumber")==0 || columns.count("Distance")==0){
+		printf("Error: could not read residue distances %s.\n", parts[1].c_str());
+		return 1;
+	}
+	for(unsigned int i=0; i<rows.size(); i++){
+		int codon=atoi(rows[i][columns["AANumber"]].c_str())+(*gene).Offset;
+		double distance=atof(rows[i][columns["Distance"]].c_str());
+		if((*gene).Distances.count(codon)==0){
+			(*gene).Distances[codon]=distance;
+		}
+		(*gene).AllDistances.push_back(distance);
+	}
+	return 0;
+}
+
+// Median
+// Returns the median of a set of values, averaging the middle two
+// if there is an even number, as R's median does. Reorders the values.
+double Median(vector<double> *values){
+	size_t n=(*values).size();
+	size_t half=n/2;
+	nth_element((*values).begin(), (*values).begin()+half, (*values).end());
+	double upper=(*values)[half];
+	if(n%2==1){
+		return upper;
+	}
+	double lower=*max_element((*values).begin(), (*values).begin()+half);
+	return (lower+upper)/2;
+}
+
+// InitializeStream
+// Sets up the random number stream for one simulation of one test.
+void InitializeStream(RandomStream_t *stream, unsigned long long seed,
+		unsigned int test, unsigned long long simulation){
+	(*stream).Key[0]=(uint32_t) seed;
+	(*stream).Key[1]=(uint32_t) (seed >> 32);
+	(*stream).Counter[0]=0;
+	(*stream).Counter[1]=(uint32_t) simulation;
+	(*stream).Counter[2]=(uint32_t) (simulation >> 32);
+	(*stream).Counter[3]=test;
+	(*stream).Used=4;
+}
+
+// NextRandom
+// Returns the next uniformly distributed 32-bit integer in a stream,
+// computing a new block of four with ten Philox rounds when needed.
+uint32_t NextRandom(RandomStream_t *stream){
+	if((*stream).Used==4){
+		uint32_t c[4];
+		memcpy(c, (*stream).Counter, sizeof(c));
+		uint32_t k0=(*stream).Key[0];
+		uint32_t k1=(*stream).Key[1];
+		for(int round=0; round<10; round++){
+			uint64_t p0=(uint64_t) 0xD2511F53u*c[0];
+			uint64_t p1=(uint64_t) 0xCD9E8D57u*c[2];
+			uint32_t n0=(uint32_t) (p1 >> 32) ^ c[1] ^ k0;
+			uint32_t n1=(uint32_t) p1;
+			uint32_t n2=(uint32_t) (p0 >> 32) ^ c[3] ^ k1;
+			uint32_t n3=(uint32_t) p0;
+			c[0]=n0;
+			c[1]=n1;
+			c[2]=n2;
+			c[3]=n3;
+			k0+=0x9E3779B9u;
+			k1+=0xBB67AE85u;
+		}
+		memcpy((*stream).Block, c, sizeof(c));
+		(*stream).Counter[0]++;
+		(*stream).Used=0;
+	}
+	return (*stream).Block[(*stream).Used++];
+}
+
+// RandomBelow
+// Returns a uniformly distributed integer in [0, n),
+// using Lemire's multiply-and-reject method to avoid modulo bias.
+uint32_t RandomBelow(RandomStream_t *stream, uint32_t n){
+	uint64_t m=(uint64_t) NextRandom(stream)*n;
+	uint32_t low=(uint32_t) m;
+	if(low < n){
+		uint32_t threshold=(uint32_t) (-n) % n;
+		while(low < threshold){
+			m=(uint64_t) NextRandom(stream)*n;
+			low=(uint32_t) m;
+		}
+	}
+	return (uint32_t) (m >> 32);
+}
+
+// RunSimulations
+// Runs simulations first to last-1 of a test and counts the simulations
+// whose median distance is at most the observed median.
+// Residues are drawn without replacement for each patient
+// with Floyd's algorithm, marking the residues drawn with stamps.
+void RunSimulations(PermutationTest_t *test, unsigned int testindex,
+		long long first, long long last, long long *numatmost){
+	int n=(*(*test).Pool).size();
+	vector<uint32_t> stamp(n, 0);
+	uint32_t numdraws=0;
+	vector<double> drawn;
+	RandomStream_t stream;
+	(*numatmost)=0;
+	for(long long s=first; s<last; s++){
+		InitializeStream(&stream, SEED, testindex, s);
+		drawn.clear();
+		for(unsigned int p=0; p<(*test).Draws.size(); p++){
+			numdraws++;
+			int k=(*test).Draws[p];
+			for(int j=n-k; j<n; j++){
+				int residue=RandomBelow(&stream, j+1);
+				if(stamp[residue]==numdraws){
+					residue=j;
+				}
+				stamp[residue]=numdraws;
+				drawn.push_back((*(*test).Pool)[residue]);
+			}
+		}
+		if(Median(&drawn) <= (*test).Observed){
+			(*numatmost)++;
+		}
+	}
+}
+
+// RunPermutationTest
+// Runs NUMSIMULATIONS simulations of a test, divided among NUMTHREADS
+// threads, and counts those at or below the observed median.
+void RunPermutationTest(PermutationTest_t *test, unsigned int testindex){
+	int numthreads=NUMTHREADS;
+	if(numthreads > NUMSIMULATIONS){
+		numthreads=NUMSIMULATIONS;
+	}
+	vector<long long> numatmost(numthreads, 0);
+	vector<thread> threads;
+	for(int t=0; t<numthreads; t++){
+		long long first=NUMSIMULATIONS*t/numthreads;
+		long long last=NUMSIMULATIONS*(t+1)/numthreads;
+		threads.push_back(thread(RunSimulations, test, testindex,
+				first, last, &numatmost[t]));
+	}
+	(*test).NumAtMost=0;
+	for(int t=0; t<numthreads; t++){
+		threads[t].join();
+		(*test).NumAtMost += numatmost[t];
+	}
+}
+
+// RunPermutations
+// Tests whether variant sites are closer to the ligand than random
+// residues, as PermuteDistances.R does. For nonsynonymous and synonymous
+// variants in each gene, each patient's sites are redrawn from all
+// residues in the structure. For sites mutated in more than one patient,
+// the same number of residues is drawn once.
+// Only variant sites in the structure are tested.
+// Returns 1 if an input cannot be read.
+int RunPermutations(){
+
+	vector<GeneDistances_t> Genes(DISTANCEFILES.size());
+	for(unsigned int g=0; g<DISTANCEFILES.size(); g++){
+		if(ReadGeneDistances(DISTANCEFILES[g], &Genes[g]) != 0){
+			return 1;
+		}
+	}
+
+	// Read in the distinct sites of each patient, gene, and amino-acid
+	// change, where variants that keep the amino acid are synonymous.
+	map<string, int> columns;
+	vector<vector<string> > rows;
+	if(ReadTable(VARFILE, ' ', &columns, &rows) != 0){
+		printf("Error: could not read longitudinal variants.\n");
+		return 1;
+	}
+	const char *required[]={"Patient", "Gene", "Codon", "InitAA", "DerAA"};
+	for(int c=0; c<5; c++){
+		if(columns.count(required[c])==0){
+			printf("Error: longitudinal variants have no %s column.\n", required[c]);
+			return 1;
+		}
+	}
+	// Sites[gene][aachange][patient] is the set of codons.
+	map<string, map<string, map<string, set<int> > > > Sites;
+	for(unsigned int i=0; i<rows.size(); i++){
+		vector<string> *row=&rows[i];
+		string aachange=((*row)[columns["InitAA"]]==(*row)[columns["DerAA"]]) ?
+				"S" : "NS";
+		Sites[(*row)[columns["Gene"]]][aachange][(*row)[columns["Patient"]]].insert(
+				atoi((*row)[columns["Codon"]].c_str()));
+	}
+
+	// Set up the tests, with the observed median distance of each.
+	vector<PermutationTest_t> Tests;
+	const char *AAChanges[]={"NS", "S"};
+	for(int c=0; c<2; c++){
+		for(unsigned int g=0; g<Genes.size(); g++){
+			PermutationTest_t test;
+			test.Gene=Genes[g].Gene;
+			test.AAChange=AAChanges[c];
+			test.Pool=&Genes[g].AllDistances;
+			vector<double> observed;
+			map<string, set<int> > *patients=&Sites[test.Gene][test.AAChange];
+			for(map<string, set<int> >::iterator it=(*patients).begin();
+					it!=(*patients).end(); ++it){
+				int numsites=0;
+				for(set<int>::iterator s=it->second.begin(); s!=it->second.end(); ++s){
+					if(Genes[g].Distances.count(*s)>0){
+						observed.push_back(Genes[g].Distances[*s]);
+						numsites++;
+					}
+				}
+				if(numsites>0){
+					test.Draws.push_back(numsites);
+				}
+			}
+			if(observed.size()==0){
+				continue;
+			}
+			test.Observed=Median(&observed);
+			Tests.push_back(test);
+		}
+	}
+
+	// Sites mutated in more than one patient or with both kinds of change.
+	for(unsigned int g=0; g<Genes.size(); g++){
+		map<int, int> counts;
+		for(int c=0; c<2; c++){
+			map<string, set<int> > *patients=&Sites[Genes[g].Gene][AAChanges[c]];
+			for(map<string, set<int> >::iterator it=(*patients).begin();
+					it!=(*patients).end(); ++it){
+				for(set<int>::iterator s=it->second.begin(); s!=it->second.end(); ++s){
+					counts[*s]++;
+				}
+			}
+		}
+		vector<double> observed;
+		for(int c=0; c<2; c++){
+			set<int> codons;
+			map<string, set<int> > *patients=&Sites[Genes[g].Gene][AAChanges[c]];
+			for(map<string, set<int> >::iterator it=(*patients).begin();
+					it!=(*patients).end(); ++it){
+				codons.insert(it->second.begin(), it->second.end());
+			}
+			for(set<int>::iterator s=codons.begin(); s!=codons.end(); ++s){
+				if(counts[*s]>1 && Genes[g].Distances.count(*s)>0){
+					observed.push_back(Genes[g].Distances[*s]);
+				}
+			}
+		}
+		if(observed.size()==0){
+			continue;
+		}
+		PermutationTest_t test;
+		test.Gene=Genes[g].Gene;
+		test.AAChange="parallel";
+		test.Pool=&Genes[g].AllDistances;
+		test.Draws.push_back(observed.size());
+		test.Observed=Median(&observed);
+		Tests.push_back(test);
+	}
+
+	//==================================================
+	// Run the tests and output the p-values: the proportion of
+	// simulations with a median distance at most the observed median.
+	//==================================================
+
+	ofstream fout(OUTFILE.c_str(), ios::out);
+	if(!fout){
+		printf("Error: could not open output file.\n");
+		return 1;
+	}
+	fout << setprecision(15);
+	fout << "Gene AAChange NumPermutations pvalue\n";
+	for(unsigned int t=0; t<Tests.size(); t++){
+		printf("Testing %s %s sites.\n", Tests[t].Gene.c_str(),
+				Tests[t].AAChange.c_str());
+		RunPermutationTest(&Tests[t], t);
+		fout << Tests[t].Gene << " " << Tests[t].AAChange << " "
+				<< NUMSIMULATIONS << " "
+				<< (double)Tests[t].NumAtMost/NUMSIMULATIONS << "\n";
+	}
+	fout.close();
+
+	return 0;
+}
@@ -0,0 +1,845 @@
+//============================================================================
+// Name        : ReconstructHaplotypes.cpp
+// Version     : 1.0
+// Description : 1.0 Given the read-pair haplotypes output by CountHaplotypes,
+//               estimate the frequencies of haplotypes spanning all sites
+//               of interest by expectation maximization.
+//               Read-pair haplotypes are counted as unique patterns, and
+//               candidate haplotypes are built up one site at a time,
+//               running EM and pruning rare candidates after each site.
+//               Calls are packed into bitsets to check compatibility,
+//               and E-steps run over batches of patterns in parallel
+//               threads; batches are summed in order, so results do not
+//               depend on the number of threads.
+//============================================================================
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cmath>
+#include <thread>
+#include <chrono>
+
+using namespace std;
+
+// RUN PARAMETERS
+string VERSION="1.0";
+string INFILE="";
+string OUTFILE="";
+string LOGFILE="";
+double MINFREQ=0.001;
+int MAXHAPLOTYPES=256;
+double TOLERANCE=1e-6;
+int MAXITERATIONS=1000;
+int NUMTHREADS=0;
+
+bool DEBUG=false;
+
+// Number of unique read-pair haplotypes in each batch of the E-step.
+// Batches are fixed so that their sums, and so the estimates,
+// are the same for any number of threads.
+const int BATCHSIZE=1024;
+
+// Major and minor alleles at a site of interest:
+// the two most common bases among the read-pair haplotypes.
+struct SiteAlleles_t{
+	char Major='N';
+	char Minor='N';
+	long long MajorCount=0;
+	long long MinorCount=0;
+};
+
+// Unique read-pair haplotypes (fragments) and candidate haplotypes.
+// The sites at which a fragment is called as the major or minor allele
+// (FragmentCalled) and the sites at which a fragment or candidate carries
+// the minor allele (FragmentMinor, CandidateMinor) are packed into bitsets
+// of NumWords words each. Only the sites in Active are considered.
+// For the E-step, each batch of fragments keeps the candidates compatible
+// with each of its fragments, in CompatibleStart and Compatible,
+// and its own expected counts of the candidates and log-likelihood.
+struct EMData_t{
+	int NumWords=0;
+	int NumFragments=0;
+	vector<uint64_t> FragmentCalled;
+	vector<uint64_t> FragmentMinor;
+	vector<double> FragmentCount;
+	vector<uint64_t> Active;
+	int NumCandidates=0;
+	vector<uint64_t> CandidateMinor;
+	vector<double> Frequency;
+	int NumBatches=0;
+	vector<vector<int> > CompatibleStart;
+	vector<vector<int> > Compatible;
+	vector<vector<double> > ExpectedCounts;
+	vector<double> LogLikelihood;
+	vector<double> Explained;
+	vector<double> Unexplained;
+};
+
+// Convergence of EM after adding a site.
+struct EMResult_t{
+	int Iterations=0;
+	double LogLikelihood=0;
+	double MaxChange=0;
+	double Explained=0;
+	double Unexplained=0;
+};
+
+
+// FUNCTIONS
+int ArgsParse(int argc, char *argv[]);
+void PrintUsage();
+void PrintParameters();
+void SetDebug();
+vector<string> StringSplit(string s, char c);
+int ReadFragments(string filename, vector<string> *sites,
+		map<string, long long> *fragmentcounts);
+void CountSiteAlleles(map<string, long long> *fragmentcounts, int numsites,
+		vector<SiteAlleles_t> *alleles);
+void EncodeFragments(map<string, long long> *fragmentcounts,
+		vector<SiteAlleles_t> *alleles, EMData_t *data);
+void RunBatches(void (*work)(EMData_t *, int), EMData_t *data);
+void FindCompatible(EMData_t *data, int batch);
+void EStep(EMData_t *data, int batch);
+EMResult_t RunEM(EMData_t *data);
+void ExtendCandidates(EMData_t *data, int site, SiteAlleles_t *alleles);
+void PruneCandidates(EMData_t *data);
+int WriteHaplotypes(string filename, EMData_t *data, vector<string> *sites,
+		vector<SiteAlleles_t> *alleles, double totalcount);
+
+int main(int argc, char *argv[]) {
+
+	//==================================================
+	// Parse command-line arguments.
+	//==================================================
+
+	if(ArgsParse(argc, argv) != 0){
+		PrintUsage();
+		return 1;
+	}
+
+	if(NUMTHREADS<=0){
+		NUMTHREADS=thread::hardware_concurrency();
+		if(NUMTHREADS<=0){
+			NUMTHREADS=1;
+		}
+	}
+
+	PrintParameters();
+
+	chrono::steady_clock::time_point Start=chrono::steady_clock::now();
+
+	//==================================================
+	// Read in and encode the read-pair haplotypes.
+	//==================================================
+
+	printf("Reading read-pair haplotypes.\n");
+	vector<string> Sites;
+	map<string, long long> FragmentCounts;
+	if(ReadFragments(INFILE, &Sites, &FragmentCounts) != 0){
+		printf("Error: could not read haplotype file.\n");
+		return 1;
+	}
+	int NumSites=Sites.size();
+	if(NumSites==0){
+		printf("Error: no sites in haplotype file.\n");
+		return 1;
+	}
+
+	vector<SiteAlleles_t> Alleles;
+	CountSiteAlleles(&FragmentCounts, NumSites, &Alleles);
+
+	EMData_t Data;
+	EncodeFragments(&FragmentCounts, &Alleles, &Data);
+	double TotalCount=0;
+	for(int f=0; f<Data.NumFragments; f++){
+		TotalCount += Data.FragmentCount[f];
+	}
+	printf("Number of sites: %d\n", NumSites);
+	printf("Number of read pairs: %.0f\n", TotalCount);
+	printf("Number of unique read-pair haplotypes: %d\n", Data.NumFragments);
+
+	//==================================================
+	// Build up candidate haplotypes one site at a time.
+	//==================================================
+
+	ofstream flog;
+	if(LOGFILE!=""){
+		flog.open(LOGFILE.c_str(), ios::out);
+		if(!flog){
+			printf("Error: could not open convergence log.\n");
+			return 1;
+		}
+		flog << "Site\tCandidates\tIterations\tLogLikelihood\tMaxChange\t"
+				"Unexplained\tSeconds\n";
+	}
+
+	printf("Estimating haplotype frequencies.\n");
+	EMResult_t Result;
+	long long TotalIterations=0;
+	for(int s=0; s<NumSites; s++){
+		chrono::steady_clock::time_point SiteStart=chrono::steady_clock::now();
+		ExtendCandidates(&Data, s, &Alleles[s]);
+		RunBatches(FindCompatible, &Data);
+		Result=RunEM(&Data);
+		TotalIterations += Result.Iterations;
+		int NumCandidates=Data.NumCandidates;
+		PruneCandidates(&Data);
+		double Seconds=chrono::duration<double>(
+				chrono::steady_clock::now()-SiteStart).count();
+		if(LOGFILE!=""){
+			flog << Sites[s] << "\t" << NumCandidates << "\t"
+					<< Result.Iterations << "\t" << Result.LogLikelihood << "\t"
+					<< Result.MaxChange << "\t" << Result.Unexplained << "\t"
+					<< Seconds << "\n";
+		}
+		if(Result.Iterations==MAXITERATIONS && Result.MaxChange>=TOLERANCE){
+			printf("Warning: EM did not converge at site %s.\n", Sites[s].c_str());
+		}
+	}
+	if(LOGFILE!=""){
+		flog.close();
+	}
+
+	// Re-estimate the frequencies of the remaining candidates,
+	// so that they sum to one without the pruned candidates.
+	RunBatches(FindCompatible, &Data);
+	Result=RunEM(&Data);
+	TotalIterations += Result.Iterations;
+
+	//==================================================
+	// Output the haplotypes and convergence summary.
+	//==================================================
+
+	if(WriteHaplotypes(OUTFILE, &Data, &Sites, &Alleles, TotalCount) != 0){
+		printf("Error: could not write output file.\n");
+		return 1;
+	}
+
+	double Seconds=chrono::duration<double>(
+			chrono::steady_clock::now()-Start).count();
+	printf("Number of haplotypes: %d\n", Data.NumCandidates);
+	printf("Total EM iterations: %lld\n", TotalIterations);
+	printf("Final EM iterations: %d\n", Result.Iterations);
+	printf("Final maximum frequency change: %g\n", Result.MaxChange);
+	printf("Final log-likelihood: %.6f\n", Result.LogLikelihood);
+	printf("Read pairs compatible with a haplotype: %.0f\n", Result.Explained);
+	printf("Read pairs compatible with no haplotype: %.0f\n", Result.Unexplained);
+	printf("Run time (s): %.2f\n", Seconds);
+
+	return 0;
+}
+
+// ArgsParse
+// Parses command-line arguments.
+// Returns 1 if any argument conditions are violated.
+int ArgsParse(int argc, char *argv[]){
+
+	// If the only argument is debug,
+	// set all parameters to the debug state.
+	if(argc==2 && strcmp(argv[1],"debug")==0){
+		SetDebug();
+		return 0;
+	}
+
+	// Ensure that there are an even number of arguments,
+	// leaving aside the program name.
+	if((argc - 1) % 2 != 0){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	// Check the structure of arguments.
+	for(int i=1; i<argc; i++){
+		// Verify that every other argument is a flag.
+		if(i%2 != 0){
+			if(argv[i][0] != '-' || strlen(argv[i])!=2){
+				printf("Invalid use of argument flags.\n");
+				return 1;
+			}
+		}
+	}
+
+	// Parse each pair of arguments.
+	for(int i=0; i<(argc-1)/2; i++){
+
+		string flag=argv[2*i+1];
+		string arg=argv[2*i+2];
+
+		// Parse the flag string.
+		switch(flag[1]){
+		// -i read-pair haplotypes from CountHaplotypes
+		case 'i':
+			INFILE = arg;
+			break;
+		// -o output haplotypes and frequencies
+		case 'o':
+			OUTFILE = arg;
+			break;
+		// -l output convergence log
+		case 'l':
+			LOGFILE = arg;
+			break;
+		// -p minimum frequency of a candidate haplotype
+		case 'p':
+			MINFREQ = atof(arg.c_str());
+			if(MINFREQ < 0 || MINFREQ >= 1){
+				printf("Invalid -p minimum frequency.\n");
+				return 1;
+			}
+			break;
+		// -m maximum number of candidate haplotypes
+		case 'm':
+			MAXHAPLOTYPES = atoi(arg.c_str());
+			if(MAXHAPLOTYPES <= 0){
+				printf("Invalid -m maximum number of haplotypes.\n");
+				return 1;
+			}
+			break;
+		// -e convergence tolerance
+		case 'e':
+			TOLERANCE = atof(arg.c_str());
+			if(TOLERANCE <= 0){
+				printf("Invalid -e tolerance.\n");
+				return 1;
+			}
+			break;
+		// -n maximum number of EM iterations per site
+		case 'n':
+			MAXITERATIONS = atoi(arg.c_str());
+			if(MAXITERATIONS <= 0){
+				printf("Invalid -n maximum number of iterations.\n");
+				return 1;
+			}
+			break;
+		// -t number of threads
+		case 't':
+			NUMTHREADS = atoi(arg.c_str());
+			break;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(INFILE==""){
+		printf("Invalid arguments. Specify haplotype file.\n");
+		return 1;
+	}
+	if(OUTFILE==""){
+		printf("Invalid arguments. Specify output file.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// PrintParameters
+// When called, prints the parameters for the run.
+void PrintParameters(){
+	cout << "ReconstructHaplotypes version " << VERSION << endl;
+	cout << "RUN PARAMETERS" << endl;
+	cout << "haplotype file: " << INFILE << endl;
+	cout << "output file: " << OUTFILE << endl;
+	if(LOGFILE!=""){
+		cout << "convergence log: " << LOGFILE << endl;
+	}
+	cout << "minimum haplotype frequency: " << MINFREQ << endl;
+	cout << "maximum number of haplotypes: " << MAXHAPLOTYPES << endl;
+	cout << "convergence tolerance: " << TOLERANCE << endl;
+	cout << "maximum EM iterations per site: " << MAXITERATIONS << endl;
+	cout << "threads: " << NUMTHREADS << endl;
+	cout << endl;
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: ReconstructHaplotypes -i in.haplotypes -o out.hapfreq\n");
+	printf("Given the read-pair haplotypes output by CountHaplotypes,\n"
+			"estimate the frequencies of haplotypes spanning all sites\n"
+			"by expectation maximization.\n");
+	printf("\n");
+	printf("  -i FILE\tread-pair haplotypes, one per line, as output by\n"
+			"\t\tCountHaplotypes; with -h 1, sites are named by the header\n");
+	printf("  -o FILE\toutput haplotypes, their frequencies, and expected\n"
+			"\t\tnumbers of read pairs\n");
+	printf("options (defaults in parentheses):\n");
+	printf("  -l FILE\toutput convergence log, one line per site added\n");
+	printf("  -p FLOAT\tminimum frequency of a candidate haplotype [0.001]\n");
+	printf("  -m INT\tmaximum number of candidate haplotypes [256]\n");
+	printf("  -e FLOAT\tconvergence tolerance on the largest change\n"
+			"\t\tin a haplotype frequency [1e-6]\n");
+	printf("  -n INT\tmaximum EM iterations per site [1000]\n");
+	printf("  -t INT\tnumber of threads [all cores]\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	INFILE="test.haplotypes";
+	OUTFILE="test.hapfreq";
+	LOGFILE="test.emlog";
+	DEBUG=true;
+}
+
+//
+// StringSplit
+// Takes in a string and a character delimiter
+// and returns a vector of strings split at that character.
+vector<string> StringSplit(string s, char c){
+	vector<string> splits;
+	string s0;
+	unsigned int i=0;
+
+	while(i < s.length()){
+		// Skip through delimiter characters at the beginnings of lines.
+		while(s[i] == c && i < s.length() - 1){
+			i++;
+		}
+		// Iterate through actual characters until you encounter c.
+		while(i < s.length() && s[i] != c){
+			s0 += s[i];
+			i++;
+		}
+		// Once c is encountered, stop and save the string, then reset it.
+		if(s0.size() > 0){
+			splits.push_back(s0);
+			s0 = "";
+		}
+		i++;
+	}
+
+	return splits;
+}
+
+//
+// ReadFragments
+// Reads the tab-delimited read-pair haplotypes output by CountHaplotypes
+// and counts each unique haplotype. If the file starts with the header
+// of one-indexed sites, the sites are named by it, and otherwise they are
+// named by their column. Returns 1 if the file does not exist
+// or a haplotype has the wrong number of sites.
+int ReadFragments(string filename, vector<string> *sites,
+		map<string, long long> *fragmentcounts){
+	ifstream f_in(filename.c_str(), ios::in);
+	if(!f_in){
+		return 1;
+	}
+
+	string line;
+	bool First=true;
+	while(getline(f_in, line)){
+		vector<string> fields=StringSplit(line, '\t');
+		if(fields.size()==0){
+			continue;
+		}
+		if(First){
+			First=false;
+			if(isdigit(fields[0][0])){
+				*sites=fields;
+				continue;
+			}
+			for(unsigned int i=0; i<fields.size(); i++){
+				(*sites).push_back(to_string(i+1));
+			}
+		}
+		if(fields.size()!=(*sites).size()){
+			printf("Haplotype has %d sites instead of %d.\n",
+					(int) fields.size(), (int) (*sites).size());
+			return 1;
+		}
+		string haplotype;
+		for(unsigned int i=0; i<fields.size(); i++){
+			haplotype += fields[i][0];
+		}
+		(*fragmentcounts)[haplotype]++;
+	}
+
+	f_in.close();
+	return 0;
+}
+
+//
+// CountSiteAlleles
+// Given the counts of each read-pair haplotype, finds the major and minor
+// alleles at each site, i.e. the two most common bases other than N.
+void CountSiteAlleles(map<string, long long> *fragmentcounts, int numsites,
+		vector<SiteAlleles_t> *alleles){
+	string Bases="ACGT";
+	vector<long long> BaseCounts(numsites*4, 0);
+	for(map<string, long long>::iterator it=(*fragmentcounts).begin();
+			it!=(*fragmentcounts).end(); ++it){
+		for(int s=0; s<numsites; s++){
+			size_t b=Bases.find(it->first[s]);
+			if(b!=string::npos){
+				BaseCounts[s*4+b] += it->second;
+			}
+		}
+	}
+
+	(*alleles).assign(numsites, SiteAlleles_t());
+	for(int s=0; s<numsites; s++){
+		int major=-1;
+		int minor=-1;
+		for(int b=0; b<4; b++){
+			long long count=BaseCounts[s*4+b];
+			if(count==0){
+				continue;
+			}
+			if(major<0 || count>BaseCounts[s*4+major]){
+				minor=major;
+				major=b;
+			}
+			else if(minor<0 || count>BaseCounts[s*4+minor]){
+				minor=b;
+			}
+		}
+		if(major>=0){
+			(*alleles)[s].Major=Bases[major];
+			(*alleles)[s].MajorCount=BaseCounts[s*4+major];
+		}
+		if(minor>=0){
+			(*alleles)[s].Minor=Bases[minor];
+			(*alleles)[s].MinorCount=BaseCounts[s*4+minor];
+		}
+	}
+}
+
+//
+// EncodeFragments
+// Packs the calls of each unique read-pair haplotype into bitsets,
+// treating bases other than the major and minor alleles as uncalled.
+// Read-pair haplotypes with no calls are dropped. Starts the candidates
+// with a single empty haplotype, and splits the fragments into batches.
+void EncodeFragments(map<string, long long> *fragmentcounts,
+		vector<SiteAlleles_t> *alleles, EMData_t *data){
+	int NumSites=(*alleles).size();
+	int NumWords=(NumSites+63)/64;
+	(*data).NumWords=NumWords;
+	vector<uint64_t> Called(NumWords);
+	vector<uint64_t> Minor(NumWords);
+	for(map<string, long long>::iterator it=(*fragmentcounts).begin();
+			it!=(*fragmentcounts).end(); ++it){
+		fill(Called.begin(), Called.end(), 0);
+		fill(Minor.begin(), Minor.end(), 0);
+		bool AnyCalled=false;
+		for(int s=0; s<NumSites; s++){
+			char base=it->first[s];
+			uint64_t bit=1ULL << (s % 64);
+			if(base=='N'){
+				continue;
+			}
+			if(base==(*alleles)[s].Major){
+				Called[s/64] |= bit;
+				AnyCalled=true;
+			}
+			else if(base==(*alleles)[s].Minor){
+				Called[s/64] |= bit;
+				Minor[s/64] |= bit;
+				AnyCalled=true;
+			}
+		}
+		if(!AnyCalled){
+			continue;
+		}
+		(*data).FragmentCalled.insert((*data).FragmentCalled.end(),
+				Called.begin(), Called.end());
+		(*data).FragmentMinor.insert((*data).FragmentMinor.end(),
+				Minor.begin(), Minor.end());
+		(*data).FragmentCount.push_back(it->second);
+	}
+	(*data).NumFragments=(*data).FragmentCount.size();
+	(*data).Active.assign(NumWords, 0);
+
+	(*data).NumCandidates=1;
+	(*data).CandidateMinor.assign(NumWords, 0);
+	(*data).Frequency.assign(1, 1.0);
+
+	int NumBatches=((*data).NumFragments+BATCHSIZE-1)/BATCHSIZE;
+	(*data).NumBatches=NumBatches;
+	(*data).CompatibleStart.resize(NumBatches);
+	(*data).Compatible.resize(NumBatches);
+	(*data).ExpectedCounts.resize(NumBatches);
+	(*data).LogLikelihood.resize(NumBatches);
+	(*data).Explained.resize(NumBatches);
+	(*data).Unexplained.resize(NumBatches);
+}
+
+//
+// RunBatches
+// Runs a function on every batch of fragments, dividing the batches
+// among NUMTHREADS threads.
+void RunBatches(void (*work)(EMData_t *, int), EMData_t *data){
+	int numthreads=NUMTHREADS;
+	if(numthreads > (*data).NumBatches){
+		numthreads=(*data).NumBatches;
+	}
+	if(numthreads<=1){
+		for(int b=0; b<(*data).NumBatches; b++){
+			work(data, b);
+		}
+		return;
+	}
+	vector<thread> threads;
+	for(int t=0; t<numthreads; t++){
+		threads.push_back(thread([work, data, t, numthreads](){
+			for(int b=t; b<(*data).NumBatches; b+=numthreads){
+				work(data, b);
+			}
+		}));
+	}
+	for(int t=0; t<numthreads; t++){
+		threads[t].join();
+	}
+}
+
+//
+// FindCompatible
+// For each fragment in a batch, lists the candidates that carry the same
+// allele at every active site at which the fragment is called.
+// Fragments with no calls at active sites are left with no candidates,
+// since they carry no information yet.
+void FindCompatible(EMData_t *data, int batch){
+	int NumWords=(*data).NumWords;
+	int First=batch*BATCHSIZE;
+	int Last=min(First+BATCHSIZE, (*data).NumFragments);
+	vector<int> *Start=&(*data).CompatibleStart[batch];
+	vector<int> *Compatible=&(*data).Compatible[batch];
+	(*Start).assign(1, 0);
+	(*Compatible).clear();
+	vector<uint64_t> Mask(NumWords);
+	for(int f=First; f<Last; f++){
+		const uint64_t *Called=&(*data).FragmentCalled[f*NumWords];
+		const uint64_t *Minor=&(*data).FragmentMinor[f*NumWords];
+		uint64_t AnyActive=0;
+		for(int w=0; w<NumWords; w++){
+			Mask[w]=Called[w] & (*data).Active[w];
+			AnyActive |= Mask[w];
+		}
+		if(AnyActive!=0){
+			for(int h=0; h<(*data).NumCandidates; h++){
+				const uint64_t *Candidate=&(*data).CandidateMinor[h*NumWords];
+				uint64_t Mismatch=0;
+				for(int w=0; w<NumWords; w++){
+					Mismatch |= (Candidate[w] ^ Minor[w]) & Mask[w];
+				}
+				if(Mismatch==0){
+					(*Compatible).push_back(h);
+				}
+			}
+		}
+		(*Start).push_back((*Compatible).size());
+	}
+}
+
+//
+// EStep
+// For each fragment in a batch with compatible candidates, divides its
+// count among them in proportion to their frequencies, and adds the
+// log-likelihood of the fragment. Fragments with calls at active sites
+// but no compatible candidate are counted as unexplained.
+void EStep(EMData_t *data, int batch){
+	int First=batch*BATCHSIZE;
+	int Last=min(First+BATCHSIZE, (*data).NumFragments);
+	vector<int> *Start=&(*data).CompatibleStart[batch];
+	vector<int> *Compatible=&(*data).Compatible[batch];
+	vector<double> *Expected=&(*data).ExpectedCounts[batch];
+	const double *Frequency=&(*data).Frequency[0];
+	(*Expected).assign((*data).NumCandidates, 0);
+	double LogLikelihood=0;
+	double Explained=0;
+	double Unexplained=0;
+	int NumWords=(*data).NumWords;
+	for(int f=First; f<Last; f++){
+		int i=f-First;
+		int begin=(*Start)[i];
+		int end=(*Start)[i+1];
+		double count=(*data).FragmentCount[f];
+		if(begin==end){
+			const uint64_t *Called=&(*data).FragmentCalled[f*NumWords];
+			for(int w=0; w<NumWords; w++){
+				if((Called[w] & (*data).Active[w])!=0){
+					Unexplained += count;
+					break;
+				}
+			}
+			continue;
+		}
+		double Total=0;
+		for(int j=begin; j<end; j++){
+			Total += Frequency[(*Compatible)[j]];
+		}
+		if(Total<=0){
+			Unexplained += count;
+			continue;
+		}
+		for(int j=begin; j<end; j++){
+			int h=(*Compatible)[j];
+			(*Expected)[h] += count*Frequency[h]/Total;
+		}
+		LogLikelihood += count*log(Total);
+		Explained += count;
+	}
+	(*data).LogLikelihood[batch]=LogLikelihood;
+	(*data).Explained[batch]=Explained;
+	(*data).Unexplained[batch]=Unexplained;
+}
+
+//
+// RunEM
+// Iterates E-steps over all batches, summing the batches in order,
+// and M-steps until the largest change in a candidate's frequency
+// is below TOLERANCE or MAXITERATIONS is reached.
+// The log-likelihood is that of the last E-step.
+EMResult_t RunEM(EMData_t *data){
+	EMResult_t result;
+	vector<double> Updated((*data).NumCandidates);
+	while(result.Iterations<MAXITERATIONS){
+		RunBatches(EStep, data);
+		fill(Updated.begin(), Updated.end(), 0);
+		result.LogLikelihood=0;
+		result.Explained=0;
+		result.Unexplained=0;
+		for(int b=0; b<(*data).NumBatches; b++){
+			for(int h=0; h<(*data).NumCandidates; h++){
+				Updated[h] += (*data).ExpectedCounts[b][h];
+			}
+			result.LogLikelihood += (*data).LogLikelihood[b];
+			result.Explained += (*data).Explained[b];
+			result.Unexplained += (*data).Unexplained[b];
+		}
+		result.Iterations++;
+
+		// With no informative fragments, the frequencies stay as they are.
+		if(result.Explained<=0){
+			result.MaxChange=0;
+			break;
+		}
+		result.MaxChange=0;
+		for(int h=0; h<(*data).NumCandidates; h++){
+			Updated[h] /= result.Explained;
+			result.MaxChange=max(result.MaxChange,
+					fabs(Updated[h]-(*data).Frequency[h]));
+			(*data).Frequency[h]=Updated[h];
+		}
+		if(result.MaxChange<TOLERANCE){
+			break;
+		}
+	}
+	return result;
+}
+
+//
+// ExtendCandidates
+// Adds a site to the active sites, and extends each candidate with the
+// major allele and, if the site is polymorphic, the minor allele.
+// Each extension starts with the candidate's frequency times
+// the frequency of the allele among the read-pair haplotypes.
+void ExtendCandidates(EMData_t *data, int site, SiteAlleles_t *alleles){
+	int NumWords=(*data).NumWords;
+	uint64_t bit=1ULL << (site % 64);
+	(*data).Active[site/64] |= bit;
+	if((*alleles).MinorCount==0){
+		return;
+	}
+
+	double MinorFrequency=(double) (*alleles).MinorCount/
+			((*alleles).MajorCount+(*alleles).MinorCount);
+	int NumCandidates=(*data).NumCandidates;
+	(*data).CandidateMinor.resize(2*NumCandidates*NumWords);
+	(*data).Frequency.resize(2*NumCandidates);
+	for(int h=0; h<NumCandidates; h++){
+		uint64_t *Major=&(*data).CandidateMinor[h*NumWords];
+		uint64_t *Minor=&(*data).CandidateMinor[(NumCandidates+h)*NumWords];
+		copy(Major, Major+NumWords, Minor);
+		Minor[site/64] |= bit;
+		(*data).Frequency[NumCandidates+h]=(*data).Frequency[h]*MinorFrequency;
+		(*data).Frequency[h] *= 1-MinorFrequency;
+	}
+	(*data).NumCandidates=2*NumCandidates;
+}
+
+//
+// PruneCandidates
+// Drops candidates with frequency below MINFREQ, keeping at most
+// MAXHAPLOTYPES of the most frequent, and always the most frequent one.
+// The remaining candidates are ordered by frequency
+// and their frequencies rescaled to sum to one.
+void PruneCandidates(EMData_t *data){
+	int NumWords=(*data).NumWords;
+	vector<pair<double, int> > Order;
+	for(int h=0; h<(*data).NumCandidates; h++){
+		Order.push_back(make_pair(-(*data).Frequency[h], h));
+	}
+	sort(Order.begin(), Order.end());
+
+	vector<uint64_t> CandidateMinor;
+	vector<double> Frequency;
+	double Total=0;
+	for(unsigned int i=0; i<Order.size(); i++){
+		double frequency=-Order[i].first;
+		if(i>0 && (frequency<MINFREQ || (int) i>=MAXHAPLOTYPES)){
+			break;
+		}
+		const uint64_t *Minor=&(*data).CandidateMinor[Order[i].second*NumWords];
+		CandidateMinor.insert(CandidateMinor.end(), Minor, Minor+NumWords);
+		Frequency.push_back(frequency);
+		Total += frequency;
+	}
+	for(unsigned int h=0; h<Frequency.size(); h++){
+		Frequency[h] = (Total>0) ? Frequency[h]/Total : 1.0/Frequency.size();
+	}
+	(*data).CandidateMinor.swap(CandidateMinor);
+	(*data).Frequency.swap(Frequency);
+	(*data).NumCandidates=(*data).Frequency.size();
+}
+
+//
+// WriteHaplotypes
+// Writes the sites, then each haplotype with its frequency and expected
+// number of read pairs, from the most to the least frequent haplotype.
+// Returns 1 if the file cannot be written.
+int WriteHaplotypes(string filename, EMData_t *data, vector<string> *sites,
+		vector<SiteAlleles_t> *alleles, double totalcount){
+	ofstream fout(filename.c_str(), ios::out);
+	if(!fout){
+		return 1;
+	}
+	int NumWords=(*data).NumWords;
+	int NumSites=(*sites).size();
+
+	fout << "#Sites=";
+	for(int s=0; s<NumSites; s++){
+		fout << (*sites)[s] << ((s<NumSites-1) ? "," : "\n");
+	}
+
+	vector<pair<double, int> > Order;
+	for(int h=0; h<(*data).NumCandidates; h++){
+		Order.push_back(make_pair(-(*data).Frequency[h], h));
+	}
+	sort(Order.begin(), Order.end());
+
+	fout << "Haplotype\tFrequency\tReadPairs\n";
+	for(unsigned int i=0; i<Order.size(); i++){
+		int h=Order[i].second;
+		const uint64_t *Minor=&(*data).CandidateMinor[h*NumWords];
+		string haplotype(NumSites, 'N');
+		for(int s=0; s<NumSites; s++){
+			bool minor=(Minor[s/64] >> (s % 64)) & 1ULL;
+			haplotype[s]=minor ? (*alleles)[s].Minor : (*alleles)[s].Major;
+		}
+		fout << haplotype << "\t" << (*data).Frequency[h] << "\t"
+				<< (*data).Frequency[h]*totalcount << "\n";
+	}
+	fout.close();
+	return 0;
+}
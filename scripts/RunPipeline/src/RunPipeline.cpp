@@ -0,0 +1,1552 @@
+//============================================================================
+// Name        : RunPipeline.cpp
+// Version     : 1.1
+// Description : 1.1 Optionally cache the outputs of each task in a directory
+//               keyed by a SHA-256 hash of its command, its program, and the
+//               contents of its input files, and restore them instead of
+//               rerunning the task when nothing has changed. Single commands
+//               can also be run through the cache.
+//           1.0 Run a pipeline of stages over the samples in a sample
+//               sheet on one node, replacing the qsub loops and Wait.sh.
+//               Each stage runs once per sample, once per patient, or once
+//               overall, after the stages it depends on. Worker threads
+//               start each task as soon as its dependencies finish and
+//               the node's thread and memory budgets allow, rather than
+//               polling for finished jobs. Tasks run as bash commands,
+//               or in-process for built-in commands.
+//============================================================================
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+using namespace std;
+
+// RUN PARAMETERS
+string VERSION="1.1";
+string SAMPLESHEET="";
+string STAGEFILE="";
+string LOGDIR="";
+string STATUSFILE="";
+string RUNSTAGES="";
+int NUMTHREADS=0;
+long long MEMORY=0;
+bool DRYRUN=false;
+string CACHEDIR="";
+string COMMAND="";
+string INPUTS="";
+string OUTPUTS="";
+
+bool DEBUG=false;
+
+// Written at the start of every cache key, so that keys change
+// whenever the layout of the cache does.
+const string CACHEFORMAT="RunPipeline cache 1";
+
+// Scopes of a stage: one task per sample, per patient, or overall.
+enum Scope_t {SCOPE_SAMPLE, SCOPE_PATIENT, SCOPE_ALL};
+
+// States of a task.
+// A task is skipped if a task that it depends on failed or was skipped.
+enum TaskStatus_t {TASK_WAITING, TASK_READY, TASK_RUNNING, TASK_DONE,
+	TASK_FAILED, TASK_SKIPPED};
+const char *STATUSNAMES[]={"waiting", "ready", "running", "done",
+	"failed", "skipped"};
+
+// A sample in the sample sheet, with the patient parsed from its name
+// as in AlignSummarizeAnnotate.sh.
+struct Sample_t{
+	string Name="";
+	string Reference="";
+	string Patient="";
+};
+
+// A stage in the stage file, with the stages that must finish before it,
+// and the threads and memory (in MB) that each of its tasks uses.
+// Inputs and Outputs list files that the command reads and writes,
+// beyond those named in the command, for the cache.
+struct Stage_t{
+	string Name="";
+	int Scope=SCOPE_SAMPLE;
+	int Threads=1;
+	long long Memory=0;
+	vector<int> After;
+	string Command="";
+	string Inputs="";
+	string Outputs="";
+	bool Run=true;
+};
+
+// A single run of a stage for a sample, patient, or overall.
+// Waiting counts the tasks it depends on that have not finished.
+struct Task_t{
+	int Stage=0;
+	string Instance="";
+	string Command="";
+	int Threads=1;
+	long long Memory=0;
+	vector<int> Dependents;
+	int Waiting=0;
+	int Status=TASK_WAITING;
+	int ExitCode=0;
+	double Start=0;
+	double Seconds=0;
+	vector<string> Inputs;
+	vector<string> Outputs;
+	bool Cached=false;
+};
+
+// Hashes of files, by path, reused while a file keeps its size and
+// modification time, so that large inputs are hashed only once.
+// Stored in the cache directory as files.index between runs.
+struct FileStamp_t{
+	long long Size=0;
+	long long ModTime=0;
+	string Hash="";
+};
+
+struct FileIndex_t{
+	mutex Lock;
+	map<string, FileStamp_t> Files;
+};
+
+// State of a SHA-256 hash (FIPS 180-4).
+struct Sha256_t{
+	uint32_t State[8];
+	uint64_t Length=0;
+	unsigned char Block[64];
+	int Used=0;
+};
+
+// State shared by the worker threads. Workers wait on Changed until a
+// ready task fits in the free threads and memory, or all tasks are done.
+struct Scheduler_t{
+	mutex Lock;
+	condition_variable Changed;
+	vector<Task_t> Tasks;
+	vector<int> Ready;
+	int FreeThreads=0;
+	long long FreeMemory=0;
+	int Remaining=0;
+	int NumFailed=0;
+	int NumCached=0;
+	FileIndex_t *Index=NULL;
+	chrono::steady_clock::time_point Start;
+};
+
+
+// FUNCTIONS
+int ArgsParse(int argc, char *argv[]);
+void PrintUsage();
+void PrintParameters();
+void SetDebug();
+vector<string> StringSplit(string s, char c);
+string SamplePatient(string sample);
+int ReadSampleSheet(string filename, vector<Sample_t> *samples);
+int ReadStages(string filename, vector<Stage_t> *stages);
+string ReplaceAll(string s, string from, string to);
+string ExpandCommand(string command, vector<Sample_t> *samples,
+		vector<int> *members, string patient, int threads);
+void BuildTasks(vector<Stage_t> *stages, vector<Sample_t> *samples,
+		vector<Task_t> *tasks);
+void FinishTask(Scheduler_t *scheduler, int task, int status);
+int NextTask(Scheduler_t *scheduler);
+int RunCommand(Task_t *task, string name);
+int RunBuiltin(Task_t *task, ostream *log);
+int Concatenate(vector<string> *args, ostream *log);
+int RunTask(Task_t *task, string name, FileIndex_t *index);
+void RunWorker(Scheduler_t *scheduler, vector<Stage_t> *stages);
+double Elapsed(Scheduler_t *scheduler);
+int WriteStatus(string filename, Scheduler_t *scheduler,
+		vector<Stage_t> *stages);
+void Sha256Init(Sha256_t *sha);
+void Sha256Block(Sha256_t *sha, const unsigned char *block);
+void Sha256Update(Sha256_t *sha, const void *data, size_t length);
+string Sha256Final(Sha256_t *sha);
+int HashFile(string path, FileIndex_t *index, string *hash);
+void ReadFileIndex(FileIndex_t *index);
+int WriteFileIndex(FileIndex_t *index);
+int TaskKey(Task_t *task, FileIndex_t *index, string *key);
+int LinkOrCopy(string source, string destination);
+void RemoveEntry(string entry);
+int RestoreOutputs(Task_t *task, string key, FileIndex_t *index);
+int StoreOutputs(Task_t *task, string key, FileIndex_t *index);
+
+int main(int argc, char *argv[]) {
+
+	//==================================================
+	// Parse command-line arguments.
+	//==================================================
+
+	if(ArgsParse(argc, argv) != 0){
+		PrintUsage();
+		return 1;
+	}
+
+	if(NUMTHREADS<=0){
+		NUMTHREADS=thread::hardware_concurrency();
+		if(NUMTHREADS<=0){
+			NUMTHREADS=1;
+		}
+	}
+
+	PrintParameters();
+
+	FileIndex_t Index;
+	if(CACHEDIR!=""){
+		mkdir(CACHEDIR.c_str(), 0755);
+		ReadFileIndex(&Index);
+	}
+
+	//==================================================
+	// Run a single command through the cache.
+	//==================================================
+
+	if(COMMAND!=""){
+		Task_t task;
+		task.Command=COMMAND;
+		task.Inputs=StringSplit(INPUTS, ' ');
+		task.Outputs=StringSplit(OUTPUTS, ' ');
+		int code=RunTask(&task, "command", &Index);
+		if(task.Cached){
+			printf("Restored outputs from cache.\n");
+		}
+		if(CACHEDIR!="" && WriteFileIndex(&Index)!=0){
+			printf("Error: could not write cache file index.\n");
+			return 1;
+		}
+		return code;
+	}
+
+	//==================================================
+	// Read in the samples and stages and build the tasks.
+	//==================================================
+
+	vector<Sample_t> Samples;
+	if(ReadSampleSheet(SAMPLESHEET, &Samples) != 0){
+		printf("Error: could not read sample sheet.\n");
+		return 1;
+	}
+	vector<Stage_t> Stages;
+	if(ReadStages(STAGEFILE, &Stages) != 0){
+		printf("Error: could not read stage file.\n");
+		return 1;
+	}
+
+	// Only run the chosen stages, if given.
+	// The others are taken to have finished already.
+	if(RUNSTAGES!=""){
+		vector<string> names=StringSplit(RUNSTAGES, ',');
+		for(unsigned int s=0; s<Stages.size(); s++){
+			Stages[s].Run=(find(names.begin(), names.end(), Stages[s].Name)
+					!=names.end());
+		}
+		for(unsigned int i=0; i<names.size(); i++){
+			bool found=false;
+			for(unsigned int s=0; s<Stages.size(); s++){
+				found = found || Stages[s].Name==names[i];
+			}
+			if(!found){
+				printf("Error: stage %s is not in the stage file.\n",
+						names[i].c_str());
+				return 1;
+			}
+		}
+	}
+
+	Scheduler_t Scheduler;
+	BuildTasks(&Stages, &Samples, &Scheduler.Tasks);
+	printf("Number of samples: %d\n", (int) Samples.size());
+	printf("Number of stages: %d\n", (int) Stages.size());
+	printf("Number of tasks: %d\n", (int) Scheduler.Tasks.size());
+
+	// Tasks cannot use more than the whole node.
+	for(unsigned int t=0; t<Scheduler.Tasks.size(); t++){
+		Task_t *task=&Scheduler.Tasks[t];
+		(*task).Threads=min((*task).Threads, NUMTHREADS);
+		if(MEMORY>0){
+			(*task).Memory=min((*task).Memory, MEMORY);
+		}
+	}
+
+	//==================================================
+	// Run the tasks.
+	//==================================================
+
+	Scheduler.FreeThreads=NUMTHREADS;
+	Scheduler.FreeMemory=MEMORY;
+	Scheduler.Index=&Index;
+	Scheduler.Remaining=Scheduler.Tasks.size();
+	Scheduler.Start=chrono::steady_clock::now();
+
+	// Tasks of stages that are not run count as done, so that
+	// the tasks depending on them are ready.
+	for(unsigned int t=0; t<Scheduler.Tasks.size(); t++){
+		Task_t *task=&Scheduler.Tasks[t];
+		if(Stages[(*task).Stage].Run){
+			continue;
+		}
+		(*task).Status=TASK_DONE;
+		Scheduler.Remaining--;
+		for(unsigned int d=0; d<(*task).Dependents.size(); d++){
+			Scheduler.Tasks[(*task).Dependents[d]].Waiting--;
+		}
+	}
+	for(unsigned int t=0; t<Scheduler.Tasks.size(); t++){
+		Task_t *task=&Scheduler.Tasks[t];
+		if((*task).Status==TASK_WAITING && (*task).Waiting==0){
+			(*task).Status=TASK_READY;
+			Scheduler.Ready.push_back(t);
+		}
+	}
+
+	if(DRYRUN){
+		// Print the tasks in an order in which they could run.
+		while(Scheduler.Ready.size()>0){
+			int t=NextTask(&Scheduler);
+			Task_t *task=&Scheduler.Tasks[t];
+			printf("%s\t%s\t%d\t%lld\t%s\n",
+					Stages[(*task).Stage].Name.c_str(),
+					(*task).Instance.c_str(), (*task).Threads,
+					(*task).Memory, (*task).Command.c_str());
+			FinishTask(&Scheduler, t, TASK_DONE);
+		}
+		return 0;
+	}
+
+	vector<thread> Workers;
+	for(int w=0; w<NUMTHREADS; w++){
+		Workers.push_back(thread(RunWorker, &Scheduler, &Stages));
+	}
+	for(int w=0; w<NUMTHREADS; w++){
+		Workers[w].join();
+	}
+	if(CACHEDIR!="" && WriteFileIndex(&Index)!=0){
+		printf("Error: could not write cache file index.\n");
+		return 1;
+	}
+
+	//==================================================
+	// Output the status of each task.
+	//==================================================
+
+	if(STATUSFILE!="" && WriteStatus(STATUSFILE, &Scheduler, &Stages) != 0){
+		printf("Error: could not write status file.\n");
+		return 1;
+	}
+
+	int NumSkipped=0;
+	for(unsigned int t=0; t<Scheduler.Tasks.size(); t++){
+		if(Scheduler.Tasks[t].Status==TASK_SKIPPED){
+			NumSkipped++;
+		}
+	}
+	if(CACHEDIR!=""){
+		printf("Number of tasks restored from cache: %d\n", Scheduler.NumCached);
+	}
+	printf("Number of failed tasks: %d\n", Scheduler.NumFailed);
+	printf("Number of skipped tasks: %d\n", NumSkipped);
+	printf("Run time (s): %.1f\n", Elapsed(&Scheduler));
+
+	return (Scheduler.NumFailed>0) ? 1 : 0;
+}
+
+// ArgsParse
+// Parses command-line arguments.
+// Returns 1 if any argument conditions are violated.
+int ArgsParse(int argc, char *argv[]){
+
+	// If the only argument is debug,
+	// set all parameters to the debug state.
+	if(argc==2 && strcmp(argv[1],"debug")==0){
+		SetDebug();
+		return 0;
+	}
+
+	// Ensure that there are an even number of arguments,
+	// leaving aside the program name.
+	if((argc - 1) % 2 != 0){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	// Check the structure of arguments.
+	for(int i=1; i<argc; i++){
+		// Verify that every other argument is a flag.
+		if(i%2 != 0){
+			if(argv[i][0] != '-' || strlen(argv[i])!=2){
+				printf("Invalid use of argument flags.\n");
+				return 1;
+			}
+		}
+	}
+
+	// Parse each pair of arguments.
+	for(int i=0; i<(argc-1)/2; i++){
+
+		string flag=argv[2*i+1];
+		string arg=argv[2*i+2];
+
+		// Parse the flag string.
+		switch(flag[1]){
+		// -s sample sheet
+		case 's':
+			SAMPLESHEET = arg;
+			break;
+		// -g stage file
+		case 'g':
+			STAGEFILE = arg;
+			break;
+		// -l directory for the output and error logs of each task
+		case 'l':
+			LOGDIR = arg;
+			break;
+		// -o output status of each task
+		case 'o':
+			STATUSFILE = arg;
+			break;
+		// -r stages to run
+		case 'r':
+			RUNSTAGES = arg;
+			break;
+		// -t number of threads on the node
+		case 't':
+			NUMTHREADS = atoi(arg.c_str());
+			break;
+		// -m memory on the node, in MB
+		case 'm':
+			MEMORY = atoll(arg.c_str());
+			if(MEMORY < 0){
+				printf("Invalid -m memory.\n");
+				return 1;
+			}
+			break;
+		// -n print the tasks without running them
+		case 'n':
+			DRYRUN = (atoi(arg.c_str())!=0);
+			break;
+		// -c cache directory
+		case 'c':
+			CACHEDIR = arg;
+			break;
+		// -x single command to run through the cache
+		case 'x':
+			COMMAND = arg;
+			break;
+		// -I input files of the single command
+		case 'I':
+			INPUTS = arg;
+			break;
+		// -O output files of the single command
+		case 'O':
+			OUTPUTS = arg;
+			break;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(COMMAND!=""){
+		return 0;
+	}
+	if(INPUTS!="" || OUTPUTS!=""){
+		printf("Invalid arguments. -I and -O require -x.\n");
+		return 1;
+	}
+	if(SAMPLESHEET==""){
+		printf("Invalid arguments. Specify sample sheet.\n");
+		return 1;
+	}
+	if(STAGEFILE==""){
+		printf("Invalid arguments. Specify stage file.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// PrintParameters
+// When called, prints the parameters for the run.
+void PrintParameters(){
+	cout << "RunPipeline version " << VERSION << endl;
+	cout << "RUN PARAMETERS" << endl;
+	if(COMMAND==""){
+		cout << "sample sheet: " << SAMPLESHEET << endl;
+		cout << "stage file: " << STAGEFILE << endl;
+	}
+	if(LOGDIR!=""){
+		cout << "log directory: " << LOGDIR << endl;
+	}
+	if(STATUSFILE!=""){
+		cout << "status file: " << STATUSFILE << endl;
+	}
+	if(RUNSTAGES!=""){
+		cout << "stages to run: " << RUNSTAGES << endl;
+	}
+	cout << "threads: " << NUMTHREADS << endl;
+	if(MEMORY>0){
+		cout << "memory (MB): " << MEMORY << endl;
+	}
+	else{
+		cout << "memory (MB): no limit" << endl;
+	}
+	if(DRYRUN){
+		cout << "dry run" << endl;
+	}
+	if(CACHEDIR!=""){
+		cout << "cache directory: " << CACHEDIR << endl;
+	}
+	if(COMMAND!=""){
+		cout << "command: " << COMMAND << endl;
+		cout << "inputs: " << INPUTS << endl;
+		cout << "outputs: " << OUTPUTS << endl;
+	}
+	cout << endl;
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: RunPipeline -s samples.txt -g stages.txt\n");
+	printf("       RunPipeline -c cache -x command -I inputs -O outputs\n");
+	printf("Given a sample sheet and a file of pipeline stages,\n"
+			"run each stage for each sample, patient, or overall,\n"
+			"as soon as the stages it depends on are done.\n");
+	printf("\n");
+	printf("  -s FILE\tsample sheet: sample name and reference, one sample\n"
+			"\t\tper line; patients are parsed from sample names\n");
+	printf("  -g FILE\tstage file: one tab-delimited line per stage, with\n"
+			"\t\tname, scope (sample, patient, or all), threads, memory\n"
+			"\t\tin MB, comma-separated stages it follows or -, and command;\n"
+			"\t\tstages must follow only stages listed before them;\n"
+			"\t\toptionally followed by space-separated input files beyond\n"
+			"\t\tthose named in the command, and output files, or -\n");
+	printf("\t\tCommands are run with bash, after replacing {sample},\n"
+			"\t\t{reference}, {referencebase} (without extension), {patient},\n"
+			"\t\tand {threads}. For patient and all\n"
+			"\t\tstages, each word with {sample} or {reference} is repeated\n"
+			"\t\tfor each of their samples. Commands starting with\n"
+			"\t\t@concat OUT IN... concatenate files in-process,\n"
+			"\t\tcompressing OUT if it ends with .gz\n");
+	printf("options (defaults in parentheses):\n");
+	printf("  -t INT\tthreads on the node [all cores]\n");
+	printf("  -m INT\tmemory on the node in MB [no limit]\n");
+	printf("  -l DIR\twrite the output and errors of each task to\n"
+			"\t\tDIR/stage-instance.o and .e\n");
+	printf("  -o FILE\toutput the status, start, and run time of each task\n");
+	printf("  -r STRING\tcomma-separated stages to run; the others are\n"
+			"\t\ttaken to be done [all stages]\n");
+	printf("  -n INT\tif 1, print the tasks in order without running them [0]\n");
+	printf("  -c DIR\tcache the outputs of tasks that list them, keyed by a\n"
+			"\t\thash of the command, its program, the files named in it,\n"
+			"\t\tand its inputs, and restore them when the key is unchanged\n");
+	printf("  -x STRING\tinstead of -s and -g, run this command through the cache\n");
+	printf("  -I STRING\tspace-separated input files of -x beyond those named in it\n");
+	printf("  -O STRING\tspace-separated output files of -x\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	SAMPLESHEET="test.samples";
+	STAGEFILE="test.stages";
+	DRYRUN=true;
+	DEBUG=true;
+}
+
+//
+// StringSplit
+// Takes in a string and a character delimiter
+// and returns a vector of strings split at that character.
+vector<string> StringSplit(string s, char c){
+	vector<string> splits;
+	string s0;
+	unsigned int i=0;
+
+	while(i < s.length()){
+		// Skip through delimiter characters at the beginnings of lines.
+		while(s[i] == c && i < s.length() - 1){
+			i++;
+		}
+		// Iterate through actual characters until you encounter c.
+		while(i < s.length() && s[i] != c){
+			s0 += s[i];
+			i++;
+		}
+		// Once c is encountered, stop and save the string, then reset it.
+		if(s0.size() > 0){
+			splits.push_back(s0);
+			s0 = "";
+		}
+		i++;
+	}
+
+	return splits;
+}
+
+//
+// SamplePatient
+// Parses the patient from a sample name, as in AlignSummarizeAnnotate.sh:
+// the first character, or PLASMID or WSN for the control samples.
+string SamplePatient(string sample){
+	if(sample.find("PLASMID")!=string::npos){
+		return "PLASMID";
+	}
+	if(sample.find("WSN")!=string::npos){
+		return "WSN";
+	}
+	return sample.substr(0,1);
+}
+
+//
+// ReadSampleSheet
+// Reads the sample name and reference of each sample,
+// separated by whitespace as read by the driver scripts.
+// Returns 1 if the file does not exist or a line has no reference.
+int ReadSampleSheet(string filename, vector<Sample_t> *samples){
+	ifstream f_in(filename.c_str(), ios::in);
+	if(!f_in){
+		return 1;
+	}
+
+	string line;
+	while(getline(f_in, line)){
+		istringstream fields(line);
+		Sample_t sample;
+		if(!(fields >> sample.Name)){
+			continue;
+		}
+		if(!(fields >> sample.Reference)){
+			printf("Sample %s has no reference.\n", sample.Name.c_str());
+			return 1;
+		}
+		sample.Patient=SamplePatient(sample.Name);
+		(*samples).push_back(sample);
+	}
+
+	f_in.close();
+	return 0;
+}
+
+//
+// ReadStages
+// Reads the tab-delimited stages, skipping blank lines and lines
+// starting with #. Returns 1 if the file does not exist or a stage
+// is malformed, repeated, or follows a stage not listed before it,
+// so that the stages always form a directed acyclic graph.
+int ReadStages(string filename, vector<Stage_t> *stages){
+	ifstream f_in(filename.c_str(), ios::in);
+	if(!f_in){
+		return 1;
+	}
+
+	map<string, int> index;
+	string line;
+	while(getline(f_in, line)){
+		if(line.size()==0 || line[0]=='#'){
+			continue;
+		}
+		vector<string> fields=StringSplit(line, '\t');
+		if(fields.size()==0){
+			continue;
+		}
+		if(fields.size()!=6 && fields.size()!=8){
+			printf("Stage line does not have 6 or 8 fields: %s\n", line.c_str());
+			return 1;
+		}
+		Stage_t stage;
+		stage.Name=fields[0];
+		if(index.count(stage.Name)>0){
+			printf("Stage %s is listed twice.\n", stage.Name.c_str());
+			return 1;
+		}
+		if(fields[1]=="sample"){
+			stage.Scope=SCOPE_SAMPLE;
+		}
+		else if(fields[1]=="patient"){
+			stage.Scope=SCOPE_PATIENT;
+		}
+		else if(fields[1]=="all"){
+			stage.Scope=SCOPE_ALL;
+		}
+		else{
+			printf("Stage %s has invalid scope %s.\n", stage.Name.c_str(),
+					fields[1].c_str());
+			return 1;
+		}
+		stage.Threads=atoi(fields[2].c_str());
+		stage.Memory=atoll(fields[3].c_str());
+		if(stage.Threads<=0 || stage.Memory<0){
+			printf("Stage %s has invalid threads or memory.\n",
+					stage.Name.c_str());
+			return 1;
+		}
+		if(fields[4]!="-"){
+			vector<string> after=StringSplit(fields[4], ',');
+			for(unsigned int i=0; i<after.size(); i++){
+				if(index.count(after[i])==0){
+					printf("Stage %s follows %s, which is not listed before it.\n",
+							stage.Name.c_str(), after[i].c_str());
+					return 1;
+				}
+				stage.After.push_back(index[after[i]]);
+			}
+		}
+		stage.Command=fields[5];
+		if(fields.size()==8){
+			stage.Inputs=(fields[6]=="-") ? "" : fields[6];
+			stage.Outputs=(fields[7]=="-") ? "" : fields[7];
+		}
+		index[stage.Name]=(*stages).size();
+		(*stages).push_back(stage);
+	}
+
+	f_in.close();
+	return 0;
+}
+
+//
+// ReplaceAll
+// Returns a string with every occurrence of one substring replaced.
+string ReplaceAll(string s, string from, string to){
+	size_t pos=0;
+	while((pos=s.find(from, pos))!=string::npos){
+		s.replace(pos, from.size(), to);
+		pos+=to.size();
+	}
+	return s;
+}
+
+//
+// ExpandCommand
+// Replaces the placeholders in a stage's command for one task.
+// For a single sample, {sample} and {reference} are replaced directly.
+// For several samples, each space-separated word containing them is
+// repeated once for each sample.
+string ExpandCommand(string command, vector<Sample_t> *samples,
+		vector<int> *members, string patient, int threads){
+	command=ReplaceAll(command, "{patient}", patient);
+	command=ReplaceAll(command, "{threads}", to_string(threads));
+
+	string expanded;
+	size_t start=0;
+	while(start<=command.size()){
+		size_t end=command.find(' ', start);
+		if(end==string::npos){
+			end=command.size();
+		}
+		string word=command.substr(start, end-start);
+		if(word.find("{sample}")!=string::npos ||
+				word.find("{reference")!=string::npos){
+			for(unsigned int i=0; i<(*members).size(); i++){
+				Sample_t *sample=&(*samples)[(*members)[i]];
+				string base=(*sample).Reference;
+				size_t dot=base.find('.', base.rfind('/')+1);
+				if(dot!=string::npos){
+					base=base.substr(0, dot);
+				}
+				string w=ReplaceAll(word, "{sample}", (*sample).Name);
+				w=ReplaceAll(w, "{referencebase}", base);
+				w=ReplaceAll(w, "{reference}", (*sample).Reference);
+				expanded += (i>0 ? " " : "") + w;
+			}
+		}
+		else{
+			expanded += word;
+		}
+		if(end<command.size()){
+			expanded += " ";
+		}
+		start=end+1;
+	}
+	return expanded;
+}
+
+//
+// BuildTasks
+// Creates the tasks of each stage and links each task to the tasks it
+// depends on: the task of the same sample or patient, or all tasks of
+// the earlier stage that share its samples.
+void BuildTasks(vector<Stage_t> *stages, vector<Sample_t> *samples,
+		vector<Task_t> *tasks){
+
+	// Samples of each patient, in sample sheet order.
+	vector<string> Patients;
+	map<string, vector<int> > PatientSamples;
+	for(unsigned int i=0; i<(*samples).size(); i++){
+		string patient=(*samples)[i].Patient;
+		if(PatientSamples.count(patient)==0){
+			Patients.push_back(patient);
+		}
+		PatientSamples[patient].push_back(i);
+	}
+	vector<int> AllSamples;
+	for(unsigned int i=0; i<(*samples).size(); i++){
+		AllSamples.push_back(i);
+	}
+
+	// For each stage and sample, the task of that stage covering the sample.
+	vector<vector<int> > SampleTask((*stages).size(),
+			vector<int>((*samples).size(), -1));
+	vector<vector<int> > Members;
+	for(unsigned int s=0; s<(*stages).size(); s++){
+		Stage_t *stage=&(*stages)[s];
+
+		// Group the samples of the stage's tasks.
+		vector<string> instances;
+		vector<vector<int> > groups;
+		if((*stage).Scope==SCOPE_SAMPLE){
+			for(unsigned int i=0; i<(*samples).size(); i++){
+				instances.push_back((*samples)[i].Name);
+				groups.push_back(vector<int>(1, i));
+			}
+		}
+		else if((*stage).Scope==SCOPE_PATIENT){
+			for(unsigned int p=0; p<Patients.size(); p++){
+				instances.push_back(Patients[p]);
+				groups.push_back(PatientSamples[Patients[p]]);
+			}
+		}
+		else{
+			instances.push_back("all");
+			groups.push_back(AllSamples);
+		}
+
+		for(unsigned int g=0; g<groups.size(); g++){
+			Task_t task;
+			task.Stage=s;
+			task.Instance=instances[g];
+			task.Threads=(*stage).Threads;
+			task.Memory=(*stage).Memory;
+			string patient=((*stage).Scope==SCOPE_ALL) ? "all" :
+					(*samples)[groups[g][0]].Patient;
+			task.Command=ExpandCommand((*stage).Command, samples, &groups[g],
+					patient, task.Threads);
+			task.Inputs=StringSplit(ExpandCommand((*stage).Inputs, samples,
+					&groups[g], patient, task.Threads), ' ');
+			task.Outputs=StringSplit(ExpandCommand((*stage).Outputs, samples,
+					&groups[g], patient, task.Threads), ' ');
+			int t=(*tasks).size();
+
+			// Depend on each distinct task of the earlier stages
+			// that covers any of this task's samples.
+			for(unsigned int a=0; a<(*stage).After.size(); a++){
+				vector<int> depends;
+				for(unsigned int i=0; i<groups[g].size(); i++){
+					depends.push_back(SampleTask[(*stage).After[a]][groups[g][i]]);
+				}
+				sort(depends.begin(), depends.end());
+				depends.erase(unique(depends.begin(), depends.end()),
+						depends.end());
+				for(unsigned int d=0; d<depends.size(); d++){
+					(*tasks)[depends[d]].Dependents.push_back(t);
+					task.Waiting++;
+				}
+			}
+			for(unsigned int i=0; i<groups[g].size(); i++){
+				SampleTask[s][groups[g][i]]=t;
+			}
+			(*tasks).push_back(task);
+		}
+	}
+}
+
+//
+// FinishTask
+// Records that a task has finished, then releases the tasks that depend
+// on it if it is done, or skips them if it failed or was skipped.
+// The scheduler must be locked.
+void FinishTask(Scheduler_t *scheduler, int task, int status){
+	vector<int> finished(1, task);
+	(*scheduler).Tasks[task].Status=status;
+	while(finished.size()>0){
+		int t=finished.back();
+		finished.pop_back();
+		(*scheduler).Remaining--;
+		bool done=((*scheduler).Tasks[t].Status==TASK_DONE);
+		vector<int> *dependents=&(*scheduler).Tasks[t].Dependents;
+		for(unsigned int d=0; d<(*dependents).size(); d++){
+			Task_t *dependent=&(*scheduler).Tasks[(*dependents)[d]];
+			(*dependent).Waiting--;
+			if((*dependent).Status!=TASK_WAITING){
+				continue;
+			}
+			if(!done){
+				(*dependent).Status=TASK_SKIPPED;
+				finished.push_back((*dependents)[d]);
+			}
+			else if((*dependent).Waiting==0){
+				(*dependent).Status=TASK_READY;
+				(*scheduler).Ready.push_back((*dependents)[d]);
+			}
+		}
+	}
+}
+
+//
+// NextTask
+// Takes the ready task that fits in the free threads and memory,
+// preferring tasks of later stages so that samples finish the pipeline
+// early, then tasks listed first. Returns -1 if none fits.
+// The scheduler must be locked.
+int NextTask(Scheduler_t *scheduler){
+	int best=-1;
+	for(unsigned int r=0; r<(*scheduler).Ready.size(); r++){
+		Task_t *task=&(*scheduler).Tasks[(*scheduler).Ready[r]];
+		if(!DRYRUN && ((*task).Threads>(*scheduler).FreeThreads ||
+				(MEMORY>0 && (*task).Memory>(*scheduler).FreeMemory))){
+			continue;
+		}
+		if(best<0){
+			best=r;
+			continue;
+		}
+		Task_t *other=&(*scheduler).Tasks[(*scheduler).Ready[best]];
+		if((*task).Stage>(*other).Stage ||
+				((*task).Stage==(*other).Stage &&
+				(*scheduler).Ready[r]<(*scheduler).Ready[best])){
+			best=r;
+		}
+	}
+	if(best<0){
+		return -1;
+	}
+	int t=(*scheduler).Ready[best];
+	(*scheduler).Ready.erase((*scheduler).Ready.begin()+best);
+	return t;
+}
+
+//
+// RunCommand
+// Runs a task's command with bash in a child process, writing its output
+// and errors to the log directory if given. Returns the exit code,
+// or 127 if the command could not be started.
+int RunCommand(Task_t *task, string name){
+	int out=-1;
+	int err=-1;
+	if(LOGDIR!=""){
+		string prefix=LOGDIR+"/"+name;
+		out=open((prefix+".o").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		err=open((prefix+".e").c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if(out<0 || err<0){
+			if(out>=0) close(out);
+			if(err>=0) close(err);
+			return 127;
+		}
+	}
+	pid_t pid=fork();
+	if(pid==0){
+		if(out>=0){
+			dup2(out, 1);
+			dup2(err, 2);
+			close(out);
+			close(err);
+		}
+		execl("/bin/bash", "bash", "-c", (*task).Command.c_str(), (char *) NULL);
+		_exit(127);
+	}
+	if(out>=0){
+		close(out);
+		close(err);
+	}
+	if(pid<0){
+		return 127;
+	}
+	int status=0;
+	while(waitpid(pid, &status, 0)<0){
+		if(errno!=EINTR){
+			return 127;
+		}
+	}
+	if(WIFEXITED(status)){
+		return WEXITSTATUS(status);
+	}
+	return 128+WTERMSIG(status);
+}
+
+//
+// RunBuiltin
+// Runs a built-in command in-process. Returns 0 on success.
+int RunBuiltin(Task_t *task, ostream *log){
+	vector<string> args=StringSplit((*task).Command, ' ');
+	if(args[0]=="@concat"){
+		return Concatenate(&args, log);
+	}
+	(*log) << "Unknown built-in command " << args[0] << endl;
+	return 1;
+}
+
+//
+// Concatenate
+// Given @concat OUT IN..., concatenates the input files, plain or
+// gzipped, into the output file, which is gzipped if it ends with .gz.
+// Returns 1 if a file cannot be read or written.
+int Concatenate(vector<string> *args, ostream *log){
+	if((*args).size()<3){
+		(*log) << "@concat needs an output file and input files." << endl;
+		return 1;
+	}
+	string outfile=(*args)[1];
+	bool compress=(outfile.size()>3 &&
+			outfile.compare(outfile.size()-3, 3, ".gz")==0);
+	gzFile out=gzopen(outfile.c_str(), compress ? "wb6" : "wbT");
+	if(out==NULL){
+		(*log) << "Could not open " << outfile << endl;
+		return 1;
+	}
+	vector<char> buffer(1<<20);
+	for(unsigned int i=2; i<(*args).size(); i++){
+		gzFile in=gzopen((*args)[i].c_str(), "rb");
+		if(in==NULL){
+			(*log) << "Could not open " << (*args)[i] << endl;
+			gzclose(out);
+			return 1;
+		}
+		int n;
+		while((n=gzread(in, &buffer[0], buffer.size()))>0){
+			if(gzwrite(out, &buffer[0], n)!=n){
+				(*log) << "Could not write " << outfile << endl;
+				gzclose(in);
+				gzclose(out);
+				return 1;
+			}
+		}
+		gzclose(in);
+		if(n<0){
+			(*log) << "Could not read " << (*args)[i] << endl;
+			gzclose(out);
+			return 1;
+		}
+	}
+	if(gzclose(out)!=Z_OK){
+		(*log) << "Could not write " << outfile << endl;
+		return 1;
+	}
+	return 0;
+}
+
+//
+// RunTask
+// Runs a task, as a built-in command or with bash. With a cache directory,
+// a task that lists its outputs first looks up the key of its inputs,
+// and restores the outputs on a hit; otherwise its old outputs are removed,
+// so that no command writes into a cached file, and its new outputs are
+// stored after it succeeds. Returns the exit code.
+int RunTask(Task_t *task, string name, FileIndex_t *index){
+	string key;
+	bool cache=(CACHEDIR!="" && (*task).Outputs.size()>0 &&
+			TaskKey(task, index, &key)==0);
+	if(cache){
+		if(RestoreOutputs(task, key, index)==0){
+			(*task).Cached=true;
+			return 0;
+		}
+		for(unsigned int i=0; i<(*task).Outputs.size(); i++){
+			unlink((*task).Outputs[i].c_str());
+		}
+	}
+
+	int code;
+	if((*task).Command[0]=='@'){
+		if(LOGDIR!=""){
+			ofstream log((LOGDIR+"/"+name+".e").c_str(), ios::out);
+			code=RunBuiltin(task, &log);
+		}
+		else{
+			code=RunBuiltin(task, &cerr);
+		}
+	}
+	else{
+		code=RunCommand(task, name);
+	}
+
+	if(code==0 && cache && StoreOutputs(task, key, index)!=0){
+		printf("Warning: could not cache the outputs of %s.\n", name.c_str());
+	}
+	return code;
+}
+
+//
+// RunWorker
+// Repeatedly takes the next ready task that fits, runs it, and releases
+// its threads and memory, until no tasks remain. A worker waits for
+// another task to finish only when no ready task fits.
+void RunWorker(Scheduler_t *scheduler, vector<Stage_t> *stages){
+	unique_lock<mutex> lock((*scheduler).Lock);
+	while((*scheduler).Remaining>0){
+		int t=NextTask(scheduler);
+		if(t<0){
+			(*scheduler).Changed.wait(lock);
+			continue;
+		}
+		Task_t *task=&(*scheduler).Tasks[t];
+		(*scheduler).FreeThreads-=(*task).Threads;
+		(*scheduler).FreeMemory-=(*task).Memory;
+		(*task).Status=TASK_RUNNING;
+		(*task).Start=Elapsed(scheduler);
+		string name=(*stages)[(*task).Stage].Name+"-"+(*task).Instance;
+		printf("[%.1f] Starting %s.\n", (*task).Start, name.c_str());
+		fflush(stdout);
+		lock.unlock();
+
+		int code=RunTask(task, name, (*scheduler).Index);
+
+		lock.lock();
+		(*task).ExitCode=code;
+		(*task).Seconds=Elapsed(scheduler)-(*task).Start;
+		(*scheduler).FreeThreads+=(*task).Threads;
+		(*scheduler).FreeMemory+=(*task).Memory;
+		if(code==0 && (*task).Cached){
+			printf("[%.1f] Restored %s from cache.\n", Elapsed(scheduler),
+					name.c_str());
+			(*scheduler).NumCached++;
+			FinishTask(scheduler, t, TASK_DONE);
+		}
+		else if(code==0){
+			printf("[%.1f] Finished %s.\n", Elapsed(scheduler), name.c_str());
+			FinishTask(scheduler, t, TASK_DONE);
+		}
+		else{
+			printf("[%.1f] Failed %s with exit code %d.\n", Elapsed(scheduler),
+					name.c_str(), code);
+			(*scheduler).NumFailed++;
+			FinishTask(scheduler, t, TASK_FAILED);
+		}
+		fflush(stdout);
+		(*scheduler).Changed.notify_all();
+	}
+}
+
+//
+// Elapsed
+// Returns the seconds since the scheduler started.
+double Elapsed(Scheduler_t *scheduler){
+	return chrono::duration<double>(chrono::steady_clock::now()-
+			(*scheduler).Start).count();
+}
+
+//
+// WriteStatus
+// Writes the status, exit code, start, and run time of each task,
+// in the order in which the tasks were built.
+// Returns 1 if the file cannot be written.
+int WriteStatus(string filename, Scheduler_t *scheduler,
+		vector<Stage_t> *stages){
+	ofstream fout(filename.c_str(), ios::out);
+	if(!fout){
+		return 1;
+	}
+	fout << "Stage\tInstance\tThreads\tMemory\tStatus\tExitCode\tCached\t"
+			"Start\tSeconds\n";
+	for(unsigned int t=0; t<(*scheduler).Tasks.size(); t++){
+		Task_t *task=&(*scheduler).Tasks[t];
+		fout << (*stages)[(*task).Stage].Name << "\t" << (*task).Instance << "\t"
+				<< (*task).Threads << "\t" << (*task).Memory << "\t"
+				<< STATUSNAMES[(*task).Status] << "\t" << (*task).ExitCode << "\t"
+				<< ((*task).Cached ? 1 : 0) << "\t"
+				<< (*task).Start << "\t" << (*task).Seconds << "\n";
+	}
+	fout.close();
+	return 0;
+}
+
+//
+// Sha256Init
+// Sets a hash to the initial state of SHA-256.
+void Sha256Init(Sha256_t *sha){
+	const uint32_t initial[8]={0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+			0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	for(int i=0; i<8; i++){
+		(*sha).State[i]=initial[i];
+	}
+	(*sha).Length=0;
+	(*sha).Used=0;
+}
+
+//
+// Sha256Block
+// Mixes one 64-byte block into the state of a hash.
+void Sha256Block(Sha256_t *sha, const unsigned char *block){
+	static const uint32_t K[64]={
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+		0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+		0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+		0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+		0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+		0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+		0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+		0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+		0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+	uint32_t w[64];
+	for(int i=0; i<16; i++){
+		w[i]=((uint32_t)block[4*i]<<24) | ((uint32_t)block[4*i+1]<<16) |
+				((uint32_t)block[4*i+2]<<8) | (uint32_t)block[4*i+3];
+	}
+	for(int i=16; i<64; i++){
+		uint32_t s0=((w[i-15]>>7) | (w[i-15]<<25)) ^
+				((w[i-15]>>18) | (w[i-15]<<14)) ^ (w[i-15]>>3);
+		uint32_t s1=((w[i-2]>>17) | (w[i-2]<<15)) ^
+				((w[i-2]>>19) | (w[i-2]<<13)) ^ (w[i-2]>>10);
+		w[i]=w[i-16]+s0+w[i-7]+s1;
+	}
+	uint32_t a=(*sha).State[0], b=(*sha).State[1], c=(*sha).State[2],
+			d=(*sha).State[3], e=(*sha).State[4], f=(*sha).State[5],
+			g=(*sha).State[6], h=(*sha).State[7];
+	for(int i=0; i<64; i++){
+		uint32_t S1=((e>>6) | (e<<26)) ^ ((e>>11) | (e<<21)) ^
+				((e>>25) | (e<<7));
+		uint32_t t1=h+S1+((e & f) ^ (~e & g))+K[i]+w[i];
+		uint32_t S0=((a>>2) | (a<<30)) ^ ((a>>13) | (a<<19)) ^
+				((a>>22) | (a<<10));
+		uint32_t t2=S0+((a & b) ^ (a & c) ^ (b & c));
+		h=g;
+		g=f;
+		f=e;
+		e=d+t1;
+		d=c;
+		c=b;
+		b=a;
+		a=t1+t2;
+	}
+	(*sha).State[0]+=a;
+	(*sha).State[1]+=b;
+	(*sha).State[2]+=c;
+	(*sha).State[3]+=d;
+	(*sha).State[4]+=e;
+	(*sha).State[5]+=f;
+	(*sha).State[6]+=g;
+	(*sha).State[7]+=h;
+}
+
+//
+// Sha256Update
+// Adds bytes to a hash.
+void Sha256Update(Sha256_t *sha, const void *data, size_t length){
+	const unsigned char *bytes=(const unsigned char *)data;
+	(*sha).Length+=length;
+	while(length>0){
+		if((*sha).Used==0 && length>=64){
+			Sha256Block(sha, bytes);
+			bytes+=64;
+			length-=64;
+			continue;
+		}
+		size_t n=min(length, (size_t)(64-(*sha).Used));
+		memcpy((*sha).Block+(*sha).Used, bytes, n);
+		(*sha).Used+=n;
+		bytes+=n;
+		length-=n;
+		if((*sha).Used==64){
+			Sha256Block(sha, (*sha).Block);
+			(*sha).Used=0;
+		}
+	}
+}
+
+//
+// Sha256Final
+// Pads a hash and returns its digest as 64 hexadecimal characters.
+string Sha256Final(Sha256_t *sha){
+	uint64_t bits=(*sha).Length*8;
+	unsigned char pad[72]={0x80};
+	size_t npad=((*sha).Used<56) ? 56-(*sha).Used : 120-(*sha).Used;
+	for(int i=0; i<8; i++){
+		pad[npad+i]=(unsigned char)(bits>>(56-8*i));
+	}
+	Sha256Update(sha, pad, npad+8);
+
+	const char *hex="0123456789abcdef";
+	string digest="";
+	for(int i=0; i<8; i++){
+		for(int j=28; j>=0; j-=4){
+			digest+=hex[((*sha).State[i]>>j) & 0xf];
+		}
+	}
+	return digest;
+}
+
+//
+// HashFile
+// Finds the SHA-256 hash of a regular file. The hash in the file index is
+// reused while the size and modification time of the file are unchanged.
+// Returns 1 if the file does not exist or cannot be read.
+int HashFile(string path, FileIndex_t *index, string *hash){
+	struct stat info;
+	if(stat(path.c_str(), &info)!=0 || !S_ISREG(info.st_mode)){
+		return 1;
+	}
+	FileStamp_t stamp;
+	stamp.Size=info.st_size;
+	stamp.ModTime=(long long)info.st_mtim.tv_sec*1000000000LL+
+			info.st_mtim.tv_nsec;
+	{
+		lock_guard<mutex> lock((*index).Lock);
+		map<string, FileStamp_t>::iterator it=(*index).Files.find(path);
+		if(it!=(*index).Files.end() && (*it).second.Size==stamp.Size &&
+				(*it).second.ModTime==stamp.ModTime){
+			(*hash)=(*it).second.Hash;
+			return 0;
+		}
+	}
+
+	FILE *in=fopen(path.c_str(), "rb");
+	if(in==NULL){
+		return 1;
+	}
+	Sha256_t sha;
+	Sha256Init(&sha);
+	vector<char> buffer(1<<20);
+	size_t n;
+	while((n=fread(&buffer[0], 1, buffer.size(), in))>0){
+		Sha256Update(&sha, &buffer[0], n);
+	}
+	bool failed=(ferror(in)!=0);
+	fclose(in);
+	if(failed){
+		return 1;
+	}
+	stamp.Hash=Sha256Final(&sha);
+	(*hash)=stamp.Hash;
+
+	lock_guard<mutex> lock((*index).Lock);
+	(*index).Files[path]=stamp;
+	return 0;
+}
+
+//
+// ReadFileIndex
+// Reads the file index of the cache directory, if there is one.
+// Each line holds a hash, size, modification time, and path.
+void ReadFileIndex(FileIndex_t *index){
+	ifstream fin((CACHEDIR+"/files.index").c_str());
+	string line;
+	while(getline(fin, line)){
+		vector<string> fields=StringSplit(line, '\t');
+		if(fields.size()!=4){
+			continue;
+		}
+		FileStamp_t stamp;
+		stamp.Hash=fields[0];
+		stamp.Size=atoll(fields[1].c_str());
+		stamp.ModTime=atoll(fields[2].c_str());
+		(*index).Files[fields[3]]=stamp;
+	}
+}
+
+//
+// WriteFileIndex
+// Writes the file index to the cache directory, replacing the old one
+// only once the new one is complete. Entries for files that no longer
+// exist are dropped. Returns 1 if the index cannot be written.
+int WriteFileIndex(FileIndex_t *index){
+	string filename=CACHEDIR+"/files.index";
+	ofstream fout((filename+".tmp").c_str(), ios::out);
+	if(!fout){
+		return 1;
+	}
+	lock_guard<mutex> lock((*index).Lock);
+	for(map<string, FileStamp_t>::iterator it=(*index).Files.begin();
+			it!=(*index).Files.end(); ++it){
+		if(access((*it).first.c_str(), F_OK)!=0){
+			continue;
+		}
+		fout << (*it).second.Hash << "\t" << (*it).second.Size << "\t"
+				<< (*it).second.ModTime << "\t" << (*it).first << "\n";
+	}
+	fout.close();
+	if(!fout || rename((filename+".tmp").c_str(), filename.c_str())!=0){
+		return 1;
+	}
+	return 0;
+}
+
+//
+// TaskKey
+// Finds the cache key of a task: a hash of the cache format, the command,
+// and the path and hash of each input. Inputs are the declared inputs of
+// the task and each word of the command that names an existing file other
+// than a declared output, which covers the program or script itself and,
+// through the version in its name, the version of each tool.
+// Returns 1 if a declared input does not exist.
+int TaskKey(Task_t *task, FileIndex_t *index, string *key){
+	vector<string> inputs=(*task).Inputs;
+	vector<string> words=StringSplit((*task).Command, ' ');
+	for(unsigned int i=0; i<words.size(); i++){
+		struct stat info;
+		if(find((*task).Outputs.begin(), (*task).Outputs.end(), words[i])==
+				(*task).Outputs.end() && stat(words[i].c_str(), &info)==0 &&
+				S_ISREG(info.st_mode)){
+			inputs.push_back(words[i]);
+		}
+	}
+	sort(inputs.begin(), inputs.end());
+	inputs.erase(unique(inputs.begin(), inputs.end()), inputs.end());
+
+	Sha256_t sha;
+	Sha256Init(&sha);
+	string text=CACHEFORMAT+"\n"+(*task).Command+"\n";
+	Sha256Update(&sha, text.c_str(), text.size());
+	for(unsigned int i=0; i<inputs.size(); i++){
+		string hash;
+		if(HashFile(inputs[i], index, &hash)!=0){
+			printf("Warning: cannot hash input %s; not caching.\n",
+					inputs[i].c_str());
+			return 1;
+		}
+		text=inputs[i]+"\t"+hash+"\n";
+		Sha256Update(&sha, text.c_str(), text.size());
+	}
+	(*key)=Sha256Final(&sha);
+	return 0;
+}
+
+//
+// LinkOrCopy
+// Makes a hard link to a file, or copies it when the two paths are on
+// different file systems. Returns 1 if neither works.
+int LinkOrCopy(string source, string destination){
+	if(link(source.c_str(), destination.c_str())==0){
+		return 0;
+	}
+	ifstream fin(source.c_str(), ios::in | ios::binary);
+	ofstream fout(destination.c_str(), ios::out | ios::binary);
+	if(!fin || !fout){
+		return 1;
+	}
+	fout << fin.rdbuf();
+	fout.close();
+	if(!fout){
+		unlink(destination.c_str());
+		return 1;
+	}
+	return 0;
+}
+
+//
+// RemoveEntry
+// Removes a cache entry directory and the files in it.
+void RemoveEntry(string entry){
+	DIR *dir=opendir(entry.c_str());
+	if(dir==NULL){
+		return;
+	}
+	struct dirent *file;
+	while((file=readdir(dir))!=NULL){
+		string name=file->d_name;
+		if(name!="." && name!=".."){
+			unlink((entry+"/"+name).c_str());
+		}
+	}
+	closedir(dir);
+	rmdir(entry.c_str());
+}
+
+//
+// RestoreOutputs
+// Looks up the key of a task in the cache directory, checks the hash of
+// each cached file against its manifest, and replaces each output of the
+// task with the cached file. Returns 1 on a miss or a damaged entry.
+int RestoreOutputs(Task_t *task, string key, FileIndex_t *index){
+	string entry=CACHEDIR+"/"+key;
+	ifstream fin((entry+"/manifest").c_str());
+	if(!fin){
+		return 1;
+	}
+	vector<string> hashes;
+	vector<string> paths;
+	string line;
+	while(getline(fin, line)){
+		vector<string> fields=StringSplit(line, '\t');
+		if(fields.size()!=2){
+			return 1;
+		}
+		hashes.push_back(fields[0]);
+		paths.push_back(fields[1]);
+	}
+	if(paths!=(*task).Outputs){
+		return 1;
+	}
+	for(unsigned int i=0; i<paths.size(); i++){
+		string hash;
+		string cached=entry+"/"+to_string(i);
+		if(HashFile(cached, index, &hash)!=0 || hash!=hashes[i]){
+			printf("Warning: cache entry %s is damaged; rerunning.\n",
+					key.c_str());
+			RemoveEntry(entry);
+			return 1;
+		}
+	}
+	for(unsigned int i=0; i<paths.size(); i++){
+		unlink(paths[i].c_str());
+		if(LinkOrCopy(entry+"/"+to_string(i), paths[i])!=0){
+			printf("Warning: could not restore %s from cache.\n",
+					paths[i].c_str());
+			return 1;
+		}
+		string hash;
+		HashFile(paths[i], index, &hash);
+	}
+	return 0;
+}
+
+//
+// StoreOutputs
+// Stores the outputs of a task in the cache directory under its key,
+// with a manifest of their hashes and paths. The entry is built in a
+// temporary directory and renamed into place, so that a partial entry
+// is never read. Returns 1 if an output is missing or cannot be stored.
+int StoreOutputs(Task_t *task, string key, FileIndex_t *index){
+	string pattern=CACHEDIR+"/tmp.XXXXXX";
+	vector<char> name(pattern.begin(), pattern.end());
+	name.push_back('\0');
+	if(mkdtemp(&name[0])==NULL){
+		return 1;
+	}
+	string entry(&name[0]);
+
+	int failed=0;
+	ofstream manifest((entry+"/manifest").c_str(), ios::out);
+	for(unsigned int i=0; i<(*task).Outputs.size(); i++){
+		string hash;
+		string path=(*task).Outputs[i];
+		if(HashFile(path, index, &hash)!=0 ||
+				LinkOrCopy(path, entry+"/"+to_string(i))!=0){
+			printf("Warning: output %s is missing.\n", path.c_str());
+			failed=1;
+			break;
+		}
+		manifest << hash << "\t" << path << "\n";
+	}
+	manifest.close();
+	if(!manifest){
+		failed=1;
+	}
+	if(failed==0 && rename(entry.c_str(), (CACHEDIR+"/"+key).c_str())==0){
+		return 0;
+	}
+
+	// Another task may have stored the same key first.
+	RemoveEntry(entry);
+	return failed;
+}
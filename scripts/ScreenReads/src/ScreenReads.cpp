@@ -0,0 +1,939 @@
+//============================================================================
+// Name        : ScreenReads.cpp
+// Version     : 1.0
+// Description : 1.0 Screen paired gzipped FASTQ files for read pairs that
+//               share k-mers with a set of viral references, optionally
+//               rejecting pairs whose k-mers are mostly found in a Bloom
+//               filter built from a host genome. Read pairs are screened
+//               in parallel threads in blocks of bounded size, and kept
+//               pairs are written to paired gzipped FASTQ files.
+//               Replaces the bowtie2 alignment to hs37d5 in
+//               pipelines/SCCA/FilterOutHumanReads.sh.
+//============================================================================
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <thread>
+#include <zlib.h>
+
+using namespace std;
+
+// RUN PARAMETERS
+string MODE="";
+string REFFASTA="";
+string FASTQ1="";
+string FASTQ2="";
+string OUTPREFIX="";
+string BLOOMFILE="";
+string HOSTFASTA="";
+int KMERLENGTH=21;
+int WINDOW=1;
+int MINHITS=2;
+double MAXHOSTFRACTION=0.5;
+long long BLOOMMEGABYTES=4096;
+int NUMHASHES=3;
+int NUMTHREADS=0;
+
+bool DEBUG=false;
+
+// Number of read pairs read in before they are split among the threads.
+const unsigned int PAIRSPERTHREAD=16384;
+
+// Compression level of the filtered FASTQ files.
+const int COMPRESSIONLEVEL=6;
+
+// Identifier at the start of a host Bloom filter file.
+const char BLOOMMAGIC[8]={'S','R','B','L','O','O','M','\0'};
+const long long BLOOMFORMAT=1;
+
+// Stores one FASTQ record.
+struct FastqRecord_t{
+	string Name="";
+	string Seq="";
+	string Plus="";
+	string Qual="";
+};
+
+// Stores one read pair and the result of screening it.
+struct ReadPair_t{
+	FastqRecord_t Read1;
+	FastqRecord_t Read2;
+	int ViralHits=0;
+	int HostHits=0;
+	int NumKmers=0;
+	bool Keep=false;
+};
+
+// Bloom filter of host k-mers. The bits are stored in 64-bit words,
+// and the number of bits is a power of two.
+// Layout of a Bloom filter file:
+//   char Magic[8], long long Format, KmerLength, NumHashes, NumBits
+//   uint64_t Words[NumBits/64]
+struct BloomFilter_t{
+	int KmerLength=0;
+	int NumHashes=0;
+	long long NumBits=0;
+	vector<uint64_t> Words;
+};
+
+// Stores the sorted hashes of the viral k-mers
+// and the host Bloom filter, shared read-only by all threads.
+struct Screen_t{
+	vector<uint64_t> ViralKmers;
+	bool UseBloom=false;
+	BloomFilter_t Bloom;
+};
+
+// Stores the gzipped FASTQ text of the kept pairs of one thread's range,
+// written as one gzip member per file.
+struct CompressedBlock_t{
+	string Out1="";
+	string Out2="";
+	int Status=Z_OK;
+};
+
+
+// FUNCTIONS
+int ArgsParse(int argc, char *argv[]);
+void PrintUsage();
+void PrintParameters();
+void SetDebug();
+int ReadGzLine(gzFile file, string *line);
+int ReadFastqRecord(gzFile file, FastqRecord_t *record);
+string PairName(string name);
+int ReadFastaSequences(string filename, vector<string> *sequences);
+uint64_t HashKmer(uint64_t kmer);
+void CanonicalKmerHashes(const string &seq, int k, int window,
+		vector<uint64_t> *hashes);
+void BloomInsert(BloomFilter_t *bloom, uint64_t hash);
+bool BloomContains(BloomFilter_t *bloom, uint64_t hash);
+int WriteBloom(string filename, BloomFilter_t *bloom);
+int ReadBloom(string filename, BloomFilter_t *bloom);
+void AppendFastqRecord(FastqRecord_t *record, string *out);
+int CompressGzipMember(string *in, string *out);
+void ScreenPairs(vector<ReadPair_t> *pairs, unsigned int first,
+		unsigned int last, Screen_t *screen, CompressedBlock_t *block);
+int BuildBloom();
+int ScreenReads();
+
+int main(int argc, char *argv[]) {
+
+	//==================================================
+	// Parse command-line arguments.
+	//==================================================
+
+	if(ArgsParse(argc, argv) != 0){
+		PrintUsage();
+		return 1;
+	}
+
+	if(NUMTHREADS<=0){
+		NUMTHREADS=thread::hardware_concurrency();
+		if(NUMTHREADS<=0){
+			NUMTHREADS=1;
+		}
+	}
+
+	PrintParameters();
+
+	//==================================================
+	// Build a host Bloom filter or screen read pairs.
+	//==================================================
+
+	if(MODE=="bloom"){
+		return BuildBloom();
+	}
+	return ScreenReads();
+}
+
+// ArgsParse
+// Parses command-line arguments.
+// The first argument names the mode, and the rest are flag pairs.
+// Returns 1 if any argument conditions are violated.
+int ArgsParse(int argc, char *argv[]){
+
+	// If the only argument is debug,
+	// set all parameters to the debug state.
+	if(argc==2 && strcmp(argv[1],"debug")==0){
+		SetDebug();
+		return 0;
+	}
+
+	if(argc<2){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	MODE=argv[1];
+	if(MODE!="screen" && MODE!="bloom"){
+		printf("Invalid mode. Specify screen or bloom.\n");
+		return 1;
+	}
+
+	// Ensure that there are an even number of arguments,
+	// leaving aside the program name and mode.
+	if((argc - 2) % 2 != 0){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	// Check the structure of arguments.
+	for(int i=2; i<argc; i++){
+		// Verify that every other argument is a flag.
+		if(i%2 == 0){
+			if(argv[i][0] != '-' || strlen(argv[i])!=2){
+				printf("Invalid use of argument flags.\n");
+				return 1;
+			}
+		}
+	}
+
+	// Parse each pair of arguments.
+	for(int i=1; i<(argc-2)/2+1; i++){
+
+		string flag=argv[2*i];
+		string arg=argv[2*i+1];
+
+		// Parse the flag string.
+		switch(flag[1]){
+		// -f viral reference FASTA file
+		case 'f':
+			REFFASTA = arg;
+			break;
+		// -1 first-read FASTQ file
+		case '1':
+			FASTQ1 = arg;
+			break;
+		// -2 second-read FASTQ file
+		case '2':
+			FASTQ2 = arg;
+			break;
+		// -o output prefix, or Bloom filter file in bloom mode
+		case 'o':
+			OUTPREFIX = arg;
+			break;
+		// -b host Bloom filter file
+		case 'b':
+			BLOOMFILE = arg;
+			break;
+		// -x host FASTA file
+		case 'x':
+			HOSTFASTA = arg;
+			break;
+		// -k k-mer length
+		case 'k':
+			KMERLENGTH = atoi(arg.c_str());
+			if(KMERLENGTH < 8 || KMERLENGTH > 31){
+				printf("Invalid -k k-mer length. Specify 8 to 31.\n");
+				return 1;
+			}
+			break;
+		// -w minimizer window, in k-mers
+		case 'w':
+			WINDOW = atoi(arg.c_str());
+			if(WINDOW < 1){
+				printf("Invalid -w minimizer window.\n");
+				return 1;
+			}
+			break;
+		// -m minimum number of viral k-mer hits per pair
+		case 'm':
+			MINHITS = atoi(arg.c_str());
+			break;
+		// -y maximum fraction of host k-mers per pair
+		case 'y':
+			MAXHOSTFRACTION = atof(arg.c_str());
+			break;
+		// -s Bloom filter size in megabytes
+		case 's':
+			BLOOMMEGABYTES = atoll(arg.c_str());
+			if(BLOOMMEGABYTES <= 0){
+				printf("Invalid -s Bloom filter size.\n");
+				return 1;
+			}
+			break;
+		// -n number of Bloom filter hash functions
+		case 'n':
+			NUMHASHES = atoi(arg.c_str());
+			if(NUMHASHES < 1 || NUMHASHES > 16){
+				printf("Invalid -n number of hash functions.\n");
+				return 1;
+			}
+			break;
+		// -t number of threads
+		case 't':
+			NUMTHREADS = atoi(arg.c_str());
+			break;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(OUTPREFIX==""){
+		printf("Invalid arguments. Specify output.\n");
+		return 1;
+	}
+	if(MODE=="bloom"){
+		if(HOSTFASTA==""){
+			printf("Invalid arguments. Specify host FASTA file.\n");
+			return 1;
+		}
+		return 0;
+	}
+	if(REFFASTA==""){
+		printf("Invalid arguments. Specify viral reference FASTA file.\n");
+		return 1;
+	}
+	if(FASTQ1=="" || FASTQ2==""){
+		printf("Invalid arguments. Specify both FASTQ files.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// PrintParameters
+// When called, prints the parameters for the run.
+void PrintParameters(){
+	cout << "RUN PARAMETERS" << endl;
+	cout << "mode: " << MODE << endl;
+	if(MODE=="bloom"){
+		cout << "host sequences: " << HOSTFASTA << endl;
+		cout << "Bloom filter file: " << OUTPREFIX << endl;
+		cout << "Bloom filter size (MB): " << BLOOMMEGABYTES << endl;
+		cout << "hash functions: " << NUMHASHES << endl;
+		cout << "k-mer length: " << KMERLENGTH << endl;
+	}
+	else{
+		cout << "viral reference: " << REFFASTA << endl;
+		cout << "reads: " << FASTQ1 << " " << FASTQ2 << endl;
+		cout << "output prefix: " << OUTPREFIX << endl;
+		cout << "k-mer length: " << KMERLENGTH << endl;
+		cout << "minimizer window: " << WINDOW << endl;
+		cout << "minimum viral hits per pair: " << MINHITS << endl;
+		if(BLOOMFILE != ""){
+			cout << "host Bloom filter: " << BLOOMFILE << endl;
+			cout << "maximum host fraction: " << MAXHOSTFRACTION << endl;
+		}
+	}
+	cout << "threads: " << NUMTHREADS << endl;
+	cout << endl;
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: ScreenReads screen -f H3N2-Brisbane-2007.fasta\n"
+			"         -1 R1.fastq.gz -2 R2.fastq.gz -o sample-filtered\n");
+	printf("       ScreenReads bloom -x hs37d5.fa -o hs37d5.bloom\n");
+	printf("\n");
+	printf("Modes:\n");
+	printf("  screen\tkeep read pairs with viral k-mers, written to\n"
+			"\t\t<prefix>.1.fastq.gz and <prefix>.2.fastq.gz\n");
+	printf("  bloom\t\tbuild a Bloom filter of host k-mers\n");
+	printf("\n");
+	printf("Options (defaults in parentheses):\n");
+	printf("  -k INT\tk-mer length; the Bloom filter stores its own [21]\n");
+	printf("  -w INT\tminimizer window in k-mers; 1 uses every k-mer [1]\n");
+	printf("  -m INT\tminimum viral k-mer hits per read pair [2]\n");
+	printf("  -b FILE\thost Bloom filter built in bloom mode\n");
+	printf("  -y FLOAT\treject pairs with more than this fraction of\n"
+			"\t\tk-mers in the host Bloom filter [0.5]\n");
+	printf("  -s INT\tBloom filter size in megabytes, rounded down\n"
+			"\t\tto a power of two [4096]\n");
+	printf("  -n INT\tnumber of Bloom filter hash functions [3]\n");
+	printf("  -t INT\tnumber of threads [all cores]\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	MODE="screen";
+	REFFASTA="ref.test";
+	FASTQ1="R1.test.fastq.gz";
+	FASTQ2="R2.test.fastq.gz";
+	OUTPREFIX="out.test";
+	NUMTHREADS=1;
+	DEBUG=true;
+}
+
+// ReadGzLine
+// Reads one line of a plain or gzipped file, without the newline.
+// Returns 1 if a line was read and 0 at the end of the file.
+int ReadGzLine(gzFile file, string *line){
+	char buffer[4096];
+	(*line).clear();
+	while(gzgets(file, buffer, sizeof(buffer)) != NULL){
+		size_t len=strlen(buffer);
+		if(len > 0 && buffer[len-1]=='\n'){
+			(*line).append(buffer, len-1);
+			return 1;
+		}
+		(*line).append(buffer, len);
+	}
+	return (*line).size() > 0 ? 1 : 0;
+}
+
+// ReadFastqRecord
+// Reads the four lines of one FASTQ record.
+// Returns 1 if a record was read, 0 at the end of the file,
+// and -1 if the record is malformed.
+int ReadFastqRecord(gzFile file, FastqRecord_t *record){
+	if(ReadGzLine(file, &(*record).Name)==0){
+		return 0;
+	}
+	if(ReadGzLine(file, &(*record).Seq)==0 ||
+			ReadGzLine(file, &(*record).Plus)==0 ||
+			ReadGzLine(file, &(*record).Qual)==0){
+		return -1;
+	}
+	if((*record).Name[0]!='@' || (*record).Plus[0]!='+' ||
+			(*record).Seq.size()!=(*record).Qual.size()){
+		return -1;
+	}
+	return 1;
+}
+
+// PairName
+// Returns the read name shared by both mates: the first word of the
+// FASTQ name line, without the @ and any /1 or /2 suffix.
+string PairName(string name){
+	size_t end=name.find_first_of(" \t");
+	if(end==string::npos){
+		end=name.size();
+	}
+	if(end >= 3 && name[end-2]=='/' && (name[end-1]=='1' || name[end-1]=='2')){
+		end -= 2;
+	}
+	return name.substr(1, end-1);
+}
+
+// ReadFastaSequences
+// Reads in the sequences of a plain or gzipped multi-FASTA file.
+// Returns 1 if the file does not exist.
+int ReadFastaSequences(string filename, vector<string> *sequences){
+	gzFile fin=gzopen(filename.c_str(), "rb");
+	if(fin==NULL){
+		return 1;
+	}
+	string line;
+	while(ReadGzLine(fin, &line)){
+		if(line.size() > 0 && line[0]=='>'){
+			(*sequences).push_back("");
+			continue;
+		}
+		if((*sequences).size() > 0){
+			(*sequences).back() += line;
+		}
+	}
+	gzclose(fin);
+	return 0;
+}
+
+// HashKmer
+// Mixes the bits of a 2-bit packed k-mer with the splitmix64 finalizer.
+uint64_t HashKmer(uint64_t kmer){
+	kmer ^= kmer >> 30;
+	kmer *= 0xbf58476d1ce4e5b9ULL;
+	kmer ^= kmer >> 27;
+	kmer *= 0x94d049bb133111ebULL;
+	kmer ^= kmer >> 31;
+	return kmer;
+}
+
+// CanonicalKmerHashes
+// Appends the hashes of the canonical k-mers of a sequence, i.e. the
+// lesser of each k-mer and its reverse complement, skipping k-mers with
+// bases other than ACGT. If window is greater than 1, only the minimizer
+// of each run of window consecutive k-mers is kept, once per position.
+void CanonicalKmerHashes(const string &seq, int k, int window,
+		vector<uint64_t> *hashes){
+	uint64_t mask=(1ULL<<(2*k))-1;
+	uint64_t forward=0;
+	uint64_t reverse=0;
+	int run=0;
+	// Hashes of the k-mers of the current stretch of ACGT,
+	// used for minimizer sampling.
+	vector<uint64_t> stretch;
+
+	for(unsigned int i=0; i<=seq.size(); i++){
+		int code=-1;
+		if(i < seq.size()){
+			switch(seq[i]){
+			case 'A': case 'a': code=0; break;
+			case 'C': case 'c': code=1; break;
+			case 'G': case 'g': code=2; break;
+			case 'T': case 't': code=3; break;
+			}
+		}
+		if(code < 0){
+			// Pick the minimizers of the stretch that just ended.
+			// A stretch shorter than the window has one minimizer.
+			if(window > 1 && stretch.size() > 0){
+				long long size=stretch.size();
+				long long numwindows=max(1LL, size-window+1);
+				long long lastpos=-1;
+				for(long long w=0; w<numwindows; w++){
+					long long end=min(size, w+window);
+					long long best=w;
+					for(long long p=w+1; p<end; p++){
+						if(stretch[p] < stretch[best]){
+							best=p;
+						}
+					}
+					if(best!=lastpos){
+						(*hashes).push_back(stretch[best]);
+						lastpos=best;
+					}
+				}
+			}
+			stretch.clear();
+			run=0;
+			forward=0;
+			reverse=0;
+			continue;
+		}
+		forward=((forward<<2) | code) & mask;
+		reverse=(reverse>>2) | ((uint64_t)(3-code) << (2*(k-1)));
+		run++;
+		if(run >= k){
+			uint64_t hash=HashKmer(min(forward, reverse));
+			if(window > 1){
+				stretch.push_back(hash);
+			}
+			else{
+				(*hashes).push_back(hash);
+			}
+		}
+	}
+}
+
+// BloomInsert
+// Sets the bits of a hash in the Bloom filter,
+// deriving each hash function by double hashing.
+void BloomInsert(BloomFilter_t *bloom, uint64_t hash){
+	uint64_t mask=(uint64_t)(*bloom).NumBits-1;
+	uint64_t step=(hash >> 32) | 1;
+	for(int h=0; h<(*bloom).NumHashes; h++){
+		uint64_t bit=(hash + h*step) & mask;
+		(*bloom).Words[bit >> 6] |= (1ULL << (bit & 63));
+	}
+}
+
+// BloomContains
+// Returns true if all bits of a hash are set in the Bloom filter.
+bool BloomContains(BloomFilter_t *bloom, uint64_t hash){
+	uint64_t mask=(uint64_t)(*bloom).NumBits-1;
+	uint64_t step=(hash >> 32) | 1;
+	for(int h=0; h<(*bloom).NumHashes; h++){
+		uint64_t bit=(hash + h*step) & mask;
+		if(!((*bloom).Words[bit >> 6] & (1ULL << (bit & 63)))){
+			return false;
+		}
+	}
+	return true;
+}
+
+// WriteBloom
+// Writes a Bloom filter to a binary file.
+// Returns 1 if the file cannot be written.
+int WriteBloom(string filename, BloomFilter_t *bloom){
+	FILE *fout=fopen(filename.c_str(), "wb");
+	if(fout==NULL){
+		return 1;
+	}
+	long long header[4]={BLOOMFORMAT, (*bloom).KmerLength,
+			(*bloom).NumHashes, (*bloom).NumBits};
+	bool ok=fwrite(BLOOMMAGIC, 1, 8, fout)==8 &&
+			fwrite(header, sizeof(long long), 4, fout)==4 &&
+			fwrite(&(*bloom).Words[0], sizeof(uint64_t), (*bloom).Words.size(),
+					fout)==(*bloom).Words.size();
+	fclose(fout);
+	return ok ? 0 : 1;
+}
+
+// ReadBloom
+// Reads a Bloom filter written by WriteBloom.
+// Returns 1 if the file does not exist or is not a Bloom filter.
+int ReadBloom(string filename, BloomFilter_t *bloom){
+	FILE *fin=fopen(filename.c_str(), "rb");
+	if(fin==NULL){
+		return 1;
+	}
+	char magic[8];
+	long long header[4];
+	if(fread(magic, 1, 8, fin)!=8 || memcmp(magic, BLOOMMAGIC, 8)!=0 ||
+			fread(header, sizeof(long long), 4, fin)!=4 ||
+			header[0]!=BLOOMFORMAT || header[3] < 64 ||
+			(header[3] & (header[3]-1))!=0){
+		fclose(fin);
+		return 1;
+	}
+	(*bloom).KmerLength=header[1];
+	(*bloom).NumHashes=header[2];
+	(*bloom).NumBits=header[3];
+	(*bloom).Words.resize((*bloom).NumBits/64);
+	size_t numread=fread(&(*bloom).Words[0], sizeof(uint64_t),
+			(*bloom).Words.size(), fin);
+	fclose(fin);
+	return numread==(*bloom).Words.size() ? 0 : 1;
+}
+
+// AppendFastqRecord
+// Appends one FASTQ record to a text buffer.
+void AppendFastqRecord(FastqRecord_t *record, string *out){
+	(*out) += (*record).Name;
+	(*out) += '\n';
+	(*out) += (*record).Seq;
+	(*out) += '\n';
+	(*out) += (*record).Plus;
+	(*out) += '\n';
+	(*out) += (*record).Qual;
+	(*out) += '\n';
+}
+
+// CompressGzipMember
+// Compresses a text buffer into a complete gzip member.
+// Concatenated members form a valid gzip file, so each thread
+// can compress its own range of pairs.
+// Returns the zlib status.
+int CompressGzipMember(string *in, string *out){
+	(*out).clear();
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	// A window of 15 bits plus 16 writes a gzip header and trailer.
+	int status=deflateInit2(&stream, COMPRESSIONLEVEL, Z_DEFLATED,
+			15+16, 8, Z_DEFAULT_STRATEGY);
+	if(status!=Z_OK){
+		return status;
+	}
+	(*out).resize(deflateBound(&stream, (*in).size())+32);
+	stream.next_in=(Bytef *)(*in).data();
+	stream.avail_in=(*in).size();
+	stream.next_out=(Bytef *)&(*out)[0];
+	stream.avail_out=(*out).size();
+	status=deflate(&stream, Z_FINISH);
+	(*out).resize(stream.total_out);
+	deflateEnd(&stream);
+	return status==Z_STREAM_END ? Z_OK : status;
+}
+
+// ScreenPairs
+// Screens the read pairs from first to last, not including last,
+// and compresses the kept pairs.
+// Run in parallel threads on separate ranges of the same block.
+void ScreenPairs(vector<ReadPair_t> *pairs, unsigned int first,
+		unsigned int last, Screen_t *screen, CompressedBlock_t *block){
+	vector<uint64_t> hashes;
+	string text1;
+	string text2;
+	for(unsigned int i=first; i<last; i++){
+		ReadPair_t *pair=&(*pairs)[i];
+
+		// Count viral k-mer hits in both mates.
+		hashes.clear();
+		CanonicalKmerHashes((*pair).Read1.Seq, KMERLENGTH, WINDOW, &hashes);
+		CanonicalKmerHashes((*pair).Read2.Seq, KMERLENGTH, WINDOW, &hashes);
+		(*pair).ViralHits=0;
+		for(unsigned int h=0; h<hashes.size(); h++){
+			if(binary_search((*screen).ViralKmers.begin(),
+					(*screen).ViralKmers.end(), hashes[h])){
+				(*pair).ViralHits++;
+			}
+		}
+		(*pair).Keep=((*pair).ViralHits >= MINHITS);
+
+		// Count host k-mer hits in both mates, using all k-mers
+		// of the length stored in the Bloom filter.
+		(*pair).HostHits=0;
+		(*pair).NumKmers=0;
+		if((*pair).Keep && (*screen).UseBloom){
+			hashes.clear();
+			int k=(*screen).Bloom.KmerLength;
+			CanonicalKmerHashes((*pair).Read1.Seq, k, 1, &hashes);
+			CanonicalKmerHashes((*pair).Read2.Seq, k, 1, &hashes);
+			(*pair).NumKmers=hashes.size();
+			for(unsigned int h=0; h<hashes.size(); h++){
+				if(BloomContains(&(*screen).Bloom, hashes[h])){
+					(*pair).HostHits++;
+				}
+			}
+			if((*pair).NumKmers > 0 &&
+					(double)(*pair).HostHits/(*pair).NumKmers > MAXHOSTFRACTION){
+				(*pair).Keep=false;
+			}
+		}
+
+		if((*pair).Keep){
+			AppendFastqRecord(&(*pair).Read1, &text1);
+			AppendFastqRecord(&(*pair).Read2, &text2);
+		}
+	}
+
+	(*block).Out1.clear();
+	(*block).Out2.clear();
+	(*block).Status=Z_OK;
+	if(text1.size() > 0){
+		(*block).Status=CompressGzipMember(&text1, &(*block).Out1);
+	}
+	if(text2.size() > 0 && (*block).Status==Z_OK){
+		(*block).Status=CompressGzipMember(&text2, &(*block).Out2);
+	}
+}
+
+// BuildBloom
+// Builds a Bloom filter of the canonical k-mers of the host sequences.
+// Returns 1 if the host file cannot be read or the filter cannot be written.
+int BuildBloom(){
+	BloomFilter_t Bloom;
+	Bloom.KmerLength=KMERLENGTH;
+	Bloom.NumHashes=NUMHASHES;
+	// Round the size down to a power of two, so that bits are
+	// chosen with a mask.
+	Bloom.NumBits=64;
+	while(Bloom.NumBits*2 <= BLOOMMEGABYTES*8*1024*1024){
+		Bloom.NumBits *= 2;
+	}
+	Bloom.Words.assign(Bloom.NumBits/64, 0);
+
+	printf("Reading host sequences.\n");
+	gzFile fin=gzopen(HOSTFASTA.c_str(), "rb");
+	if(fin==NULL){
+		printf("Error: host FASTA file does not exist.\n");
+		return 1;
+	}
+
+	// Add k-mers line by line, carrying the last k-1 bases of each line
+	// into the next so that k-mers that span lines are kept.
+	string line;
+	string carry="";
+	vector<uint64_t> hashes;
+	long long NumKmers=0;
+	long long NumSequences=0;
+	while(ReadGzLine(fin, &line)){
+		if(line.size() > 0 && line[0]=='>'){
+			carry="";
+			NumSequences++;
+			continue;
+		}
+		string seq=carry+line;
+		hashes.clear();
+		CanonicalKmerHashes(seq, KMERLENGTH, 1, &hashes);
+		for(unsigned int h=0; h<hashes.size(); h++){
+			BloomInsert(&Bloom, hashes[h]);
+		}
+		NumKmers += hashes.size();
+		if((int)seq.size() >= KMERLENGTH-1){
+			carry=seq.substr(seq.size()-(KMERLENGTH-1));
+		}
+		else{
+			carry=seq;
+		}
+	}
+	gzclose(fin);
+
+	long long NumSet=0;
+	for(unsigned int w=0; w<Bloom.Words.size(); w++){
+		NumSet += __builtin_popcountll(Bloom.Words[w]);
+	}
+	printf("Number of host sequences: %lld\n", NumSequences);
+	printf("Number of host k-mers added: %lld\n", NumKmers);
+	printf("Fraction of Bloom filter bits set: %f\n",
+			(double)NumSet/Bloom.NumBits);
+
+	if(WriteBloom(OUTPREFIX, &Bloom) != 0){
+		printf("Error: could not write Bloom filter.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// ScreenReads
+// Streams the read pairs in blocks, screens each block in parallel,
+// and writes the kept pairs in input order.
+// Returns 1 if any input cannot be read or the reads are not paired.
+int ScreenReads(){
+
+	//==================================================
+	// Read in the viral k-mers and the host Bloom filter.
+	//==================================================
+
+	printf("Reading viral references.\n");
+	vector<string> RefSequences;
+	if(ReadFastaSequences(REFFASTA, &RefSequences) != 0 ||
+			RefSequences.size()==0){
+		printf("Error: viral reference does not exist.\n");
+		return 1;
+	}
+	Screen_t Screen;
+	for(unsigned int i=0; i<RefSequences.size(); i++){
+		CanonicalKmerHashes(RefSequences[i], KMERLENGTH, WINDOW,
+				&Screen.ViralKmers);
+	}
+	sort(Screen.ViralKmers.begin(), Screen.ViralKmers.end());
+	Screen.ViralKmers.erase(unique(Screen.ViralKmers.begin(),
+			Screen.ViralKmers.end()), Screen.ViralKmers.end());
+	printf("Number of viral references: %d\n", (int)RefSequences.size());
+	printf("Number of viral k-mers: %d\n", (int)Screen.ViralKmers.size());
+
+	if(BLOOMFILE != ""){
+		printf("Reading host Bloom filter.\n");
+		if(ReadBloom(BLOOMFILE, &Screen.Bloom) != 0){
+			printf("Error: could not read host Bloom filter.\n");
+			return 1;
+		}
+		Screen.UseBloom=true;
+	}
+
+	//==================================================
+	// Stream the read pairs in blocks.
+	// Each block is split evenly among the threads, and each
+	// thread writes its kept pairs as one gzip member, so memory
+	// use is bounded by the block size.
+	//==================================================
+
+	gzFile fin1=gzopen(FASTQ1.c_str(), "rb");
+	gzFile fin2=gzopen(FASTQ2.c_str(), "rb");
+	if(fin1==NULL || fin2==NULL){
+		printf("Error: FASTQ file does not exist.\n");
+		return 1;
+	}
+	gzbuffer(fin1, 1<<17);
+	gzbuffer(fin2, 1<<17);
+
+	string Out1=OUTPREFIX+".1.fastq.gz";
+	string Out2=OUTPREFIX+".2.fastq.gz";
+	FILE *fout1=fopen(Out1.c_str(), "wb");
+	FILE *fout2=fopen(Out2.c_str(), "wb");
+	if(fout1==NULL || fout2==NULL){
+		printf("Error: could not open output files.\n");
+		return 1;
+	}
+
+	printf("Screening read pairs.\n");
+
+	unsigned int BlockSize=PAIRSPERTHREAD*NUMTHREADS;
+	vector<ReadPair_t> Pairs(BlockSize);
+	vector<CompressedBlock_t> Blocks(NUMTHREADS);
+
+	long long NumPairs=0;
+	long long NumKept=0;
+	long long NumLowViral=0;
+	long long NumHost=0;
+	bool Done=false;
+	int Status=0;
+
+	while(!Done && Status==0){
+
+		// Read in the next block of read pairs.
+		unsigned int numpairs=0;
+		while(numpairs < BlockSize){
+			ReadPair_t *pair=&Pairs[numpairs];
+			int status1=ReadFastqRecord(fin1, &(*pair).Read1);
+			int status2=ReadFastqRecord(fin2, &(*pair).Read2);
+			if(status1==0 && status2==0){
+				Done=true;
+				break;
+			}
+			if(status1!=1 || status2!=1){
+				printf("Error: malformed or unpaired FASTQ record after %lld pairs.\n",
+						NumPairs+numpairs);
+				Status=1;
+				break;
+			}
+			if(PairName((*pair).Read1.Name)!=PairName((*pair).Read2.Name)){
+				printf("Error: read names do not match: %s %s\n",
+						(*pair).Read1.Name.c_str(), (*pair).Read2.Name.c_str());
+				Status=1;
+				break;
+			}
+			numpairs++;
+		}
+		if(Status!=0 || numpairs==0){
+			break;
+		}
+
+		// Screen the block in parallel.
+		int numthreads=NUMTHREADS;
+		if((unsigned int)numthreads > numpairs){
+			numthreads=numpairs;
+		}
+		vector<thread> threads;
+		for(int t=0; t<numthreads; t++){
+			unsigned int first=(unsigned long long)numpairs*t/numthreads;
+			unsigned int last=(unsigned long long)numpairs*(t+1)/numthreads;
+			threads.push_back(thread(ScreenPairs, &Pairs, first, last,
+					&Screen, &Blocks[t]));
+		}
+		for(int t=0; t<numthreads; t++){
+			threads[t].join();
+		}
+
+		// Write the compressed blocks in input order.
+		for(int t=0; t<numthreads; t++){
+			if(Blocks[t].Status!=Z_OK){
+				printf("Error: compression failed.\n");
+				Status=1;
+				break;
+			}
+			if(fwrite(Blocks[t].Out1.data(), 1, Blocks[t].Out1.size(), fout1)!=
+					Blocks[t].Out1.size() ||
+					fwrite(Blocks[t].Out2.data(), 1, Blocks[t].Out2.size(), fout2)!=
+					Blocks[t].Out2.size()){
+				printf("Error: could not write output files.\n");
+				Status=1;
+				break;
+			}
+		}
+
+		// Tally the screening results.
+		for(unsigned int i=0; i<numpairs; i++){
+			if(Pairs[i].Keep){
+				NumKept++;
+			}
+			else if(Pairs[i].ViralHits < MINHITS){
+				NumLowViral++;
+			}
+			else{
+				NumHost++;
+			}
+		}
+		NumPairs += numpairs;
+	}
+
+	gzclose(fin1);
+	gzclose(fin2);
+
+	// An empty gzip member keeps the output readable
+	// when no pairs are kept.
+	if(Status==0 && NumKept==0){
+		string empty="";
+		string member="";
+		CompressGzipMember(&empty, &member);
+		fwrite(member.data(), 1, member.size(), fout1);
+		fwrite(member.data(), 1, member.size(), fout2);
+	}
+	fclose(fout1);
+	fclose(fout2);
+
+	if(Status!=0){
+		return Status;
+	}
+
+	printf("Number of read pairs: %lld\n", NumPairs);
+	printf("Number of read pairs kept: %lld\n", NumKept);
+	printf("Number of read pairs with too few viral k-mers: %lld\n", NumLowViral);
+	if(Screen.UseBloom){
+		printf("Number of read pairs rejected as host: %lld\n", NumHost);
+	}
+
+	return 0;
+}
@@ -1,7 +1,49 @@
 //============================================================================
 // Name        : SummarizeBAM.cpp
-// Version     : 1.21
-// Description : 1.21 Modify types to account for very high coverage.
+// Version     : 1.32
+// Description : 1.32 Optionally collect strand, base quality, and read position
+//               histograms for each position and base in the same pass,
+//               in 16-bit counters that spill into a map on overflow,
+//               and store them in the binary pileup for later QC.
+//               Histograms are added in the same loop as the pileup,
+//               in an instantiation chosen at startup.
+//           1.31 Optionally keep a separate pileup for each read group,
+//               from the RG tag, and write each output once per group
+//               in a single pass over the reads.
+//           1.30 Optionally mark duplicate read pairs in coordinate-sorted
+//               input by a hash of their unclipped 5' positions, strands,
+//               and mate positions, kept over a sliding window, and
+//               exclude them from the tally. Report the duplicate rate.
+//           1.29 Optionally downsample read pairs before tallying them:
+//               a fixed fraction, a coverage cap, or a fixed number
+//               per window, decided by a hash of the read name so that
+//               mates stay together, as in CountHaplotypes.
+//               In sorted input, coverage cap decisions held for mates
+//               are dropped once the input passes the mate.
+//           1.28 Specialize the read setup on whether reads are trimmed,
+//               chosen at startup, and add each run to the pileup
+//               branch-free, without bounds checks for runs that lie
+//               within the chromosome, specialized on read orientation.
+//           1.27 Optionally write a sparse summary, with one depth record
+//               for each covered position and rows only for bases that
+//               pass minimum count and frequency floors, and with sample
+//               metadata given once in a header.
+//           1.26 Optionally write mean coverage in bins along the genome
+//               and for each gene in a BED annotation, flagging bins and
+//               genes below a minimum coverage.
+//           1.25 Add a merge mode that adds together binary pileups,
+//               checkpoints, or text summaries without re-reading reads.
+//               Optionally write the pileup in binary form.
+//           1.24 Periodically write a checkpoint of the pileup and resume
+//               from it when the run is restarted with the same arguments.
+//           1.23 Add a mate overlap mode in which bases covered by both
+//               reads of a pair are counted once per fragment.
+//           1.22 Store the pileup in dense arrays indexed by 2-bit base codes.
+//               Tally each aligned run of a read with a vectorized kernel
+//               (AVX2/SSE4.2 with scalar fallback) chosen at runtime
+//               or with -T, which can also check the chosen kernel's
+//               pileups against those of the scalar kernel.
+//           1.21 Modify types to account for very high coverage.
 //               Ignore secondary read alignments.
 //           1.2 Fix base position counter to account for read orientation.
 //               Modify file format to remove header row and include genome position.
@@ -24,19 +66,63 @@
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <set>
+#include <list>
+#include <queue>
+#include <unordered_map>
 #include <cstring>
+#include <cmath>
+#include <cctype>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TALLY_X86_DISPATCH
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 // RUN PARAMETERS
+string VERSION="1.32";
 string SAM="";
 string REFFASTA="";
 string OUTFILE="";
 string OUTFASTA="";
+string OUTPILEUP="";
+bool MERGE=false;
+vector<string> MERGEINPUTS;
 int BASEQTHRESHOLD=20;
 int MAPQTHRESHOLD=20;
 int LEFTTRIM=0;
 int RIGHTTRIM=0;
+int REQUIREFLAGS=0;
+int EXCLUDEFLAGS=0xF04;
+string CHR="";
+int OVERLAPMODE=0;
+int MAXPENDINGMATES=100000;
+string CHECKPOINT="";
+long long CHECKPOINTINTERVAL=1000000;
+string OUTCOVERAGE="";
+int BINWIDTH=50;
+string REFBED="";
+string OUTGENECOVERAGE="";
+long long MINCOVERAGE=200;
+string OUTFORMAT="dense";
+long long MINBASECOUNT=1;
+double MINBASEFREQ=0;
+vector<string> SAMPLEFIELDS;
+string DOWNSAMPLEMODE="none";
+double DOWNSAMPLEVALUE=0;
+int DOWNSAMPLEWINDOW=200;
+long long DOWNSAMPLESEED=0;
+int DUPLICATEMODE=0;
+int DUPLICATEWINDOW=500;
+int OPTICALDISTANCE=100;
+bool READGROUPS=false;
+string OUTHISTOGRAMS="";
+string TALLYKERNEL="auto";
+
+bool DEBUG=false;
 
 struct PositionBase_t{
 	long long Count;
@@ -44,16 +130,391 @@ struct PositionBase_t{
 	long long TotalReadPosition; // 1-indexed read position
 };
 
+// Number of mandatory fields in a SAM-format line.
+// Optional fields, if present, are kept together as one extra field.
+const int NUMSAMFIELDS=11;
+
+// Locations of the tab-delimited fields in a SAM-format line,
+// so that integer fields can be checked before SEQ and QUAL are touched.
+struct SAMFields_t{
+	const char *Start[NUMSAMFIELDS+1];
+	int Length[NUMSAMFIELDS+1];
+};
+
+// Read filter expressed as FLAG bitmasks, as in samtools view -f/-F,
+// together with a minimum mapping quality and an optional chromosome.
+// Reads must also map to one of the reference sequences.
+struct ReadFilter_t{
+	int RequireFlags=0;
+	int ExcludeFlags=0;
+	int MinMapQ=0;
+	string Chr="";
+};
+
+// Results of FilterRead, naming the filter that rejected a read.
+enum FilterResult_t {FILTER_PASS, FILTER_FLAGS, FILTER_UNMAPPED,
+	FILTER_MAPQ, FILTER_REFERENCE};
+
+// Number of reads removed by each filter, in the order they are applied.
+struct FilterCounts_t{
+	long long Total=0;
+	long long FailRequireFlags=0;
+	long long FailExcludeFlags=0;
+	long long Unmapped=0;
+	long long FailMapQ=0;
+	long long FailReference=0;
+	long long Indel=0;
+	long long Passed=0;
+};
+
+// Bases are stored in the pileup by their 2-bit code,
+// so that BASES[code] gives the base.
+const char BASES[4]={'A','C','G','T'};
+const int NUMBASES=4;
+
+// Per-base results of the tally kernel for one aligned run of a read.
+// Mask is 1 for bases that pass the quality threshold and are A, C, G, or T,
+// and Code is the 2-bit base code. The 1-indexed read position of base i,
+// adjusted for read orientation, is ReadPosStart + ReadPosStep*i.
+struct ReadTally_t{
+	int Chr;
+	int Group=0;
+	bool Reverse=false;
+	int RefStart;
+	int Length;
+	int ReadPosStart;
+	int ReadPosStep;
+	const char *Seq;
+	const char *Quality;
+	vector<unsigned char> Mask;
+	vector<unsigned char> Code;
+};
+
+// Histograms kept for each position and base, if requested:
+// the count on each strand, from FLAG 0x10, the count in each base quality
+// bin of QUALITYBINWIDTH, with the last bin open-ended, and the count in
+// each read position bin, whose last positions are READPOSBINENDS.
+const int NUMSTRANDBINS=2;
+const int NUMQUALITYBINS=5;
+const int QUALITYBINWIDTH=10;
+const int NUMREADPOSBINS=8;
+const int READPOSBINENDS[NUMREADPOSBINS-1]={5, 10, 25, 50, 75, 100, 150};
+const int NUMHISTOGRAMBINS=NUMSTRANDBINS+NUMQUALITYBINS+NUMREADPOSBINS;
+
+// Dense pileup of base counts for each reference sequence, called as follows:
+// Summary[int chr][pos*NUMBASES + int basecode].
+//   (Count/TotalQuality/TotalReadPosition)
+// Coverage[int chr][pos] stores the total coverage at each position.
+// Histograms[int chr][(pos*NUMBASES + int basecode)*NUMHISTOGRAMBINS + bin]
+// stores the low 16 bits of each histogram count, and HistogramSpill[chr]
+// the rest of the counts that have overflowed, by the same index.
+// Histograms are empty unless they are collected.
+struct Pileup_t{
+	vector<vector<PositionBase_t> > Summary;
+	vector<vector<long long> > Coverage;
+	vector<vector<uint16_t> > Histograms;
+	vector<unordered_map<long long, long long> > HistogramSpill;
+};
+
+// Pileups for each read group, in the order the groups were first seen
+// in the header or the reads, together with an index by group name
+// and the number of reads tallied in each group.
+// Without read groups, there is a single group with an empty name.
+struct ReadGroups_t{
+	vector<string> Names;
+	unordered_map<string, int> Index;
+	vector<Pileup_t> Pileups;
+	vector<long long> NumReads;
+};
+
+// Read group of reads without an RG tag.
+const string NOREADGROUP="unassigned";
+
+// A read held back until its mate arrives, in mate overlap mode.
+// The tally points into the read's own copies of its bases and qualities.
+struct PendingMate_t{
+	string QName;
+	int Flag;
+	int MateStart;
+	string Seq;
+	string Quality;
+	ReadTally_t Tally;
+};
+
+// Reads waiting for their mates, in the order they were read,
+// together with an index by read name.
+struct MateBuffer_t{
+	list<PendingMate_t> Pending;
+	unordered_map<string, list<PendingMate_t>::iterator> Index;
+	long long NumPairsMerged=0;
+	long long NumOverlapBases=0;
+	long long NumDiscordantBases=0;
+};
+
+// Gene annotation read from a BED file.
+struct Annotation_t{
+	string Chr="";
+	int ChrStart=0;
+	int ChrEnd=0;
+	string Name="";
+	int NumExons=0;
+	vector <int> ExonSizes;
+	vector <int> ExonStarts;
+};
+
+// Read pair downsampling modes, applied to every alignment line
+// before the read filters.
+enum DownsampleMode_t {DOWNSAMPLE_NONE, DOWNSAMPLE_FRACTION,
+	DOWNSAMPLE_CAP, DOWNSAMPLE_WINDOW};
+
+// Identifies the window of a read pair in window downsampling:
+// the chromosome and window index of the leftmost mate,
+// computed the same way from either mate.
+typedef pair<string, int> WindowKey_t;
+
+// A decision on a read pair in coverage cap mode, made at the first
+// primary line of the pair and applied to the rest of the pair.
+// In sorted input, it is dropped once the input passes MatePos on MateChr.
+struct PairDecision_t{
+	bool Keep=true;
+	int NumPrimary=0;
+	string MateChr="";
+	int MatePos=-1;
+};
+
+// Names of the pairs whose decisions are held, by the position of the mate,
+// lowest first, so that decisions can be dropped once the mate has passed.
+typedef priority_queue<pair<int, string>, vector<pair<int, string> >,
+		greater<pair<int, string> > > DecisionQueue_t;
+
+// Downsampling parameters and state.
+// Pairs are ranked by a hash of the read name, so every line of a pair
+// gets the same decision, and any program reading the same SAM file
+// with the same parameters keeps the same pairs.
+//   Fraction: keep pairs whose hash falls below Fraction of the hash range.
+//   Cap: keep a pair unless the read coverage of the pairs already kept
+//     reaches Cap at every position of its fragment. While the input is
+//     sorted by coordinate, decisions are dropped once the input leaves
+//     the mate's chromosome or passes its position, as in duplicate
+//     marking, and otherwise held until the mate arrives.
+//   Window: keep the PairsPerWindow pairs with the lowest hashes among
+//     the pairs whose leftmost mate starts in each window of WindowSize
+//     positions, found in a first pass over the file.
+struct Downsampler_t{
+	DownsampleMode_t Mode=DOWNSAMPLE_NONE;
+	uint64_t Seed=0;
+	uint64_t FractionThreshold=0;
+	long long Cap=0;
+	long long PairsPerWindow=0;
+	int WindowSize=1;
+	map<string, vector<long long> > Depth;
+	unordered_map<string, PairDecision_t> Decisions;
+	map<string, DecisionQueue_t> DecisionQueues;
+	string LastChr="";
+	int LastPos=-1;
+	bool Sorted=true;
+	set<string> ChrSeen;
+	map<WindowKey_t, uint64_t> WindowThresholds;
+	long long NumLines=0;
+	long long NumRemoved=0;
+};
+
+// Results of MarkDuplicate. Duplicates are optical if the read names
+// place them close to the read they duplicate on the same flow cell tile.
+enum DuplicateResult_t {DUPLICATE_UNIQUE, DUPLICATE_PCR, DUPLICATE_OPTICAL,
+	DUPLICATE_UNSORTED};
+
+// A read pair kept by the duplicate marker, stored under the hash of its key:
+// the unclipped 5' position of its first read, and the flow cell tile
+// and coordinates from the read name, if the name gives them.
+struct DuplicateEntry_t{
+	int FivePrime=0;
+	bool HasLocation=false;
+	uint64_t Tile=0;
+	int X=0;
+	int Y=0;
+};
+
+// The result for a read pair, made at its first read and held
+// until its mate arrives at MatePos.
+struct DuplicateDecision_t{
+	int Result=DUPLICATE_UNIQUE;
+	int MatePos=0;
+};
+
+// Duplicate marking state for coordinate-sorted input.
+// Keys of the pairs kept so far are held only while a duplicate could
+// still arrive, i.e. until the input moves Window positions past their
+// 5' position, and decisions only until the mate's position is passed.
+// Both are dropped at each new chromosome.
+struct DuplicateMarker_t{
+	int Window=1;
+	int OpticalDistance=0;
+	int LastChr=-1;
+	int LastPos=-1;
+	vector<bool> ChrSeen;
+	unordered_map<uint64_t, DuplicateEntry_t> Keys;
+	priority_queue<pair<int, uint64_t>, vector<pair<int, uint64_t> >,
+		greater<pair<int, uint64_t> > > KeyQueue;
+	unordered_map<string, DuplicateDecision_t> Decisions;
+	priority_queue<pair<int, string>, vector<pair<int, string> >,
+		greater<pair<int, string> > > DecisionQueue;
+	long long NumReads=0;
+	long long NumDuplicates=0;
+	long long NumOptical=0;
+};
+
+// Identifiers at the start of binary pileup and checkpoint files.
+const char PILEUPMAGIC[8]={'S','B','P','I','L','E','U','P'};
+const char CHECKPOINTMAGIC[8]={'S','B','C','H','E','C','K','P'};
+const long long PILEUPFORMAT=1;
+const long long PILEUPHISTOGRAMFORMAT=2;
+const long long CHECKPOINTFORMAT=2;
+
+// The start of a checkpoint, ahead of the reads waiting for mates:
+// the run fingerprint, the input offset and number of lines read,
+// the filter counters, and the mate overlap counters.
+struct CheckpointHeader_t{
+	string Fingerprint="";
+	long long Offset=0;
+	long long NumLines=0;
+	FilterCounts_t Counts;
+	long long NumPairsMerged=0;
+	long long NumOverlapBases=0;
+	long long NumDiscordantBases=0;
+};
+
+// Signature shared by the scalar and vectorized tally kernels.
+typedef void (*TallyKernel_t)(const char *seq, const char *quality, int n,
+		int qthreshold, unsigned char *mask, unsigned char *code);
+
+// Signature of the run setup for a read,
+// specialized on whether reads are trimmed.
+typedef void (*ReadRunSetter_t)(ReadTally_t *tally, int startpos, int tlen,
+		const char *read, const char *quality, int readlength,
+		int leftclip, int rightclip);
+
+// Signature of the addition of a run to a pileup, specialized on whether
+// positions are checked against the chromosome bounds, on the read
+// orientation, and on whether histograms are collected.
+typedef void (*ReadRunAdder_t)(ReadTally_t *tally, Pileup_t *pileup);
+
 // FUNCTIONS
 int ArgsParse(int argc, char *argv[]);
+int MergeArgsParse(int argc, char *argv[]);
 void PrintUsage();
 void PrintParameters();
+void PrintCoverageParameters();
+void PrintFormatParameters();
+int CheckSummaryFormat();
 void SetDebug();
 int ReadMultiFasta(string filename,
 		vector<string> *sequencenames,
 		vector<string> *sequences);
+int ReadBED(string filename, vector<Annotation_t> *annotations);
 vector<string> StringSplit(string s, char c);
-string ExpandCIGAR(string cigar);
+int SplitSAMLine(const string &line, SAMFields_t *fields);
+int FilterRead(SAMFields_t *fields, ReadFilter_t *filter,
+		map<string, int> *refindex, int *chrindex, FilterCounts_t *counts);
+void PrintFilterCounts(FilterCounts_t *counts);
+void SummarizeCIGAR(const char *cigar, int length,
+		int *leftclip, int *rightclip, int *querylength, bool *indel);
+void TallyKernelScalar(const char *seq, const char *quality, int n,
+		int qthreshold, unsigned char *mask, unsigned char *code);
+#ifdef TALLY_X86_DISPATCH
+void TallyKernelSSE42(const char *seq, const char *quality, int n,
+		int qthreshold, unsigned char *mask, unsigned char *code);
+void TallyKernelAVX2(const char *seq, const char *quality, int n,
+		int qthreshold, unsigned char *mask, unsigned char *code);
+#endif
+TallyKernel_t SelectTallyKernel(string name, string *kernelname);
+template<bool Trim>
+void SetReadRun(ReadTally_t *tally, int startpos, int tlen,
+		const char *read, const char *quality, int readlength,
+		int leftclip, int rightclip);
+void RunTallyKernel(TallyKernel_t kernel, ReadTally_t *tally);
+template<bool CheckBounds, bool Forward, bool Histograms>
+void AddReadRun(ReadTally_t *tally, Pileup_t *pileup);
+template<bool Histograms>
+void SetReadRunAdders();
+void AddReadTally(ReadTally_t *tally, ReadGroups_t *groups);
+long long ComparePileups(Pileup_t *first, Pileup_t *second);
+void AddHistogramCount(Pileup_t *pileup, int chr, long long index,
+		long long value);
+long long HistogramCount(Pileup_t *pileup, int chr, long long index);
+void WriteHistograms(ofstream *out, vector<string> *refnames,
+		vector<string> *refsequences, Pileup_t *pileup);
+void AddMateTally(SAMFields_t *fields, ReadTally_t *tally, int startpos,
+		MateBuffer_t *buffer, ReadGroups_t *groups);
+void ReleaseMate(SAMFields_t *fields, MateBuffer_t *buffer,
+		ReadGroups_t *groups);
+void FlushPendingMates(MateBuffer_t *buffer, int chr, int pos,
+		ReadGroups_t *groups);
+void MergeMateTallies(ReadTally_t *first, ReadTally_t *second,
+		MateBuffer_t *buffer);
+void HoldMate(string qname, int flag, int matestart, ReadTally_t *tally,
+		MateBuffer_t *buffer);
+void WriteInt64(ofstream *out, long long value);
+long long ReadInt64(ifstream *in);
+void WriteString(ofstream *out, string value);
+string ReadString(ifstream *in);
+void WritePileup(ofstream *out, vector<string> *refnames, Pileup_t *pileup);
+int ReadPileup(ifstream *in, vector<string> *refnames, Pileup_t *pileup,
+		bool add);
+int MergePileupFile(string filename, vector<string> *refnames,
+		Pileup_t *pileup);
+string RunFingerprint();
+void WriteCheckpointHeader(ofstream *out, CheckpointHeader_t *header);
+int ReadCheckpointHeader(ifstream *in, CheckpointHeader_t *header);
+int WriteCheckpoint(string filename, long long offset, long long numlines,
+		FilterCounts_t *counts, MateBuffer_t *buffer, Downsampler_t *downsampler,
+		DuplicateMarker_t *marker, vector<string> *refnames,
+		ReadGroups_t *groups);
+int ReadCheckpoint(string filename, long long *offset, long long *numlines,
+		FilterCounts_t *counts, MateBuffer_t *buffer, Downsampler_t *downsampler,
+		DuplicateMarker_t *marker, vector<string> *refnames,
+		vector<string> *refsequences, ReadGroups_t *groups);
+void WriteDownsampler(ofstream *out, Downsampler_t *downsampler);
+int ReadDownsampler(ifstream *in, Downsampler_t *downsampler);
+long long WriteCoverageBins(ofstream *out, vector<string> *refnames,
+		Pileup_t *pileup);
+long long WriteGeneCoverage(ofstream *out, vector<Annotation_t> *annotations,
+		map<string, int> *refindex, Pileup_t *pileup);
+void WriteSparseSummary(ofstream *out, vector<string> *refnames,
+		vector<string> *refsequences, string readgroup, Pileup_t *pileup);
+int CheckDownsampleParameters();
+void SetDownsampler(Downsampler_t *downsampler);
+void PrintDownsampleParameters();
+uint64_t HashReadName(const char *name, int length, uint64_t seed);
+int CIGARReferenceLength(const char *cigar, int length);
+WindowKey_t PairWindow(SAMFields_t *fields, int windowsize);
+int InitializeDownsampler(ifstream *in, Downsampler_t *downsampler);
+bool KeepRead(SAMFields_t *fields, Downsampler_t *downsampler);
+void ExpireDecisions(Downsampler_t *downsampler, string chr, int pos);
+void DropDecisions(Downsampler_t *downsampler, string chr, int pos);
+bool ParseReadLocation(const char *name, int length, DuplicateEntry_t *entry);
+int UnclippedFivePrime(const char *cigar, int length, int pos, bool reverse);
+int MarkDuplicate(SAMFields_t *fields, int chr, int pos,
+		DuplicateMarker_t *marker);
+void WriteDuplicateMarker(ofstream *out, DuplicateMarker_t *marker);
+int ReadDuplicateMarker(ifstream *in, DuplicateMarker_t *marker);
+void InitializePileup(Pileup_t *pileup, vector<string> *refsequences);
+int FindReadGroup(string name, vector<string> *refsequences,
+		ReadGroups_t *groups);
+string ReadGroupTag(SAMFields_t *fields);
+string HeaderReadGroup(const string &line);
+string GroupFileName(string filename, string group);
+
+// Tally kernel selected at startup based on the CPU.
+TallyKernel_t TallyKernel=TallyKernelScalar;
+string TALLYKERNELNAME="scalar";
+
+// Run setup selected at startup based on the read trimming.
+ReadRunSetter_t SetTallyRun=SetReadRun<false>;
+
+// Run additions selected at startup based on whether histograms are
+// collected, indexed by [CheckBounds][Forward].
+ReadRunAdder_t AddTallyRun[2][2];
 
 int main(int argc, char *argv[]) {
 
@@ -66,6 +527,24 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	// Choose the tally kernel for this CPU, the run setup for whether
+	// reads are trimmed, and the run additions for whether histograms
+	// are collected.
+	TallyKernel=SelectTallyKernel(TALLYKERNEL, &TALLYKERNELNAME);
+	if(TallyKernel==NULL){
+		printf("Error: this CPU does not support the %s tally kernel.\n",
+				TALLYKERNEL.c_str());
+		return 1;
+	}
+	SetTallyRun=(LEFTTRIM!=0 || RIGHTTRIM!=0) ? SetReadRun<true> :
+			SetReadRun<false>;
+	if(OUTHISTOGRAMS != ""){
+		SetReadRunAdders<true>();
+	}
+	else{
+		SetReadRunAdders<false>();
+	}
+
 	PrintParameters();
 
 
@@ -81,158 +560,301 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	// Look up references by name when parsing reads.
+	map<string, int> RefIndex;
+	for(unsigned int i=0; i<RefNames.size(); i++){
+		RefIndex[RefNames[i]]=i;
+	}
+
+	//==================================================
+	// Read in BED annotation file for gene coverage.
+	//==================================================
+
+	vector<Annotation_t> Annotations;
+	if(REFBED != ""){
+		printf("Reading BED file.\n");
+		if(ReadBED(REFBED,&Annotations) != 0){
+			printf("Error: BED annotation does not exist.\n");
+			return 1;
+		}
+	}
+
 	//==============================================================
 	// Create a data structure to store the BAM summary information.
 	//==============================================================
 
 	printf("Initializing data structure.\n");
 
-	// Structure is a nested series of maps, called as follows:
-	// BAMSummary[string chr][int pos][char base].
-	//   (Count/TotalQuality/TotalReadPosition)
-
-	map<string, map<int, map<char, PositionBase_t> > > BAMSummary;
-	const char BASES[4]={'A','C','G','T'};
-
-	// Also initiate a data structure to store total coverage at each position.
-	map<string, map<int, int> > BAMCoverage;
+	// Structure is a dense array of base counts for each reference sequence,
+	// along with the total coverage at each position, for each read group.
+	// All counters start at zero. With read groups, a pileup is added
+	// for each group as it is found.
+	ReadGroups_t ReadGroups;
+	if(!READGROUPS){
+		FindReadGroup("", &RefSequences, &ReadGroups);
+	}
 
-	// Initialize the data structures.
-	for(unsigned int i=0; i<RefSequences.size();i++){
-		for(unsigned int j=0; j<RefSequences[i].size();j++){
-			BAMCoverage[RefNames[i]][j]=0;
-			for(unsigned int k=0; k<sizeof(BASES)/sizeof(char);k++){
-				PositionBase_t PositionBase;
-				BAMSummary[RefNames[i]][j][BASES[k]]=PositionBase;
-				BAMSummary[RefNames[i]][j][BASES[k]].Count=0;
-				BAMSummary[RefNames[i]][j][BASES[k]].TotalQuality=0;
-				BAMSummary[RefNames[i]][j][BASES[k]].TotalReadPosition=0;
-			}
-		}
+	// In kernel check mode, every read is tallied a second time with the
+	// scalar kernel, into a separate set of pileups with its own mate buffer,
+	// and the two sets are compared once all reads are tallied.
+	bool KernelCheck=(TALLYKERNEL=="check");
+	ReadGroups_t CheckGroups;
+	if(KernelCheck && !READGROUPS){
+		FindReadGroup("", &RefSequences, &CheckGroups);
 	}
+	ReadTally_t CheckTally;
+	MateBuffer_t CheckBuffer;
 
 	//==================================================
 	// Read in BAM file and tally reads.
 	//==================================================
 
-	printf("Reading SAM file.\n");
+	// Open the file, unless merging existing pileups.
+	ifstream fin;
+	if(!MERGE){
+		printf("Reading SAM file.\n");
+		fin.open(SAM.c_str(), ios::in);
+	}
 
-	// Open the file.
-	ifstream fin(SAM.c_str(), ios::in);
+	// Set up the read filter and its counters.
+	ReadFilter_t Filter;
+	Filter.RequireFlags=REQUIREFLAGS;
+	Filter.ExcludeFlags=EXCLUDEFLAGS;
+	Filter.MinMapQ=MAPQTHRESHOLD;
+	Filter.Chr=CHR;
+	FilterCounts_t FilterCounts;
+
+	// Reuse the kernel output buffers from read to read.
+	ReadTally_t Tally;
+
+	// In mate overlap mode, hold reads whose mates may overlap them.
+	MateBuffer_t MateBuffer;
+
+	// Downsample read pairs before any other work on them.
+	Downsampler_t Downsampler;
+	SetDownsampler(&Downsampler);
+
+	// Mark duplicate read pairs among the reads that pass the filters.
+	DuplicateMarker_t Duplicates;
+	Duplicates.Window=DUPLICATEWINDOW;
+	Duplicates.OpticalDistance=OPTICALDISTANCE;
+
+	// Track the byte offset of the next line and the number of lines read,
+	// which are saved in checkpoints.
+	long long InputOffset=0;
+	long long NumLines=0;
+
+	// In merge mode, add together the pileups from each input file.
+	if(MERGE){
+		printf("Merging pileups.\n");
+		for(unsigned int i=0; i<MERGEINPUTS.size(); i++){
+			if(MergePileupFile(MERGEINPUTS[i], &RefNames,
+					&ReadGroups.Pileups[0])!=0){
+				printf("Error: cannot merge %s.\n", MERGEINPUTS[i].c_str());
+				return 1;
+			}
+		}
+	}
+	else if(fin){
+
+		// Checkpoints require an input file that supports seeking,
+		// rather than a pipe.
+		bool Checkpointing=false;
+		if(CHECKPOINT!=""){
+			if(fin.tellg()==(streampos) -1){
+				printf("Input is not seekable; checkpoints are disabled.\n");
+			}
+			else{
+				Checkpointing=true;
+			}
+		}
 
-	// Tally the number of reads that contain indels and are not counted.
-	int NumIndels=0;
+		// In window downsampling mode, find the pairs to keep in each window
+		// in a first pass over the input.
+		if(InitializeDownsampler(&fin, &Downsampler)!=0){
+			printf("Error: window downsampling requires a SAM file rather than a pipe.\n");
+			return 1;
+		}
 
-	if(fin){
+		// Resume from an existing checkpoint for the same run.
+		if(Checkpointing && ReadCheckpoint(CHECKPOINT, &InputOffset, &NumLines,
+				&FilterCounts, &MateBuffer, &Downsampler, &Duplicates, &RefNames,
+				&RefSequences, &ReadGroups)==0){
+			printf("Resuming from checkpoint at line %lld.\n", NumLines);
+			fin.seekg(InputOffset);
+		}
 
 		// Read in the file line by line.
 		string line;
 
 		while(getline(fin, line)){
 
-			// Split the tab-delimited line.
-			vector<string> fields=StringSplit(line,'\t');
-
-			// Store the information in the appropriate formats.
-			// Fields are hard-coded based on BAM file format.
-			// Convert sequence positions from one-indexed to zero-indexed.
-			int Flag=atoi(fields[1].c_str())-1;
-			string Chr=fields[2];
-			int StartPos=atoi(fields[3].c_str())-1;
-			int MapQ=atoi(fields[4].c_str())-1;
-			string Cigar=fields[5];
-			int TLen=atoi(fields[8].c_str());
-			string Read=fields[9];
-			string Quality=fields[10];
-
-			// Exclude reads that did not map based on the CIGAR string.
-			if(Cigar=="*"){
+			// Save the state of the run before this line at regular intervals.
+			if(Checkpointing && NumLines>0 && NumLines%CHECKPOINTINTERVAL==0){
+				WriteCheckpoint(CHECKPOINT, InputOffset, NumLines, &FilterCounts,
+						&MateBuffer, &Downsampler, &Duplicates, &RefNames,
+						&ReadGroups);
+			}
+			NumLines++;
+			InputOffset+=line.size()+1;
+
+			// Skip header lines, adding a pileup for each read group.
+			if(line[0]=='@'){
+				if(READGROUPS && line.compare(0, 4, "@RG\t")==0){
+					FindReadGroup(HeaderReadGroup(line), &RefSequences,
+							&ReadGroups);
+					if(KernelCheck){
+						FindReadGroup(HeaderReadGroup(line), &RefSequences,
+								&CheckGroups);
+					}
+				}
 				continue;
 			}
 
-			// Exclude secondary read alignments,
-			// i.e. those with FLAG above 256.
-			if(Flag>256){
+			// Locate the tab-delimited fields without copying them.
+			// Skip lines without the mandatory fields.
+			SAMFields_t Fields;
+			if(SplitSAMLine(line, &Fields) < NUMSAMFIELDS){
 				continue;
 			}
 
-			// Expand the CIGAR string to account for soft clippings.
-			string ExpandedCigar=ExpandCIGAR(Cigar);
-			// Verify that the expanded CIGAR string matches the read length.
-			if(ExpandedCigar.size() != Read.size()){
-				printf("CIGAR parsing error.\n");
+			// Drop reads from pairs that are not in the subsample,
+			// as if they were not in the input.
+			if(!KeepRead(&Fields, &Downsampler)){
+				continue;
 			}
-			// Determine from the CIGAR string whether indels are present.
-			// Tally the number of reads that contain indels and are not counted.
-			bool indel=false;
-			string ForbiddenOperations="IDP";
-			for(unsigned int i=0; i<Cigar.size(); i++){
-				if(strchr(ForbiddenOperations.c_str(), Cigar[i])!=NULL){
-					indel=true;
-					NumIndels++;
+
+			// Apply the FLAG, mapping quality, and reference filters
+			// before looking at the CIGAR string, sequence, or qualities.
+			int ChrIndex=-1;
+			if(FilterRead(&Fields, &Filter, &RefIndex, &ChrIndex,
+					&FilterCounts) != FILTER_PASS){
+				if(OVERLAPMODE!=0){
+					ReleaseMate(&Fields, &MateBuffer, &ReadGroups);
+					if(KernelCheck){
+						ReleaseMate(&Fields, &CheckBuffer, &CheckGroups);
+					}
 				}
+				continue;
 			}
 
-			// Consider only reads that map to the reference,
-			// do not contain indels,
-			// and have mapping quality above a certain threshold.
-			if(find(RefNames.begin(), RefNames.end(), Chr)!=RefNames.end() &&
-					MapQ>MAPQTHRESHOLD && indel==false){
+			// Store the information in the appropriate formats.
+			// Fields are hard-coded based on BAM file format.
+			// Convert sequence positions from one-indexed to zero-indexed.
+			int StartPos=atoi(Fields.Start[3])-1;
+			int TLen=atoi(Fields.Start[8]);
+			const char *Read=Fields.Start[9];
+			const char *Quality=Fields.Start[10];
+			int ReadLength=Fields.Length[9];
+
+			// Count the number of bases that are soft-clipped
+			// from each end of the read, and determine from the
+			// CIGAR string whether indels are present.
+			int LeftClip=0;
+			int RightClip=0;
+			int QueryLength=0;
+			bool indel=false;
+			SummarizeCIGAR(Fields.Start[5], Fields.Length[5],
+					&LeftClip, &RightClip, &QueryLength, &indel);
 
-				// Count the number of bases that are soft-clipped
-				// from each end of the read.
-				int LeftClip=0;
-				int RightClip=0;
-				for(unsigned int i=0; i<ExpandedCigar.size();i++){
-					if(ExpandedCigar[i]=='S'){
-						LeftClip++;
-					}
-					else{
-						break;
+			// Verify that the CIGAR string matches the read length.
+			if(QueryLength != ReadLength || Fields.Length[10] != ReadLength){
+				printf("CIGAR parsing error.\n");
+				if(OVERLAPMODE!=0){
+					ReleaseMate(&Fields, &MateBuffer, &ReadGroups);
+					if(KernelCheck){
+						ReleaseMate(&Fields, &CheckBuffer, &CheckGroups);
 					}
 				}
-				for(unsigned int i=0; i<ExpandedCigar.size();i++){
-					if(ExpandedCigar[ExpandedCigar.size()-1-i]=='S'){
-						RightClip++;
-					}
-					else{
-						break;
+				continue;
+			}
+
+			// Exclude reads that contain indels
+			// and tally the number of such reads.
+			if(indel){
+				FilterCounts.Indel++;
+				if(OVERLAPMODE!=0){
+					ReleaseMate(&Fields, &MateBuffer, &ReadGroups);
+					if(KernelCheck){
+						ReleaseMate(&Fields, &CheckBuffer, &CheckGroups);
 					}
 				}
+				continue;
+			}
 
-				// Iterate along length of read and quality scores.
-				// Tally bases that are correctly aligned based on the CIGAR string.
-				// Adjust base numbering based on CIGAR string information.
-				// Take into account read orientation based on TLen field.
-				int NumAligned=0;
-				for(unsigned int i=0; i<Read.size();i++){
-					if(ExpandedCigar[i]!='I' && ExpandedCigar[i]!='S'){
-						int RefPos=StartPos + NumAligned;
-						// Tally only bases that exceed the quality threshold
-						// and that have not been trimmed.
-						if(((int) Quality[i])-33 > BASEQTHRESHOLD &&
-								i >= LeftClip + LEFTTRIM &&
-								i < Read.size() - RightClip - RIGHTTRIM){
-							BAMCoverage[Chr][RefPos]++;
-							BAMSummary[Chr][RefPos][Read[i]].Count++;
-							BAMSummary[Chr][RefPos][Read[i]].TotalQuality+=
-								((int) Quality[i])-33;
-							// Tally base position in read,
-							// accounting for read orientation.
-							if(TLen>=0){
-								BAMSummary[Chr][RefPos][Read[i]].TotalReadPosition+=i+1;
-							}
-							else{
-								BAMSummary[Chr][RefPos][Read[i]].TotalReadPosition+=
-										Read.size()-(i+1);
-							}
+			// Mark duplicate read pairs, and exclude them in mode 2.
+			if(DUPLICATEMODE!=0){
+				int Duplicate=MarkDuplicate(&Fields, ChrIndex, StartPos,
+						&Duplicates);
+				if(Duplicate==DUPLICATE_UNSORTED){
+					printf("Error: duplicate marking requires coordinate-sorted input.\n");
+					return 1;
+				}
+				if(Duplicate!=DUPLICATE_UNIQUE && DUPLICATEMODE==2){
+					if(OVERLAPMODE!=0){
+						ReleaseMate(&Fields, &MateBuffer, &ReadGroups);
+						if(KernelCheck){
+							ReleaseMate(&Fields, &CheckBuffer, &CheckGroups);
 						}
-						NumAligned++;
 					}
+					continue;
+				}
+			}
+			FilterCounts.Passed++;
+
+			// Without indels, the aligned bases form a single run
+			// between the soft clips, less any trimming.
+			// The run is added to the pileup of the read's group.
+			Tally.Chr=ChrIndex;
+			Tally.Reverse=(atoi(Fields.Start[1]) & 0x10)!=0;
+			if(READGROUPS){
+				Tally.Group=FindReadGroup(ReadGroupTag(&Fields), &RefSequences,
+						&ReadGroups);
+				if(KernelCheck){
+					FindReadGroup(ReadGroupTag(&Fields), &RefSequences,
+							&CheckGroups);
+				}
+			}
+			ReadGroups.NumReads[Tally.Group]++;
+			SetTallyRun(&Tally, StartPos, TLen, Read, Quality, ReadLength,
+					LeftClip, RightClip);
+
+			// Compute the quality mask, base codes, and read positions
+			// for the whole run, then add the run to the pileup.
+			// In mate overlap mode, the run may first be held
+			// until it can be compared with its mate.
+			RunTallyKernel(TallyKernel, &Tally);
+			if(OVERLAPMODE!=0){
+				AddMateTally(&Fields, &Tally, StartPos, &MateBuffer, &ReadGroups);
+			}
+			else{
+				AddReadTally(&Tally, &ReadGroups);
+			}
+			if(KernelCheck){
+				CheckTally=Tally;
+				RunTallyKernel(TallyKernelScalar, &CheckTally);
+				if(OVERLAPMODE!=0){
+					AddMateTally(&Fields, &CheckTally, StartPos, &CheckBuffer,
+							&CheckGroups);
+				}
+				else{
+					AddReadTally(&CheckTally, &CheckGroups);
 				}
 			}
 
 		}
+
+		// Tally any reads whose mates never arrived.
+		FlushPendingMates(&MateBuffer, -1, 0, &ReadGroups);
+		FlushPendingMates(&CheckBuffer, -1, 0, &CheckGroups);
+
+		// Save the final state, so that a restarted run
+		// goes straight to writing the output.
+		if(Checkpointing){
+			WriteCheckpoint(CHECKPOINT, InputOffset, NumLines, &FilterCounts,
+					&MateBuffer, &Downsampler, &Duplicates, &RefNames,
+					&ReadGroups);
+		}
 	}
 	else{
 		printf("Error: SAM file does not exist.\n");
@@ -242,93 +864,221 @@ int main(int argc, char *argv[]) {
 	// Close the file.
 	fin.close();
 
-	//==============================================================
-	// Output summary of base frequencies at each position.
-	//==============================================================
+	// In kernel check mode, stop if the pileups tallied with the selected
+	// kernel differ from those tallied with the scalar kernel.
+	if(KernelCheck){
+		long long NumMismatches=0;
+		for(unsigned int g=0; g<ReadGroups.Names.size(); g++){
+			NumMismatches+=ComparePileups(&ReadGroups.Pileups[g],
+					&CheckGroups.Pileups[g]);
+		}
+		if(NumMismatches>0){
+			printf("Error: %s and scalar tally kernel pileups differ at %lld positions.\n",
+					TALLYKERNELNAME.c_str(), NumMismatches);
+			return 1;
+		}
+		printf("The %s and scalar tally kernel pileups are identical.\n",
+				TALLYKERNELNAME.c_str());
+	}
 
-	printf("Writing base frequencies.\n");
-
-	ofstream fout(OUTFILE.c_str(), ios::out);
-	//fout << "Chr\tPos\tBase\tRefBase\tGenomePos\tCount\tAvgQ\tAvgReadPos" << endl;
-
-	// Iterate through the summary data structure
-	// and output the desired values using 1-indexed read positions.
-	long long GenomicPosition=0;
-	for(unsigned int i=0; i<RefSequences.size();i++){
-		for(unsigned int j=0; j<RefSequences[i].size();j++){
-			GenomicPosition++;
-			for(unsigned int k=0; k<sizeof(BASES)/sizeof(char);k++){
-				if(BAMSummary[RefNames[i]][j][BASES[k]].Count > 0){
-					fout << RefNames[i] << "\t" <<
-							j+1 << "\t" <<
-							BASES[k] << "\t" <<
-							RefSequences[i][j] << "\t" <<
-							GenomicPosition << "\t" <<
-							BAMSummary[RefNames[i]][j][BASES[k]].Count <<
-							"\t" <<
-							(float) BAMSummary[RefNames[i]][j][BASES[k]].TotalQuality/
-							BAMSummary[RefNames[i]][j][BASES[k]].Count <<
-							"\t" <<
-							(float) BAMSummary[RefNames[i]][j][BASES[k]].TotalReadPosition/
-							BAMSummary[RefNames[i]][j][BASES[k]].Count<<
-							"\t" << endl;
-				}
-				// For positions with 0 counts, replace the "nan" with 0.
-				else{
-					fout << RefNames[i] << "\t" <<
-						j+1 << "\t" <<
-						BASES[k] << "\t" <<
-						RefSequences[i][j] << "\t" <<
-						GenomicPosition << "\t" <<
-						BAMSummary[RefNames[i]][j][BASES[k]].Count <<
-						"\t" <<
-						"0" <<
-						"\t" <<
-						"0"<<
-						"\t" << endl;
+	// Write each output once for each read group, naming the files
+	// of a group by inserting the group name before the extension.
+	vector<long long> NumLowCoverageBins(ReadGroups.Names.size(), 0);
+	vector<long long> NumLowCoverageGenes(ReadGroups.Names.size(), 0);
+	for(unsigned int g=0; g<ReadGroups.Names.size(); g++){
+
+		string Group=ReadGroups.Names[g];
+		Pileup_t *BAMPileup=&ReadGroups.Pileups[g];
+		if(READGROUPS){
+			printf("Writing read group %s.\n", Group.c_str());
+		}
+
+		//==============================================================
+		// Output summary of base frequencies at each position.
+		//==============================================================
+
+		printf("Writing base frequencies.\n");
+
+		ofstream fout(GroupFileName(OUTFILE, Group).c_str(), ios::out);
+		//fout << "Chr\tPos\tBase\tRefBase\tGenomePos\tCount\tAvgQ\tAvgReadPos" << endl;
+
+		// In sparse format, write only the covered positions and the bases
+		// that pass the count and frequency floors.
+		if(OUTFORMAT=="sparse"){
+			WriteSparseSummary(&fout, &RefNames, &RefSequences, Group, BAMPileup);
+		}
+		else{
+			// Otherwise, iterate through the summary data structure
+			// and output the desired values using 1-indexed read positions.
+			long long GenomicPosition=0;
+			for(unsigned int i=0; i<RefSequences.size();i++){
+				for(unsigned int j=0; j<RefSequences[i].size();j++){
+					GenomicPosition++;
+					for(int k=0; k<NUMBASES;k++){
+						PositionBase_t *PositionBase=&(*BAMPileup).Summary[i][j*NUMBASES+k];
+						if(PositionBase->Count > 0){
+							fout << RefNames[i] << "\t" <<
+									j+1 << "\t" <<
+									BASES[k] << "\t" <<
+									RefSequences[i][j] << "\t" <<
+									GenomicPosition << "\t" <<
+									PositionBase->Count <<
+									"\t" <<
+									(float) PositionBase->TotalQuality/
+									PositionBase->Count <<
+									"\t" <<
+									(float) PositionBase->TotalReadPosition/
+									PositionBase->Count<<
+									"\t" << endl;
+						}
+						// For positions with 0 counts, replace the "nan" with 0.
+						else{
+							fout << RefNames[i] << "\t" <<
+								j+1 << "\t" <<
+								BASES[k] << "\t" <<
+								RefSequences[i][j] << "\t" <<
+								GenomicPosition << "\t" <<
+								PositionBase->Count <<
+								"\t" <<
+								"0" <<
+								"\t" <<
+								"0"<<
+								"\t" << endl;
+						}
+					}
 				}
 			}
 		}
-	}
 
-	fout.close();
+		fout.close();
 
-	//==============================================================
-	// Output consensus FASTA file for the alignment.
-	//==============================================================
+		//==============================================================
+		// Output consensus FASTA file for the alignment.
+		//==============================================================
 
-	// Iterate through the summary data structure
-	// and determine the consensus base at each position.
+		// Iterate through the summary data structure
+		// and determine the consensus base at each position.
 
-	if(OUTFASTA != ""){
+		if(OUTFASTA != ""){
 
-		printf("Writing consensus reference.\n");
+			printf("Writing consensus reference.\n");
 
-		ofstream foutf(OUTFASTA.c_str(), ios::out);
+			ofstream foutf(GroupFileName(OUTFASTA, Group).c_str(), ios::out);
 
-		for(unsigned int i=0; i<RefSequences.size();i++){
-			foutf << ">" << RefNames[i] << endl;
-			for(unsigned int j=0; j<RefSequences[i].size();j++){
-				char maxbase='N';
-				for(unsigned int k=0; k<sizeof(BASES)/sizeof(char);k++){
-					if(BAMSummary[RefNames[i]][j][BASES[k]].Count >
-						BAMSummary[RefNames[i]][j][maxbase].Count){
-						maxbase=BASES[k];
+			for(unsigned int i=0; i<RefSequences.size();i++){
+				foutf << ">" << RefNames[i] << endl;
+				for(unsigned int j=0; j<RefSequences[i].size();j++){
+					char maxbase='N';
+					long long maxcount=0;
+					for(int k=0; k<NUMBASES;k++){
+						if((*BAMPileup).Summary[i][j*NUMBASES+k].Count > maxcount){
+							maxbase=BASES[k];
+							maxcount=(*BAMPileup).Summary[i][j*NUMBASES+k].Count;
+						}
+					}
+					foutf << maxbase;
+					// Insert a line break in the sequence every 70 bases.
+					if((j+1)%70 == 0){
+						foutf << endl;
 					}
 				}
-				foutf << maxbase;
-				// Insert a line break in the sequence every 70 bases.
-				if((j+1)%70 == 0){
-					foutf << endl;
-				}
+				foutf << endl;
 			}
-			foutf << endl;
+
+			foutf.close();
+		}
+
+		//==============================================================
+		// Output the pileup in binary form.
+		//==============================================================
+
+		if(OUTPILEUP != ""){
+
+			printf("Writing binary pileup.\n");
+
+			ofstream foutp(GroupFileName(OUTPILEUP, Group).c_str(),
+					ios::out | ios::binary);
+			WritePileup(&foutp, &RefNames, BAMPileup);
+			foutp.close();
+		}
+
+		//==============================================================
+		// Output strand, quality, and read position histograms.
+		//==============================================================
+
+		if(OUTHISTOGRAMS != ""){
+
+			printf("Writing histograms.\n");
+
+			ofstream fouth(GroupFileName(OUTHISTOGRAMS, Group).c_str(),
+					ios::out);
+			WriteHistograms(&fouth, &RefNames, &RefSequences, BAMPileup);
+			fouth.close();
+		}
+
+		//==============================================================
+		// Output mean coverage in bins along the genome and for each gene.
+		//==============================================================
+
+		if(OUTCOVERAGE != ""){
+
+			printf("Writing binned coverage.\n");
+
+			ofstream foutc(GroupFileName(OUTCOVERAGE, Group).c_str(), ios::out);
+			NumLowCoverageBins[g]=WriteCoverageBins(&foutc, &RefNames,
+					BAMPileup);
+			foutc.close();
 		}
+		if(OUTGENECOVERAGE != ""){
 
-		foutf.close();
+			printf("Writing gene coverage.\n");
+
+			ofstream foutg(GroupFileName(OUTGENECOVERAGE, Group).c_str(),
+					ios::out);
+			NumLowCoverageGenes[g]=WriteGeneCoverage(&foutg, &Annotations,
+					&RefIndex, BAMPileup);
+			foutg.close();
+		}
 	}
 
-	printf("Number of reads containing indels: %d\n", NumIndels);
+	if(!MERGE && Downsampler.Mode!=DOWNSAMPLE_NONE){
+		printf("Number of reads removed by downsampling: %lld of %lld\n",
+				Downsampler.NumRemoved, Downsampler.NumLines);
+	}
+	if(!MERGE){
+		PrintFilterCounts(&FilterCounts);
+	}
+	if(!MERGE && DUPLICATEMODE!=0){
+		printf("Number of duplicate reads: %lld of %lld\n",
+				Duplicates.NumDuplicates, Duplicates.NumReads);
+		printf("Number of optical duplicate reads: %lld\n",
+				Duplicates.NumOptical);
+		printf("Duplicate rate: %.4f\n", (Duplicates.NumReads>0) ?
+				(double) Duplicates.NumDuplicates/Duplicates.NumReads : 0.0);
+	}
+	for(unsigned int g=0; g<ReadGroups.Names.size(); g++){
+		string group=READGROUPS ? " in read group "+ReadGroups.Names[g] : "";
+		if(READGROUPS && !MERGE){
+			printf("Number of reads tallied%s: %lld\n", group.c_str(),
+					ReadGroups.NumReads[g]);
+		}
+		if(OUTCOVERAGE != ""){
+			printf("Number of coverage bins below %lldx%s: %lld\n",
+					MINCOVERAGE, group.c_str(), NumLowCoverageBins[g]);
+		}
+		if(OUTGENECOVERAGE != ""){
+			printf("Number of genes with mean coverage below %lldx%s: %lld\n",
+					MINCOVERAGE, group.c_str(), NumLowCoverageGenes[g]);
+		}
+	}
+	if(OVERLAPMODE!=0){
+		printf("Number of read pairs compared for overlap: %lld\n",
+				MateBuffer.NumPairsMerged);
+		printf("Number of overlapping bases counted once: %lld\n",
+				MateBuffer.NumOverlapBases);
+		printf("Number of discordant overlapping bases: %lld\n",
+				MateBuffer.NumDiscordantBases);
+	}
 	cout << "!!!Hello World!!!" << endl; // prints !!!Hello World!!!
 	return 0;
 }
@@ -345,6 +1095,11 @@ int ArgsParse(int argc, char *argv[]){
 		return 0;
 	}
 
+	// If the first argument is merge, parse the arguments for merge mode.
+	if(argc>=2 && strcmp(argv[1],"merge")==0){
+		return MergeArgsParse(argc, argv);
+	}
+
 	// Ensure that there are an even number of arguments,
 	// leaving aside the program name.
 	// The only exception is if the only argument is debug,
@@ -388,6 +1143,14 @@ int ArgsParse(int argc, char *argv[]){
 		case 's':
 			OUTFASTA = arg;
 			break;
+		// -b binary pileup output file
+		case 'b':
+			OUTPILEUP = arg;
+			break;
+		// -H histogram output file
+		case 'H':
+			OUTHISTOGRAMS = arg;
+			break;
 		// -Q base quality threshold
 		case 'Q':
 			BASEQTHRESHOLD = atoi(arg.c_str());
@@ -408,6 +1171,136 @@ int ArgsParse(int argc, char *argv[]){
 		case 'r':
 			RIGHTTRIM = atoi(arg.c_str());
 			break;
+		// -R FLAG bits that must all be set
+		case 'R':
+			REQUIREFLAGS = strtol(arg.c_str(), NULL, 0);
+			break;
+		// -F FLAG bits that must all be unset
+		case 'F':
+			EXCLUDEFLAGS = strtol(arg.c_str(), NULL, 0);
+			break;
+		// -c chromosome
+		case 'c':
+			CHR = arg;
+			break;
+		// -m mate overlap mode
+		case 'm':
+			OVERLAPMODE = atoi(arg.c_str());
+			if(OVERLAPMODE < 0 || OVERLAPMODE > 2){
+				printf("Invalid -m mate overlap mode.\n");
+				return 1;
+			}
+			break;
+		// -p maximum number of reads waiting for their mates
+		case 'p':
+			MAXPENDINGMATES = atoi(arg.c_str());
+			break;
+		// -k checkpoint file
+		case 'k':
+			CHECKPOINT = arg;
+			break;
+		// -K number of input lines between checkpoints
+		case 'K':
+			CHECKPOINTINTERVAL = atoll(arg.c_str());
+			if(CHECKPOINTINTERVAL <= 0){
+				printf("Invalid -K checkpoint interval.\n");
+				return 1;
+			}
+			break;
+		// -d binned coverage output file
+		case 'd':
+			OUTCOVERAGE = arg;
+			break;
+		// -w coverage bin width
+		case 'w':
+			BINWIDTH = atoi(arg.c_str());
+			if(BINWIDTH <= 0){
+				printf("Invalid -w coverage bin width.\n");
+				return 1;
+			}
+			break;
+		// -g reference BED file for gene coverage
+		case 'g':
+			REFBED = arg;
+			break;
+		// -e gene coverage output file
+		case 'e':
+			OUTGENECOVERAGE = arg;
+			break;
+		// -x minimum coverage
+		case 'x':
+			MINCOVERAGE = atoll(arg.c_str());
+			break;
+		// -t summary format
+		case 't':
+			OUTFORMAT = arg;
+			break;
+		// -n minimum base count for a sparse base row
+		case 'n':
+			MINBASECOUNT = atoll(arg.c_str());
+			break;
+		// -u minimum base frequency for a sparse base row
+		case 'u':
+			MINBASEFREQ = atof(arg.c_str());
+			break;
+		// -a sample metadata for the sparse header
+		case 'a':
+			SAMPLEFIELDS.push_back(arg);
+			break;
+		// -D downsampling mode
+		case 'D':
+			DOWNSAMPLEMODE = arg;
+			break;
+		// -N fraction, coverage, or pairs per window for downsampling
+		case 'N':
+			DOWNSAMPLEVALUE = atof(arg.c_str());
+			break;
+		// -W downsampling window
+		case 'W':
+			DOWNSAMPLEWINDOW = atoi(arg.c_str());
+			break;
+		// -S downsampling seed
+		case 'S':
+			DOWNSAMPLESEED = atoll(arg.c_str());
+			break;
+		// -M duplicate marking mode
+		case 'M':
+			DUPLICATEMODE = atoi(arg.c_str());
+			if(DUPLICATEMODE < 0 || DUPLICATEMODE > 2){
+				printf("Invalid -M duplicate marking mode.\n");
+				return 1;
+			}
+			break;
+		// -L duplicate marking window
+		case 'L':
+			DUPLICATEWINDOW = atoi(arg.c_str());
+			if(DUPLICATEWINDOW <= 0){
+				printf("Invalid -L duplicate marking window.\n");
+				return 1;
+			}
+			break;
+		// -G separate pileups for each read group
+		case 'G':
+			READGROUPS = (atoi(arg.c_str()) != 0);
+			break;
+		// -O optical duplicate distance
+		case 'O':
+			OPTICALDISTANCE = atoi(arg.c_str());
+			if(OPTICALDISTANCE < 0){
+				printf("Invalid -O optical duplicate distance.\n");
+				return 1;
+			}
+			break;
+		// -T tally kernel
+		case 'T':
+			TALLYKERNEL = arg;
+			if(TALLYKERNEL!="auto" && TALLYKERNEL!="scalar" &&
+					TALLYKERNEL!="sse4.2" && TALLYKERNEL!="avx2" &&
+					TALLYKERNEL!="check"){
+				printf("Invalid -T tally kernel.\n");
+				return 1;
+			}
+			break;
 		}
 	}
 
@@ -424,65 +1317,379 @@ int ArgsParse(int argc, char *argv[]){
 		printf("Invalid arguments. Specify output file.\n");
 		return 1;
 	}
-	return 0;
-}
-
-// PrintParameters
-// When called, prints the parameters for the run.
-void PrintParameters(){
-	cout << "RUN PARAMETERS" << endl;
-	cout << "input file: " << SAM << endl;
-	cout << "reference: " << REFFASTA << endl;
-	cout << "output file: " << OUTFILE << endl;
-	if(OUTFASTA != ""){
-		cout << "output FASTA: " << OUTFASTA << endl;
+	if((REFBED=="") != (OUTGENECOVERAGE=="")){
+		printf("Invalid arguments. Specify both -g and -e for gene coverage.\n");
+		return 1;
 	}
-	cout << "base quality threshold: " << BASEQTHRESHOLD << endl;
-	cout << "mapping quality threshold: " << MAPQTHRESHOLD << endl;
-	cout << "left read trimming: " << LEFTTRIM << endl;
-	cout << "right read trimming: " << RIGHTTRIM << endl;
-	cout << endl;
+	if(TALLYKERNEL=="check" && CHECKPOINT!=""){
+		printf("Invalid arguments. -T check cannot be combined with -k.\n");
+		return 1;
+	}
+	if(CheckDownsampleParameters()!=0){
+		return 1;
+	}
+	return CheckSummaryFormat();
 }
 
-// PrintUsage
-// When called, prints the usage statement for this program.
-void PrintUsage(){
-	printf("\n\n");
-	printf("Usage: SummarizeBAM -i input.sam -f ref.fasta -o out.summary\n");
-	printf("\n");
-	printf("Input options (defaults in parentheses):\n");
-	printf("  -s FILE\twrite consensus sequence to FILE\n");
-	printf("  -Q INT\tminimum base quality for a base to be tallied [20]\n");
-	printf("  -q INT\tminimum mapping quality for a read to be tallied [20]\n");
-	printf("  -l INT\tnum bases to trim from 5' (left) end of each read, after soft clipping [0]\n");
-	printf("  -r INT\tnum bases to trim from 3' (right) end of each read, after soft clipping [0]\n");
-	printf("\n\n");
-}
+// MergeArgsParse
+// Parses command-line arguments for merge mode,
+// in which every argument that does not follow a flag is an input file.
+// Returns 1 if any argument conditions are violated.
+int MergeArgsParse(int argc, char *argv[]){
 
-// SetDebug
-// Sets all parameters to their debug state.
-void SetDebug(){
-	SAM="sam.test";
-	REFFASTA="ref.test";
-	OUTFILE="out.test";
-	OUTFASTA="seq.test";
-}
+	MERGE=true;
 
-// ReadMultiFasta
-// Given a file name for a FASTA file containing multiple sequences,
-// as well as a location to store multiple sequences,
-// reads in the sequences as multiple strings to the given location
-// and returns the FASTA header names as a vector of strings.
-// Returns 1 if the file does not exist.
-int ReadMultiFasta(string filename,
-		vector<string> *sequencenames,
-		vector<string> *sequences){
+	for(int i=2; i<argc; i++){
 
-	// Open the file.
-	ifstream f_in(filename.c_str(), ios::in);
+		// Store arguments that are not flags as input files.
+		if(argv[i][0] != '-'){
+			MERGEINPUTS.push_back(argv[i]);
+			continue;
+		}
 
-	string line;
-	string header;
+		// Verify that each flag is followed by a value.
+		if(strlen(argv[i])!=2 || i+1>=argc){
+			printf("Invalid use of argument flags.\n");
+			return 1;
+		}
+		string arg=argv[i+1];
+		i++;
+
+		// Parse the flag string.
+		switch(argv[i-1][1]){
+		// -f reference FASTA
+		case 'f':
+			REFFASTA = arg;
+			break;
+		// -o output summary file
+		case 'o':
+			OUTFILE = arg;
+			break;
+		// -s FASTA file summary of consensus
+		case 's':
+			OUTFASTA = arg;
+			break;
+		// -b binary pileup output file
+		case 'b':
+			OUTPILEUP = arg;
+			break;
+		// -H histogram output file
+		case 'H':
+			OUTHISTOGRAMS = arg;
+			break;
+		// -d binned coverage output file
+		case 'd':
+			OUTCOVERAGE = arg;
+			break;
+		// -w coverage bin width
+		case 'w':
+			BINWIDTH = atoi(arg.c_str());
+			if(BINWIDTH <= 0){
+				printf("Invalid -w coverage bin width.\n");
+				return 1;
+			}
+			break;
+		// -g reference BED file for gene coverage
+		case 'g':
+			REFBED = arg;
+			break;
+		// -e gene coverage output file
+		case 'e':
+			OUTGENECOVERAGE = arg;
+			break;
+		// -x minimum coverage
+		case 'x':
+			MINCOVERAGE = atoll(arg.c_str());
+			break;
+		// -t summary format
+		case 't':
+			OUTFORMAT = arg;
+			break;
+		// -n minimum base count for a sparse base row
+		case 'n':
+			MINBASECOUNT = atoll(arg.c_str());
+			break;
+		// -u minimum base frequency for a sparse base row
+		case 'u':
+			MINBASEFREQ = atof(arg.c_str());
+			break;
+		// -a sample metadata for the sparse header
+		case 'a':
+			SAMPLEFIELDS.push_back(arg);
+			break;
+		default:
+			printf("Invalid flag for merge mode.\n");
+			return 1;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(MERGEINPUTS.size()==0){
+		printf("Invalid arguments. Specify files to merge.\n");
+		return 1;
+	}
+	if(REFFASTA==""){
+		printf("Invalid arguments. Specify reference sequence.\n");
+		return 1;
+	}
+	if(OUTFILE==""){
+		printf("Invalid arguments. Specify output file.\n");
+		return 1;
+	}
+	if((REFBED=="") != (OUTGENECOVERAGE=="")){
+		printf("Invalid arguments. Specify both -g and -e for gene coverage.\n");
+		return 1;
+	}
+	return CheckSummaryFormat();
+}
+
+// PrintParameters
+// When called, prints the parameters for the run.
+void PrintParameters(){
+	cout << "SummarizeBAM version " << VERSION << endl;
+	cout << "RUN PARAMETERS" << endl;
+	if(MERGE){
+		cout << "merging files:";
+		for(unsigned int i=0; i<MERGEINPUTS.size(); i++){
+			cout << " " << MERGEINPUTS[i];
+		}
+		cout << endl;
+		cout << "reference: " << REFFASTA << endl;
+		cout << "output file: " << OUTFILE << endl;
+		PrintFormatParameters();
+		if(OUTFASTA != ""){
+			cout << "output FASTA: " << OUTFASTA << endl;
+		}
+		if(OUTPILEUP != ""){
+			cout << "output binary pileup: " << OUTPILEUP << endl;
+		}
+		if(OUTHISTOGRAMS != ""){
+			cout << "output histograms: " << OUTHISTOGRAMS << endl;
+		}
+		PrintCoverageParameters();
+		cout << endl;
+		return;
+	}
+	cout << "input file: " << SAM << endl;
+	cout << "reference: " << REFFASTA << endl;
+	cout << "output file: " << OUTFILE << endl;
+	PrintFormatParameters();
+	if(OUTFASTA != ""){
+		cout << "output FASTA: " << OUTFASTA << endl;
+	}
+	if(OUTPILEUP != ""){
+		cout << "output binary pileup: " << OUTPILEUP << endl;
+	}
+	if(OUTHISTOGRAMS != ""){
+		cout << "output histograms: " << OUTHISTOGRAMS << endl;
+	}
+	cout << "base quality threshold: " << BASEQTHRESHOLD << endl;
+	cout << "mapping quality threshold: " << MAPQTHRESHOLD << endl;
+	cout << "left read trimming: " << LEFTTRIM << endl;
+	cout << "right read trimming: " << RIGHTTRIM << endl;
+	cout << "required FLAG bits: 0x" << hex << REQUIREFLAGS << dec << endl;
+	cout << "excluded FLAG bits: 0x" << hex << EXCLUDEFLAGS << dec << endl;
+	if(CHR != ""){
+		cout << "chromosome: " << CHR << endl;
+	}
+	cout << "mate overlap mode: " << OVERLAPMODE << endl;
+	if(OVERLAPMODE != 0){
+		cout << "maximum reads waiting for mates: " << MAXPENDINGMATES << endl;
+	}
+	PrintDownsampleParameters();
+	cout << "read groups: " << (READGROUPS ? 1 : 0) << endl;
+	cout << "duplicate marking mode: " << DUPLICATEMODE << endl;
+	if(DUPLICATEMODE != 0){
+		cout << "duplicate marking window: " << DUPLICATEWINDOW << endl;
+		cout << "optical duplicate distance: " << OPTICALDISTANCE << endl;
+	}
+	if(CHECKPOINT != ""){
+		cout << "checkpoint file: " << CHECKPOINT << endl;
+		cout << "lines between checkpoints: " << CHECKPOINTINTERVAL << endl;
+	}
+	PrintCoverageParameters();
+	cout << "tally kernel: " << TALLYKERNELNAME << endl;
+	if(TALLYKERNEL=="check"){
+		cout << "check tally kernel against: scalar" << endl;
+	}
+	cout << endl;
+}
+
+// PrintCoverageParameters
+// Prints the parameters for the coverage outputs, if any are written.
+void PrintCoverageParameters(){
+	if(OUTCOVERAGE != ""){
+		cout << "output binned coverage: " << OUTCOVERAGE << endl;
+		cout << "coverage bin width: " << BINWIDTH << endl;
+	}
+	if(OUTGENECOVERAGE != ""){
+		cout << "gene annotation: " << REFBED << endl;
+		cout << "output gene coverage: " << OUTGENECOVERAGE << endl;
+	}
+	if(OUTCOVERAGE != "" || OUTGENECOVERAGE != ""){
+		cout << "minimum coverage: " << MINCOVERAGE << endl;
+	}
+}
+
+// PrintFormatParameters
+// Prints the format of the summary, and for sparse summaries,
+// the base row floors and the sample metadata.
+void PrintFormatParameters(){
+	cout << "summary format: " << OUTFORMAT << endl;
+	if(OUTFORMAT == "sparse"){
+		cout << "minimum base count: " << MINBASECOUNT << endl;
+		cout << "minimum base frequency: " << MINBASEFREQ << endl;
+		for(unsigned int i=0; i<SAMPLEFIELDS.size(); i++){
+			cout << "sample metadata: " << SAMPLEFIELDS[i] << endl;
+		}
+	}
+}
+
+// CheckSummaryFormat
+// Checks the summary format and the options of sparse summaries.
+// Returns 1 if any argument conditions are violated.
+int CheckSummaryFormat(){
+	if(OUTFORMAT!="dense" && OUTFORMAT!="sparse"){
+		printf("Invalid -t summary format.\n");
+		return 1;
+	}
+	if(MINBASECOUNT < 1){
+		printf("Invalid -n minimum base count.\n");
+		return 1;
+	}
+	if(MINBASEFREQ < 0 || MINBASEFREQ > 1){
+		printf("Invalid -u minimum base frequency.\n");
+		return 1;
+	}
+	for(unsigned int i=0; i<SAMPLEFIELDS.size(); i++){
+		size_t equals=SAMPLEFIELDS[i].find('=');
+		if(equals==string::npos || equals==0 ||
+				SAMPLEFIELDS[i].find_first_of("\t\n")!=string::npos){
+			printf("Invalid -a sample metadata %s; use NAME=VALUE.\n",
+					SAMPLEFIELDS[i].c_str());
+			return 1;
+		}
+	}
+	if(OUTFORMAT=="dense" && SAMPLEFIELDS.size()>0){
+		printf("Invalid arguments. Sample metadata requires -t sparse.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: SummarizeBAM -i input.sam -f ref.fasta -o out.summary\n");
+	printf("\n");
+	printf("Input options (defaults in parentheses):\n");
+	printf("  -s FILE\twrite consensus sequence to FILE\n");
+	printf("  -b FILE\twrite pileup in binary form to FILE, for merging\n");
+	printf("  -H FILE\twrite strand, base quality, and read position histograms\n"
+			"\t\tof each position and base to FILE; the histograms are\n"
+			"\t\talso kept in the -b binary pileup\n");
+	printf("  -Q INT\tminimum base quality for a base to be tallied [20]\n");
+	printf("  -q INT\tminimum mapping quality for a read to be tallied [20]\n");
+	printf("  -l INT\tnum bases to trim from 5' (left) end of each read, after soft clipping [0]\n");
+	printf("  -r INT\tnum bases to trim from 3' (right) end of each read, after soft clipping [0]\n");
+	printf("  -R INT\tonly tally reads with all of these FLAG bits set [0]\n");
+	printf("  -F INT\tonly tally reads with none of these FLAG bits set\n"
+			"\t\t(unmapped, secondary, QC fail, duplicate,\n"
+			"\t\tsupplementary) [0xF04]\n");
+	printf("  -c STRING\tonly tally reads that map to this chromosome [all]\n");
+	printf("  -m INT\tcount bases where the mates of a pair overlap only once [0]\n");
+	printf("\t\t0: count both mates\n");
+	printf("\t\t1: keep the higher-quality call; N if the mates disagree\n");
+	printf("\t\t2: keep the higher-quality call; N if the mates disagree\n"
+			"\t\t   with equal quality\n");
+	printf("  -p INT\tmaximum number of reads held while waiting for mates [100000]\n");
+	printf("  -D STRING\tdownsample read pairs, deciding by a hash of the read name\n"
+			"\t\tso that mates stay together [none]\n");
+	printf("\t\tfraction: keep a fraction -N of read pairs\n");
+	printf("\t\tcap: keep pairs until the read coverage reaches -N\n"
+			"\t\t   at every position of their fragment\n");
+	printf("\t\twindow: keep the -N pairs with the lowest hashes among those\n"
+			"\t\t   starting in each -W window; the input must be a file\n");
+	printf("  -N FLOAT\tfraction, coverage, or pairs per window for -D\n");
+	printf("  -W INT\twidth of windows for -D window [200]\n");
+	printf("  -S INT\tseed for the read name hash [0]\n");
+	printf("  -G INT\tif 1, tally each read group (RG tag) separately and write\n"
+			"\t\teach output once per group, with the group name inserted\n"
+			"\t\tbefore the file extension; reads without an RG tag are\n"
+			"\t\tin group %s [0]\n", NOREADGROUP.c_str());
+	printf("  -M INT\tmark duplicate read pairs; the input must be sorted\n"
+			"\t\tby coordinate [0]\n");
+	printf("\t\t0: do not mark duplicates\n");
+	printf("\t\t1: count duplicates but tally them\n");
+	printf("\t\t2: exclude duplicates from the tally\n");
+	printf("  -L INT\tnum positions over which duplicates are tracked; must\n"
+			"\t\texceed the longest clip at the start of a read [500]\n");
+	printf("  -O INT\tmaximum flow cell distance between optical duplicates [100]\n");
+	printf("  -k FILE\tperiodically save the run to FILE, and resume from FILE\n"
+			"\t\tif it exists; the input must be a file rather than a pipe\n");
+	printf("  -K INT\tnum input lines between checkpoints [1000000]\n");
+	printf("  -d FILE\twrite mean coverage in bins along the genome to FILE\n");
+	printf("  -w INT\twidth of coverage bins, in genome positions [50]\n");
+	printf("  -g FILE\tBED format annotation for gene coverage\n");
+	printf("  -e FILE\twrite mean coverage of each gene in the -g annotation to FILE\n");
+	printf("  -x INT\tflag bins and genes with mean coverage below INT [200]\n");
+	printf("  -t STRING\tsummary format [dense]\n");
+	printf("\t\tdense: one row for every base at every position\n");
+	printf("\t\tsparse: a header of sample metadata, then for each covered\n"
+			"\t\t   position a depth row (Base *, Count the coverage)\n"
+			"\t\t   followed by rows for the bases that pass -n and -u\n");
+	printf("  -n INT\tminimum count of a base row in a sparse summary [1]\n");
+	printf("  -u FLOAT\tminimum frequency of a base row in a sparse summary [0]\n");
+	printf("  -a NAME=VALUE\tsample metadata for the sparse summary header;\n"
+			"\t\tmay be given more than once\n");
+	printf("  -T STRING\ttally kernel [auto]\n");
+	printf("\t\tauto: the fastest kernel the CPU supports\n");
+	printf("\t\tscalar, sse4.2, avx2: the given kernel\n");
+	printf("\t\tcheck: the fastest kernel, but also tally every read with\n"
+			"\t\t   the scalar kernel and stop with an error if the two\n"
+			"\t\t   pileups differ\n");
+	printf("\n");
+	printf("Usage: SummarizeBAM merge -f ref.fasta -o out.summary in1 in2 ...\n");
+	printf("Adds together pileups summarized from separate reads.\n");
+	printf("Inputs may be binary pileups (-b), finished checkpoints (-k),\n"
+			"or text summaries; text summaries store rounded averages,\n"
+			"so only binary inputs give exactly the counts of a single run.\n");
+	printf("  -s FILE\twrite consensus sequence to FILE\n");
+	printf("  -b FILE\twrite merged pileup in binary form to FILE\n");
+	printf("  -H FILE\twrite merged histograms to FILE; every input must be\n"
+			"\t\ta binary pileup or checkpoint with histograms\n");
+	printf("  -d, -w, -g, -e, -x, -t, -n, -u, -a\tas above\n");
+	printf("Merging a single sparse summary writes it as a dense summary,\n"
+			"with 0 counts for bases that were below its -n and -u floors.\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	SAM="sam.test";
+	REFFASTA="ref.test";
+	OUTFILE="out.test";
+	OUTFASTA="seq.test";
+	DEBUG=true;
+}
+
+// ReadMultiFasta
+// Given a file name for a FASTA file containing multiple sequences,
+// as well as a location to store multiple sequences,
+// reads in the sequences as multiple strings to the given location
+// and returns the FASTA header names as a vector of strings.
+// Returns 1 if the file does not exist.
+int ReadMultiFasta(string filename,
+		vector<string> *sequencenames,
+		vector<string> *sequences){
+
+	// Open the file.
+	ifstream f_in(filename.c_str(), ios::in);
+
+	string line;
+	string header;
 	string sequence;
 	int numsequences=0;
 
@@ -549,38 +1756,2238 @@ vector<string> StringSplit(string s, char c){
 }
 
 //
-// ExpandCIGAR
+// ReadBED
+// Given a file name for a BED format file containing sequence annotations,
+// as well as a location to store the annotations,
+// reads in the annotations and stores the information in appropriate form.
+// Returns 1 if the file does not exist.
+int ReadBED(string filename, vector<Annotation_t> *annotations){
+	// Open the file.
+	ifstream f_in(filename.c_str(), ios::in);
+
+	string line;
+	string header;
+	string sequence;
+
+	if(f_in){
+		// Read in the file line by line,
+		// storing lines that begin with '>' as the sequence name
+		while(getline(f_in, line)){
+
+			vector<string> fields=StringSplit(line,'\t');
+
+			// Check that annotation contains the necessary fields.
+			if(fields.size()>=12){
+
+				// Verify that genes are on the positive strand of the vRNA.
+				if(fields[5]!="+"){
+					printf("This script does not accept negative-sense genes.\n");
+					return 1;
+				}
+
+				// Store relevant information in Annotation_t format.
+				Annotation_t annotation;
+
+				annotation.Chr=fields[0];
+				annotation.ChrStart=atoi(fields[1].c_str());
+				annotation.ChrEnd=atoi(fields[2].c_str());
+				annotation.Name=fields[3];
+				annotation.NumExons=atoi(fields[9].c_str());
+
+				vector<string> exonsizes=StringSplit(fields[10],',');
+				vector<string> exonstarts=StringSplit(fields[11],',');
+				for(int i=0; i<annotation.NumExons; i++){
+					annotation.ExonSizes.push_back(atoi(exonsizes[i].c_str()));
+					annotation.ExonStarts.push_back(atoi(exonstarts[i].c_str()));
+				}
+
+				(*annotations).push_back(annotation);
+			}
+			else{
+				printf("BED file is not in accepted format.\n");
+				return 1;
+			}
+		}
+	}
+	else{
+		return 1;
+	}
+
+	// Close the file.
+	f_in.close();
+
+	return 0;
+}
+
+// SplitSAMLine
+// Given a line of a SAM-format file, records where each of the
+// mandatory tab-delimited fields starts and how long it is.
+// Any optional fields are kept together as one extra field.
+// Returns the number of mandatory fields found.
+int SplitSAMLine(const string &line, SAMFields_t *fields){
+	const char *start=line.c_str();
+	const char *end=start+line.size();
+	int numfields=0;
+	while(numfields<NUMSAMFIELDS){
+		const char *tab=(const char *) memchr(start, '\t', end-start);
+		const char *fieldend=(tab==NULL) ? end : tab;
+		(*fields).Start[numfields]=start;
+		(*fields).Length[numfields]=fieldend-start;
+		numfields++;
+		if(tab==NULL){
+			break;
+		}
+		start=tab+1;
+	}
+	// Store the optional fields, which are empty if absent.
+	if(numfields==NUMSAMFIELDS && (*fields).Start[NUMSAMFIELDS-1]+
+			(*fields).Length[NUMSAMFIELDS-1] < end){
+		(*fields).Start[NUMSAMFIELDS]=start;
+		(*fields).Length[NUMSAMFIELDS]=end-start;
+	}
+	else{
+		(*fields).Start[NUMSAMFIELDS]=end;
+		(*fields).Length[NUMSAMFIELDS]=0;
+	}
+	return numfields;
+}
+
+//
+// FilterRead
+// Given the fields of a SAM-format line and a read filter,
+// decides whether the read should be tallied, using only the
+// FLAG, RNAME, MAPQ, and CIGAR fields.
+// If a map of reference names is given, reads must map to one of them,
+// and the index of the read's reference sequence is stored in chrindex.
+// Counts the filter that rejected the read, if any, and returns it.
+int FilterRead(SAMFields_t *fields, ReadFilter_t *filter,
+		map<string, int> *refindex, int *chrindex, FilterCounts_t *counts){
+
+	(*counts).Total++;
+
+	// Check the FLAG bitmasks.
+	int flag=atoi((*fields).Start[1]);
+	if((flag & (*filter).RequireFlags) != (*filter).RequireFlags){
+		(*counts).FailRequireFlags++;
+		return FILTER_FLAGS;
+	}
+	if((flag & (*filter).ExcludeFlags) != 0){
+		(*counts).FailExcludeFlags++;
+		return FILTER_FLAGS;
+	}
+
+	// Exclude reads that did not map based on the CIGAR string.
+	if((*fields).Start[5][0]=='*'){
+		(*counts).Unmapped++;
+		return FILTER_UNMAPPED;
+	}
+
+	// Check the mapping quality.
+	if(atoi((*fields).Start[4]) < (*filter).MinMapQ){
+		(*counts).FailMapQ++;
+		return FILTER_MAPQ;
+	}
+
+	// Check that the read maps to the chromosome of interest,
+	// if one is given, and to a reference sequence.
+	string chr((*fields).Start[2], (*fields).Length[2]);
+	if((*filter).Chr != "" && chr != (*filter).Chr){
+		(*counts).FailReference++;
+		return FILTER_REFERENCE;
+	}
+	if(refindex != NULL){
+		map<string, int>::iterator it=(*refindex).find(chr);
+		if(it==(*refindex).end()){
+			(*counts).FailReference++;
+			return FILTER_REFERENCE;
+		}
+		*chrindex=it->second;
+	}
+
+	return FILTER_PASS;
+}
+
+//
+// PrintFilterCounts
+// Prints the number of reads removed by each filter.
+void PrintFilterCounts(FilterCounts_t *counts){
+	printf("Number of reads: %lld\n", (*counts).Total);
+	printf("Number of reads missing required FLAG bits: %lld\n",
+			(*counts).FailRequireFlags);
+	printf("Number of reads with excluded FLAG bits: %lld\n",
+			(*counts).FailExcludeFlags);
+	printf("Number of unmapped reads: %lld\n", (*counts).Unmapped);
+	printf("Number of reads below mapping quality threshold: %lld\n",
+			(*counts).FailMapQ);
+	printf("Number of reads not mapping to the reference: %lld\n",
+			(*counts).FailReference);
+	printf("Number of reads containing indels: %lld\n", (*counts).Indel);
+	printf("Number of reads tallied: %lld\n", (*counts).Passed);
+}
+
+//
+// SummarizeCIGAR
 // Takes in a CIGAR string as specified by the SAM/BAM file standard
-// and expands it into a string the length of the read describing its features.
-// For instance, 1S5M4S becomes SMMMMMSSSS
-string ExpandCIGAR(string cigar){
-	string expanded="";
-	string NumBases="";
-	// All allowed operations characters.
-	string CigarOperations="MIDNSHP=X";
-	// Operations characters that sum to the length of the sequence.
-	string CigarOperationsSubset="MIS=X";
-
-	// Iterate through the CIGAR string and check for operation characters.
-	for(unsigned int i=0; i<cigar.length(); i++){
-		// Store non-operation characters that indicate the number of bases.
-		if(strchr(CigarOperations.c_str(), cigar[i])==NULL){
-			NumBases+=cigar[i];
-		}
-		// After reaching one of the useful operation characters,
-		// add the appropriate number of characters to the expanded string.
-		else if(strchr(CigarOperationsSubset.c_str(), cigar[i])!=NULL){
-			unsigned int Num=atoi(NumBases.c_str());
-			for(unsigned int j=0; j<Num; j++){
-				expanded+=cigar[i];
-			}
-			NumBases="";
-		}
-		// If the operation character should not be added to the string,
-		// reset the number of bases.
-		else{
-			NumBases="";
+// and counts the bases soft-clipped from each end of the read,
+// the number of bases in the read (operations MIS=X),
+// and whether the alignment contains indels (operations IDP).
+// For instance, 1S5M4S gives 1, 4, 10, and no indels.
+void SummarizeCIGAR(const char *cigar, int length,
+		int *leftclip, int *rightclip, int *querylength, bool *indel){
+	*leftclip=0;
+	*rightclip=0;
+	*querylength=0;
+	*indel=false;
+	int numbases=0;
+	bool aligned=false;
+	for(int i=0; i<length; i++){
+		char c=cigar[i];
+		if(c>='0' && c<='9'){
+			numbases=numbases*10 + (c-'0');
+			continue;
+		}
+		switch(c){
+		case 'S':
+			// Soft clips count toward the left end until
+			// the first aligned base is reached.
+			if(aligned){
+				*rightclip+=numbases;
+			}
+			else{
+				*leftclip+=numbases;
+			}
+			*querylength+=numbases;
+			break;
+		case 'M':
+		case '=':
+		case 'X':
+			aligned=true;
+			*querylength+=numbases;
+			break;
+		case 'I':
+			*indel=true;
+			*querylength+=numbases;
+			break;
+		case 'D':
+		case 'P':
+			*indel=true;
+			break;
+		}
+		numbases=0;
+	}
+}
+
+//
+// TallyKernelScalar
+// Given an aligned run of bases and their quality scores,
+// flags bases that exceed the quality threshold and are A, C, G, or T,
+// and encodes each base as a 2-bit code.
+// This is the reference implementation for the vectorized kernels.
+void TallyKernelScalar(const char *seq, const char *quality, int n,
+		int qthreshold, unsigned char *mask, unsigned char *code){
+	for(int i=0; i<n; i++){
+		unsigned char basecode=0;
+		bool valid=true;
+		switch(seq[i]){
+		case 'A': basecode=0; break;
+		case 'C': basecode=1; break;
+		case 'G': basecode=2; break;
+		case 'T': basecode=3; break;
+		default: valid=false;
+		}
+		mask[i]=(valid && ((int) quality[i])-33 > qthreshold) ? 1 : 0;
+		code[i]=basecode;
+	}
+}
+
+#ifdef TALLY_X86_DISPATCH
+
+//
+// TallyKernelSSE42
+// Vectorized version of TallyKernelScalar that processes 16 bases at a time.
+// Bases are encoded by a table lookup on the low four bits of the character,
+// which are distinct for A (1), C (3), G (7), and T (4).
+__attribute__((target("sse4.2")))
+void TallyKernelSSE42(const char *seq, const char *quality, int n,
+		int qthreshold, unsigned char *mask, unsigned char *code){
+	const __m128i Threshold=_mm_set1_epi8((char) (qthreshold+33));
+	const __m128i LowNibble=_mm_set1_epi8(0x0F);
+	const __m128i One=_mm_set1_epi8(1);
+	const __m128i CodeTable=_mm_setr_epi8(0,0,0,1,3,0,0,2,0,0,0,0,0,0,0,0);
+	const __m128i A=_mm_set1_epi8('A');
+	const __m128i C=_mm_set1_epi8('C');
+	const __m128i G=_mm_set1_epi8('G');
+	const __m128i T=_mm_set1_epi8('T');
+
+	int i=0;
+	for(; i+16<=n; i+=16){
+		__m128i s=_mm_loadu_si128((const __m128i *) (seq+i));
+		__m128i q=_mm_loadu_si128((const __m128i *) (quality+i));
+		__m128i valid=_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(s,A), _mm_cmpeq_epi8(s,C)),
+				_mm_or_si128(_mm_cmpeq_epi8(s,G), _mm_cmpeq_epi8(s,T)));
+		__m128i pass=_mm_and_si128(valid, _mm_cmpgt_epi8(q,Threshold));
+		__m128i c=_mm_shuffle_epi8(CodeTable, _mm_and_si128(s,LowNibble));
+		_mm_storeu_si128((__m128i *) (mask+i), _mm_and_si128(pass,One));
+		_mm_storeu_si128((__m128i *) (code+i), _mm_and_si128(c,valid));
+	}
+	TallyKernelScalar(seq+i, quality+i, n-i, qthreshold, mask+i, code+i);
+}
+
+//
+// TallyKernelAVX2
+// Vectorized version of TallyKernelScalar that processes 32 bases at a time.
+// Uses the same lookup as TallyKernelSSE42, repeated in each 128-bit lane.
+__attribute__((target("avx2")))
+void TallyKernelAVX2(const char *seq, const char *quality, int n,
+		int qthreshold, unsigned char *mask, unsigned char *code){
+	const __m256i Threshold=_mm256_set1_epi8((char) (qthreshold+33));
+	const __m256i LowNibble=_mm256_set1_epi8(0x0F);
+	const __m256i One=_mm256_set1_epi8(1);
+	const __m256i CodeTable=_mm256_setr_epi8(0,0,0,1,3,0,0,2,0,0,0,0,0,0,0,0,
+			0,0,0,1,3,0,0,2,0,0,0,0,0,0,0,0);
+	const __m256i A=_mm256_set1_epi8('A');
+	const __m256i C=_mm256_set1_epi8('C');
+	const __m256i G=_mm256_set1_epi8('G');
+	const __m256i T=_mm256_set1_epi8('T');
+
+	int i=0;
+	for(; i+32<=n; i+=32){
+		__m256i s=_mm256_loadu_si256((const __m256i *) (seq+i));
+		__m256i q=_mm256_loadu_si256((const __m256i *) (quality+i));
+		__m256i valid=_mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(s,A), _mm256_cmpeq_epi8(s,C)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(s,G), _mm256_cmpeq_epi8(s,T)));
+		__m256i pass=_mm256_and_si256(valid, _mm256_cmpgt_epi8(q,Threshold));
+		__m256i c=_mm256_shuffle_epi8(CodeTable, _mm256_and_si256(s,LowNibble));
+		_mm256_storeu_si256((__m256i *) (mask+i), _mm256_and_si256(pass,One));
+		_mm256_storeu_si256((__m256i *) (code+i), _mm256_and_si256(c,valid));
+	}
+	TallyKernelScalar(seq+i, quality+i, n-i, qthreshold, mask+i, code+i);
+}
+
+#endif
+
+//
+// SelectTallyKernel
+// Given the -T kernel name, chooses the named tally kernel, or for auto
+// and check, the fastest kernel supported by the CPU, and stores the name
+// of the chosen kernel in the given string.
+// Returns NULL if the CPU does not support the named kernel.
+TallyKernel_t SelectTallyKernel(string name, string *kernelname){
+	bool fastest=(name=="auto" || name=="check");
+#ifdef TALLY_X86_DISPATCH
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2") && (fastest || name=="avx2")){
+		*kernelname="avx2";
+		return TallyKernelAVX2;
+	}
+	if(__builtin_cpu_supports("sse4.2") && (fastest || name=="sse4.2")){
+		*kernelname="sse4.2";
+		return TallyKernelSSE42;
+	}
+#endif
+	if(!fastest && name!="scalar"){
+		return NULL;
+	}
+	*kernelname="scalar";
+	return TallyKernelScalar;
+}
+
+//
+// SetReadRun
+// Given the start position, TLEN, bases, and qualities of a read without
+// indels, and the number of bases soft-clipped from each end, sets the
+// aligned run to be tallied: the bases between the soft clips, less
+// LEFTTRIM and RIGHTTRIM bases if Trim is true. The run may be empty.
+// Bases are numbered along the read according to its orientation,
+// taken from the sign of TLEN.
+template<bool Trim>
+void SetReadRun(ReadTally_t *tally, int startpos, int tlen,
+		const char *read, const char *quality, int readlength,
+		int leftclip, int rightclip){
+	int runstart=leftclip;
+	int runend=readlength - rightclip;
+	if(Trim){
+		runstart+=LEFTTRIM;
+		runend-=RIGHTTRIM;
+		if(runend < runstart){
+			runend=runstart;
+		}
+	}
+
+	(*tally).RefStart=startpos + runstart - leftclip;
+	(*tally).Length=runend - runstart;
+	(*tally).Seq=read + runstart;
+	(*tally).Quality=quality + runstart;
+
+	if(tlen>=0){
+		(*tally).ReadPosStart=runstart+1;
+		(*tally).ReadPosStep=1;
+	}
+	else{
+		(*tally).ReadPosStart=readlength-(runstart+1);
+		(*tally).ReadPosStep=-1;
+	}
+}
+
+//
+// RunTallyKernel
+// Sizes the output buffers of a read tally and runs the given kernel on it.
+void RunTallyKernel(TallyKernel_t kernel, ReadTally_t *tally){
+	if((int) (*tally).Mask.size() < (*tally).Length+1){
+		(*tally).Mask.resize((*tally).Length+1);
+		(*tally).Code.resize((*tally).Length+1);
+	}
+	kernel((*tally).Seq, (*tally).Quality, (*tally).Length, BASEQTHRESHOLD,
+			&(*tally).Mask[0], &(*tally).Code[0]);
+}
+
+//
+// AddReadRun
+// Given the kernel output for an aligned run of a read,
+// adds the bases that passed the quality mask to the pileup and coverage,
+// and if Histograms is true, to the strand, base quality, and read position
+// histograms of their position and base.
+// Bases are added to the pileup branch-free, weighted by their mask,
+// since the mask depends on the base quality and is not predictable.
+// CheckBounds is false when the whole run lies within the chromosome,
+// so that the loop has no per-base bounds check, and Forward gives the
+// direction in which read positions are numbered along the run.
+template<bool CheckBounds, bool Forward, bool Histograms>
+void AddReadRun(ReadTally_t *tally, Pileup_t *pileup){
+	int chr=(*tally).Chr;
+	PositionBase_t *chrpileup=&(*pileup).Summary[chr][0];
+	long long *chrcoverage=&(*pileup).Coverage[chr][0];
+	int chrlength=(*pileup).Coverage[chr].size();
+	const unsigned char *mask=&(*tally).Mask[0];
+	const unsigned char *code=&(*tally).Code[0];
+	const char *quality=(*tally).Quality;
+	int readposstart=(*tally).ReadPosStart;
+	uint16_t *counts=Histograms ? &(*pileup).Histograms[chr][0] : NULL;
+	int strandbin=(*tally).Reverse ? 1 : 0;
+	for(int i=0; i<(*tally).Length; i++){
+		int refpos=(*tally).RefStart+i;
+		if(CheckBounds && (refpos<0 || refpos>=chrlength)){
+			continue;
+		}
+		long long m=mask[i];
+		int readpos=Forward ? readposstart+i : readposstart-i;
+		PositionBase_t *positionbase=&chrpileup[refpos*NUMBASES+code[i]];
+		// The quality is loaded between the count and quality updates,
+		// which keeps GCC from merging them into one 16-byte update
+		// that measured slower.
+		chrcoverage[refpos]+=m;
+		(*positionbase).Count+=m;
+		(*positionbase).TotalQuality+=m*(((int) quality[i])-33);
+		(*positionbase).TotalReadPosition+=m*readpos;
+
+		if(Histograms && m){
+			int qualitybin=min((((int) quality[i])-33)/QUALITYBINWIDTH,
+					NUMQUALITYBINS-1);
+			int readposbin=0;
+			while(readposbin<NUMREADPOSBINS-1 &&
+					readpos>READPOSBINENDS[readposbin]){
+				readposbin++;
+			}
+			long long index=((long long) refpos*NUMBASES+code[i])*
+					NUMHISTOGRAMBINS;
+			int bins[3]={strandbin, NUMSTRANDBINS+qualitybin,
+					NUMSTRANDBINS+NUMQUALITYBINS+readposbin};
+			for(int b=0; b<3; b++){
+				// Spill the count to the map each time the counter wraps.
+				if(++counts[index+bins[b]]==0){
+					(*pileup).HistogramSpill[chr][index+bins[b]]+=65536;
+				}
+			}
+		}
+	}
+}
+
+//
+// SetReadRunAdders
+// Fills the table of run additions with the instantiations of AddReadRun
+// for whether histograms are collected.
+template<bool Histograms>
+void SetReadRunAdders(){
+	AddTallyRun[0][0]=AddReadRun<false, false, Histograms>;
+	AddTallyRun[0][1]=AddReadRun<false, true, Histograms>;
+	AddTallyRun[1][0]=AddReadRun<true, false, Histograms>;
+	AddTallyRun[1][1]=AddReadRun<true, true, Histograms>;
+}
+
+//
+// AddReadTally
+// Adds an aligned run of a read to the pileup of its read group,
+// checking each position against the chromosome bounds only
+// if the run extends past either end of the chromosome.
+void AddReadTally(ReadTally_t *tally, ReadGroups_t *groups){
+	if((*tally).Length<=0){
+		return;
+	}
+	Pileup_t *pileup=&(*groups).Pileups[(*tally).Group];
+	int chrlength=(*pileup).Coverage[(*tally).Chr].size();
+	bool checkbounds=((*tally).RefStart<0 ||
+			(*tally).RefStart+(*tally).Length>chrlength);
+	bool forward=((*tally).ReadPosStep>0);
+	AddTallyRun[checkbounds][forward](tally, pileup);
+}
+
+//
+// ComparePileups
+// Given two pileups of the same reference sequences,
+// returns the number of positions at which their base counts, qualities,
+// read positions, coverage, or histograms differ.
+long long ComparePileups(Pileup_t *first, Pileup_t *second){
+	long long nummismatches=0;
+	for(unsigned int i=0; i<(*first).Coverage.size(); i++){
+		for(unsigned int j=0; j<(*first).Coverage[i].size(); j++){
+			bool match=((*first).Coverage[i][j]==(*second).Coverage[i][j]);
+			for(int k=0; k<NUMBASES; k++){
+				PositionBase_t *a=&(*first).Summary[i][j*NUMBASES+k];
+				PositionBase_t *b=&(*second).Summary[i][j*NUMBASES+k];
+				match=match && (*a).Count==(*b).Count &&
+						(*a).TotalQuality==(*b).TotalQuality &&
+						(*a).TotalReadPosition==(*b).TotalReadPosition;
+				for(int bin=0; bin<NUMHISTOGRAMBINS &&
+						(*first).Histograms.size()>0; bin++){
+					long long index=(j*NUMBASES+k)*NUMHISTOGRAMBINS+bin;
+					match=match && HistogramCount(first, i, index)==
+							HistogramCount(second, i, index);
+				}
+			}
+			if(!match){
+				nummismatches++;
+			}
+		}
+	}
+	return nummismatches;
+}
+
+//
+// AddMateTally
+// Given the fields, kernel output, and untrimmed start position
+// of a read in mate overlap mode, merges the read with its mate
+// if the mate is waiting, and otherwise either holds the read
+// until its mate arrives or adds it to the pileup directly.
+// A read is held only if its mate is on the same chromosome
+// and starts before the read's aligned run ends,
+// so a mate that finds nothing waiting cannot overlap the read.
+void AddMateTally(SAMFields_t *fields, ReadTally_t *tally, int startpos,
+		MateBuffer_t *buffer, ReadGroups_t *groups){
+
+	string qname((*fields).Start[0], (*fields).Length[0]);
+
+	// If the mate is waiting, count overlapping bases once
+	// and add both reads to the pileup.
+	unordered_map<string, list<PendingMate_t>::iterator>::iterator it=
+			(*buffer).Index.find(qname);
+	if(it!=(*buffer).Index.end()){
+		PendingMate_t *mate=&(*(it->second));
+		// Pass the first read of the pair first, so that ties are
+		// resolved the same way whatever order the mates arrive in.
+		if((*mate).Flag & 0x40){
+			MergeMateTallies(&(*mate).Tally, tally, buffer);
+		}
+		else{
+			MergeMateTallies(tally, &(*mate).Tally, buffer);
+		}
+		AddReadTally(&(*mate).Tally, groups);
+		AddReadTally(tally, groups);
+		(*buffer).Pending.erase(it->second);
+		(*buffer).Index.erase(it);
+		return;
+	}
+
+	// Before holding another read, tally reads whose mates should
+	// already have appeared in coordinate-sorted input. The input is
+	// sorted by POS, not by the trimmed start of the run.
+	FlushPendingMates(buffer, (*tally).Chr, startpos, groups);
+
+	// Hold the read if its mate is mapped to the same chromosome
+	// and could overlap it. Otherwise, tally it now.
+	int flag=atoi((*fields).Start[1]);
+	int matestart=atoi((*fields).Start[7])-1;
+	bool samechr=((*fields).Length[6]==1 && (*fields).Start[6][0]=='=') ||
+			((*fields).Length[6]==(*fields).Length[2] &&
+			strncmp((*fields).Start[6], (*fields).Start[2], (*fields).Length[2])==0);
+	if(!(flag & 0x1) || (flag & 0x8) || !samechr ||
+			matestart >= (*tally).RefStart+(*tally).Length){
+		AddReadTally(tally, groups);
+		return;
+	}
+
+	HoldMate(qname, flag, matestart, tally, buffer);
+
+	// Keep the buffer within its size limit.
+	while((int) (*buffer).Pending.size() > MAXPENDINGMATES){
+		AddReadTally(&(*buffer).Pending.front().Tally, groups);
+		(*buffer).Index.erase((*buffer).Pending.front().QName);
+		(*buffer).Pending.pop_front();
+	}
+}
+
+//
+// HoldMate
+// Copies a read into the mate buffer and points its tally at the copies.
+void HoldMate(string qname, int flag, int matestart, ReadTally_t *tally,
+		MateBuffer_t *buffer){
+	(*buffer).Pending.push_back(PendingMate_t());
+	PendingMate_t *pending=&(*buffer).Pending.back();
+	(*pending).QName=qname;
+	(*pending).Flag=flag;
+	(*pending).MateStart=matestart;
+	(*pending).Seq.assign((*tally).Seq, (*tally).Length);
+	(*pending).Quality.assign((*tally).Quality, (*tally).Length);
+	(*pending).Tally=*tally;
+	(*pending).Tally.Seq=(*pending).Seq.c_str();
+	(*pending).Tally.Quality=(*pending).Quality.c_str();
+	(*buffer).Index[qname]=--(*buffer).Pending.end();
+}
+
+//
+// ReleaseMate
+// Given the fields of a read that will not be tallied in mate overlap mode,
+// adds its waiting mate, if any, to the pileup on its own.
+// Only primary alignments of the other read in the pair release a mate,
+// so secondary alignments with the same name do not.
+void ReleaseMate(SAMFields_t *fields, MateBuffer_t *buffer,
+		ReadGroups_t *groups){
+	int flag=atoi((*fields).Start[1]);
+	if(flag & 0x900){
+		return;
+	}
+	string qname((*fields).Start[0], (*fields).Length[0]);
+	unordered_map<string, list<PendingMate_t>::iterator>::iterator it=
+			(*buffer).Index.find(qname);
+	if(it==(*buffer).Index.end() ||
+			(it->second->Flag & 0xC0) == (flag & 0xC0)){
+		return;
+	}
+	AddReadTally(&it->second->Tally, groups);
+	(*buffer).Pending.erase(it->second);
+	(*buffer).Index.erase(it);
+}
+
+//
+// FlushPendingMates
+// Adds waiting reads to the pileup on their own once their mates
+// can no longer arrive in coordinate-sorted input, i.e. once the input
+// has moved past the mate's start position or onto another chromosome.
+// Checks reads in the order they were read and stops at the first one
+// that may still be matched. A chromosome of -1 flushes all reads.
+void FlushPendingMates(MateBuffer_t *buffer, int chr, int pos,
+		ReadGroups_t *groups){
+	while(!(*buffer).Pending.empty()){
+		PendingMate_t *front=&(*buffer).Pending.front();
+		if(chr>=0 && (*front).Tally.Chr==chr && (*front).MateStart>=pos){
+			break;
+		}
+		AddReadTally(&(*front).Tally, groups);
+		(*buffer).Index.erase((*front).QName);
+		(*buffer).Pending.pop_front();
+	}
+}
+
+//
+// MergeMateTallies
+// Given the kernel output for the two reads of a pair,
+// masks bases so that each reference position covered by both reads
+// is counted at most once.
+// Where both calls pass the quality mask and agree, keeps the one with
+// higher quality, or the call from the first read if qualities are equal.
+// Where they disagree, masks both (an N) in mode 1, and keeps
+// the higher-quality call in mode 2 unless qualities are equal.
+void MergeMateTallies(ReadTally_t *first, ReadTally_t *second,
+		MateBuffer_t *buffer){
+	(*buffer).NumPairsMerged++;
+	if((*first).Chr!=(*second).Chr){
+		return;
+	}
+	int start=max((*first).RefStart, (*second).RefStart);
+	int end=min((*first).RefStart+(*first).Length,
+			(*second).RefStart+(*second).Length);
+	for(int pos=start; pos<end; pos++){
+		int i=pos-(*first).RefStart;
+		int j=pos-(*second).RefStart;
+		if(!(*first).Mask[i] || !(*second).Mask[j]){
+			continue;
+		}
+		(*buffer).NumOverlapBases++;
+		bool concordant=((*first).Code[i]==(*second).Code[j]);
+		if(!concordant){
+			(*buffer).NumDiscordantBases++;
+		}
+		char firstq=(*first).Quality[i];
+		char secondq=(*second).Quality[j];
+		if(concordant || (OVERLAPMODE==2 && firstq!=secondq)){
+			if(firstq>=secondq){
+				(*second).Mask[j]=0;
+			}
+			else{
+				(*first).Mask[i]=0;
+			}
+		}
+		else{
+			(*first).Mask[i]=0;
+			(*second).Mask[j]=0;
+		}
+	}
+}
+
+//
+// WriteInt64
+// Writes a 64-bit integer to a binary file.
+void WriteInt64(ofstream *out, long long value){
+	(*out).write((const char *) &value, sizeof(value));
+}
+
+//
+// ReadInt64
+// Reads a 64-bit integer from a binary file.
+long long ReadInt64(ifstream *in){
+	long long value=0;
+	(*in).read((char *) &value, sizeof(value));
+	return value;
+}
+
+//
+// WriteString
+// Writes a length-prefixed string to a binary file.
+void WriteString(ofstream *out, string value){
+	WriteInt64(out, value.size());
+	(*out).write(value.c_str(), value.size());
+}
+
+//
+// ReadString
+// Reads a length-prefixed string from a binary file.
+string ReadString(ifstream *in){
+	long long length=ReadInt64(in);
+	if(!(*in) || length<0 || length>(1<<30)){
+		(*in).setstate(ios::failbit);
+		return "";
+	}
+	string value(length, ' ');
+	if(length>0){
+		(*in).read(&value[0], length);
+	}
+	return value;
+}
+
+//
+// WritePileup
+// Writes the pileup in binary form: the name and length of each
+// reference sequence, followed by the raw counters for each sequence.
+// The counters are sums, so pileups of separate reads can be added.
+// Pileups with histograms have a different format number, and after the
+// counters, the 16-bit histogram counters of each sequence followed by
+// the number of spilled counts and each index and spilled count,
+// in order of index.
+void WritePileup(ofstream *out, vector<string> *refnames, Pileup_t *pileup){
+	bool histograms=((*pileup).Histograms.size()>0);
+	(*out).write(PILEUPMAGIC, sizeof(PILEUPMAGIC));
+	WriteInt64(out, histograms ? PILEUPHISTOGRAMFORMAT : PILEUPFORMAT);
+	WriteInt64(out, (*refnames).size());
+	for(unsigned int i=0; i<(*refnames).size(); i++){
+		WriteString(out, (*refnames)[i]);
+		WriteInt64(out, (*pileup).Coverage[i].size());
+	}
+	for(unsigned int i=0; i<(*refnames).size(); i++){
+		(*out).write((const char *) &(*pileup).Summary[i][0],
+				(*pileup).Summary[i].size()*sizeof(PositionBase_t));
+		(*out).write((const char *) &(*pileup).Coverage[i][0],
+				(*pileup).Coverage[i].size()*sizeof(long long));
+	}
+	if(!histograms){
+		return;
+	}
+	for(unsigned int i=0; i<(*refnames).size(); i++){
+		(*out).write((const char *) &(*pileup).Histograms[i][0],
+				(*pileup).Histograms[i].size()*sizeof(uint16_t));
+
+		// Write the spilled counts in order of their index, so that the
+		// same counts always give the same file.
+		vector<pair<long long, long long> > spill(
+				(*pileup).HistogramSpill[i].begin(),
+				(*pileup).HistogramSpill[i].end());
+		sort(spill.begin(), spill.end());
+		WriteInt64(out, spill.size());
+		for(unsigned int j=0; j<spill.size(); j++){
+			WriteInt64(out, spill[j].first);
+			WriteInt64(out, spill[j].second);
+		}
+	}
+}
+
+//
+// ReadPileup
+// Reads a binary pileup written by WritePileup into an initialized pileup,
+// either replacing or adding to its counters.
+// Histograms in the file are skipped if the pileup has none.
+// Returns 1 if the file is invalid, its reference sequences
+// do not match the given ones, or the pileup has histograms
+// but the file does not.
+int ReadPileup(ifstream *in, vector<string> *refnames, Pileup_t *pileup,
+		bool add){
+	char magic[sizeof(PILEUPMAGIC)];
+	(*in).read(magic, sizeof(magic));
+	if(!(*in) || memcmp(magic, PILEUPMAGIC, sizeof(magic))!=0){
+		return 1;
+	}
+	long long format=ReadInt64(in);
+	bool histograms=((*pileup).Histograms.size()>0);
+	if((format!=PILEUPFORMAT && format!=PILEUPHISTOGRAMFORMAT) ||
+			(histograms && format!=PILEUPHISTOGRAMFORMAT)){
+		return 1;
+	}
+	if(ReadInt64(in)!=(long long) (*refnames).size()){
+		return 1;
+	}
+	for(unsigned int i=0; i<(*refnames).size(); i++){
+		string name=ReadString(in);
+		long long length=ReadInt64(in);
+		if(!(*in) || name!=(*refnames)[i] ||
+				length!=(long long) (*pileup).Coverage[i].size()){
+			return 1;
+		}
+	}
+	for(unsigned int i=0; i<(*refnames).size(); i++){
+		vector<PositionBase_t> summary((*pileup).Summary[i].size());
+		vector<long long> coverage((*pileup).Coverage[i].size());
+		(*in).read((char *) &summary[0], summary.size()*sizeof(PositionBase_t));
+		(*in).read((char *) &coverage[0], coverage.size()*sizeof(long long));
+		if(!(*in)){
+			return 1;
+		}
+		if(!add){
+			(*pileup).Summary[i].swap(summary);
+			(*pileup).Coverage[i].swap(coverage);
+			continue;
+		}
+		for(unsigned int j=0; j<summary.size(); j++){
+			(*pileup).Summary[i][j].Count+=summary[j].Count;
+			(*pileup).Summary[i][j].TotalQuality+=summary[j].TotalQuality;
+			(*pileup).Summary[i][j].TotalReadPosition+=summary[j].TotalReadPosition;
+		}
+		for(unsigned int j=0; j<coverage.size(); j++){
+			(*pileup).Coverage[i][j]+=coverage[j];
+		}
+	}
+	if(format!=PILEUPHISTOGRAMFORMAT){
+		return 0;
+	}
+	for(unsigned int i=0; i<(*refnames).size(); i++){
+		vector<uint16_t> counts((*pileup).Summary[i].size()*NUMHISTOGRAMBINS);
+		(*in).read((char *) &counts[0], counts.size()*sizeof(uint16_t));
+		unordered_map<long long, long long> spill;
+		long long numspill=ReadInt64(in);
+		for(long long j=0; j<numspill && *in; j++){
+			long long index=ReadInt64(in);
+			spill[index]=ReadInt64(in);
+		}
+		if(!(*in)){
+			return 1;
+		}
+		if(!histograms){
+			continue;
+		}
+		if(!add){
+			(*pileup).Histograms[i].swap(counts);
+			(*pileup).HistogramSpill[i].swap(spill);
+			continue;
+		}
+		for(unsigned int j=0; j<counts.size(); j++){
+			AddHistogramCount(pileup, i, j, counts[j]);
+		}
+		for(unordered_map<long long, long long>::iterator it=spill.begin();
+				it!=spill.end(); ++it){
+			AddHistogramCount(pileup, i, it->first, it->second);
+		}
+	}
+	return 0;
+}
+
+//
+// RunFingerprint
+// Returns a string describing every parameter that affects the tally,
+// so that a checkpoint is only resumed by an identical run.
+string RunFingerprint(){
+	ostringstream fingerprint;
+	fingerprint << VERSION << "\t" << SAM << "\t" << REFFASTA << "\t" <<
+			BASEQTHRESHOLD << "\t" << MAPQTHRESHOLD << "\t" <<
+			LEFTTRIM << "\t" << RIGHTTRIM << "\t" <<
+			REQUIREFLAGS << "\t" << EXCLUDEFLAGS << "\t" << CHR << "\t" <<
+			OVERLAPMODE << "\t" << MAXPENDINGMATES << "\t" <<
+			DOWNSAMPLEMODE << "\t" << DOWNSAMPLEVALUE << "\t" <<
+			DOWNSAMPLEWINDOW << "\t" << DOWNSAMPLESEED << "\t" <<
+			DUPLICATEMODE << "\t" << DUPLICATEWINDOW << "\t" << OPTICALDISTANCE <<
+			"\t" << READGROUPS << "\t" << (OUTHISTOGRAMS != "");
+	return fingerprint.str();
+}
+
+//
+// WriteCheckpointHeader
+// Writes the magic, the checkpoint format, and the given header
+// at the start of a checkpoint.
+void WriteCheckpointHeader(ofstream *out, CheckpointHeader_t *header){
+	(*out).write(CHECKPOINTMAGIC, sizeof(CHECKPOINTMAGIC));
+	WriteInt64(out, CHECKPOINTFORMAT);
+	WriteString(out, (*header).Fingerprint);
+	WriteInt64(out, (*header).Offset);
+	WriteInt64(out, (*header).NumLines);
+	WriteInt64(out, (*header).Counts.Total);
+	WriteInt64(out, (*header).Counts.FailRequireFlags);
+	WriteInt64(out, (*header).Counts.FailExcludeFlags);
+	WriteInt64(out, (*header).Counts.Unmapped);
+	WriteInt64(out, (*header).Counts.FailMapQ);
+	WriteInt64(out, (*header).Counts.FailReference);
+	WriteInt64(out, (*header).Counts.Indel);
+	WriteInt64(out, (*header).Counts.Passed);
+	WriteInt64(out, (*header).NumPairsMerged);
+	WriteInt64(out, (*header).NumOverlapBases);
+	WriteInt64(out, (*header).NumDiscordantBases);
+}
+
+//
+// ReadCheckpointHeader
+// Reads the header written by WriteCheckpointHeader from the start
+// of a checkpoint, leaving the file at the reads waiting for mates.
+// Returns 1 if the file is not a checkpoint of this format.
+int ReadCheckpointHeader(ifstream *in, CheckpointHeader_t *header){
+	char magic[sizeof(CHECKPOINTMAGIC)];
+	(*in).read(magic, sizeof(magic));
+	if(!*in || memcmp(magic, CHECKPOINTMAGIC, sizeof(magic))!=0 ||
+			ReadInt64(in)!=CHECKPOINTFORMAT){
+		return 1;
+	}
+	(*header).Fingerprint=ReadString(in);
+	(*header).Offset=ReadInt64(in);
+	(*header).NumLines=ReadInt64(in);
+	(*header).Counts.Total=ReadInt64(in);
+	(*header).Counts.FailRequireFlags=ReadInt64(in);
+	(*header).Counts.FailExcludeFlags=ReadInt64(in);
+	(*header).Counts.Unmapped=ReadInt64(in);
+	(*header).Counts.FailMapQ=ReadInt64(in);
+	(*header).Counts.FailReference=ReadInt64(in);
+	(*header).Counts.Indel=ReadInt64(in);
+	(*header).Counts.Passed=ReadInt64(in);
+	(*header).NumPairsMerged=ReadInt64(in);
+	(*header).NumOverlapBases=ReadInt64(in);
+	(*header).NumDiscordantBases=ReadInt64(in);
+	return *in ? 0 : 1;
+}
+
+//
+// WriteCheckpoint
+// Saves the state of the run: the run parameters, the input offset and
+// number of lines read, the filter counters, any reads waiting for mates,
+// the pileup of each read group, and the downsampling and duplicate
+// marking state. Writes to a temporary file and then renames it,
+// so that an interrupted write leaves the previous checkpoint intact.
+// Returns 1 if the checkpoint cannot be written.
+int WriteCheckpoint(string filename, long long offset, long long numlines,
+		FilterCounts_t *counts, MateBuffer_t *buffer, Downsampler_t *downsampler,
+		DuplicateMarker_t *marker, vector<string> *refnames,
+		ReadGroups_t *groups){
+
+	string tempname=filename+".tmp";
+	ofstream out(tempname.c_str(), ios::out | ios::binary);
+	if(!out){
+		printf("Error: cannot write checkpoint file.\n");
+		return 1;
+	}
+
+	CheckpointHeader_t header;
+	header.Fingerprint=RunFingerprint();
+	header.Offset=offset;
+	header.NumLines=numlines;
+	header.Counts=*counts;
+	header.NumPairsMerged=(*buffer).NumPairsMerged;
+	header.NumOverlapBases=(*buffer).NumOverlapBases;
+	header.NumDiscordantBases=(*buffer).NumDiscordantBases;
+	WriteCheckpointHeader(&out, &header);
+
+	// Save the reads waiting for their mates as they were read,
+	// since the tally kernel can recompute the rest.
+	WriteInt64(&out, (*buffer).Pending.size());
+	for(list<PendingMate_t>::iterator it=(*buffer).Pending.begin();
+			it!=(*buffer).Pending.end(); ++it){
+		WriteString(&out, (*it).QName);
+		WriteInt64(&out, (*it).Flag);
+		WriteInt64(&out, (*it).MateStart);
+		WriteInt64(&out, (*it).Tally.Chr);
+		WriteInt64(&out, (*it).Tally.Group);
+		WriteInt64(&out, (*it).Tally.Reverse ? 1 : 0);
+		WriteInt64(&out, (*it).Tally.RefStart);
+		WriteInt64(&out, (*it).Tally.ReadPosStart);
+		WriteInt64(&out, (*it).Tally.ReadPosStep);
+		WriteString(&out, (*it).Seq);
+		WriteString(&out, (*it).Quality);
+	}
+
+	// The downsampling and duplicate marking state follows the pileups,
+	// so that checkpoints can still be merged as pileups.
+	WriteInt64(&out, (*groups).Names.size());
+	for(unsigned int g=0; g<(*groups).Names.size(); g++){
+		WriteString(&out, (*groups).Names[g]);
+		WriteInt64(&out, (*groups).NumReads[g]);
+		WritePileup(&out, refnames, &(*groups).Pileups[g]);
+	}
+	WriteDownsampler(&out, downsampler);
+	WriteDuplicateMarker(&out, marker);
+	out.close();
+
+	if(!out || rename(tempname.c_str(), filename.c_str())!=0){
+		printf("Error: cannot write checkpoint file.\n");
+		return 1;
+	}
+	return 0;
+}
+
+//
+// ReadCheckpoint
+// Restores the state of a run saved by WriteCheckpoint
+// into initialized counters, mate buffer, and read groups.
+// Returns 1 if the checkpoint does not exist, is invalid,
+// or was written by a run with different parameters.
+int ReadCheckpoint(string filename, long long *offset, long long *numlines,
+		FilterCounts_t *counts, MateBuffer_t *buffer, Downsampler_t *downsampler,
+		DuplicateMarker_t *marker, vector<string> *refnames,
+		vector<string> *refsequences, ReadGroups_t *groups){
+
+	ifstream in(filename.c_str(), ios::in | ios::binary);
+	if(!in){
+		return 1;
+	}
+
+	// Read the whole checkpoint before changing any state.
+	CheckpointHeader_t header;
+	if(ReadCheckpointHeader(&in, &header)!=0){
+		printf("Checkpoint file is invalid; starting from the beginning.\n");
+		return 1;
+	}
+	if(header.Fingerprint!=RunFingerprint()){
+		printf("Checkpoint is from a different run; starting from the beginning.\n");
+		return 1;
+	}
+
+	MateBuffer_t newbuffer;
+	long long numpending=ReadInt64(&in);
+	int maxgroup=-1;
+	for(long long i=0; i<numpending && in; i++){
+		string qname=ReadString(&in);
+		int flag=ReadInt64(&in);
+		int matestart=ReadInt64(&in);
+		ReadTally_t tally;
+		tally.Chr=ReadInt64(&in);
+		tally.Group=ReadInt64(&in);
+		tally.Reverse=(ReadInt64(&in)!=0);
+		tally.RefStart=ReadInt64(&in);
+		tally.ReadPosStart=ReadInt64(&in);
+		tally.ReadPosStep=ReadInt64(&in);
+		string seq=ReadString(&in);
+		string quality=ReadString(&in);
+		if(!in || tally.Chr<0 || tally.Chr>=(int) (*refnames).size() ||
+				tally.Group<0 || seq.size()!=quality.size()){
+			break;
+		}
+		tally.Length=seq.size();
+		tally.Seq=seq.c_str();
+		tally.Quality=quality.c_str();
+		RunTallyKernel(TallyKernel, &tally);
+		HoldMate(qname, flag, matestart, &tally, &newbuffer);
+		maxgroup=max(maxgroup, tally.Group);
+	}
+
+	ReadGroups_t newgroups;
+	long long numgroups=ReadInt64(&in);
+	for(long long g=0; g<numgroups && in; g++){
+		int group=FindReadGroup(ReadString(&in), refsequences, &newgroups);
+		newgroups.NumReads[group]=ReadInt64(&in);
+		if(ReadPileup(&in, refnames, &newgroups.Pileups[group], false)!=0){
+			break;
+		}
+	}
+	Downsampler_t newdownsampler=*downsampler;
+	DuplicateMarker_t newmarker=*marker;
+	if(!in || maxgroup>=(int) newgroups.Names.size() ||
+			(long long) newgroups.Names.size()!=numgroups ||
+			ReadDownsampler(&in, &newdownsampler)!=0 ||
+			ReadDuplicateMarker(&in, &newmarker)!=0){
+		printf("Checkpoint file is invalid; starting from the beginning.\n");
+		return 1;
+	}
+	in.close();
+
+	*offset=header.Offset;
+	*numlines=header.NumLines;
+	*counts=header.Counts;
+	(*buffer).Pending.clear();
+	(*buffer).Index.clear();
+	(*buffer).Pending.splice((*buffer).Pending.end(), newbuffer.Pending);
+	(*buffer).Index.swap(newbuffer.Index);
+	(*buffer).NumPairsMerged=header.NumPairsMerged;
+	(*buffer).NumOverlapBases=header.NumOverlapBases;
+	(*buffer).NumDiscordantBases=header.NumDiscordantBases;
+	(*groups).Names.swap(newgroups.Names);
+	(*groups).Index.swap(newgroups.Index);
+	(*groups).Pileups.swap(newgroups.Pileups);
+	(*groups).NumReads.swap(newgroups.NumReads);
+	*downsampler=newdownsampler;
+	*marker=newmarker;
+	return 0;
+}
+
+//
+// MergePileupFile
+// Given a binary pileup, a checkpoint, or a text summary
+// for the given reference sequences, adds its counts to the pileup.
+// For checkpoints with read groups, the counts of every group are added.
+// For text summaries, totals are recovered as average times count.
+// For sparse summaries, coverage is read from the depth rows,
+// so that it includes bases below the floors for base rows.
+// Returns 1 if the file does not exist, is invalid,
+// or is a checkpoint with reads still waiting for their mates.
+int MergePileupFile(string filename, vector<string> *refnames,
+		Pileup_t *pileup){
+
+	ifstream in(filename.c_str(), ios::in | ios::binary);
+	if(!in){
+		return 1;
+	}
+
+	// Identify the type of file from its first bytes.
+	char magic[sizeof(PILEUPMAGIC)];
+	in.read(magic, sizeof(magic));
+	bool binary=(in && memcmp(magic, PILEUPMAGIC, sizeof(magic))==0);
+	bool checkpoint=(in && memcmp(magic, CHECKPOINTMAGIC, sizeof(magic))==0);
+
+	// A binary pileup is added directly.
+	if(binary){
+		in.seekg(0);
+		return ReadPileup(&in, refnames, pileup, true);
+	}
+
+	// A checkpoint contains a pileup for each read group
+	// after the state of its run. The groups are added together.
+	if(checkpoint){
+		in.seekg(0);
+		CheckpointHeader_t header;
+		if(ReadCheckpointHeader(&in, &header)!=0){
+			printf("Checkpoint format is not supported.\n");
+			return 1;
+		}
+		if(ReadInt64(&in)!=0){
+			printf("Checkpoint has reads waiting for mates.\n");
+			return 1;
+		}
+		long long numgroups=ReadInt64(&in);
+		for(long long g=0; g<numgroups; g++){
+			ReadString(&in);
+			ReadInt64(&in);
+			if(!in || ReadPileup(&in, refnames, pileup, true)!=0){
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	// Otherwise, read a text summary line by line.
+	// Text summaries have no histograms to add.
+	if((*pileup).Histograms.size()>0){
+		printf("Text summaries cannot be merged with histograms.\n");
+		return 1;
+	}
+	in.close();
+	ifstream fin(filename.c_str(), ios::in);
+	map<string, int> refindex;
+	for(unsigned int i=0; i<(*refnames).size(); i++){
+		refindex[(*refnames)[i]]=i;
+	}
+	string line;
+	bool sparse=false;
+	while(getline(fin, line)){
+
+		// Skip the header of a sparse summary.
+		if(line[0]=='#'){
+			sparse=sparse || line=="#Format=sparse";
+			continue;
+		}
+		vector<string> fields=StringSplit(line,'\t');
+		bool depth=(fields.size()>=6 && fields[2]=="*");
+		if(fields.size()<8 && !depth){
+			return 1;
+		}
+		map<string, int>::iterator it=refindex.find(fields[0]);
+		int pos=atoi(fields[1].c_str())-1;
+		if(it==refindex.end() ||
+				pos<0 || pos>=(int) (*pileup).Coverage[it->second].size()){
+			return 1;
+		}
+		long long count=atoll(fields[5].c_str());
+		if(depth){
+			(*pileup).Coverage[it->second][pos]+=count;
+			continue;
+		}
+		const char *base=(const char *) memchr(BASES, fields[2][0], NUMBASES);
+		if(base==NULL || fields[2].size()!=1){
+			return 1;
+		}
+		PositionBase_t *positionbase=
+				&(*pileup).Summary[it->second][pos*NUMBASES+(base-BASES)];
+		(*positionbase).Count+=count;
+		(*positionbase).TotalQuality+=llround(atof(fields[6].c_str())*count);
+		(*positionbase).TotalReadPosition+=llround(atof(fields[7].c_str())*count);
+		if(!sparse){
+			(*pileup).Coverage[it->second][pos]+=count;
+		}
+	}
+	return 0;
+}
+
+// WriteCoverageBins
+// Writes the mean coverage in bins of BINWIDTH genome positions,
+// where genome positions number the reference sequences consecutively
+// from 1 and a bin spanning two sequences is split between them.
+// Each line gives Chr, the first genome position of the bin,
+// the number of positions, the mean, minimum, and maximum coverage,
+// and 1 if the mean coverage is below MINCOVERAGE.
+// Returns the number of bins below MINCOVERAGE.
+long long WriteCoverageBins(ofstream *out, vector<string> *refnames,
+		Pileup_t *pileup){
+	long long numlowbins=0;
+	long long genomepos=0;
+	for(unsigned int i=0; i<(*pileup).Coverage.size(); i++){
+		vector<long long> *coverage=&(*pileup).Coverage[i];
+		unsigned int j=0;
+		while(j<(*coverage).size()){
+			long long binstart=((genomepos+1)/BINWIDTH)*BINWIDTH;
+			long long numpositions=0;
+			long long total=0;
+			long long mincoverage=(*coverage)[j];
+			long long maxcoverage=(*coverage)[j];
+			while(j<(*coverage).size() &&
+					(genomepos+1)/BINWIDTH*BINWIDTH==binstart){
+				total+=(*coverage)[j];
+				mincoverage=min(mincoverage, (*coverage)[j]);
+				maxcoverage=max(maxcoverage, (*coverage)[j]);
+				numpositions++;
+				genomepos++;
+				j++;
+			}
+			double meancoverage=(double) total/numpositions;
+			int low=(meancoverage < MINCOVERAGE) ? 1 : 0;
+			numlowbins+=low;
+			(*out) << (*refnames)[i] << "\t" << binstart << "\t" <<
+					numpositions << "\t" << meancoverage << "\t" <<
+					mincoverage << "\t" << maxcoverage << "\t" <<
+					low << "\n";
+		}
+	}
+	return numlowbins;
+}
+
+// WriteGeneCoverage
+// Writes the coverage over the exons of each annotated gene.
+// Each line gives the gene name, Chr, the number of positions,
+// the mean, minimum, and maximum coverage, the number of positions
+// below MINCOVERAGE, and 1 if the mean coverage is below MINCOVERAGE.
+// Genes on sequences that are not in the reference are skipped.
+// Returns the number of genes below MINCOVERAGE.
+long long WriteGeneCoverage(ofstream *out, vector<Annotation_t> *annotations,
+		map<string, int> *refindex, Pileup_t *pileup){
+	long long numlowgenes=0;
+	for(unsigned int i=0; i<(*annotations).size(); i++){
+		Annotation_t *annotation=&(*annotations)[i];
+		map<string, int>::iterator it=(*refindex).find((*annotation).Chr);
+		if(it==(*refindex).end()){
+			printf("Gene %s is not on a reference sequence.\n",
+					(*annotation).Name.c_str());
+			continue;
+		}
+		vector<long long> *coverage=&(*pileup).Coverage[it->second];
+		long long numpositions=0;
+		long long total=0;
+		long long mincoverage=0;
+		long long maxcoverage=0;
+		long long numlowpositions=0;
+		for(int j=0; j<(*annotation).NumExons; j++){
+			int exonstart=(*annotation).ChrStart+(*annotation).ExonStarts[j];
+			for(int k=0; k<(*annotation).ExonSizes[j]; k++){
+				int pos=exonstart+k;
+				if(pos<0 || pos>=(int) (*coverage).size()){
+					continue;
+				}
+				long long positioncoverage=(*coverage)[pos];
+				if(numpositions==0 || positioncoverage<mincoverage){
+					mincoverage=positioncoverage;
+				}
+				if(numpositions==0 || positioncoverage>maxcoverage){
+					maxcoverage=positioncoverage;
+				}
+				if(positioncoverage<MINCOVERAGE){
+					numlowpositions++;
+				}
+				total+=positioncoverage;
+				numpositions++;
+			}
+		}
+		double meancoverage=(numpositions>0) ? (double) total/numpositions : 0;
+		int low=(meancoverage < MINCOVERAGE) ? 1 : 0;
+		numlowgenes+=low;
+		(*out) << (*annotation).Name << "\t" << (*annotation).Chr << "\t" <<
+				numpositions << "\t" << meancoverage << "\t" <<
+				mincoverage << "\t" << maxcoverage << "\t" <<
+				numlowpositions << "\t" << low << "\n";
+	}
+	return numlowgenes;
+}
+
+// WriteSparseSummary
+// Writes a header of sample metadata, one NAME=VALUE per line after '#',
+// including the read group, if any,
+// then for each position with coverage a depth row, in which the base is *
+// and the count is the coverage, followed by rows in the dense format
+// for the bases whose count and frequency reach MINBASECOUNT and MINBASEFREQ.
+// Positions without coverage are omitted.
+void WriteSparseSummary(ofstream *out, vector<string> *refnames,
+		vector<string> *refsequences, string readgroup, Pileup_t *pileup){
+	(*out) << "#Format=sparse\n";
+	(*out) << "#MinBaseCount=" << MINBASECOUNT << "\n";
+	(*out) << "#MinBaseFreq=" << MINBASEFREQ << "\n";
+	if(readgroup != ""){
+		(*out) << "#ReadGroup=" << readgroup << "\n";
+	}
+	for(unsigned int i=0; i<SAMPLEFIELDS.size(); i++){
+		(*out) << "#" << SAMPLEFIELDS[i] << "\n";
+	}
+	long long genomepos=0;
+	for(unsigned int i=0; i<(*refsequences).size(); i++){
+		const string &chr=(*refnames)[i];
+		for(unsigned int j=0; j<(*refsequences)[i].size(); j++){
+			genomepos++;
+			long long coverage=(*pileup).Coverage[i][j];
+			if(coverage==0){
+				continue;
+			}
+			char refbase=(*refsequences)[i][j];
+			(*out) << chr << "\t" << j+1 << "\t*\t" << refbase << "\t" <<
+					genomepos << "\t" << coverage << "\n";
+			for(int k=0; k<NUMBASES; k++){
+				PositionBase_t *positionbase=&(*pileup).Summary[i][j*NUMBASES+k];
+				long long count=(*positionbase).Count;
+				if(count==0 || count<MINBASECOUNT ||
+						(double) count/coverage < MINBASEFREQ){
+					continue;
+				}
+				(*out) << chr << "\t" << j+1 << "\t" << BASES[k] << "\t" <<
+						refbase << "\t" << genomepos << "\t" << count << "\t" <<
+						(float) (*positionbase).TotalQuality/count << "\t" <<
+						(float) (*positionbase).TotalReadPosition/count << "\n";
+			}
+		}
+	}
+}
+
+//
+// CheckDownsampleParameters
+// Checks the downsampling mode and the number that goes with it.
+// Returns 1 if any argument conditions are violated.
+int CheckDownsampleParameters(){
+	if(DOWNSAMPLEMODE=="none"){
+		return 0;
+	}
+	if(DOWNSAMPLEMODE=="fraction"){
+		if(DOWNSAMPLEVALUE<=0 || DOWNSAMPLEVALUE>1){
+			printf("Invalid -N fraction of read pairs; must be in (0,1].\n");
+			return 1;
+		}
+	}
+	else if(DOWNSAMPLEMODE=="cap" || DOWNSAMPLEMODE=="window"){
+		if(DOWNSAMPLEVALUE<1){
+			printf("Invalid -N number for %s downsampling.\n",
+					DOWNSAMPLEMODE.c_str());
+			return 1;
+		}
+	}
+	else{
+		printf("Invalid -D downsampling mode.\n");
+		return 1;
+	}
+	if(DOWNSAMPLEWINDOW<=0){
+		printf("Invalid -W downsampling window.\n");
+		return 1;
+	}
+	return 0;
+}
+
+//
+// SetDownsampler
+// Sets the downsampler from the run parameters.
+void SetDownsampler(Downsampler_t *downsampler){
+	(*downsampler).Seed=DOWNSAMPLESEED;
+	(*downsampler).WindowSize=DOWNSAMPLEWINDOW;
+	if(DOWNSAMPLEMODE=="fraction"){
+		(*downsampler).Mode=DOWNSAMPLE_FRACTION;
+		(*downsampler).FractionThreshold=(DOWNSAMPLEVALUE>=1) ? UINT64_MAX :
+				(uint64_t) ((long double) DOWNSAMPLEVALUE*18446744073709551616.0L);
+	}
+	else if(DOWNSAMPLEMODE=="cap"){
+		(*downsampler).Mode=DOWNSAMPLE_CAP;
+		(*downsampler).Cap=(long long) DOWNSAMPLEVALUE;
+	}
+	else if(DOWNSAMPLEMODE=="window"){
+		(*downsampler).Mode=DOWNSAMPLE_WINDOW;
+		(*downsampler).PairsPerWindow=(long long) DOWNSAMPLEVALUE;
+	}
+}
+
+//
+// PrintDownsampleParameters
+// Prints the downsampling parameters, if reads are downsampled.
+void PrintDownsampleParameters(){
+	if(DOWNSAMPLEMODE=="none"){
+		return;
+	}
+	cout << "downsampling: " << DOWNSAMPLEMODE << " " << DOWNSAMPLEVALUE << endl;
+	if(DOWNSAMPLEMODE=="window"){
+		cout << "downsampling window: " << DOWNSAMPLEWINDOW << endl;
+	}
+	cout << "downsampling seed: " << DOWNSAMPLESEED << endl;
+}
+
+//
+// HashReadName
+// Hashes a read name with the given seed (64-bit FNV-1a,
+// followed by the SplitMix64 finalizer to mix the high bits).
+uint64_t HashReadName(const char *name, int length, uint64_t seed){
+	uint64_t hash=14695981039346656037ULL ^ seed;
+	for(int i=0; i<length; i++){
+		hash^=(unsigned char) name[i];
+		hash*=1099511628211ULL;
+	}
+	hash^=hash >> 30;
+	hash*=0xbf58476d1ce4e5b9ULL;
+	hash^=hash >> 27;
+	hash*=0x94d049bb133111ebULL;
+	hash^=hash >> 31;
+	return hash;
+}
+
+//
+// CIGARReferenceLength
+// Returns the number of reference positions covered by a CIGAR string.
+int CIGARReferenceLength(const char *cigar, int length){
+	int reflength=0;
+	int numbases=0;
+	for(int i=0; i<length; i++){
+		if(isdigit(cigar[i])){
+			numbases=numbases*10+(cigar[i]-'0');
+			continue;
+		}
+		if(strchr("MDN=X", cigar[i])!=NULL){
+			reflength+=numbases;
+		}
+		numbases=0;
+	}
+	return reflength;
+}
+
+//
+// PairWindow
+// Returns the window of the leftmost mate of a read pair,
+// which is the same for both mates. For mates on different chromosomes,
+// the window is that of the first mate.
+WindowKey_t PairWindow(SAMFields_t *fields, int windowsize){
+	string rname((*fields).Start[2], (*fields).Length[2]);
+	string rnext((*fields).Start[6], (*fields).Length[6]);
+	int flag=atoi((*fields).Start[1]);
+	int pos=atoi((*fields).Start[3]);
+	int pnext=atoi((*fields).Start[7]);
+	if(!(flag & 0x1)){
+		return WindowKey_t(rname, pos/windowsize);
+	}
+	if(rnext=="=" || rnext==rname){
+		int start=(pnext>0 && pnext<pos) ? pnext : pos;
+		return WindowKey_t(rname, start/windowsize);
+	}
+	if(flag & 0x80){
+		return WindowKey_t(rnext, pnext/windowsize);
+	}
+	return WindowKey_t(rname, pos/windowsize);
+}
+
+//
+// InitializeDownsampler
+// Prepares the downsampler for a run. In window mode, reads the whole
+// input once to find the hash of the last pair kept in each window,
+// counting each pair at its first mate, then returns to the start.
+// Returns 1 if the input cannot be read twice.
+int InitializeDownsampler(ifstream *in, Downsampler_t *downsampler){
+	if((*downsampler).Mode!=DOWNSAMPLE_WINDOW){
+		return 0;
+	}
+	streampos start=(*in).tellg();
+	if(start==(streampos) -1){
+		return 1;
+	}
+
+	// Keep the lowest hashes of each window in a max-heap.
+	map<WindowKey_t, vector<uint64_t> > lowest;
+	string line;
+	while(getline(*in, line)){
+		SAMFields_t fields;
+		if(line[0]=='@' || SplitSAMLine(line, &fields) < NUMSAMFIELDS){
+			continue;
+		}
+		int flag=atoi(fields.Start[1]);
+		if((flag & 0x900) || ((flag & 0x1) && !(flag & 0x40))){
+			continue;
+		}
+		vector<uint64_t> *heap=&lowest[PairWindow(&fields,
+				(*downsampler).WindowSize)];
+		uint64_t hash=HashReadName(fields.Start[0], fields.Length[0],
+				(*downsampler).Seed);
+		if((long long) (*heap).size() < (*downsampler).PairsPerWindow){
+			(*heap).push_back(hash);
+			push_heap((*heap).begin(), (*heap).end());
+		}
+		else if(hash < (*heap).front()){
+			pop_heap((*heap).begin(), (*heap).end());
+			(*heap).back()=hash;
+			push_heap((*heap).begin(), (*heap).end());
+		}
+	}
+
+	// Windows with no more pairs than the limit keep all of their pairs.
+	(*downsampler).WindowThresholds.clear();
+	for(map<WindowKey_t, vector<uint64_t> >::iterator it=lowest.begin();
+			it!=lowest.end(); ++it){
+		(*downsampler).WindowThresholds[it->first]=
+				((long long) it->second.size() < (*downsampler).PairsPerWindow) ?
+				UINT64_MAX : it->second.front();
+	}
+
+	(*in).clear();
+	(*in).seekg(start);
+	return 0;
+}
+
+//
+// KeepRead
+// Decides whether to keep an alignment line, using only its SAM fields
+// and, in coverage cap mode, the pairs kept so far.
+// Every line of a pair gets the same decision.
+// In coverage cap mode, the first primary line of a pair decides for the
+// pair, based on the coverage over its fragment: from the leftmost mate
+// to the end of the rightmost mate, taking the mate to be as long as the
+// read. The primary lines of kept pairs then add to the coverage.
+bool KeepRead(SAMFields_t *fields, Downsampler_t *downsampler){
+	if((*downsampler).Mode==DOWNSAMPLE_NONE){
+		return true;
+	}
+	(*downsampler).NumLines++;
+
+	bool keep=true;
+	uint64_t hash=HashReadName((*fields).Start[0], (*fields).Length[0],
+			(*downsampler).Seed);
+	if((*downsampler).Mode==DOWNSAMPLE_FRACTION){
+		keep=(hash < (*downsampler).FractionThreshold);
+	}
+	else if((*downsampler).Mode==DOWNSAMPLE_WINDOW){
+		map<WindowKey_t, uint64_t>::iterator it=
+				(*downsampler).WindowThresholds.find(
+						PairWindow(fields, (*downsampler).WindowSize));
+		keep=(it==(*downsampler).WindowThresholds.end() || hash <= it->second);
+	}
+	else{
+		int flag=atoi((*fields).Start[1]);
+		string qname((*fields).Start[0], (*fields).Length[0]);
+		string rname((*fields).Start[2], (*fields).Length[2]);
+		int pos=atoi((*fields).Start[3])-1;
+		int reflength=(flag & 0x4) ? (*fields).Length[9] :
+				CIGARReferenceLength((*fields).Start[5], (*fields).Length[5]);
+		bool primary=!(flag & 0x900);
+		ExpireDecisions(downsampler, rname, pos);
+
+		// Look up the decision for the pair, if one has been made.
+		unordered_map<string, PairDecision_t>::iterator it=
+				(*downsampler).Decisions.find(qname);
+		if(it!=(*downsampler).Decisions.end()){
+			keep=it->second.Keep;
+			if(primary && ++it->second.NumPrimary==2){
+				(*downsampler).Decisions.erase(it);
+			}
+		}
+		else if(primary){
+
+			// Find the fragment of the pair on this chromosome.
+			int fragstart=pos;
+			int fragend=pos+reflength;
+			string rnext((*fields).Start[6], (*fields).Length[6]);
+			int pnext=atoi((*fields).Start[7])-1;
+			string matechr=(rnext=="=") ? rname : rnext;
+			if((flag & 0x1) && pnext>=0 && (rnext=="=" || rnext==rname)){
+				fragstart=min(pos, pnext);
+				fragend=max(pos, pnext)+reflength;
+			}
+
+			// Keep the pair unless every position is already at the cap.
+			vector<long long> *depth=&(*downsampler).Depth[rname];
+			keep=(fragend<=fragstart || fragstart<0);
+			for(int i=max(fragstart, 0); i<fragend && !keep; i++){
+				keep=(i>=(int) (*depth).size() || (*depth)[i] < (*downsampler).Cap);
+			}
+
+			// Hold the decision for the mate. In sorted input, the decision
+			// is also queued to be dropped once the input passes the mate,
+			// or this read if the input has already left the mate's
+			// chromosome.
+			if((flag & 0x1)){
+				PairDecision_t decision;
+				decision.Keep=keep;
+				decision.NumPrimary=1;
+				decision.MateChr=matechr;
+				decision.MatePos=pnext;
+				if(matechr!=rname && (*downsampler).ChrSeen.count(matechr)>0){
+					decision.MateChr=rname;
+					decision.MatePos=pos;
+				}
+				(*downsampler).Decisions[qname]=decision;
+				if((*downsampler).Sorted && decision.MateChr!="*" &&
+						decision.MatePos>=0){
+					(*downsampler).DecisionQueues[decision.MateChr].push(
+							make_pair(decision.MatePos, qname));
+				}
+			}
+		}
+
+		// Add the primary mapped lines of kept pairs to the coverage.
+		if(keep && primary && !(flag & 0x4) && pos>=0 && reflength>0){
+			vector<long long> *depth=&(*downsampler).Depth[rname];
+			if((int) (*depth).size() < pos+reflength){
+				(*depth).resize(pos+reflength, 0);
+			}
+			for(int i=pos; i<pos+reflength; i++){
+				(*depth)[i]++;
+			}
+		}
+	}
+
+	if(!keep){
+		(*downsampler).NumRemoved++;
+	}
+	return keep;
+}
+
+//
+// ExpireDecisions
+// Given the chromosome and zero-indexed position of a line in coverage
+// cap mode, drops the decisions of pairs whose mates can no longer arrive
+// in coordinate-sorted input: those whose mates are on a chromosome
+// the input has left, and those whose mate positions it has passed.
+// Stops dropping decisions for the rest of the run once the input
+// turns out not to be sorted. Unmapped pairs at the end are skipped.
+void ExpireDecisions(Downsampler_t *downsampler, string chr, int pos){
+	if(!(*downsampler).Sorted || chr=="*"){
+		return;
+	}
+	if(chr!=(*downsampler).LastChr){
+		if((*downsampler).ChrSeen.count(chr)>0){
+			(*downsampler).Sorted=false;
+			(*downsampler).DecisionQueues.clear();
+			return;
+		}
+		(*downsampler).ChrSeen.insert(chr);
+		DropDecisions(downsampler, (*downsampler).LastChr, -1);
+		(*downsampler).LastChr=chr;
+	}
+	else if(pos<(*downsampler).LastPos){
+		(*downsampler).Sorted=false;
+		(*downsampler).DecisionQueues.clear();
+		return;
+	}
+	(*downsampler).LastPos=pos;
+	DropDecisions(downsampler, chr, pos);
+}
+
+//
+// DropDecisions
+// Drops the held decisions of pairs whose mates are on the given chromosome
+// before the given position, or at any position if the position is -1.
+void DropDecisions(Downsampler_t *downsampler, string chr, int pos){
+	map<string, DecisionQueue_t>::iterator queue=
+			(*downsampler).DecisionQueues.find(chr);
+	if(queue==(*downsampler).DecisionQueues.end()){
+		return;
+	}
+	while(!queue->second.empty() &&
+			(pos<0 || queue->second.top().first < pos)){
+		unordered_map<string, PairDecision_t>::iterator it=
+				(*downsampler).Decisions.find(queue->second.top().second);
+		if(it!=(*downsampler).Decisions.end() && it->second.MateChr==chr &&
+				it->second.MatePos==queue->second.top().first){
+			(*downsampler).Decisions.erase(it);
+		}
+		queue->second.pop();
+	}
+	if(queue->second.empty()){
+		(*downsampler).DecisionQueues.erase(queue);
+	}
+}
+
+//
+// WriteDownsampler
+// Saves the state of the downsampler: its counters and, in coverage cap
+// mode, the coverage of the pairs kept so far, the pending decisions,
+// and the chromosomes and position reached in sorted input.
+// Window thresholds are found again from the input, and the queues
+// of decisions by mate position from the decisions.
+void WriteDownsampler(ofstream *out, Downsampler_t *downsampler){
+	WriteInt64(out, (*downsampler).NumLines);
+	WriteInt64(out, (*downsampler).NumRemoved);
+	WriteInt64(out, (*downsampler).Depth.size());
+	for(map<string, vector<long long> >::iterator it=
+			(*downsampler).Depth.begin(); it!=(*downsampler).Depth.end(); ++it){
+		WriteString(out, it->first);
+		WriteInt64(out, it->second.size());
+		if(it->second.size()>0){
+			(*out).write((const char *) &it->second[0],
+					it->second.size()*sizeof(long long));
+		}
+	}
+	WriteInt64(out, (*downsampler).Decisions.size());
+	for(unordered_map<string, PairDecision_t>::iterator it=
+			(*downsampler).Decisions.begin();
+			it!=(*downsampler).Decisions.end(); ++it){
+		WriteString(out, it->first);
+		WriteInt64(out, it->second.Keep ? 1 : 0);
+		WriteInt64(out, it->second.NumPrimary);
+		WriteString(out, it->second.MateChr);
+		WriteInt64(out, it->second.MatePos);
+	}
+	WriteString(out, (*downsampler).LastChr);
+	WriteInt64(out, (*downsampler).LastPos);
+	WriteInt64(out, (*downsampler).Sorted ? 1 : 0);
+	WriteInt64(out, (*downsampler).ChrSeen.size());
+	for(set<string>::iterator it=(*downsampler).ChrSeen.begin();
+			it!=(*downsampler).ChrSeen.end(); ++it){
+		WriteString(out, *it);
+	}
+}
+
+//
+// ReadDownsampler
+// Restores the state saved by WriteDownsampler.
+// Returns 1 if the state is invalid.
+int ReadDownsampler(ifstream *in, Downsampler_t *downsampler){
+	(*downsampler).NumLines=ReadInt64(in);
+	(*downsampler).NumRemoved=ReadInt64(in);
+	(*downsampler).Depth.clear();
+	long long numchr=ReadInt64(in);
+	for(long long i=0; i<numchr && *in; i++){
+		string chr=ReadString(in);
+		long long length=ReadInt64(in);
+		if(!*in || length<0){
+			return 1;
+		}
+		vector<long long> *depth=&(*downsampler).Depth[chr];
+		(*depth).resize(length);
+		if(length>0){
+			(*in).read((char *) &(*depth)[0], length*sizeof(long long));
+		}
+	}
+	(*downsampler).Decisions.clear();
+	long long numdecisions=ReadInt64(in);
+	for(long long i=0; i<numdecisions && *in; i++){
+		string qname=ReadString(in);
+		PairDecision_t decision;
+		decision.Keep=(ReadInt64(in)!=0);
+		decision.NumPrimary=ReadInt64(in);
+		decision.MateChr=ReadString(in);
+		decision.MatePos=ReadInt64(in);
+		(*downsampler).Decisions[qname]=decision;
+	}
+	(*downsampler).LastChr=ReadString(in);
+	(*downsampler).LastPos=ReadInt64(in);
+	(*downsampler).Sorted=(ReadInt64(in)!=0);
+	(*downsampler).ChrSeen.clear();
+	long long numseen=ReadInt64(in);
+	for(long long i=0; i<numseen && *in; i++){
+		(*downsampler).ChrSeen.insert(ReadString(in));
+	}
+	(*downsampler).DecisionQueues.clear();
+	if((*downsampler).Sorted){
+		for(unordered_map<string, PairDecision_t>::iterator it=
+				(*downsampler).Decisions.begin();
+				it!=(*downsampler).Decisions.end(); ++it){
+			if(it->second.MateChr!="*" && it->second.MatePos>=0){
+				(*downsampler).DecisionQueues[it->second.MateChr].push(
+						make_pair(it->second.MatePos, it->first));
+			}
+		}
+	}
+	return *in ? 0 : 1;
+}
+
+//
+// ParseReadLocation
+// Given an Illumina read name, whose last three colon-separated fields
+// are the tile, x, and y coordinates on the flow cell, stores a hash of
+// the name up to the tile, which identifies the flow cell, lane, and tile,
+// and the coordinates. Anything after the y coordinate, such as /1, is
+// ignored. Returns false if the name does not have this form.
+bool ParseReadLocation(const char *name, int length, DuplicateEntry_t *entry){
+	// Find the colons that start the x and y fields.
+	int colons[2]={-1, -1};
+	int numcolons=0;
+	for(int i=0; i<length; i++){
+		if(name[i]==':'){
+			colons[0]=colons[1];
+			colons[1]=i;
+			numcolons++;
+		}
+	}
+	if(numcolons<4 || !isdigit(name[colons[0]+1]) ||
+			!isdigit(name[colons[1]+1])){
+		return false;
+	}
+	(*entry).HasLocation=true;
+	(*entry).Tile=HashReadName(name, colons[0], 0);
+	(*entry).X=atoi(name+colons[0]+1);
+	(*entry).Y=atoi(name+colons[1]+1);
+	return true;
+}
+
+//
+// UnclippedFivePrime
+// Returns the zero-indexed position of the 5' end of a read
+// before soft or hard clipping: the start of the alignment less any
+// leading clips for forward reads, and the end of the alignment plus
+// any trailing clips for reverse reads.
+int UnclippedFivePrime(const char *cigar, int length, int pos, bool reverse){
+	int leadingclip=0;
+	int trailingclip=0;
+	int reflength=0;
+	int numbases=0;
+	bool aligned=false;
+	for(int i=0; i<length; i++){
+		if(isdigit(cigar[i])){
+			numbases=numbases*10+(cigar[i]-'0');
+			continue;
+		}
+		if(cigar[i]=='S' || cigar[i]=='H'){
+			if(aligned){
+				trailingclip+=numbases;
+			}
+			else{
+				leadingclip+=numbases;
+			}
+		}
+		else if(strchr("MDN=X", cigar[i])!=NULL){
+			aligned=true;
+			reflength+=numbases;
+		}
+		numbases=0;
+	}
+	if(reverse){
+		return pos+reflength-1+trailingclip;
+	}
+	return pos-leadingclip;
+}
+
+//
+// MarkDuplicate
+// Given a read that passed the filters, its chromosome index, and its
+// zero-indexed start position in coordinate-sorted input, decides whether
+// its pair duplicates a pair already seen. The first read of each pair to
+// arrive decides for the pair, by the hash of its chromosome, unclipped 5'
+// position, strand, and mate position and strand; a 64-bit hash makes
+// collisions within the window negligible. Of each set of duplicates,
+// the first pair seen is kept. Mates on other chromosomes, and mates whose
+// first read was filtered out, decide on their own keys.
+// Secondary and supplementary alignments are not marked.
+// Returns the result for the read, or DUPLICATE_UNSORTED if the input
+// is not sorted by coordinate.
+int MarkDuplicate(SAMFields_t *fields, int chr, int pos,
+		DuplicateMarker_t *marker){
+	int flag=atoi((*fields).Start[1]);
+	if(flag & 0x900){
+		return DUPLICATE_UNIQUE;
+	}
+
+	// Check that the input is sorted, and start afresh on each chromosome.
+	if(chr!=(*marker).LastChr){
+		if(chr<(int) (*marker).ChrSeen.size() && (*marker).ChrSeen[chr]){
+			return DUPLICATE_UNSORTED;
+		}
+		if(chr>=(int) (*marker).ChrSeen.size()){
+			(*marker).ChrSeen.resize(chr+1, false);
+		}
+		(*marker).ChrSeen[chr]=true;
+		(*marker).LastChr=chr;
+		(*marker).Keys.clear();
+		(*marker).KeyQueue=decltype((*marker).KeyQueue)();
+		(*marker).Decisions.clear();
+		(*marker).DecisionQueue=decltype((*marker).DecisionQueue)();
+	}
+	else if(pos<(*marker).LastPos){
+		return DUPLICATE_UNSORTED;
+	}
+	(*marker).LastPos=pos;
+
+	// Drop keys that no later read can match,
+	// and decisions whose mates can no longer arrive.
+	while(!(*marker).KeyQueue.empty() &&
+			(*marker).KeyQueue.top().first < pos-(*marker).Window){
+		(*marker).Keys.erase((*marker).KeyQueue.top().second);
+		(*marker).KeyQueue.pop();
+	}
+	while(!(*marker).DecisionQueue.empty() &&
+			(*marker).DecisionQueue.top().first < pos){
+		unordered_map<string, DuplicateDecision_t>::iterator it=
+				(*marker).Decisions.find((*marker).DecisionQueue.top().second);
+		if(it!=(*marker).Decisions.end() &&
+				it->second.MatePos==(*marker).DecisionQueue.top().first){
+			(*marker).Decisions.erase(it);
+		}
+		(*marker).DecisionQueue.pop();
+	}
+
+	// Hash the key of the read. Single reads and reads with unmapped mates
+	// have no mate position, and mates on other chromosomes
+	// add the name of their chromosome.
+	bool reverse=(flag & 0x10);
+	int fiveprime=UnclippedFivePrime((*fields).Start[5], (*fields).Length[5],
+			pos, reverse);
+	int matepos=atoi((*fields).Start[7])-1;
+	bool paired=(flag & 0x1) && !(flag & 0x8) && matepos>=0;
+	bool samechr=((*fields).Length[6]==1 && (*fields).Start[6][0]=='=') ||
+			((*fields).Length[6]==(*fields).Length[2] &&
+			strncmp((*fields).Start[6], (*fields).Start[2], (*fields).Length[2])==0);
+	int key[5]={chr, fiveprime, reverse ? 1 : 0, paired ? matepos : -1,
+			(paired && (flag & 0x20)) ? 1 : 0};
+	uint64_t hash=HashReadName((const char *) key, sizeof(key), 0);
+	if(paired && !samechr){
+		hash=HashReadName((*fields).Start[6], (*fields).Length[6], hash);
+	}
+
+	DuplicateEntry_t entry;
+	entry.FivePrime=fiveprime;
+	string qname((*fields).Start[0], (*fields).Length[0]);
+
+	// Apply the decision for the pair, if its first read made one.
+	// The mates of kept pairs are added to the keys, so that mates
+	// that decide on their own keys can match them.
+	int result=DUPLICATE_UNIQUE;
+	unordered_map<string, DuplicateDecision_t>::iterator decision=
+			(*marker).Decisions.find(qname);
+	if(decision!=(*marker).Decisions.end()){
+		result=decision->second.Result;
+		(*marker).Decisions.erase(decision);
+		if(result==DUPLICATE_UNIQUE && (*marker).Keys.count(hash)==0){
+			ParseReadLocation((*fields).Start[0], (*fields).Length[0], &entry);
+			(*marker).Keys[hash]=entry;
+			(*marker).KeyQueue.push(make_pair(fiveprime, hash));
+		}
+	}
+	else{
+		// Otherwise, compare the key with those of the pairs kept so far.
+		ParseReadLocation((*fields).Start[0], (*fields).Length[0], &entry);
+		unordered_map<uint64_t, DuplicateEntry_t>::iterator kept=
+				(*marker).Keys.find(hash);
+		if(kept==(*marker).Keys.end()){
+			(*marker).Keys[hash]=entry;
+			(*marker).KeyQueue.push(make_pair(fiveprime, hash));
+		}
+		else if(entry.HasLocation && kept->second.HasLocation &&
+				entry.Tile==kept->second.Tile &&
+				abs(entry.X-kept->second.X) <= (*marker).OpticalDistance &&
+				abs(entry.Y-kept->second.Y) <= (*marker).OpticalDistance){
+			result=DUPLICATE_OPTICAL;
+		}
+		else{
+			result=DUPLICATE_PCR;
+		}
+
+		// Hold the decision for a mate that is still to come.
+		if(paired && samechr && matepos>=pos){
+			DuplicateDecision_t pairdecision;
+			pairdecision.Result=result;
+			pairdecision.MatePos=matepos;
+			(*marker).Decisions[qname]=pairdecision;
+			(*marker).DecisionQueue.push(make_pair(matepos, qname));
+		}
+	}
+
+	(*marker).NumReads++;
+	if(result!=DUPLICATE_UNIQUE){
+		(*marker).NumDuplicates++;
+	}
+	if(result==DUPLICATE_OPTICAL){
+		(*marker).NumOptical++;
+	}
+	return result;
+}
+
+//
+// WriteDuplicateMarker
+// Saves the state of the duplicate marker: its counters, the chromosomes
+// seen so far, and the keys and decisions still held.
+void WriteDuplicateMarker(ofstream *out, DuplicateMarker_t *marker){
+	WriteInt64(out, (*marker).NumReads);
+	WriteInt64(out, (*marker).NumDuplicates);
+	WriteInt64(out, (*marker).NumOptical);
+	WriteInt64(out, (*marker).LastChr);
+	WriteInt64(out, (*marker).LastPos);
+	WriteInt64(out, (*marker).ChrSeen.size());
+	for(unsigned int i=0; i<(*marker).ChrSeen.size(); i++){
+		WriteInt64(out, (*marker).ChrSeen[i] ? 1 : 0);
+	}
+	WriteInt64(out, (*marker).Keys.size());
+	for(unordered_map<uint64_t, DuplicateEntry_t>::iterator it=
+			(*marker).Keys.begin(); it!=(*marker).Keys.end(); ++it){
+		WriteInt64(out, it->first);
+		WriteInt64(out, it->second.FivePrime);
+		WriteInt64(out, it->second.HasLocation ? 1 : 0);
+		WriteInt64(out, it->second.Tile);
+		WriteInt64(out, it->second.X);
+		WriteInt64(out, it->second.Y);
+	}
+	WriteInt64(out, (*marker).Decisions.size());
+	for(unordered_map<string, DuplicateDecision_t>::iterator it=
+			(*marker).Decisions.begin(); it!=(*marker).Decisions.end(); ++it){
+		WriteString(out, it->first);
+		WriteInt64(out, it->second.Result);
+		WriteInt64(out, it->second.MatePos);
+	}
+}
+
+//
+// ReadDuplicateMarker
+// Restores the state saved by WriteDuplicateMarker,
+// rebuilding the queues that drop keys and decisions.
+// Returns 1 if the state is invalid.
+int ReadDuplicateMarker(ifstream *in, DuplicateMarker_t *marker){
+	(*marker).NumReads=ReadInt64(in);
+	(*marker).NumDuplicates=ReadInt64(in);
+	(*marker).NumOptical=ReadInt64(in);
+	(*marker).LastChr=ReadInt64(in);
+	(*marker).LastPos=ReadInt64(in);
+	long long numchr=ReadInt64(in);
+	if(!*in || numchr<0){
+		return 1;
+	}
+	(*marker).ChrSeen.assign(numchr, false);
+	for(long long i=0; i<numchr && *in; i++){
+		(*marker).ChrSeen[i]=(ReadInt64(in)!=0);
+	}
+	(*marker).Keys.clear();
+	(*marker).KeyQueue=decltype((*marker).KeyQueue)();
+	long long numkeys=ReadInt64(in);
+	for(long long i=0; i<numkeys && *in; i++){
+		uint64_t hash=ReadInt64(in);
+		DuplicateEntry_t entry;
+		entry.FivePrime=ReadInt64(in);
+		entry.HasLocation=(ReadInt64(in)!=0);
+		entry.Tile=ReadInt64(in);
+		entry.X=ReadInt64(in);
+		entry.Y=ReadInt64(in);
+		(*marker).Keys[hash]=entry;
+		(*marker).KeyQueue.push(make_pair(entry.FivePrime, hash));
+	}
+	(*marker).Decisions.clear();
+	(*marker).DecisionQueue=decltype((*marker).DecisionQueue)();
+	long long numdecisions=ReadInt64(in);
+	for(long long i=0; i<numdecisions && *in; i++){
+		string qname=ReadString(in);
+		DuplicateDecision_t decision;
+		decision.Result=ReadInt64(in);
+		decision.MatePos=ReadInt64(in);
+		(*marker).Decisions[qname]=decision;
+		(*marker).DecisionQueue.push(make_pair(decision.MatePos, qname));
+	}
+	return *in ? 0 : 1;
+}
+
+//
+// InitializePileup
+// Sizes a pileup for the given reference sequences, with all counters zero,
+// including histograms if they are written.
+void InitializePileup(Pileup_t *pileup, vector<string> *refsequences){
+	PositionBase_t EmptyPositionBase;
+	EmptyPositionBase.Count=0;
+	EmptyPositionBase.TotalQuality=0;
+	EmptyPositionBase.TotalReadPosition=0;
+	(*pileup).Summary.resize((*refsequences).size());
+	(*pileup).Coverage.resize((*refsequences).size());
+	for(unsigned int i=0; i<(*refsequences).size(); i++){
+		(*pileup).Summary[i].assign((*refsequences)[i].size()*NUMBASES,
+				EmptyPositionBase);
+		(*pileup).Coverage[i].assign((*refsequences)[i].size(), 0);
+	}
+	if(OUTHISTOGRAMS != ""){
+		(*pileup).Histograms.resize((*refsequences).size());
+		(*pileup).HistogramSpill.assign((*refsequences).size(),
+				unordered_map<long long, long long>());
+		for(unsigned int i=0; i<(*refsequences).size(); i++){
+			(*pileup).Histograms[i].assign(
+					(*refsequences)[i].size()*NUMBASES*NUMHISTOGRAMBINS, 0);
+		}
+	}
+}
+
+//
+// FindReadGroup
+// Returns the index of the read group with the given name,
+// adding the group with an empty pileup if it is new.
+int FindReadGroup(string name, vector<string> *refsequences,
+		ReadGroups_t *groups){
+	unordered_map<string, int>::iterator it=(*groups).Index.find(name);
+	if(it!=(*groups).Index.end()){
+		return it->second;
+	}
+	int group=(*groups).Names.size();
+	(*groups).Names.push_back(name);
+	(*groups).Index[name]=group;
+	(*groups).Pileups.push_back(Pileup_t());
+	InitializePileup(&(*groups).Pileups.back(), refsequences);
+	(*groups).NumReads.push_back(0);
+	return group;
+}
+
+//
+// ReadGroupTag
+// Returns the value of the RG:Z tag among the optional fields of a read,
+// or NOREADGROUP if the read has none.
+string ReadGroupTag(SAMFields_t *fields){
+	const char *start=(*fields).Start[NUMSAMFIELDS];
+	const char *end=start+(*fields).Length[NUMSAMFIELDS];
+	while(start<end){
+		const char *tab=(const char *) memchr(start, '\t', end-start);
+		const char *fieldend=(tab==NULL) ? end : tab;
+		if(fieldend-start>5 && strncmp(start, "RG:Z:", 5)==0){
+			return string(start+5, fieldend-start-5);
+		}
+		if(tab==NULL){
+			break;
+		}
+		start=tab+1;
+	}
+	return NOREADGROUP;
+}
+
+//
+// HeaderReadGroup
+// Returns the ID of the read group in an @RG header line.
+string HeaderReadGroup(const string &line){
+	vector<string> fields=StringSplit(line, '\t');
+	for(unsigned int i=1; i<fields.size(); i++){
+		if(fields[i].compare(0, 3, "ID:")==0){
+			return fields[i].substr(3);
+		}
+	}
+	return NOREADGROUP;
+}
+
+//
+// GroupFileName
+// Returns the name of an output file for a read group: the group name,
+// with any '/' or whitespace replaced by '_', is inserted before the
+// extension of the file name, or appended if there is none.
+// Without a group, the file name is unchanged.
+string GroupFileName(string filename, string group){
+	if(group==""){
+		return filename;
+	}
+	for(unsigned int i=0; i<group.size(); i++){
+		if(group[i]=='/' || isspace(group[i])){
+			group[i]='_';
+		}
+	}
+	size_t dot=filename.rfind('.');
+	size_t slash=filename.rfind('/');
+	if(dot==string::npos || (slash!=string::npos && dot<slash) ||
+			dot==0 || dot==slash+1){
+		return filename+"."+group;
+	}
+	return filename.substr(0, dot)+"."+group+filename.substr(dot);
+}
+
+//
+// AddHistogramCount
+// Adds a count to a histogram counter, spilling any overflow to the map.
+void AddHistogramCount(Pileup_t *pileup, int chr, long long index,
+		long long value){
+	uint16_t *counter=&(*pileup).Histograms[chr][index];
+	long long total=*counter+value;
+	*counter=total & 0xFFFF;
+	if(total > 0xFFFF){
+		(*pileup).HistogramSpill[chr][index]+=total & ~0xFFFFLL;
+	}
+}
+
+//
+// HistogramCount
+// Returns the full count of a histogram counter, including any overflow.
+long long HistogramCount(Pileup_t *pileup, int chr, long long index){
+	long long count=(*pileup).Histograms[chr][index];
+	unordered_map<long long, long long>::iterator it=
+			(*pileup).HistogramSpill[chr].find(index);
+	if(it!=(*pileup).HistogramSpill[chr].end()){
+		count+=it->second;
+	}
+	return count;
+}
+
+//
+// WriteHistograms
+// Writes the histograms of each base with a nonzero count, after a header:
+// the position and base as in the summary, the count, the forward and
+// reverse strand counts, the counts in each base quality bin, and the
+// counts in each read position bin.
+void WriteHistograms(ofstream *out, vector<string> *refnames,
+		vector<string> *refsequences, Pileup_t *pileup){
+	(*out) << "Chr\tPos\tBase\tRefBase\tGenomePos\tCount\tForward\tReverse";
+	for(int b=0; b<NUMQUALITYBINS; b++){
+		(*out) << "\tQ" << b*QUALITYBINWIDTH;
+		if(b<NUMQUALITYBINS-1){
+			(*out) << "-" << (b+1)*QUALITYBINWIDTH-1;
+		}
+		else{
+			(*out) << "+";
+		}
+	}
+	for(int b=0; b<NUMREADPOSBINS; b++){
+		(*out) << "\tReadPos" << ((b==0) ? 1 : READPOSBINENDS[b-1]+1);
+		if(b<NUMREADPOSBINS-1){
+			(*out) << "-" << READPOSBINENDS[b];
+		}
+		else{
+			(*out) << "+";
+		}
+	}
+	(*out) << "\n";
+
+	long long genomepos=0;
+	for(unsigned int i=0; i<(*refsequences).size(); i++){
+		for(unsigned int j=0; j<(*refsequences)[i].size(); j++){
+			genomepos++;
+			for(int k=0; k<NUMBASES; k++){
+				long long count=(*pileup).Summary[i][j*NUMBASES+k].Count;
+				if(count==0){
+					continue;
+				}
+				(*out) << (*refnames)[i] << "\t" << j+1 << "\t" << BASES[k] <<
+						"\t" << (*refsequences)[i][j] << "\t" << genomepos <<
+						"\t" << count;
+				long long index=((long long) j*NUMBASES+k)*NUMHISTOGRAMBINS;
+				for(int b=0; b<NUMHISTOGRAMBINS; b++){
+					(*out) << "\t" << HistogramCount(pileup, i, index+b);
+				}
+				(*out) << "\n";
+			}
 		}
 	}
-	return expanded;
 }
@@ -0,0 +1,854 @@
+//============================================================================
+// Name        : TrimReads.cpp
+// Version     : 1.0
+// Description : 1.0 Trim adapters and low-quality bases from paired gzipped
+//               FASTQ files, with the semantics of the cutadapt call in
+//               pipelines/SCCA/AlignSummarizeAnnotate.sh: 3' quality
+//               trimming with the BWA algorithm, then 3' adapter trimming
+//               allowing a 10% error rate and partial adapters at the read
+//               end, then removal of pairs with a read shorter than the
+//               minimum length. Read pairs are trimmed in parallel threads,
+//               the next block of both files is decompressed while the
+//               current block is trimmed, and trimmed pairs are written to
+//               paired gzipped FASTQ files, or streamed to stdout as
+//               tab-delimited pairs for bowtie2 --12 -.
+//============================================================================
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <thread>
+#include <zlib.h>
+
+using namespace std;
+
+// RUN PARAMETERS
+string FASTQ1="";
+string FASTQ2="";
+string OUTPREFIX="";
+string ADAPTER1="TCGTCGGCAGCGTCAGATGTGTATAAGAGACAG";
+string ADAPTER2="GTCTCGTGGGCTCGGAGATGTGTATAAGAGACAG";
+int QUALITYCUTOFF=25;
+int MINLENGTH=20;
+int MINOVERLAP=3;
+double ERRORRATE=0.1;
+int NUMTHREADS=0;
+
+bool DEBUG=false;
+
+// Trimmed pairs are streamed to stdout when the output is "-",
+// and the run log is then written to stderr.
+bool STREAM=false;
+FILE *LOG=stdout;
+
+// Number of read pairs read in before they are split among the threads.
+const unsigned int PAIRSPERTHREAD=16384;
+
+// Compression level of the trimmed FASTQ files.
+const int COMPRESSIONLEVEL=6;
+
+// Offset of the quality characters.
+const int PHREDOFFSET=33;
+
+// Stores one FASTQ record.
+struct FastqRecord_t{
+	string Name="";
+	string Seq="";
+	string Plus="";
+	string Qual="";
+};
+
+// Stores one block of read pairs, read from the two files
+// in separate threads.
+struct ReadBlock_t{
+	vector<FastqRecord_t> Read1;
+	vector<FastqRecord_t> Read2;
+	unsigned int NumRead1=0;
+	unsigned int NumRead2=0;
+	bool Malformed1=false;
+	bool Malformed2=false;
+};
+
+// Stores an adapter as bit masks of its positions for each base,
+// so that it is aligned to a read 64 cells of the alignment matrix
+// at a time (Myers 1999). Adapters are at most 64 bases long.
+struct Adapter_t{
+	string Seq="";
+	int Length=0;
+	uint64_t Mask=0;
+	uint64_t Peq[256];
+};
+
+// Stores the trimmed output of one thread's range of pairs
+// and the tallies of how the pairs were trimmed.
+struct OutputBlock_t{
+	string Out1="";
+	string Out2="";
+	int Status=Z_OK;
+	long long Mismatch=-1;
+	long long NumWritten=0;
+	long long NumTooShort=0;
+	long long NumAdapters1=0;
+	long long NumAdapters2=0;
+	long long QualityTrimmed=0;
+	long long AdapterTrimmed=0;
+	long long BasesIn=0;
+	long long BasesOut=0;
+};
+
+
+// FUNCTIONS
+int ArgsParse(int argc, char *argv[]);
+void PrintUsage();
+void PrintParameters();
+void SetDebug();
+int ReadGzLine(gzFile file, string *line);
+int ReadFastqRecord(gzFile file, FastqRecord_t *record);
+void ReadRecords(gzFile file, vector<FastqRecord_t> *records,
+		unsigned int *numread, bool *malformed);
+string PairName(string name);
+int InitializeAdapter(string seq, Adapter_t *adapter);
+int MaxErrors(int length);
+int QualityTrimIndex(const string &qual, int length);
+int AlignmentStart(Adapter_t *adapter, const string &seq, int end,
+		int length);
+int FindAdapter(Adapter_t *adapter, const string &seq, int length);
+void AppendFastqRecord(FastqRecord_t *record, int length, string *out);
+int CompressGzipMember(string *in, string *out);
+void TrimPairs(ReadBlock_t *block, unsigned int first, unsigned int last,
+		Adapter_t *adapter1, Adapter_t *adapter2, OutputBlock_t *output);
+
+int main(int argc, char *argv[]) {
+
+	//==================================================
+	// Parse command-line arguments.
+	//==================================================
+
+	if(ArgsParse(argc, argv) != 0){
+		PrintUsage();
+		return 1;
+	}
+
+	if(NUMTHREADS<=0){
+		NUMTHREADS=thread::hardware_concurrency();
+		if(NUMTHREADS<=0){
+			NUMTHREADS=1;
+		}
+	}
+
+	if(OUTPREFIX=="-"){
+		STREAM=true;
+		LOG=stderr;
+	}
+
+	PrintParameters();
+
+	Adapter_t Adapter1;
+	Adapter_t Adapter2;
+	if(InitializeAdapter(ADAPTER1, &Adapter1) != 0 ||
+			InitializeAdapter(ADAPTER2, &Adapter2) != 0){
+		fprintf(LOG, "Error: adapters must be 1 to 64 bases long.\n");
+		return 1;
+	}
+
+	//==================================================
+	// Open the input and output files.
+	//==================================================
+
+	gzFile fin1=gzopen(FASTQ1.c_str(), "rb");
+	gzFile fin2=gzopen(FASTQ2.c_str(), "rb");
+	if(fin1==NULL || fin2==NULL){
+		fprintf(LOG, "Error: FASTQ file does not exist.\n");
+		return 1;
+	}
+	gzbuffer(fin1, 1<<17);
+	gzbuffer(fin2, 1<<17);
+
+	FILE *fout1=stdout;
+	FILE *fout2=NULL;
+	if(!STREAM){
+		string Out1=OUTPREFIX+".1.fastq.gz";
+		string Out2=OUTPREFIX+".2.fastq.gz";
+		fout1=fopen(Out1.c_str(), "wb");
+		fout2=fopen(Out2.c_str(), "wb");
+		if(fout1==NULL || fout2==NULL){
+			fprintf(LOG, "Error: could not open output files.\n");
+			return 1;
+		}
+	}
+
+	//==================================================
+	// Stream the read pairs in blocks.
+	// Both files of the next block are decompressed in their own
+	// threads while the current block is trimmed, and each trimming
+	// thread compresses its pairs as one gzip member.
+	//==================================================
+
+	fprintf(LOG, "Trimming read pairs.\n");
+
+	unsigned int BlockSize=PAIRSPERTHREAD*NUMTHREADS;
+	ReadBlock_t Blocks[2];
+	for(int b=0; b<2; b++){
+		Blocks[b].Read1.resize(BlockSize);
+		Blocks[b].Read2.resize(BlockSize);
+	}
+	vector<OutputBlock_t> Outputs(NUMTHREADS);
+
+	long long NumPairs=0;
+	long long NumWritten=0;
+	long long NumTooShort=0;
+	long long NumAdapters1=0;
+	long long NumAdapters2=0;
+	long long QualityTrimmed=0;
+	long long AdapterTrimmed=0;
+	long long BasesIn=0;
+	long long BasesOut=0;
+	int Status=0;
+
+	int current=0;
+	vector<thread> readers;
+	readers.push_back(thread(ReadRecords, fin1, &Blocks[current].Read1,
+			&Blocks[current].NumRead1, &Blocks[current].Malformed1));
+	readers.push_back(thread(ReadRecords, fin2, &Blocks[current].Read2,
+			&Blocks[current].NumRead2, &Blocks[current].Malformed2));
+
+	while(Status==0){
+
+		// Wait for the current block to be read in.
+		for(unsigned int r=0; r<readers.size(); r++){
+			readers[r].join();
+		}
+		readers.clear();
+
+		ReadBlock_t *block=&Blocks[current];
+		if((*block).Malformed1 || (*block).Malformed2 ||
+				(*block).NumRead1!=(*block).NumRead2){
+			fprintf(LOG, "Error: malformed or unpaired FASTQ record after %lld pairs.\n",
+					NumPairs+min((*block).NumRead1, (*block).NumRead2));
+			Status=1;
+			break;
+		}
+		unsigned int numpairs=(*block).NumRead1;
+		if(numpairs==0){
+			break;
+		}
+
+		// Read in the next block while this one is trimmed.
+		// A short block is the end of the files.
+		bool more=(numpairs==BlockSize);
+		if(more){
+			ReadBlock_t *next=&Blocks[1-current];
+			readers.push_back(thread(ReadRecords, fin1, &(*next).Read1,
+					&(*next).NumRead1, &(*next).Malformed1));
+			readers.push_back(thread(ReadRecords, fin2, &(*next).Read2,
+					&(*next).NumRead2, &(*next).Malformed2));
+		}
+
+		// Trim the block in parallel.
+		int numthreads=NUMTHREADS;
+		if((unsigned int)numthreads > numpairs){
+			numthreads=numpairs;
+		}
+		vector<thread> threads;
+		for(int t=0; t<numthreads; t++){
+			unsigned int first=(unsigned long long)numpairs*t/numthreads;
+			unsigned int last=(unsigned long long)numpairs*(t+1)/numthreads;
+			threads.push_back(thread(TrimPairs, block, first, last,
+					&Adapter1, &Adapter2, &Outputs[t]));
+		}
+		for(int t=0; t<numthreads; t++){
+			threads[t].join();
+		}
+
+		// Write the trimmed pairs in input order and tally the trimming.
+		for(int t=0; t<numthreads; t++){
+			OutputBlock_t *output=&Outputs[t];
+			if((*output).Mismatch >= 0){
+				fprintf(LOG, "Error: read names do not match: %s %s\n",
+						(*block).Read1[(*output).Mismatch].Name.c_str(),
+						(*block).Read2[(*output).Mismatch].Name.c_str());
+				Status=1;
+				break;
+			}
+			if((*output).Status!=Z_OK){
+				fprintf(LOG, "Error: compression failed.\n");
+				Status=1;
+				break;
+			}
+			if(fwrite((*output).Out1.data(), 1, (*output).Out1.size(), fout1)!=
+					(*output).Out1.size() ||
+					(!STREAM && fwrite((*output).Out2.data(), 1,
+							(*output).Out2.size(), fout2)!=(*output).Out2.size())){
+				fprintf(LOG, "Error: could not write output.\n");
+				Status=1;
+				break;
+			}
+			NumWritten += (*output).NumWritten;
+			NumTooShort += (*output).NumTooShort;
+			NumAdapters1 += (*output).NumAdapters1;
+			NumAdapters2 += (*output).NumAdapters2;
+			QualityTrimmed += (*output).QualityTrimmed;
+			AdapterTrimmed += (*output).AdapterTrimmed;
+			BasesIn += (*output).BasesIn;
+			BasesOut += (*output).BasesOut;
+		}
+		NumPairs += numpairs;
+
+		if(!more){
+			break;
+		}
+		current=1-current;
+	}
+
+	// Finish any read that was started before an error.
+	for(unsigned int r=0; r<readers.size(); r++){
+		readers[r].join();
+	}
+	gzclose(fin1);
+	gzclose(fin2);
+
+	// An empty gzip member keeps the output readable
+	// when no pairs are written.
+	if(!STREAM && Status==0 && NumWritten==0){
+		string empty="";
+		string member="";
+		CompressGzipMember(&empty, &member);
+		fwrite(member.data(), 1, member.size(), fout1);
+		fwrite(member.data(), 1, member.size(), fout2);
+	}
+	if(STREAM){
+		fflush(stdout);
+	}
+	else{
+		fclose(fout1);
+		fclose(fout2);
+	}
+
+	if(Status!=0){
+		return Status;
+	}
+
+	//==================================================
+	// Summarize the trimming.
+	//==================================================
+
+	fprintf(LOG, "Number of read pairs: %lld\n", NumPairs);
+	fprintf(LOG, "Number of first reads with adapters: %lld\n", NumAdapters1);
+	fprintf(LOG, "Number of second reads with adapters: %lld\n", NumAdapters2);
+	fprintf(LOG, "Number of read pairs that were too short: %lld\n", NumTooShort);
+	fprintf(LOG, "Number of read pairs written: %lld\n", NumWritten);
+	fprintf(LOG, "Number of bases processed: %lld\n", BasesIn);
+	fprintf(LOG, "Number of bases quality-trimmed: %lld\n", QualityTrimmed);
+	fprintf(LOG, "Number of bases adapter-trimmed: %lld\n", AdapterTrimmed);
+	fprintf(LOG, "Number of bases written: %lld\n", BasesOut);
+
+	return 0;
+}
+
+// ArgsParse
+// Parses command-line arguments.
+// Returns 1 if any argument conditions are violated.
+int ArgsParse(int argc, char *argv[]){
+
+	// If the only argument is debug,
+	// set all parameters to the debug state.
+	if(argc==2 && strcmp(argv[1],"debug")==0){
+		SetDebug();
+		return 0;
+	}
+
+	// Ensure that there are an even number of arguments,
+	// leaving aside the program name.
+	if((argc - 1) % 2 != 0){
+		printf("Invalid number of arguments.\n");
+		return 1;
+	}
+	// Check the structure of arguments.
+	for(int i=1; i<argc; i++){
+		// Verify that every other argument is a flag.
+		if(i%2 == 1){
+			if(argv[i][0] != '-' || strlen(argv[i])!=2){
+				printf("Invalid use of argument flags.\n");
+				return 1;
+			}
+		}
+	}
+
+	// Parse each pair of arguments.
+	for(int i=0; i<(argc-1)/2; i++){
+
+		string flag=argv[2*i+1];
+		string arg=argv[2*i+2];
+
+		// Parse the flag string.
+		switch(flag[1]){
+		// -1 first-read FASTQ file
+		case '1':
+			FASTQ1 = arg;
+			break;
+		// -2 second-read FASTQ file
+		case '2':
+			FASTQ2 = arg;
+			break;
+		// -o output prefix, or - for stdout
+		case 'o':
+			OUTPREFIX = arg;
+			break;
+		// -a first-read 3' adapter
+		case 'a':
+			ADAPTER1 = arg;
+			break;
+		// -A second-read 3' adapter
+		case 'A':
+			ADAPTER2 = arg;
+			break;
+		// -q quality cutoff
+		case 'q':
+			QUALITYCUTOFF = atoi(arg.c_str());
+			if(QUALITYCUTOFF < 0){
+				printf("Invalid -q quality cutoff.\n");
+				return 1;
+			}
+			break;
+		// -m minimum read length after trimming
+		case 'm':
+			MINLENGTH = atoi(arg.c_str());
+			break;
+		// -O minimum overlap of a partial adapter
+		case 'O':
+			MINOVERLAP = atoi(arg.c_str());
+			if(MINOVERLAP < 1){
+				printf("Invalid -O minimum overlap.\n");
+				return 1;
+			}
+			break;
+		// -e maximum adapter error rate
+		case 'e':
+			ERRORRATE = atof(arg.c_str());
+			if(ERRORRATE < 0 || ERRORRATE >= 1){
+				printf("Invalid -e error rate.\n");
+				return 1;
+			}
+			break;
+		// -t number of threads
+		case 't':
+			NUMTHREADS = atoi(arg.c_str());
+			break;
+		}
+	}
+
+	// Check that the required arguments exist.
+	if(FASTQ1=="" || FASTQ2==""){
+		printf("Invalid arguments. Specify both FASTQ files.\n");
+		return 1;
+	}
+	if(OUTPREFIX==""){
+		printf("Invalid arguments. Specify output.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// PrintParameters
+// When called, prints the parameters for the run to the log.
+void PrintParameters(){
+	fprintf(LOG, "RUN PARAMETERS\n");
+	fprintf(LOG, "reads: %s %s\n", FASTQ1.c_str(), FASTQ2.c_str());
+	fprintf(LOG, "output: %s\n", STREAM ? "stdout" : OUTPREFIX.c_str());
+	fprintf(LOG, "first-read adapter: %s\n", ADAPTER1.c_str());
+	fprintf(LOG, "second-read adapter: %s\n", ADAPTER2.c_str());
+	fprintf(LOG, "quality cutoff: %d\n", QUALITYCUTOFF);
+	fprintf(LOG, "minimum length: %d\n", MINLENGTH);
+	fprintf(LOG, "minimum adapter overlap: %d\n", MINOVERLAP);
+	fprintf(LOG, "adapter error rate: %g\n", ERRORRATE);
+	fprintf(LOG, "threads: %d\n", NUMTHREADS);
+	fprintf(LOG, "\n");
+}
+
+// PrintUsage
+// When called, prints the usage statement for this program.
+void PrintUsage(){
+	printf("\n\n");
+	printf("Usage: TrimReads -1 R1.fastq.gz -2 R2.fastq.gz -o sample-trimmed\n");
+	printf("       TrimReads -1 R1.fastq.gz -2 R2.fastq.gz -o - |\n"
+			"         bowtie2 -x reference --12 - -S sample.sam\n");
+	printf("\n");
+	printf("Trimmed pairs are written to <prefix>.1.fastq.gz and\n"
+			"<prefix>.2.fastq.gz, or with -o - to stdout as tab-delimited\n"
+			"pairs (name, sequence 1, quality 1, sequence 2, quality 2).\n");
+	printf("\n");
+	printf("Options (defaults in parentheses):\n");
+	printf("  -a SEQ\t3' adapter of the first reads [Nextera]\n");
+	printf("  -A SEQ\t3' adapter of the second reads [Nextera]\n");
+	printf("  -q INT\ttrim 3' bases below this quality [25]\n");
+	printf("  -m INT\tdiscard pairs with a read shorter than this [20]\n");
+	printf("  -O INT\tminimum overlap of a partial adapter [3]\n");
+	printf("  -e FLOAT\tmaximum adapter error rate [0.1]\n");
+	printf("  -t INT\tnumber of trimming threads [all cores]\n");
+	printf("\n\n");
+}
+
+// SetDebug
+// Sets all parameters to their debug state.
+void SetDebug(){
+	FASTQ1="R1.test.fastq.gz";
+	FASTQ2="R2.test.fastq.gz";
+	OUTPREFIX="out.test";
+	NUMTHREADS=1;
+	DEBUG=true;
+}
+
+// ReadGzLine
+// Reads one line of a plain or gzipped file, without the newline.
+// Returns 1 if a line was read and 0 at the end of the file.
+int ReadGzLine(gzFile file, string *line){
+	char buffer[4096];
+	(*line).clear();
+	while(gzgets(file, buffer, sizeof(buffer)) != NULL){
+		size_t len=strlen(buffer);
+		if(len > 0 && buffer[len-1]=='\n'){
+			(*line).append(buffer, len-1);
+			return 1;
+		}
+		(*line).append(buffer, len);
+	}
+	return (*line).size() > 0 ? 1 : 0;
+}
+
+// ReadFastqRecord
+// Reads the four lines of one FASTQ record.
+// Returns 1 if a record was read, 0 at the end of the file,
+// and -1 if the record is malformed.
+int ReadFastqRecord(gzFile file, FastqRecord_t *record){
+	if(ReadGzLine(file, &(*record).Name)==0){
+		return 0;
+	}
+	if(ReadGzLine(file, &(*record).Seq)==0 ||
+			ReadGzLine(file, &(*record).Plus)==0 ||
+			ReadGzLine(file, &(*record).Qual)==0){
+		return -1;
+	}
+	if((*record).Name[0]!='@' || (*record).Plus[0]!='+' ||
+			(*record).Seq.size()!=(*record).Qual.size()){
+		return -1;
+	}
+	return 1;
+}
+
+// ReadRecords
+// Reads FASTQ records until the vector of records is full
+// or the file ends. Run in its own thread for each file of a pair.
+void ReadRecords(gzFile file, vector<FastqRecord_t> *records,
+		unsigned int *numread, bool *malformed){
+	(*numread)=0;
+	(*malformed)=false;
+	while((*numread) < (*records).size()){
+		int status=ReadFastqRecord(file, &(*records)[*numread]);
+		if(status==0){
+			break;
+		}
+		if(status < 0){
+			(*malformed)=true;
+			break;
+		}
+		(*numread)++;
+	}
+}
+
+// PairName
+// Returns the read name shared by both mates: the first word of the
+// FASTQ name line, without the @ and any /1 or /2 suffix.
+string PairName(string name){
+	size_t end=name.find_first_of(" \t");
+	if(end==string::npos){
+		end=name.size();
+	}
+	if(end >= 3 && name[end-2]=='/' && (name[end-1]=='1' || name[end-1]=='2')){
+		end -= 2;
+	}
+	return name.substr(1, end-1);
+}
+
+// InitializeAdapter
+// Sets the bit mask of adapter positions for each read character.
+// N and other characters in reads match no adapter base.
+// Returns 1 if the adapter is empty or longer than 64 bases.
+int InitializeAdapter(string seq, Adapter_t *adapter){
+	if(seq.size()==0 || seq.size() > 64){
+		return 1;
+	}
+	(*adapter).Seq=seq;
+	(*adapter).Length=seq.size();
+	(*adapter).Mask=(seq.size()==64) ? ~0ULL : ((1ULL << seq.size())-1);
+	memset((*adapter).Peq, 0, sizeof((*adapter).Peq));
+	for(unsigned int i=0; i<seq.size(); i++){
+		char base=toupper(seq[i]);
+		if(base!='A' && base!='C' && base!='G' && base!='T'){
+			continue;
+		}
+		(*adapter).Peq[(unsigned char)base] |= (1ULL << i);
+		(*adapter).Peq[(unsigned char)tolower(base)] |= (1ULL << i);
+	}
+	return 0;
+}
+
+// MaxErrors
+// Returns the number of errors allowed in an alignment
+// covering this many adapter bases.
+int MaxErrors(int length){
+	return (int)(ERRORRATE*length);
+}
+
+// QualityTrimIndex
+// Returns the length of a read after trimming low-quality 3' bases,
+// using the BWA algorithm as in cutadapt: the read is cut where the
+// sum of (cutoff - quality) over the trimmed bases is largest.
+int QualityTrimIndex(const string &qual, int length){
+	int sum=0;
+	int maxsum=0;
+	int maxindex=length;
+	for(int i=length-1; i>=0; i--){
+		sum += QUALITYCUTOFF-(qual[i]-PHREDOFFSET);
+		if(sum < 0){
+			break;
+		}
+		if(sum > maxsum){
+			maxsum=sum;
+			maxindex=i;
+		}
+	}
+	return maxindex;
+}
+
+// AlignmentStart
+// Returns the read position at which the best alignment of the first
+// length adapter bases, ending just before read position end, starts.
+// Aligns the adapter to the stretch of read that such an alignment
+// can span, with unit costs, breaking ties toward the earlier start.
+int AlignmentStart(Adapter_t *adapter, const string &seq, int end,
+		int length){
+	int window=length+MaxErrors(length)+1;
+	int start=max(0, end-window);
+	int width=end-start;
+
+	// Cost and start of the best alignment ending at each read position,
+	// for the previous and current adapter base.
+	vector<int> cost(width+1, 0);
+	vector<int> origin(width+1);
+	vector<int> prevcost(width+1);
+	vector<int> prevorigin(width+1);
+	for(int j=0; j<=width; j++){
+		origin[j]=start+j;
+	}
+
+	for(int i=1; i<=length; i++){
+		cost.swap(prevcost);
+		origin.swap(prevorigin);
+		uint64_t bit=1ULL << (i-1);
+		cost[0]=i;
+		origin[0]=start;
+		for(int j=1; j<=width; j++){
+			bool match=((*adapter).Peq[(unsigned char)seq[start+j-1]] & bit) != 0;
+			int best=prevcost[j-1]+(match ? 0 : 1);
+			int from=prevorigin[j-1];
+			if(prevcost[j]+1 < best ||
+					(prevcost[j]+1==best && prevorigin[j] < from)){
+				best=prevcost[j]+1;
+				from=prevorigin[j];
+			}
+			if(cost[j-1]+1 < best ||
+					(cost[j-1]+1==best && origin[j-1] < from)){
+				best=cost[j-1]+1;
+				from=origin[j-1];
+			}
+			cost[j]=best;
+			origin[j]=from;
+		}
+	}
+	return origin[width];
+}
+
+// FindAdapter
+// Returns the read position at which a 3' adapter starts in the first
+// length bases of a read, or length if there is no adapter.
+// The adapter is aligned to the read with the bit-parallel algorithm of
+// Myers (1999), which updates a column of 64 alignment cells with a few
+// word operations per read base, with the read start free. The whole
+// column of a 33- or 34-base Nextera adapter fits in one word, so this
+// costs less per base than a striped SIMD alignment, which would need
+// several vectors of 16-bit scores per column and a correction pass
+// for gaps along it. A full adapter with the fewest errors is taken
+// first; otherwise the longest adapter prefix that ends at the read end
+// within the error rate is taken.
+int FindAdapter(Adapter_t *adapter, const string &seq, int length){
+	int m=(*adapter).Length;
+	uint64_t high=1ULL << (m-1);
+	uint64_t Pv=(*adapter).Mask;
+	uint64_t Mv=0;
+	int score=m;
+	int bestcost=MaxErrors(m)+1;
+	int bestend=-1;
+
+	for(int j=0; j<length; j++){
+		uint64_t Eq=(*adapter).Peq[(unsigned char)seq[j]];
+		uint64_t Xv=Eq | Mv;
+		uint64_t Xh=(((Eq & Pv) + Pv) ^ Pv) | Eq;
+		uint64_t Ph=Mv | ~(Xh | Pv);
+		uint64_t Mh=Pv & Xh;
+		if(Ph & high){
+			score++;
+		}
+		else if(Mh & high){
+			score--;
+		}
+		// No carry into the first row, as the alignment
+		// may start anywhere in the read.
+		Ph <<= 1;
+		Mh <<= 1;
+		Pv=(Mh | ~(Xv | Ph)) & (*adapter).Mask;
+		Mv=Ph & Xv;
+		if(score < bestcost){
+			bestcost=score;
+			bestend=j+1;
+		}
+	}
+	if(bestend >= 0){
+		return AlignmentStart(adapter, seq, bestend, m);
+	}
+
+	// Sum the vertical differences of the last column to get the cost
+	// of each adapter prefix ending at the read end.
+	int cost=0;
+	int bestlength=0;
+	for(int i=0; i<m-1; i++){
+		cost += (int)((Pv >> i) & 1) - (int)((Mv >> i) & 1);
+		if(i+1 >= MINOVERLAP && cost <= MaxErrors(i+1)){
+			bestlength=i+1;
+		}
+	}
+	if(bestlength > 0){
+		return AlignmentStart(adapter, seq, length, bestlength);
+	}
+	return length;
+}
+
+// AppendFastqRecord
+// Appends the first length bases of a FASTQ record to a text buffer.
+void AppendFastqRecord(FastqRecord_t *record, int length, string *out){
+	(*out) += (*record).Name;
+	(*out) += '\n';
+	(*out).append((*record).Seq, 0, length);
+	(*out) += '\n';
+	(*out) += (*record).Plus;
+	(*out) += '\n';
+	(*out).append((*record).Qual, 0, length);
+	(*out) += '\n';
+}
+
+// CompressGzipMember
+// Compresses a text buffer into a complete gzip member.
+// Concatenated members form a valid gzip file, so each thread
+// can compress its own range of pairs.
+// Returns the zlib status.
+int CompressGzipMember(string *in, string *out){
+	(*out).clear();
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	// A window of 15 bits plus 16 writes a gzip header and trailer.
+	int status=deflateInit2(&stream, COMPRESSIONLEVEL, Z_DEFLATED,
+			15+16, 8, Z_DEFAULT_STRATEGY);
+	if(status!=Z_OK){
+		return status;
+	}
+	(*out).resize(deflateBound(&stream, (*in).size())+32);
+	stream.next_in=(Bytef *)(*in).data();
+	stream.avail_in=(*in).size();
+	stream.next_out=(Bytef *)&(*out)[0];
+	stream.avail_out=(*out).size();
+	status=deflate(&stream, Z_FINISH);
+	(*out).resize(stream.total_out);
+	deflateEnd(&stream);
+	return status==Z_STREAM_END ? Z_OK : status;
+}
+
+// TrimPairs
+// Trims the read pairs from first to last, not including last, and
+// formats the pairs that remain long enough, compressed unless streamed.
+// Run in parallel threads on separate ranges of the same block.
+void TrimPairs(ReadBlock_t *block, unsigned int first, unsigned int last,
+		Adapter_t *adapter1, Adapter_t *adapter2, OutputBlock_t *output){
+	(*output)=OutputBlock_t();
+	string text1;
+	string text2;
+	for(unsigned int i=first; i<last; i++){
+		FastqRecord_t *read1=&(*block).Read1[i];
+		FastqRecord_t *read2=&(*block).Read2[i];
+		string name=PairName((*read1).Name);
+		if(name!=PairName((*read2).Name)){
+			(*output).Mismatch=i;
+			return;
+		}
+
+		// Trim low-quality bases, then adapters, as cutadapt does.
+		int length1=(*read1).Seq.size();
+		int length2=(*read2).Seq.size();
+		(*output).BasesIn += length1+length2;
+		int quality1=QualityTrimIndex((*read1).Qual, length1);
+		int quality2=QualityTrimIndex((*read2).Qual, length2);
+		int trimmed1=FindAdapter(adapter1, (*read1).Seq, quality1);
+		int trimmed2=FindAdapter(adapter2, (*read2).Seq, quality2);
+		(*output).QualityTrimmed += (length1-quality1)+(length2-quality2);
+		(*output).AdapterTrimmed += (quality1-trimmed1)+(quality2-trimmed2);
+		if(trimmed1 < quality1){
+			(*output).NumAdapters1++;
+		}
+		if(trimmed2 < quality2){
+			(*output).NumAdapters2++;
+		}
+
+		// Discard the pair if either read is too short.
+		if(trimmed1 < MINLENGTH || trimmed2 < MINLENGTH){
+			(*output).NumTooShort++;
+			continue;
+		}
+		(*output).NumWritten++;
+		(*output).BasesOut += trimmed1+trimmed2;
+
+		if(STREAM){
+			text1 += name;
+			text1 += '\t';
+			text1.append((*read1).Seq, 0, trimmed1);
+			text1 += '\t';
+			text1.append((*read1).Qual, 0, trimmed1);
+			text1 += '\t';
+			text1.append((*read2).Seq, 0, trimmed2);
+			text1 += '\t';
+			text1.append((*read2).Qual, 0, trimmed2);
+			text1 += '\n';
+		}
+		else{
+			AppendFastqRecord(read1, trimmed1, &text1);
+			AppendFastqRecord(read2, trimmed2, &text2);
+		}
+	}
+
+	if(STREAM){
+		(*output).Out1.swap(text1);
+		return;
+	}
+	if(text1.size() > 0){
+		(*output).Status=CompressGzipMember(&text1, &(*output).Out1);
+	}
+	if(text2.size() > 0 && (*output).Status==Z_OK){
+		(*output).Status=CompressGzipMember(&text2, &(*output).Out2);
+	}
+}